@@ -0,0 +1,83 @@
+# This file is part of crutils.
+#
+# crutils is free software: you can redistribute it and/or modify it under the
+# terms of the GNU Lesser General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+# A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+# details.
+#
+# You should have received a copy of the GNU Lesser General Public License along
+# with crutils. If not, see <http://www.gnu.org/licenses/>.
+#
+#
+# Copyright (C)
+#   2013-2017 Alexander Haase <ahaase@alexhaase.de>
+#
+
+# Try to find libxcb. If found, the following variables will be set:
+#
+# XCB_FOUND: System has libxcb.
+# XCB_LIBRARIES: Which libraries to link for libxcb.
+# XCB_INCLUDE_DIRS: Which directories to include for libxcb headers.
+#
+# Components are pkg-config modules (e.g. xcb-xinput or xkbcommon-x11), which
+# need to be available in addition to the core library.
+#
+
+include(FindPackageHandleStandardArgs)
+
+find_package(PkgConfig QUIET)
+
+
+# Search for libxcb with pkg-config.
+pkg_check_modules(PC_XCB QUIET xcb)
+
+# Search for libxcb with hints from pkg-config.
+find_path(XCB_INCLUDE_DIR xcb/xcb.h
+          HINTS ${PC_XCB_INCLUDEDIR} ${PC_XCB_INCLUDE_DIRS})
+find_library(XCB_LIBRARY NAMES xcb
+             HINTS ${PC_XCB_LIBDIR} ${PC_XCB_LIBRARY_DIRS})
+mark_as_advanced(XCB_INCLUDE_DIR XCB_LIBRARY)
+
+# Handle libxcb components. Include directories won't be searched, as these
+# should be equal to those of the core library.
+foreach (component IN LISTS XCB_FIND_COMPONENTS)
+	pkg_check_modules(PC_XCB_${component} QUIET ${component})
+	if (PC_XCB_${component}_FOUND)
+		find_library(XCB_${component}_LIBRARY
+		             NAMES ${PC_XCB_${component}_LIBRARIES}
+		             HINTS ${PC_XCB_${component}_LIBDIR}
+		                   ${PC_XCB_${component}_LIBRARY_DIRS})
+		mark_as_advanced(XCB_${component}_LIBRARY)
+
+		if (XCB_${component}_LIBRARY)
+			set(XCB_${component}_FOUND true)
+		endif ()
+	endif ()
+endforeach ()
+
+# Handle the QUIET and REQUIRED arguments and set XCB_FOUND to TRUE if all
+# listed variables are TRUE.
+find_package_handle_standard_args(
+	XCB
+	FOUND_VAR XCB_FOUND
+	REQUIRED_VARS XCB_LIBRARY XCB_INCLUDE_DIR
+	VERSION_VAR PC_XCB_VERSION
+	HANDLE_COMPONENTS)
+
+# If libxcb and all required components have been found, set the general
+# variables for libxcb and all components.
+set(XCB_INCLUDE_DIRS ${XCB_INCLUDE_DIR})
+set(XCB_VERSION ${PC_XCB_VERSION})
+set(XCB_LIBRARIES ${XCB_LIBRARY})
+
+# Add component libraries to list of all libxcb libraries.
+foreach (component IN LISTS XCB_FIND_COMPONENTS)
+	if (XCB_${component}_LIBRARY)
+		set(XCB_LIBRARIES ${XCB_LIBRARIES} ${XCB_${component}_LIBRARY})
+	endif ()
+endforeach ()
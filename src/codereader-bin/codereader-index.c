@@ -0,0 +1,312 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Build a barcode lookup index.
+ *
+ * \details The input contains one barcode per line, separated from its record
+ *  by a tab. If a barcode is listed more than once, its last record will be
+ *  used. The index will be written to a temporary file first and renamed to
+ *  the output file, so a running `codereader --index` switches to the new
+ *  index atomically.
+ */
+
+#define _GNU_SOURCE // getline
+
+
+#include <stdbool.h> // bool
+#include <stdio.h>   // fopen, fprintf, getline, rename, snprintf
+#include <stdlib.h>  // atoi, free, malloc, qsort, realloc, EXIT_*
+#include <string.h>  // memchr, memcmp, memcpy, strcmp, strlen
+#include <unistd.h>  // fsync, unlink
+
+#include <argp.h> // argp functions
+
+#include "config.h"
+#include "index.h" // index_*
+
+
+const char *argp_program_version = "crutils " CRUTILS_VERSION;
+
+const char *argp_program_bug_address =
+    "https://github.com/alehaa/crutils/issues";
+
+static char doc[] = "Build a barcode lookup index for codereader --index\v"
+                    "INPUT contains one barcode per line, separated from its "
+                    "record by a tab. Use - to read from stdin.";
+
+static char args_doc[] = "INPUT OUTPUT";
+
+static struct argp_option options[] = {
+    {"bits", 'b', "NUMBER", 0,
+     "Hash bits of the directory (default: by number of barcodes)"},
+    {0}};
+
+/** \brief Parsed command line arguments.
+ */
+struct arguments
+{
+	const char *input;  ///< Path of the input file.
+	const char *output; ///< Path of the index file.
+	int bits;           ///< Hash bits of the directory or -1 for automatic.
+};
+
+static error_t parse_arguments(int key, char *arg, struct argp_state *state);
+static struct argp argp = {options, &parse_arguments, args_doc, doc};
+
+
+/** \brief Entry of the index being built.
+ */
+struct item
+{
+	struct index_entry entry; ///< Entry written to the index.
+	size_t line;              ///< Line of the input, for duplicates.
+};
+
+/** \brief Keys and records of all items, used by \ref item_compare.
+ */
+static char *data;
+
+
+/** \brief Compare two items by hash, key and input line.
+ */
+static int
+item_compare(const void *a, const void *b)
+{
+	const struct item *x = a, *y = b;
+	if (x->entry.hash != y->entry.hash)
+		return (x->entry.hash < y->entry.hash) ? -1 : 1;
+	if (x->entry.key_len != y->entry.key_len)
+		return (x->entry.key_len < y->entry.key_len) ? -1 : 1;
+	int cmp = memcmp(data + x->entry.key, data + y->entry.key,
+	                 x->entry.key_len);
+	if (cmp != 0)
+		return cmp;
+	return (x->line < y->line) ? -1 : (x->line > y->line);
+}
+
+
+/** \brief Argument parser for argp.
+ */
+static error_t
+parse_arguments(int key, char *arg, struct argp_state *state)
+{
+	struct arguments *args = state->input;
+	switch (key) {
+		case 'b':
+			args->bits = atoi(arg);
+			if (args->bits < 0 || args->bits > 24)
+				argp_error(state, "Bits must be between 0 and 24.");
+			break;
+
+		case ARGP_KEY_ARG:
+			if (state->arg_num == 0)
+				args->input = arg;
+			else if (state->arg_num == 1)
+				args->output = arg;
+			else
+				argp_usage(state);
+			break;
+
+		case ARGP_KEY_END:
+			if (state->arg_num < 2)
+				argp_usage(state);
+			break;
+
+		default: return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+
+/** \brief Write \p num items with \p size bytes of data to \p path.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+write_index(const char *path, struct item *items, size_t num, int bits,
+            size_t size)
+{
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		perror("Failed to create index");
+		return false;
+	}
+
+	/* The directory contains the index of the first entry of each bucket and
+	 * the number of entries. */
+	size_t buckets = 1UL << bits;
+	uint64_t *directory = calloc(buckets + 1, sizeof(uint64_t));
+	if (directory == NULL) {
+		fprintf(stderr, "Not enough memory for directory.\n");
+		fclose(f);
+		return false;
+	}
+	for (size_t i = 0; i < num; i++)
+		directory[(bits > 0) ? items[i].entry.hash >> (64 - bits) : 0]++;
+	uint64_t first = 0;
+	for (size_t i = 0; i <= buckets; i++) {
+		uint64_t n = directory[i];
+		directory[i] = first;
+		first += n;
+	}
+
+	struct index_header header = {.order = INDEX_BYTE_ORDER,
+	                              .bits = bits,
+	                              .num = num};
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.data = sizeof(header) + (buckets + 1) * sizeof(uint64_t) +
+	              num * sizeof(struct index_entry);
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+	          fwrite(directory, sizeof(uint64_t), buckets + 1, f) ==
+	              buckets + 1;
+	for (size_t i = 0; ok && i < num; i++)
+		ok = fwrite(&(items[i].entry), sizeof(struct index_entry), 1, f) == 1;
+	ok = ok && fwrite(data, 1, size, f) == size && fflush(f) == 0 &&
+	     fsync(fileno(f)) == 0;
+	free(directory);
+	if (fclose(f) != 0 || !ok) {
+		perror("Failed to write index");
+		return false;
+	}
+	return true;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct arguments args = {.bits = -1};
+	argp_parse(&argp, argc, argv, 0, NULL, &args);
+
+	FILE *in = (strcmp(args.input, "-") == 0) ? stdin : fopen(args.input, "r");
+	if (in == NULL) {
+		perror("Failed to open input");
+		return EXIT_FAILURE;
+	}
+
+	/* Read all barcodes and records. Keys and records will be stored in a
+	 * single buffer, which will be written as data of the index. */
+	struct item *items = NULL;
+	size_t num = 0, items_size = 0, size = 0, data_size = 0, line_num = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t n;
+	while ((n = getline(&line, &line_size, in)) > 0) {
+		line_num++;
+		if (line[n - 1] == '\n')
+			n--;
+		char *tab = memchr(line, '\t', n);
+		if (tab == NULL) {
+			if (n > 0)
+				fprintf(stderr, "Line %zu: missing tab, skipped.\n", line_num);
+			continue;
+		}
+
+		if (num == items_size) {
+			items_size = (items_size > 0) ? 2 * items_size : 1024;
+			struct item *p = realloc(items, items_size * sizeof(struct item));
+			if (p == NULL) {
+				fprintf(stderr, "Not enough memory for index.\n");
+				return EXIT_FAILURE;
+			}
+			items = p;
+		}
+		while (size + n > data_size) {
+			data_size = (data_size > 0) ? 2 * data_size : 65536;
+			char *p = realloc(data, data_size);
+			if (p == NULL) {
+				fprintf(stderr, "Not enough memory for index.\n");
+				return EXIT_FAILURE;
+			}
+			data = p;
+		}
+		if (size + n > UINT32_MAX) {
+			fprintf(stderr, "Input exceeds the maximum index size.\n");
+			return EXIT_FAILURE;
+		}
+
+		/* Key and record are adjacent in the line, so they will be copied
+		 * without the tab. */
+		size_t key_len = tab - line;
+		struct index_entry *e = &(items[num].entry);
+		e->hash = index_hash(line, key_len);
+		e->key = size;
+		e->key_len = key_len;
+		e->record = size + key_len;
+		e->record_len = n - key_len - 1;
+		memcpy(data + size, line, key_len);
+		memcpy(data + size + key_len, tab + 1, e->record_len);
+		size += n - 1;
+		items[num++].line = line_num;
+	}
+	free(line);
+	if (ferror(in)) {
+		perror("Failed to read input");
+		return EXIT_FAILURE;
+	}
+	if (in != stdin)
+		fclose(in);
+
+	/* Sort the items by hash and drop all but the last record of duplicate
+	 * barcodes. */
+	qsort(items, num, sizeof(struct item), item_compare);
+	size_t unique = 0;
+	for (size_t i = 0; i < num; i++) {
+		if (i + 1 < num &&
+		    items[i].entry.hash == items[i + 1].entry.hash &&
+		    items[i].entry.key_len == items[i + 1].entry.key_len &&
+		    memcmp(data + items[i].entry.key, data + items[i + 1].entry.key,
+		           items[i].entry.key_len) == 0)
+			continue;
+		items[unique++] = items[i];
+	}
+
+	/* By default, there will be about one barcode per bucket. */
+	int bits = args.bits;
+	if (bits < 0)
+		for (bits = 0; bits < 24 && (1UL << bits) < unique; bits++)
+			;
+
+	/* The index will be written to a temporary file and renamed, so readers
+	 * never see an incomplete index. */
+	size_t tmp_len = strlen(args.output) + 5;
+	char *tmp = malloc(tmp_len);
+	if (tmp == NULL) {
+		fprintf(stderr, "Not enough memory for index.\n");
+		return EXIT_FAILURE;
+	}
+	snprintf(tmp, tmp_len, "%s.tmp", args.output);
+	bool ok = write_index(tmp, items, unique, bits, size);
+	if (ok && rename(tmp, args.output) != 0) {
+		perror("Failed to install index");
+		ok = false;
+	}
+	if (!ok)
+		unlink(tmp);
+
+	free(tmp);
+	free(items);
+	free(data);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -18,13 +18,21 @@
  *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
  */
 
-#include <stdio.h>  // fclose, fprintf, printf
-#include <stdlib.h> // atoi, EXIT_SUCCESS, EXIT_FAILURE
+#include <errno.h>   // errno
+#include <limits.h>  // INT_MAX
+#include <stdbool.h> // bool
+#include <stdint.h>  // SIZE_MAX
+#include <stdio.h>   // fclose, fprintf
+#include <stdlib.h>  // strtoul, EXIT_SUCCESS, EXIT_FAILURE
+#include <string.h>  // strchr, strcmp
 
 #include <argp.h>       // argp functions
-#include <codereader.h> // codereader_open
+#include <codereader.h> // codereader_*
 
 #include "config.h"
+#include "journal.h" // journal_*
+#include "output.h"  // output_*
+#include "server.h" // server_*
 
 
 /* Configure argp.
@@ -44,8 +52,38 @@ static char doc[] = "Read barcodes from multiple barcode readers";
 static struct argp_option options[] = {
     {"config", 'c', "FILE", 0, "Configuration file"},
     {"count", 'n', "NUMBER", 0, "How many barcodes to read"},
+    {"format", 'f', "FORMAT", 0,
+     "Output format (text, raw, binary, json; default: text)"},
+    {"batch", 'b', "NUMBER", 0,
+     "Write up to NUMBER barcodes at once (default: 1)"},
+    {"flush", 't', "MS", 0,
+     "Write batched barcodes after at most MS milliseconds (default: 100)"},
+    {"latency", 'L', 0, 0, "Print a histogram of scan latencies on exit"},
+    {"listen", 'l', "PATH", 0, "Serve barcodes to clients at socket PATH"},
+    {"queue", 'q', "NUMBER", 0, "Maximum number of queued barcodes per client"},
+    {"overflow", 'o', "POLICY", 0,
+     "What to do if a client's queue is full (drop-oldest, disconnect)"},
+    {"index", 'i', "FILE", 0,
+     "Attach the record of each barcode in the lookup index FILE"},
+    {"journal", 'j', "DIR", 0, "Append all barcodes to the journal in DIR"},
+    {"journal-sync", 's', "MS", 0,
+     "Sync the journal at least every MS milliseconds (default: 50)"},
+    {"journal-size", 'S', "MB", 0,
+     "Start a new journal segment at MB megabytes (default: 64)"},
     {0}};
 
+/** \brief Parsed command line arguments.
+ */
+struct arguments
+{
+	int num;                      ///< How many barcodes to read.
+	struct output_options output; ///< Options for the output.
+	struct server_options server; ///< Options for the server mode.
+	struct journal_options journal; ///< Options for the journal.
+	bool latency;                 ///< Whether to print the latencies.
+	bool formatted;               ///< Whether output options have been set.
+};
+
 /* Initialize argp parser. We'll use above defined parameters for documentation
  * strings of argp. A forward declaration for parse_arguments is added to define
  * parse_arguments together with the other functions below. */
@@ -53,6 +91,54 @@ static error_t parse_arguments(int key, char *arg, struct argp_state *state);
 static struct argp argp = {options, &parse_arguments, NULL, doc};
 
 
+/** \brief Print the latency histogram of \p handle to stderr.
+ *
+ * \details Only the range of buckets with at least one scan will be printed.
+ */
+static void
+print_latency(const struct codereader_handle *handle)
+{
+	unsigned long buckets[CODEREADER_LATENCY_BUCKETS];
+	size_t num =
+	    codereader_latency(handle, buckets, CODEREADER_LATENCY_BUCKETS);
+
+	size_t first = 0, last = num;
+	while (first < last && buckets[first] == 0)
+		first++;
+	while (last > first && buckets[last - 1] == 0)
+		last--;
+
+	fprintf(stderr, "Latency histogram:\n");
+	for (size_t i = first; i < last; i++)
+		fprintf(stderr, "  < %10lu us: %lu\n", 1UL << i, buckets[i]);
+}
+
+
+/** \brief Parse \p arg as a number between \p min and \p max.
+ *
+ *
+ * \param arg The argument to parse.
+ * \param min Minimum value of the number.
+ * \param max Maximum value of the number.
+ * \param value Where to store the parsed number.
+ *
+ * \return If \p arg is a number in the valid range true will be returned,
+ *  otherwise false.
+ */
+static bool
+parse_number(const char *arg, unsigned long min, unsigned long max,
+             unsigned long *value)
+{
+	/* strtoul accepts negative numbers and negates them as unsigned, so they
+	 * need to be rejected before. */
+	char *end;
+	errno = 0;
+	*value = strtoul(arg, &end, 10);
+	return strchr(arg, '-') == NULL && end != arg && *end == '\0' &&
+	       errno == 0 && *value >= min && *value <= max;
+}
+
+
 /** \brief Argument parser for argp.
  *
  * \note See argp parser documentation for detailed information about the
@@ -61,9 +147,75 @@ static struct argp argp = {options, &parse_arguments, NULL, doc};
 static error_t
 parse_arguments(int key, char *arg, struct argp_state *state)
 {
+	struct arguments *args = state->input;
+	unsigned long n;
 	switch (key) {
 		case 'c': setenv("CODEREADER_CONFIG", arg, 1); break;
-		case 'n': *((int *)state->input) = atoi(arg); break;
+		case 'n':
+			if (!parse_number(arg, 1, INT_MAX, &n))
+				argp_error(state, "Count must be between 1 and %d.", INT_MAX);
+			args->num = n;
+			break;
+		case 'f':
+			args->formatted = true;
+			if (strcmp(arg, "text") == 0)
+				args->output.format = OUTPUT_TEXT;
+			else if (strcmp(arg, "raw") == 0)
+				args->output.format = OUTPUT_RAW;
+			else if (strcmp(arg, "binary") == 0)
+				args->output.format = OUTPUT_BINARY;
+			else if (strcmp(arg, "json") == 0)
+				args->output.format = OUTPUT_JSON;
+			else
+				argp_error(state, "Unknown output format '%s'.", arg);
+			break;
+		case 'b':
+			args->formatted = true;
+			if (!parse_number(arg, 1, OUTPUT_BATCH_MAX, &n))
+				argp_error(state, "Batch size must be between 1 and %d.",
+				           OUTPUT_BATCH_MAX);
+			args->output.batch = n;
+			break;
+		case 't':
+			args->formatted = true;
+			if (!parse_number(arg, 0, INT_MAX, &n))
+				argp_error(state, "Flush time must be between 0 and %d.",
+				           INT_MAX);
+			args->output.flush_ms = n;
+			break;
+		case 'L': args->latency = true; break;
+		case 'l': args->server.path = arg; break;
+		case 'q':
+			if (!parse_number(arg, 1, SERVER_QUEUE_MAX, &n))
+				argp_error(state, "Queue size must be between 1 and %d.",
+				           SERVER_QUEUE_MAX);
+			args->server.queue_size = n;
+			break;
+		case 'i': args->output.index = arg; break;
+		case 'j': args->journal.path = arg; break;
+		case 's':
+			if (!parse_number(arg, 0, INT_MAX, &n))
+				argp_error(state, "Journal sync time must be between 0 and %d.",
+				           INT_MAX);
+			args->journal.sync_ms = n;
+			break;
+		case 'S':
+			/* The size is given in megabytes, so it must not overflow when
+			 * being converted to bytes. */
+			if (!parse_number(arg, 1, SIZE_MAX >> 20, &n))
+				argp_error(state,
+				           "Journal segment size must be between 1 and %lu.",
+				           (unsigned long)(SIZE_MAX >> 20));
+			args->journal.segment_size = (size_t)n << 20;
+			break;
+		case 'o':
+			if (strcmp(arg, "drop-oldest") == 0)
+				args->server.overflow = SERVER_DROP_OLDEST;
+			else if (strcmp(arg, "disconnect") == 0)
+				args->server.overflow = SERVER_DISCONNECT;
+			else
+				argp_error(state, "Unknown overflow policy '%s'.", arg);
+			break;
 
 		default: return ARGP_ERR_UNKNOWN;
 	}
@@ -78,26 +230,74 @@ main(int argc, char **argv)
 	/* Parse our arguments. Parsed arguments will manipulate the current
 	 * environment to set options for libcodereader. If the user specified how
 	 * many barcodes to read, this number will be stored in num. */
-	int num = -1;
-	argp_parse(&argp, argc, argv, 0, NULL, &num);
+	struct arguments args = {.num = -1,
+	                         .output = {.format = OUTPUT_TEXT,
+	                                    .batch = 1,
+	                                    .flush_ms = 100,
+	                                    .index = NULL},
+	                         .server = {.path = NULL,
+	                                    .queue_size = 64,
+	                                    .overflow = SERVER_DROP_OLDEST},
+	                         .journal = {.path = NULL,
+	                                     .sync_ms = 50,
+	                                     .segment_size = 64 << 20}};
+	argp_parse(&argp, argc, argv, 0, NULL, &args);
+	int num = args.num;
+	if (args.server.path != NULL &&
+	    (args.journal.path != NULL || args.output.index != NULL)) {
+		fprintf(stderr,
+		        "The journal and index are not supported in server mode.\n");
+		return EXIT_FAILURE;
+	}
+	if (args.server.path != NULL && (args.formatted || args.latency)) {
+		fprintf(stderr, "Output options and the latency histogram are not "
+		                "supported in server mode.\n");
+		return EXIT_FAILURE;
+	}
 
 
-	/* Open the codereader stream. This will open a connection to all available
-	 * barcode readers. */
-	FILE *ch = codereader_open();
-	if (ch == NULL) {
+	/* In server mode, the barcodes will be served to all clients connected to
+	 * the socket instead of printing them. The server reads the scans from a
+	 * codereader stream, which opens a connection to all available barcode
+	 * readers. If the server fails, the stream might still be used by the
+	 * server's reader thread, so it can't be closed safely. */
+	if (args.server.path != NULL) {
+		FILE *ch = codereader_open();
+		if (ch == NULL) {
+			fprintf(stderr, "Can't open codereader!\n");
+			return EXIT_FAILURE;
+		}
+		if (server_run(ch, num, &(args.server)) < 0)
+			return EXIT_FAILURE;
+		return (fclose(ch) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/* The journal will be opened and recovered before opening the devices,
+	 * so no scan will be read, if the journal can't be written. */
+	struct journal *journal = NULL;
+	if (args.journal.path != NULL &&
+	    (journal = journal_open(&(args.journal))) == NULL)
+		return EXIT_FAILURE;
+
+	/* Open a connection to all available barcode readers and write the
+	 * specified number of barcodes or, if no maximum is defined, all barcodes
+	 * in an endless loop to stdout. */
+	struct codereader_handle *handle = codereader_new();
+	if (handle == NULL) {
 		fprintf(stderr, "Can't open codereader!\n");
+		if (journal != NULL)
+			journal_close(journal);
 		return EXIT_FAILURE;
 	}
+	int ret = output_run(handle, num, &(args.output), journal);
+	if (args.latency)
+		print_latency(handle);
 
-	/* Read data from the barcode readers for the specified number of barcodes
-	 * to read or n an endless loop if no maximum is defined. The read barcodes
-	 * will be printed to stdout. */
-	char buffer[32];
-	while ((num == -1 || num--) && (fgets(buffer, 32, ch) != NULL))
-		printf("%s", buffer);
-
-	/* Close the codereader stream and return success or failure depending on
-	 * the return code. */
-	return (fclose(ch) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	/* Close the codereader handle and the journal, which syncs all remaining
+	 * records, and return success or failure depending on the return codes. */
+	if (codereader_destroy(handle) != 0)
+		ret = -1;
+	if (journal != NULL && !journal_close(journal))
+		ret = -1;
+	return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,240 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Looking up barcodes in a memory-mapped index.
+ *
+ * \details The index file will be mapped read-only, so a lookup only touches
+ *  the directory, the bucket's entries and the matching key and record. A new
+ *  index may be installed by renaming it over the old file. The file will be
+ *  checked for a replacement at most once per second and the new index mapped
+ *  without restarting.
+ */
+
+#include "index.h"
+
+#include <fcntl.h>    // open, O_RDONLY
+#include <stdio.h>    // fprintf, perror
+#include <string.h>   // memcmp
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat, stat
+#include <time.h>     // clock_gettime
+#include <unistd.h>   // close
+
+
+/** \brief Interval in ms to check the index file for a replacement.
+ */
+#define INDEX_CHECK_MS 1000
+
+
+/** \brief Get the directory of \p map.
+ */
+static inline const uint64_t *
+index_directory(const char *map)
+{
+	return (const uint64_t *)(map + sizeof(struct index_header));
+}
+
+
+/** \brief Get the entries of \p map.
+ */
+static inline const struct index_entry *
+index_entries(const char *map)
+{
+	const struct index_header *header = (const struct index_header *)map;
+	return (const struct index_entry *)(index_directory(map) +
+	                                    (1UL << header->bits) + 1);
+}
+
+
+/** \brief Check whether the directory of \p map is sorted and complete.
+ */
+static bool
+index_check_directory(const char *map)
+{
+	const struct index_header *header = (const struct index_header *)map;
+	const uint64_t *directory = index_directory(map);
+	for (size_t i = 0; i < (1UL << header->bits); i++)
+		if (directory[i] > directory[i + 1])
+			return false;
+	return (directory[1UL << header->bits] == header->num);
+}
+
+
+/** \brief Map the index file at \p path into memory.
+ *
+ * \details The header of the index will be checked, so lookups only need to
+ *  check the offsets of the entries.
+ *
+ *
+ * \param index Where to store the mapping.
+ * \param path Path of the index file.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+index_map(struct index *index, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Failed to open index");
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror("Failed to stat index");
+		close(fd);
+		return false;
+	}
+	if ((size_t)st.st_size < sizeof(struct index_header)) {
+		fprintf(stderr, "Index %s is too small.\n", path);
+		close(fd);
+		return false;
+	}
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("Failed to map index");
+		return false;
+	}
+
+	const struct index_header *header = (const struct index_header *)map;
+	uint64_t size = st.st_size;
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->order != INDEX_BYTE_ORDER || header->bits > 24 ||
+	    header->num > size / sizeof(struct index_entry) ||
+	    header->data > size ||
+	    header->data < sizeof(struct index_header) +
+	                       ((1ULL << header->bits) + 1) * sizeof(uint64_t) +
+	                       header->num * sizeof(struct index_entry) ||
+	    !index_check_directory(map)) {
+		fprintf(stderr, "Index %s is invalid.\n", path);
+		munmap((void *)map, st.st_size);
+		return false;
+	}
+
+	/* The index is read randomly, so read-ahead would waste memory. */
+	madvise((void *)map, st.st_size, MADV_RANDOM);
+
+	index->map = map;
+	index->size = st.st_size;
+	index->dev = st.st_dev;
+	index->ino = st.st_ino;
+	return true;
+}
+
+
+/** \brief Open the index file at \p path.
+ *
+ *
+ * \param index The index to initialize.
+ * \param path Path of the index file.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+bool
+index_open(struct index *index, const char *path)
+{
+	index->path = path;
+	clock_gettime(CLOCK_MONOTONIC, &(index->checked));
+	return index_map(index, path);
+}
+
+
+/** \brief Map the index file again, if it has been replaced.
+ *
+ * \details If mapping the new file fails, the old index will be used further.
+ */
+static void
+index_reload(struct index *index)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - index->checked.tv_sec) * 1000 +
+	        (now.tv_nsec - index->checked.tv_nsec) / 1000000 <
+	    INDEX_CHECK_MS)
+		return;
+	index->checked = now;
+
+	struct stat st;
+	if (stat(index->path, &st) != 0 ||
+	    (st.st_dev == index->dev && st.st_ino == index->ino))
+		return;
+
+	struct index old = *index;
+	if (index_map(index, index->path)) {
+		munmap((void *)old.map, old.size);
+		fprintf(stderr, "Index %s reloaded.\n", index->path);
+	}
+}
+
+
+/** \brief Look up \p key in \p index.
+ *
+ *
+ * \param index The index.
+ * \param key The barcode to look up.
+ * \param length Length of \p key.
+ * \param record Where to store the record of \p key. It is valid until the
+ *  next lookup.
+ * \param record_len Where to store the length of the record.
+ *
+ * \return If \p key has been found true will be returned, otherwise false.
+ */
+bool
+index_lookup(struct index *index, const char *key, size_t length,
+             const char **record, size_t *record_len)
+{
+	index_reload(index);
+
+	const struct index_header *header = (const struct index_header *)index->map;
+	const uint64_t *directory = index_directory(index->map);
+	const struct index_entry *entries = index_entries(index->map);
+	const char *data = index->map + header->data;
+	size_t data_size = index->size - header->data;
+
+	uint64_t hash = index_hash(key, length);
+	size_t bucket = (header->bits > 0) ? hash >> (64 - header->bits) : 0;
+	for (uint64_t i = directory[bucket]; i < directory[bucket + 1]; i++) {
+		const struct index_entry *e = &(entries[i]);
+		if (e->hash != hash || e->key_len != length ||
+		    (uint64_t)e->key + e->key_len > data_size ||
+		    memcmp(data + e->key, key, length) != 0)
+			continue;
+		if ((uint64_t)e->record + e->record_len > data_size)
+			return false;
+
+		*record = data + e->record;
+		*record_len = e->record_len;
+		return true;
+	}
+	return false;
+}
+
+
+/** \brief Unmap \p index.
+ */
+void
+index_close(struct index *index)
+{
+	munmap((void *)index->map, index->size);
+}
@@ -0,0 +1,116 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Format of barcode lookup indexes.
+ *
+ * \details An index file maps barcodes to records. It is built by
+ *  `codereader-index` and memory-mapped by `codereader --index`. The file
+ *  consists of a \ref index_header, the directory, the entries and the data
+ *  of the keys and records. The entries are sorted by the hash of their key.
+ *  The directory contains the index of the first entry for each value of the
+ *  upper \ref index_header::bits bits of the hash, followed by the number of
+ *  entries, so a lookup needs to check the few entries of a single bucket
+ *  only. All integers are stored in host byte order, as the index will be used
+ *  on the host it has been built on.
+ */
+
+#ifndef CODEREADER_BIN_INDEX_H
+#define CODEREADER_BIN_INDEX_H
+
+
+#include <stdbool.h>   // bool
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint*_t
+#include <sys/types.h> // dev_t, ino_t
+#include <time.h>      // struct timespec
+
+
+/** \brief Magic bytes at the start of each index.
+ */
+#define INDEX_MAGIC "CRIDX001"
+
+/** \brief Value of \ref index_header::order, to detect foreign byte orders.
+ */
+#define INDEX_BYTE_ORDER 0x01020304
+
+
+/** \brief Header of an index file.
+ */
+struct index_header
+{
+	char magic[8];  ///< \ref INDEX_MAGIC
+	uint32_t order; ///< \ref INDEX_BYTE_ORDER
+	uint32_t bits;  ///< Number of hash bits used for the directory.
+	uint64_t num;   ///< Number of entries.
+	uint64_t data;  ///< Offset of the keys and records in the file.
+};
+
+
+/** \brief Entry of an index file.
+ *
+ * \details Offsets of the key and record are relative to
+ *  \ref index_header::data.
+ */
+struct index_entry
+{
+	uint64_t hash;       ///< Hash of the key.
+	uint32_t key;        ///< Offset of the key.
+	uint32_t key_len;    ///< Length of the key.
+	uint32_t record;     ///< Offset of the record.
+	uint32_t record_len; ///< Length of the record.
+};
+
+
+/** \brief Calculate the hash of \p key (64 bit FNV-1a).
+ */
+static inline uint64_t
+index_hash(const char *key, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+
+/** \brief A memory-mapped index.
+ */
+struct index
+{
+	const char *path; ///< Path of the index file.
+	const char *map;  ///< The mapped index file.
+	size_t size;      ///< Size of \ref map.
+	dev_t dev;        ///< Device of the mapped file.
+	ino_t ino;        ///< Inode of the mapped file.
+	struct timespec checked; ///< Time the file has been checked for updates.
+};
+
+
+bool index_open(struct index *index, const char *path);
+bool index_lookup(struct index *index, const char *key, size_t length,
+                  const char **record, size_t *record_len);
+void index_close(struct index *index);
+
+
+#endif
@@ -0,0 +1,542 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Crash-safe journal of all scans.
+ *
+ * \details Each scan will be appended as a record to the current segment of
+ *  the journal directory. Segments are named by the sequence number of their
+ *  first record, so they sort in the order they have been written. The records
+ *  will be synced to disk by a single `fdatasync` for all records appended
+ *  within the configured window (group commit), so the journal doesn't need a
+ *  sync per scan.
+ *
+ *  A segment starts with \ref JOURNAL_MAGIC. Each record consists of the length
+ *  of its body (32 bit) and the CRC-32 of its body (32 bit), followed by the
+ *  body: the sequence number (64 bit), the time of the scan and the time the
+ *  record has been appended in ns since the epoch (64 bit each), the length of
+ *  the device name (16 bit), the device name and the scan. All integers are
+ *  stored in network byte order.
+ *
+ *  A segment will be synced completely before the next one will be created, so
+ *  on startup only the last segment needs to be checked. A torn record at its
+ *  end, e.g. after a power failure, will be cut off.
+ */
+
+#include "journal.h"
+
+#include <dirent.h>   // scandir
+#include <errno.h>    // errno, EINTR
+#include <fcntl.h>    // open, O_*
+#include <stdint.h>   // uint*_t
+#include <stdio.h>    // fprintf, perror, snprintf
+#include <stdlib.h>   // calloc, free, malloc, realloc, strtoull
+#include <string.h>   // memcmp, memcpy, strcmp, strlen, strspn
+#include <sys/file.h> // flock
+#include <sys/stat.h> // fstat
+#include <time.h>     // clock_gettime
+#include <unistd.h>   // close, fdatasync, ftruncate, read, write
+
+#include "config.h" // HAVE_FDATASYNC
+
+
+/** \brief Magic bytes at the start of each segment.
+ */
+#define JOURNAL_MAGIC "CRJNL001"
+
+/** \brief Length of \ref JOURNAL_MAGIC.
+ */
+#define JOURNAL_MAGIC_SIZE 8
+
+/** \brief Size of the length and CRC preceding the body of a record.
+ */
+#define JOURNAL_HEADER_SIZE 8
+
+/** \brief Size of the fixed fields of the body of a record.
+ */
+#define JOURNAL_BODY_SIZE 26
+
+/** \brief Maximum size of a scan, as read by libcodereader.
+ */
+#define JOURNAL_SCAN_MAX (1024 * 1024)
+
+/** \brief Maximum size of the body of a record.
+ *
+ * \details The first record of a segment may exceed the segment size, so the
+ *  length of a record has to be checked against this size on recovery.
+ */
+#define JOURNAL_RECORD_MAX (JOURNAL_BODY_SIZE + UINT16_MAX + JOURNAL_SCAN_MAX)
+
+/** \brief Suffix of segment file names.
+ */
+#define JOURNAL_SUFFIX ".journal"
+
+/** \brief Length of the sequence number in segment file names.
+ */
+#define JOURNAL_DIGITS 20
+
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync fsync
+#endif
+
+
+/** \brief State of an opened journal.
+ */
+struct journal
+{
+	struct journal_options options; ///< Options of the journal.
+	int dir;     ///< File descriptor of the journal directory (locked).
+	int fd;      ///< File descriptor of the current segment.
+	size_t size; ///< Size of the current segment.
+	uint64_t seq; ///< Sequence number of the next record.
+
+	char *buffer;       ///< Buffer to assemble records in.
+	size_t buffer_size; ///< Size of \ref buffer.
+
+	bool dirty;            ///< Whether records have not been synced yet.
+	struct timespec first; ///< Time the oldest unsynced record was appended.
+};
+
+
+/** \brief Calculate the CRC-32 (IEEE 802.3) of \p data.
+ */
+static uint32_t
+crc32(const unsigned char *data, size_t length)
+{
+	static uint32_t table[256];
+	if (table[1] == 0)
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < length; i++)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+
+/** \brief Store \p value in \p p in network byte order.
+ */
+static unsigned char *
+put_be(unsigned char *p, uint64_t value, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i++)
+		p[i] = (unsigned char)(value >> (8 * (bytes - 1 - i)));
+	return p + bytes;
+}
+
+
+/** \brief Load a value of \p bytes bytes in network byte order from \p p.
+ */
+static uint64_t
+get_be(const unsigned char *p, size_t bytes)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; i++)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+
+/** \brief Write all \p length bytes of \p data to \p fd.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+write_all(int fd, const void *data, size_t length)
+{
+	const char *p = data;
+	while (length > 0) {
+		ssize_t n = write(fd, p, length);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		length -= n;
+	}
+	return true;
+}
+
+
+/** \brief Read up to \p length bytes from \p fd into \p data.
+ *
+ * \return The number of bytes read, which is less than \p length only at the
+ *  end of the file, or -1 on errors.
+ */
+static ssize_t
+read_all(int fd, void *data, size_t length)
+{
+	char *p = data;
+	size_t done = 0;
+	while (done < length) {
+		ssize_t n = read(fd, p + done, length - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+
+/** \brief Make sure the record buffer of \p j has space for \p size bytes.
+ */
+static bool
+buffer_reserve(struct journal *j, size_t size)
+{
+	if (j->buffer_size >= size)
+		return true;
+
+	size_t n = (j->buffer_size > 0) ? j->buffer_size : 256;
+	while (n < size)
+		n *= 2;
+	char *p = realloc(j->buffer, n);
+	if (p == NULL) {
+		fprintf(stderr, "Not enough memory for journal buffer.\n");
+		return false;
+	}
+	j->buffer = p;
+	j->buffer_size = n;
+	return true;
+}
+
+
+/** \brief Check whether \p name is the file name of a segment.
+ */
+static int
+segment_filter(const struct dirent *entry)
+{
+	const char *name = entry->d_name;
+	return strlen(name) == JOURNAL_DIGITS + strlen(JOURNAL_SUFFIX) &&
+	       strspn(name, "0123456789") == JOURNAL_DIGITS &&
+	       strcmp(name + JOURNAL_DIGITS, JOURNAL_SUFFIX) == 0;
+}
+
+
+/** \brief Create a new segment starting with the next record of \p j.
+ *
+ * \details The directory will be synced, so the new segment can't get lost.
+ *
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+segment_create(struct journal *j)
+{
+	char name[JOURNAL_DIGITS + sizeof(JOURNAL_SUFFIX)];
+	snprintf(name, sizeof(name), "%0*llu" JOURNAL_SUFFIX, JOURNAL_DIGITS,
+	         (unsigned long long)j->seq);
+
+	j->fd = openat(j->dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0640);
+	if (j->fd < 0 || !write_all(j->fd, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) ||
+	    fdatasync(j->fd) != 0 || fsync(j->dir) != 0) {
+		perror("Failed to create journal segment");
+		return false;
+	}
+	j->size = JOURNAL_MAGIC_SIZE;
+	return true;
+}
+
+
+/** \brief Recover the segment \p name of \p j.
+ *
+ * \details All records of the segment will be checked. If the segment ends
+ *  with a torn or corrupt record, the segment will be truncated after the last
+ *  valid record. The segment will be opened for appending further records.
+ *
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+segment_recover(struct journal *j, const char *name)
+{
+	j->seq = strtoull(name, NULL, 10);
+	int fd = openat(j->dir, name, O_RDWR | O_APPEND);
+	if (fd < 0) {
+		perror("Failed to open journal segment");
+		return false;
+	}
+	j->fd = fd;
+
+	/* A segment without a complete header has been created right before a
+	 * crash, so it will be initialized again. */
+	char magic[JOURNAL_MAGIC_SIZE];
+	ssize_t n = read_all(fd, magic, JOURNAL_MAGIC_SIZE);
+	if (n < 0) {
+		perror("Failed to read journal segment");
+		return false;
+	}
+	if (n < JOURNAL_MAGIC_SIZE) {
+		close(fd);
+		return segment_create(j);
+	}
+	if (memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0) {
+		fprintf(stderr, "Journal segment %s is not a journal.\n", name);
+		return false;
+	}
+
+	/* Check all records of the segment. The first record, which is not
+	 * complete, has an invalid checksum or an unexpected sequence number,
+	 * marks the end of the valid records. */
+	off_t valid = JOURNAL_MAGIC_SIZE;
+	while (true) {
+		unsigned char header[JOURNAL_HEADER_SIZE];
+		if (read_all(fd, header, JOURNAL_HEADER_SIZE) < JOURNAL_HEADER_SIZE)
+			break;
+		size_t length = get_be(header, 4);
+		if (length < JOURNAL_BODY_SIZE || length > JOURNAL_RECORD_MAX)
+			break;
+		if (!buffer_reserve(j, length))
+			return false;
+		unsigned char *body = (unsigned char *)j->buffer;
+		if (read_all(fd, body, length) < (ssize_t)length ||
+		    crc32(body, length) != get_be(header + 4, 4) ||
+		    get_be(body, 8) != j->seq)
+			break;
+
+		j->seq++;
+		valid += JOURNAL_HEADER_SIZE + length;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror("Failed to stat journal segment");
+		return false;
+	}
+	if (st.st_size > valid) {
+		fprintf(stderr,
+		        "Journal segment %s: dropping %lld bytes of torn records.\n",
+		        name, (long long)(st.st_size - valid));
+		if (ftruncate(fd, valid) != 0 || fdatasync(fd) != 0) {
+			perror("Failed to truncate journal segment");
+			return false;
+		}
+	}
+	j->size = valid;
+	return true;
+}
+
+
+/** \brief Open the journal configured by \p options.
+ *
+ * \details The journal directory will be locked, so only one process can
+ *  append to the journal. The last segment will be recovered and used for
+ *  appending new records.
+ *
+ *
+ * \param options Options of the journal.
+ *
+ * \return Pointer to the journal or NULL, if an error occured.
+ */
+struct journal *
+journal_open(const struct journal_options *options)
+{
+	struct journal *j = calloc(1, sizeof(struct journal));
+	if (j == NULL) {
+		fprintf(stderr, "Not enough memory for journal.\n");
+		return NULL;
+	}
+	j->options = *options;
+	j->fd = -1;
+	j->seq = 1;
+
+	j->dir = open(options->path, O_RDONLY | O_DIRECTORY);
+	if (j->dir < 0) {
+		perror("Failed to open journal directory");
+		free(j);
+		return NULL;
+	}
+	if (flock(j->dir, LOCK_EX | LOCK_NB) != 0) {
+		perror("Failed to lock journal directory");
+		journal_close(j);
+		return NULL;
+	}
+
+	/* Only the last segment needs to be recovered, as all others have been
+	 * synced completely before the next segment has been created. */
+	struct dirent **entries;
+	int num = scandir(options->path, &entries, segment_filter, alphasort);
+	if (num < 0) {
+		perror("Failed to list journal directory");
+		journal_close(j);
+		return NULL;
+	}
+	bool ok = (num > 0) ? segment_recover(j, entries[num - 1]->d_name)
+	                    : segment_create(j);
+	for (int i = 0; i < num; i++)
+		free(entries[i]);
+	free(entries);
+
+	if (!ok) {
+		journal_close(j);
+		return NULL;
+	}
+	return j;
+}
+
+
+/** \brief Append a record for \p barcode to \p journal.
+ *
+ * \details The record will be written immediately, but synced to disk by the
+ *  next call of \ref journal_sync. If the current segment would exceed its
+ *  size, it will be synced and a new segment created first.
+ *
+ *
+ * \param journal The journal.
+ * \param barcode The scan to append.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+bool
+journal_append(struct journal *journal,
+               const struct codereader_barcode *barcode)
+{
+	size_t device_len = strlen(barcode->device);
+	if (device_len > UINT16_MAX)
+		device_len = UINT16_MAX;
+	size_t length = JOURNAL_BODY_SIZE + device_len + barcode->length;
+	size_t total = JOURNAL_HEADER_SIZE + length;
+
+	if (journal->size > JOURNAL_MAGIC_SIZE &&
+	    journal->size + total > journal->options.segment_size) {
+		if (!journal_sync(journal))
+			return false;
+		close(journal->fd);
+		if (!segment_create(journal))
+			return false;
+	}
+
+	if (!buffer_reserve(journal, total))
+		return false;
+	struct timespec now, ready;
+	clock_gettime(CLOCK_REALTIME, &now);
+	unsigned char *record = (unsigned char *)journal->buffer;
+	unsigned char *body = record + JOURNAL_HEADER_SIZE;
+	unsigned char *p = put_be(body, journal->seq, 8);
+	p = put_be(p,
+	           (uint64_t)barcode->time.tv_sec * 1000000000ULL +
+	               barcode->time.tv_nsec,
+	           8);
+	p = put_be(p, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, 8);
+	p = put_be(p, device_len, 2);
+	memcpy(p, barcode->device, device_len);
+	memcpy(p + device_len, barcode->data, barcode->length);
+	p = put_be(record, length, 4);
+	put_be(p, crc32(body, length), 4);
+
+	if (!write_all(journal->fd, journal->buffer, total)) {
+		perror("Failed to write journal");
+		return false;
+	}
+	journal->size += total;
+	journal->seq++;
+
+	clock_gettime(CLOCK_MONOTONIC, &ready);
+	if (!journal->dirty) {
+		journal->dirty = true;
+		journal->first = ready;
+	}
+	return true;
+}
+
+
+/** \brief Get the time until \p journal needs to be synced.
+ *
+ *
+ * \param journal The journal.
+ *
+ * \return The time in ms until the oldest unsynced record needs to be synced,
+ *  zero if it needs to be synced now, or -1 if all records have been synced.
+ */
+int
+journal_timeout(const struct journal *journal)
+{
+	if (!journal->dirty)
+		return -1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec - journal->first.tv_sec) * 1000 +
+	               (now.tv_nsec - journal->first.tv_nsec) / 1000000;
+	return (elapsed >= journal->options.sync_ms)
+	           ? 0
+	           : journal->options.sync_ms - elapsed;
+}
+
+
+/** \brief Sync all records appended to \p journal.
+ *
+ * \details A single `fdatasync` covers all records appended since the last
+ *  sync.
+ *
+ *
+ * \param journal The journal.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+bool
+journal_sync(struct journal *journal)
+{
+	if (!journal->dirty)
+		return true;
+
+	if (fdatasync(journal->fd) != 0) {
+		perror("Failed to sync journal");
+		return false;
+	}
+	journal->dirty = false;
+	return true;
+}
+
+
+/** \brief Sync and close \p journal.
+ *
+ *
+ * \param journal The journal.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+bool
+journal_close(struct journal *journal)
+{
+	bool ret = true;
+	if (journal->fd >= 0) {
+		ret = journal_sync(journal);
+		if (close(journal->fd) != 0)
+			ret = false;
+	}
+	if (journal->dir >= 0)
+		close(journal->dir);
+
+	free(journal->buffer);
+	free(journal);
+	return ret;
+}
@@ -0,0 +1,52 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_BIN_JOURNAL_H
+#define CODEREADER_BIN_JOURNAL_H
+
+
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+#include <codereader.h> // codereader_barcode
+
+
+/** \brief Options of the journal.
+ */
+struct journal_options
+{
+	const char *path;    ///< Directory of the journal or NULL, if disabled.
+	int sync_ms;         ///< Maximum time in ms a record waits for its sync.
+	size_t segment_size; ///< Size in bytes to rotate segments at.
+};
+
+
+struct journal;
+
+
+struct journal *journal_open(const struct journal_options *options);
+bool journal_append(struct journal *journal,
+                    const struct codereader_barcode *barcode);
+int journal_timeout(const struct journal *journal);
+bool journal_sync(struct journal *journal);
+bool journal_close(struct journal *journal);
+
+
+#endif
@@ -0,0 +1,406 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Formatted output of scans.
+ *
+ * \details Each scan will be formatted into its own record buffer. The records
+ *  of a batch will be written with a single call to `writev`, when the batch is
+ *  full or its oldest scan waited for the configured time. If a journal is
+ *  used, each scan will be appended to the journal before it will be written,
+ *  and the journal synced when its oldest unsynced record waited for the
+ *  configured time. A batch will be written only after the journal has been
+ *  synced, so no scan is written, which might be lost from the journal. If a
+ *  lookup index is used, the record of each barcode will be attached to its
+ *  scan.
+ */
+
+#include "output.h"
+
+#include <errno.h>    // errno, EINTR
+#include <stdbool.h>  // bool, false, true
+#include <stdint.h>   // uint*_t
+#include <stdio.h>    // fprintf, snprintf
+#include <stdlib.h>   // calloc, free, realloc
+#include <string.h>   // memcpy, strlen
+#include <sys/uio.h>  // writev
+#include <time.h>     // clock_gettime
+#include <unistd.h>   // STDOUT_FILENO
+
+#include "index.h" // index_*
+
+
+/** \brief Size of the header of binary records.
+ *
+ * \details The header consists of the length of the scan (32 bit), the time of
+ *  the scan in ns since the epoch (64 bit) and the length of the device name
+ *  (16 bit), all in network byte order. The device name and the scan follow
+ *  the header.
+ */
+#define BINARY_HEADER_SIZE 14
+
+
+/** \brief Buffer of a single formatted scan.
+ */
+struct record
+{
+	char *data;    ///< The formatted scan.
+	size_t size;   ///< Size of \ref data.
+	size_t length; ///< Length of the formatted scan.
+};
+
+
+/** \brief Make sure \p r has space for at least \p size bytes.
+ *
+ * \details The buffers will be kept between batches, so they only need to be
+ *  reallocated for scans longer than any scan before.
+ */
+static bool
+record_reserve(struct record *r, size_t size)
+{
+	if (r->size >= size)
+		return true;
+
+	size_t n = (r->size > 0) ? r->size : 64;
+	while (n < size)
+		n *= 2;
+	char *p = realloc(r->data, n);
+	if (p == NULL) {
+		fprintf(stderr, "Not enough memory for output buffer.\n");
+		return false;
+	}
+	r->data = p;
+	r->size = n;
+	return true;
+}
+
+
+/** \brief Store \p value in \p p in network byte order.
+ */
+static char *
+put_be(char *p, uint64_t value, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i++)
+		p[i] = (char)(value >> (8 * (bytes - 1 - i)));
+	return p + bytes;
+}
+
+
+/** \brief Append \p s of length \p n as escaped JSON string to \p p.
+ *
+ * \note \p p must have space for 6 bytes per character.
+ */
+static char *
+put_json(char *p, const char *s, size_t n)
+{
+	*p++ = '"';
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20)
+			p += sprintf(p, "\\u%04x", c);
+		else
+			*p++ = c;
+	}
+	*p++ = '"';
+	return p;
+}
+
+
+/** \brief Format \p barcode into \p r.
+ *
+ * \details If a lookup index is used, the record of the barcode will be
+ *  attached: separated by a tab in text and raw format, as `record` in JSON
+ *  (null if not found) and as length-prefixed (32 bit) record following the
+ *  scan in binary format. The GS1 fields of the barcode will be added to JSON
+ *  as object `gs1` mapping the AIs to their values.
+ *
+ *
+ * \param r The record to format the scan into.
+ * \param barcode The scan.
+ * \param options Options of the output.
+ * \param match The record of the barcode in the index or NULL.
+ * \param match_len Length of \p match.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+record_format(struct record *r, const struct codereader_barcode *barcode,
+              const struct output_options *options, const char *match,
+              size_t match_len)
+{
+	size_t device_len = strlen(barcode->device);
+	char *p;
+
+	switch (options->format) {
+		case OUTPUT_TEXT:
+		case OUTPUT_RAW:
+			if (!record_reserve(r, barcode->length + match_len + 2))
+				return false;
+			p = r->data;
+			memcpy(p, barcode->data, barcode->length);
+			p += barcode->length;
+			if (match != NULL) {
+				*p++ = '\t';
+				memcpy(p, match, match_len);
+				p += match_len;
+			}
+			*p++ = (options->format == OUTPUT_TEXT) ? '\n' : '\0';
+			r->length = p - r->data;
+			return true;
+
+		case OUTPUT_BINARY:
+			if (device_len > UINT16_MAX)
+				device_len = UINT16_MAX;
+			if (!record_reserve(r, BINARY_HEADER_SIZE + device_len +
+			                           barcode->length + 4 + match_len))
+				return false;
+			p = put_be(r->data, barcode->length, 4);
+			p = put_be(p,
+			           (uint64_t)barcode->time.tv_sec * 1000000000ULL +
+			               barcode->time.tv_nsec,
+			           8);
+			p = put_be(p, device_len, 2);
+			memcpy(p, barcode->device, device_len);
+			memcpy(p + device_len, barcode->data, barcode->length);
+			p += device_len + barcode->length;
+			if (options->index != NULL) {
+				p = put_be(p, match_len, 4);
+				if (match != NULL)
+					memcpy(p, match, match_len);
+				p += match_len;
+			}
+			r->length = p - r->data;
+			return true;
+
+		case OUTPUT_JSON:
+			if (!record_reserve(r, 80 + 6 * (device_len + barcode->length +
+			                                 match_len) +
+			                           16 * barcode->num_fields +
+			                           6 * barcode->length))
+				return false;
+			p = r->data;
+			p += sprintf(p, "{\"device\":");
+			p = put_json(p, barcode->device, device_len);
+			p += sprintf(p, ",\"time\":%lld.%09ld,\"data\":",
+			             (long long)barcode->time.tv_sec,
+			             barcode->time.tv_nsec);
+			p = put_json(p, barcode->data, barcode->length);
+			if (barcode->num_fields > 0) {
+				p += sprintf(p, ",\"gs1\":{");
+				for (size_t i = 0; i < barcode->num_fields; i++) {
+					const struct codereader_gs1_field *f =
+					    &(barcode->fields[i]);
+					p += sprintf(p, "%s\"%s\":", (i > 0) ? "," : "", f->ai);
+					p = put_json(p, barcode->data + f->offset, f->length);
+				}
+				*p++ = '}';
+			}
+			if (options->index != NULL) {
+				p += sprintf(p, ",\"record\":");
+				if (match != NULL)
+					p = put_json(p, match, match_len);
+				else
+					p += sprintf(p, "null");
+			}
+			*p++ = '}';
+			*p++ = '\n';
+			r->length = p - r->data;
+			return true;
+	}
+
+	return false;
+}
+
+
+/** \brief Write all records in \p iov to stdout.
+ *
+ * \details Partial writes will be continued, until all records have been
+ *  written.
+ *
+ *
+ * \param iov The records to write.
+ * \param num Number of entries in \p iov.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+flush(struct iovec *iov, size_t num)
+{
+	while (num > 0) {
+		ssize_t n = writev(STDOUT_FILENO, iov, num);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to write scans");
+			return false;
+		}
+
+		/* Skip all records written completely and adjust the first one, which
+		 * has been written partially. */
+		while (num > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			num--;
+		}
+		if (num > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return true;
+}
+
+
+/** \brief Get the milliseconds elapsed since \p start.
+ */
+static long
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+
+/** \brief Write scans of \p handle to stdout.
+ *
+ *
+ * \param handle The codereader handle.
+ * \param num How many scans to write or -1 for an endless loop.
+ * \param options Options of the output.
+ * \param journal The journal to append all scans to or NULL.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+output_run(struct codereader_handle *handle, int num,
+           const struct output_options *options, struct journal *journal)
+{
+	struct index index;
+	if (options->index != NULL && !index_open(&index, options->index))
+		return -1;
+
+	struct record *records = calloc(options->batch, sizeof(struct record));
+	struct iovec *iov = calloc(options->batch, sizeof(struct iovec));
+	if (records == NULL || iov == NULL) {
+		fprintf(stderr, "Not enough memory for output buffers.\n");
+		free(records);
+		free(iov);
+		if (options->index != NULL)
+			index_close(&index);
+		return -1;
+	}
+
+	int ret = 0;
+	size_t pending = 0;
+	struct timespec first;
+	while (num == -1 || num > 0) {
+		/* All records appended to the journal within its sync window will be
+		 * synced together. */
+		if (journal != NULL && journal_timeout(journal) == 0 &&
+		    !journal_sync(journal)) {
+			ret = -1;
+			break;
+		}
+
+		/* If scans are waiting for their batch, wait only until the oldest of
+		 * them needs to be written. The same applies to the journal. */
+		int timeout = -1;
+		if (pending > 0) {
+			timeout = options->flush_ms - elapsed_ms(&first);
+			if (timeout < 0)
+				timeout = 0;
+		}
+		if (journal != NULL) {
+			int sync = journal_timeout(journal);
+			if (sync >= 0 && (timeout < 0 || sync < timeout))
+				timeout = sync;
+		}
+
+		struct codereader_barcode barcode;
+		int n = codereader_next(handle, &barcode, timeout);
+		if (n < 0) {
+			ret = -1;
+			break;
+		} else if (n > 0) {
+			/* The record of the barcode will be copied into the formatted
+			 * scan, so the index may be replaced before the batch is
+			 * written. */
+			const char *match = NULL;
+			size_t match_len = 0;
+			if (options->index != NULL)
+				index_lookup(&index, barcode.data, barcode.length, &match,
+				             &match_len);
+
+			if ((journal != NULL && !journal_append(journal, &barcode)) ||
+			    !record_format(&(records[pending]), &barcode, options, match,
+			                   match_len)) {
+				ret = -1;
+				break;
+			}
+			iov[pending].iov_base = records[pending].data;
+			iov[pending].iov_len = records[pending].length;
+			if (pending++ == 0)
+				clock_gettime(CLOCK_MONOTONIC, &first);
+			if (num > 0)
+				num--;
+
+			if (pending < options->batch && num != 0)
+				continue;
+		}
+
+		/* The batch is full, its time is up or no more scans will be read, so
+		 * write all pending scans. Their records will be synced first, so all
+		 * written scans are durable in the journal. If syncing fails, the
+		 * scans must not be written. */
+		if (pending > 0 && journal != NULL && !journal_sync(journal)) {
+			pending = 0;
+			ret = -1;
+			break;
+		}
+		if (pending > 0 && !flush(iov, pending)) {
+			/* The batch may have been written partially, so it must not be
+			 * written again below. */
+			pending = 0;
+			ret = -1;
+			break;
+		}
+		pending = 0;
+	}
+
+	/* Scans read before an error will still be written. */
+	if (pending > 0 &&
+	    ((journal != NULL && !journal_sync(journal)) || !flush(iov, pending)))
+		ret = -1;
+
+	for (size_t i = 0; i < options->batch; i++)
+		free(records[i].data);
+	free(records);
+	free(iov);
+	if (options->index != NULL)
+		index_close(&index);
+	return ret;
+}
@@ -0,0 +1,63 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_BIN_OUTPUT_H
+#define CODEREADER_BIN_OUTPUT_H
+
+
+#include <stddef.h> // size_t
+
+#include <codereader.h> // codereader_handle
+
+#include "journal.h" // journal
+
+
+/** \brief Maximum number of scans written with a single system call.
+ */
+#define OUTPUT_BATCH_MAX 1024
+
+
+/** \brief Format of the scans written to stdout.
+ */
+enum output_format
+{
+	OUTPUT_TEXT,   ///< One scan per line.
+	OUTPUT_RAW,    ///< Scans terminated by a null-character.
+	OUTPUT_BINARY, ///< Length-prefixed binary records.
+	OUTPUT_JSON    ///< One JSON object per line.
+};
+
+
+/** \brief Options of the output.
+ */
+struct output_options
+{
+	enum output_format format; ///< Format of the scans.
+	size_t batch; ///< Maximum number of scans written at once.
+	int flush_ms; ///< Maximum time in ms a scan waits for its batch.
+	const char *index; ///< Path of the lookup index or NULL.
+};
+
+
+int output_run(struct codereader_handle *handle, int num,
+               const struct output_options *options, struct journal *journal);
+
+
+#endif
@@ -0,0 +1,489 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Serve scans to local clients via a `SOCK_SEQPACKET` socket.
+ *
+ * \details A reader thread reads the scans from the codereader stream and
+ *  passes them to the server loop. The server loop queues each scan for all
+ *  connected clients and sends the queued scans with non-blocking writes, so a
+ *  slow client doesn't delay the delivery to other clients. The scans are
+ *  reference counted and shared by all queues, so they won't be copied for
+ *  each client.
+ */
+
+#define _GNU_SOURCE // getline, sendmmsg
+
+
+#include "server.h"
+
+#include <errno.h>      // errno, EAGAIN, EWOULDBLOCK
+#include <fcntl.h>      // fcntl, O_NONBLOCK
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_*
+#include <signal.h>     // signal, SIGPIPE
+#include <stdbool.h>    // bool, false, true
+#include <stdlib.h>     // calloc, free, malloc, realloc
+#include <string.h>     // memcpy, memset, strncpy
+#include <sys/socket.h> // socket, bind, listen, accept, send*
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close, pipe, read, unlink, write
+
+#include "config.h" // HAVE_SENDMMSG
+
+
+/** \brief Maximum number of scans sent with a single system call.
+ */
+#define SERVER_BATCH_SIZE 64
+
+
+/** \brief A single scan shared by the queues of all clients.
+ */
+struct scan
+{
+	size_t refs;   ///< Number of queues referencing this scan.
+	size_t length; ///< Length of \ref data.
+	char data[];   ///< The scan.
+};
+
+/** \brief A connected client.
+ */
+struct client
+{
+	int fd;                ///< Connection to the client.
+	struct scan **queue;   ///< Ring buffer of queued scans.
+	size_t head;           ///< Index of the oldest queued scan.
+	size_t count;          ///< Number of queued scans.
+	unsigned long dropped; ///< Number of scans dropped for this client.
+};
+
+/** \brief State of the server loop.
+ */
+struct server
+{
+	const struct server_options *options; ///< Options of the server.
+
+	struct client *clients; ///< List of connected clients.
+	size_t num_clients;     ///< Number of entries in \ref clients.
+
+	/** \brief List of descriptors to poll.
+	 *
+	 * \details The list starts with the listening socket and the pipe of the
+	 *  reader thread, followed by the connections of all clients in the same
+	 *  order as \ref clients.
+	 */
+	struct pollfd *polls;
+};
+
+/** \brief Arguments of the reader thread.
+ */
+struct reader
+{
+	FILE *ch; ///< The codereader stream.
+	int num;  ///< Number of scans to read or -1 for an endless loop.
+	int fd;   ///< Writing end of the pipe to the server loop.
+};
+
+
+/** \brief Read scans from the codereader stream and pass them to the server.
+ *
+ * \details As the server loop runs in the same process, only the pointers to
+ *  the scans will be written into the pipe. The pipe will be closed, if no
+ *  more scans can be read, which stops the server loop.
+ *
+ *
+ * \param arg Pointer to \ref reader.
+ */
+static void *
+reader_thread(void *arg)
+{
+	struct reader *r = arg;
+
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t length;
+	while ((r->num == -1 || r->num--) &&
+	       (length = getline(&line, &n, r->ch)) > 0) {
+		struct scan *s = malloc(sizeof(struct scan) + length);
+		if (s == NULL) {
+			fprintf(stderr, "Not enough memory for scan.\n");
+			continue;
+		}
+		s->refs = 0;
+		s->length = length;
+		memcpy(s->data, line, length);
+
+		if (write(r->fd, &s, sizeof(s)) != sizeof(s)) {
+			free(s);
+			break;
+		}
+	}
+	free(line);
+	close(r->fd);
+
+	return NULL;
+}
+
+
+/** \brief Release one reference of scan \p s.
+ */
+static void
+scan_release(struct scan *s)
+{
+	if (--(s->refs) == 0)
+		free(s);
+}
+
+
+/** \brief Accept a new client at \p listener.
+ *
+ *
+ * \param srv Pointer to the server state.
+ * \param listener File descriptor of the listening socket.
+ */
+static void
+client_accept(struct server *srv, int listener)
+{
+	int fd = accept(listener, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	/* All writes to the client need to be non-blocking, so a slow client can't
+	 * block the server loop. */
+	struct client c = {.fd = fd};
+	c.queue = calloc(srv->options->queue_size, sizeof(struct scan *));
+	struct client *p = realloc(srv->clients,
+	                           (srv->num_clients + 1) * sizeof(struct client));
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+	    c.queue == NULL || p == NULL) {
+		fprintf(stderr, "Failed to accept new client.\n");
+		if (p != NULL)
+			srv->clients = p;
+		free(c.queue);
+		close(fd);
+		return;
+	}
+
+	srv->clients = p;
+	srv->clients[srv->num_clients++] = c;
+}
+
+
+/** \brief Disconnect client \p n.
+ *
+ *
+ * \param srv Pointer to the server state.
+ * \param n Index of the client.
+ */
+static void
+client_remove(struct server *srv, size_t n)
+{
+	struct client *c = &(srv->clients[n]);
+	if (c->dropped > 0)
+		fprintf(stderr, "Dropped %lu scans for slow client.\n", c->dropped);
+
+	close(c->fd);
+	for (; c->count > 0; c->count--) {
+		scan_release(c->queue[c->head]);
+		c->head = (c->head + 1) % srv->options->queue_size;
+	}
+	free(c->queue);
+
+	srv->clients[n] = srv->clients[--(srv->num_clients)];
+}
+
+
+/** \brief Queue scan \p s for client \p c.
+ *
+ *
+ * \param srv Pointer to the server state.
+ * \param c The client.
+ * \param s The scan.
+ *
+ * \return If the scan has been queued, true will be returned. If the queue is
+ *  full and the client should be disconnected, false will be returned.
+ */
+static bool
+client_push(struct server *srv, struct client *c, struct scan *s)
+{
+	size_t size = srv->options->queue_size;
+	if (c->count == size) {
+		if (srv->options->overflow == SERVER_DISCONNECT)
+			return false;
+
+		scan_release(c->queue[c->head]);
+		c->head = (c->head + 1) % size;
+		c->count--;
+		c->dropped++;
+	}
+
+	c->queue[(c->head + c->count) % size] = s;
+	c->count++;
+	s->refs++;
+
+	return true;
+}
+
+
+/** \brief Remove the first \p n scans from the queue of client \p c.
+ */
+static void
+client_pop(struct server *srv, struct client *c, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		scan_release(c->queue[c->head]);
+		c->head = (c->head + 1) % srv->options->queue_size;
+	}
+	c->count -= n;
+}
+
+
+/** \brief Send the queued scans of client \p c.
+ *
+ * \details Each scan will be sent in its own packet. If available, `sendmmsg`
+ *  will be used to send up to \ref SERVER_BATCH_SIZE scans with a single system
+ *  call. `writev` can't be used for batching, as it would merge all scans into
+ *  a single packet.
+ *
+ *
+ * \param srv Pointer to the server state.
+ * \param c The client.
+ *
+ * \return If the connection is still usable, true will be returned, otherwise
+ *  false.
+ */
+static bool
+client_flush(struct server *srv, struct client *c)
+{
+	while (c->count > 0) {
+#ifdef HAVE_SENDMMSG
+		size_t size = srv->options->queue_size;
+		struct mmsghdr msgs[SERVER_BATCH_SIZE];
+		struct iovec iov[SERVER_BATCH_SIZE];
+		unsigned int n =
+		    (c->count < SERVER_BATCH_SIZE) ? c->count : SERVER_BATCH_SIZE;
+		memset(msgs, 0, n * sizeof(struct mmsghdr));
+		for (unsigned int i = 0; i < n; i++) {
+			struct scan *s = c->queue[(c->head + i) % size];
+			iov[i].iov_base = s->data;
+			iov[i].iov_len = s->length;
+			msgs[i].msg_hdr.msg_iov = &(iov[i]);
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int sent = sendmmsg(c->fd, msgs, n, 0);
+#else
+		struct scan *s = c->queue[c->head];
+		unsigned int n = 1;
+		int sent = (send(c->fd, s->data, s->length, 0) < 0) ? -1 : 1;
+#endif
+		if (sent < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK);
+
+		client_pop(srv, c, sent);
+		if ((unsigned int)sent < n)
+			break;
+	}
+
+	return true;
+}
+
+
+/** \brief Queue a new scan for all clients and try to send it immediately.
+ *
+ *
+ * \param srv Pointer to the server state.
+ * \param s The new scan.
+ */
+static void
+distribute(struct server *srv, struct scan *s)
+{
+	/* Hold an extra reference while distributing, so the scan doesn't get freed
+	 * when it's sent to a client immediately. The list of clients is iterated
+	 * backwards, as removing a client moves the last entry to its position. */
+	s->refs++;
+	for (size_t i = srv->num_clients; i-- > 0;)
+		if (!client_push(srv, &(srv->clients[i]), s) ||
+		    !client_flush(srv, &(srv->clients[i])))
+			client_remove(srv, i);
+	scan_release(s);
+}
+
+
+/** \brief Create the listening socket at \p path.
+ *
+ *
+ * \param path Path of the socket.
+ *
+ * \return On success the file descriptor of the socket, otherwise -1.
+ */
+static int
+server_listen(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(addr.sun_path);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "Can't listen on %s!\n", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/** \brief Serve the scans of \p ch to all clients connecting to the socket
+ *  defined in \p options.
+ *
+ *
+ * \param ch The codereader stream.
+ * \param num Number of scans to serve or -1 for an endless loop.
+ * \param options Options of the server.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+server_run(FILE *ch, int num, const struct server_options *options)
+{
+	/* Writing to a client that closed its connection must not terminate the
+	 * server, so SIGPIPE will be ignored and the error handled by the write
+	 * functions. */
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = server_listen(options->path);
+	if (listener < 0)
+		return -1;
+
+	int pipefd[2];
+	if (pipe(pipefd) < 0) {
+		fprintf(stderr, "Can't create pipe for reader thread!\n");
+		close(listener);
+		return -1;
+	}
+
+	struct reader r = {.ch = ch, .num = num, .fd = pipefd[1]};
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, reader_thread, &r) != 0) {
+		fprintf(stderr, "Can't start reader thread!\n");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		close(listener);
+		return -1;
+	}
+
+
+	/* Run the server loop until the reader thread finished and all queued
+	 * scans have been sent or their clients disconnected. */
+	struct server srv = {.options = options};
+	int scans = pipefd[0];
+	int ret = 0;
+	while (true) {
+		/* Rebuild the poll list, as clients may have been connected or
+		 * removed. A negative descriptor will be ignored by poll, so the pipe
+		 * doesn't need to be removed from the list after it has been closed. */
+		size_t num = srv.num_clients;
+		struct pollfd *p = realloc(srv.polls, (num + 2) * sizeof(*p));
+		if (p == NULL) {
+			fprintf(stderr, "Not enough memory to poll the clients.\n");
+			ret = -1;
+			break;
+		}
+		srv.polls = p;
+		p[0] = (struct pollfd){.fd = listener, .events = POLLIN};
+		p[1] = (struct pollfd){.fd = scans, .events = POLLIN};
+
+		bool pending = false;
+		for (size_t i = 0; i < num; i++) {
+			struct client *c = &(srv.clients[i]);
+			p[i + 2] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+			if (c->count > 0) {
+				p[i + 2].events |= POLLOUT;
+				pending = true;
+			}
+		}
+		if (scans < 0 && !pending)
+			break;
+
+		if (poll(p, num + 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to poll the clients.\n");
+			ret = -1;
+			break;
+		}
+
+		/* Clients don't send data, so a readable connection indicates the
+		 * client closed the connection. Otherwise the queued scans will be
+		 * sent, if the connection is writable. The list is iterated
+		 * backwards, as removing a client moves the last entry to its
+		 * position, which has been handled already. */
+		for (size_t i = num; i-- > 0;) {
+			struct client *c = &(srv.clients[i]);
+			short revents = p[i + 2].revents;
+			if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				char buffer[64];
+				ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+				if (n == 0 || (n < 0 && errno != EAGAIN)) {
+					client_remove(&srv, i);
+					continue;
+				}
+			}
+			if ((revents & POLLOUT) && !client_flush(&srv, c))
+				client_remove(&srv, i);
+		}
+
+		if (p[1].revents != 0) {
+			struct scan *s;
+			if (read(scans, &s, sizeof(s)) == sizeof(s)) {
+				distribute(&srv, s);
+			} else {
+				close(scans);
+				scans = -1;
+			}
+		}
+
+		if (p[0].revents != 0)
+			client_accept(&srv, listener);
+	}
+
+	/* Disconnect all remaining clients and close the listening socket. If the
+	 * server loop has been stopped by an error, the reader thread might still
+	 * wait for a scan, so it won't be joined. */
+	while (srv.num_clients > 0)
+		client_remove(&srv, srv.num_clients - 1);
+	free(srv.clients);
+	free(srv.polls);
+	close(listener);
+	unlink(options->path);
+
+	if (scans >= 0) {
+		close(scans);
+		pthread_detach(thread);
+	} else
+		pthread_join(thread, NULL);
+
+	return ret;
+}
@@ -0,0 +1,56 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_BIN_SERVER_H
+#define CODEREADER_BIN_SERVER_H
+
+
+#include <stddef.h> // size_t
+#include <stdio.h>  // FILE
+
+
+/** \brief Maximum number of scans queued per client.
+ */
+#define SERVER_QUEUE_MAX (1024 * 1024)
+
+
+/** \brief What to do, if the queue of a client is full.
+ */
+enum server_overflow
+{
+	SERVER_DROP_OLDEST, ///< Drop the oldest scan in the queue.
+	SERVER_DISCONNECT   ///< Disconnect the client.
+};
+
+
+/** \brief Options of the server mode.
+ */
+struct server_options
+{
+	const char *path;              ///< Path of the listening socket.
+	size_t queue_size;             ///< Maximum number of queued scans.
+	enum server_overflow overflow; ///< Overflow policy for the queues.
+};
+
+
+int server_run(FILE *ch, int num, const struct server_options *options);
+
+
+#endif
@@ -0,0 +1,387 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Scale test of libcodereader with many mock devices.
+ *
+ * \details This program opens a stream of mock devices in-process and drives
+ *  them through the sockets of the `mock` driver. It measures the time to open
+ *  and close the stream, the time to dispatch a scan and the fairness between
+ *  devices, which are backlogged at the same time. If a baseline is given for
+ *  any of these values and the measured value exceeds it, the program fails,
+ *  so regressions like a limit on the number of file descriptors or costs
+ *  growing with the number of devices get caught by CI. As the times depend on
+ *  the machine, they may exceed their baselines by a tolerance factor.
+ */
+
+#include <stdbool.h>      // bool, false, true
+#include <stdio.h>        // fprintf, printf, snprintf
+#include <stdlib.h>       // atoi, atof, calloc, free, setenv, EXIT_*
+#include <sys/resource.h> // getrlimit, setrlimit
+#include <sys/socket.h>   // socketpair, send
+#include <time.h>         // clock_gettime
+#include <unistd.h>       // close
+
+#include <argp.h>       // argp functions
+#include <codereader.h> // codereader_*
+
+#include "config.h"
+
+
+/* Configure argp.
+ *
+ * Argp is used to parse command line options. It handles the most common
+ * options like --help and --version, so that a manual coding of getopt code is
+ * not required anymore. For detailed information about the varaibles below, see
+ * the argp documentation.
+ */
+const char *argp_program_version = "crutils " CRUTILS_VERSION;
+
+const char *argp_program_bug_address =
+    "https://github.com/alehaa/crutils/issues";
+
+static char doc[] = "Scale test of libcodereader with many mock devices";
+
+static struct argp_option options[] = {
+    {"devices", 'n', "NUMBER", 0, "Number of mock devices"},
+    {"batches", 'b', "NUMBER", 0, "Number of batches of scans"},
+    {"depth", 'q', "NUMBER", 0, "Scans queued per device and batch"},
+    {"max-open", 'o', "MS", 0, "Baseline of the time to open the stream"},
+    {"max-close", 'c', "MS", 0, "Baseline of the time to close the stream"},
+    {"max-dispatch", 'd', "US", 0, "Baseline of the time to dispatch a scan"},
+    {"max-spread", 's', "SCANS", 0,
+     "Baseline of the difference between the most and least served device"},
+    {"tolerance", 't', "FACTOR", 0,
+     "Factor the times may exceed their baselines by"},
+    {"driver-dir", 'D', "DIR", 0, "Directory to load the mock driver from"},
+    {0}};
+
+/** \brief Options of the scale test.
+ *
+ * \details Baselines less than zero will not be checked.
+ */
+struct arguments
+{
+	int devices;         ///< Number of mock devices.
+	int batches;         ///< Number of batches.
+	int depth;           ///< Scans per device and batch.
+	double max_open;     ///< Baseline in ms to open the stream.
+	double max_close;    ///< Baseline in ms to close the stream.
+	double max_dispatch; ///< Baseline in us to dispatch a single scan.
+	int max_spread;      ///< Baseline of the spread between devices.
+	double tolerance;    ///< Factor the times may exceed their baselines by.
+};
+
+/* Initialize argp parser. We'll use above defined parameters for documentation
+ * strings of argp. A forward declaration for parse_arguments is added to define
+ * parse_arguments together with the other functions below. */
+static error_t parse_arguments(int key, char *arg, struct argp_state *state);
+static struct argp argp = {options, &parse_arguments, NULL, doc};
+
+
+/** \brief Argument parser for argp.
+ *
+ * \note See argp parser documentation for detailed information about the
+ *  structure and functionality of function.
+ */
+static error_t
+parse_arguments(int key, char *arg, struct argp_state *state)
+{
+	struct arguments *args = state->input;
+	switch (key) {
+		case 'n': args->devices = atoi(arg); break;
+		case 'b': args->batches = atoi(arg); break;
+		case 'q': args->depth = atoi(arg); break;
+		case 'o': args->max_open = atof(arg); break;
+		case 'c': args->max_close = atof(arg); break;
+		case 'd': args->max_dispatch = atof(arg); break;
+		case 's': args->max_spread = atoi(arg); break;
+		case 't': args->tolerance = atof(arg); break;
+		case 'D': setenv("CODEREADER_DRIVER_DIR", arg, 1); break;
+
+		default: return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+
+/** \brief Get the time elapsed since \p start in seconds.
+ */
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/** \brief Raise the file descriptor limit for \p num devices.
+ *
+ * \details Each device needs both ends of its socket pair and the descriptor
+ *  duplicated by the driver while the stream is opened.
+ *
+ *
+ * \param num Number of devices.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+raise_limit(int num)
+{
+	rlim_t needed = 3 * (rlim_t)num + 64;
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+		perror("Failed to get file descriptor limit");
+		return false;
+	}
+	if (limit.rlim_cur >= needed)
+		return true;
+
+	if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+		fprintf(stderr, "%d devices need %lu file descriptors, but the limit "
+		                "is %lu.\n",
+		        num, (unsigned long)needed, (unsigned long)limit.rlim_max);
+		return false;
+	}
+	limit.rlim_cur = needed;
+	if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+		perror("Failed to raise file descriptor limit");
+		return false;
+	}
+	return true;
+}
+
+
+/** \brief Open a stream of \p num mock devices.
+ *
+ * \details The devices will be named `mock0` to `mockN`. The sending ends of
+ *  their socket pairs will be stored in \p fds.
+ *
+ *
+ * \param num Number of devices.
+ * \param fds Where to store the sending ends of the socket pairs.
+ * \param open_time Where to store the time in seconds to open the stream.
+ *
+ * \return On success the handle will be returned, otherwise NULL.
+ */
+static struct codereader_handle *
+open_devices(int num, int *fds, double *open_time)
+{
+	int *peers = calloc(num, sizeof(int));
+	struct codereader_config *config = codereader_config_new();
+	if (peers == NULL || config == NULL) {
+		fprintf(stderr, "Not enough memory for %d devices.\n", num);
+		free(peers);
+		if (config != NULL)
+			codereader_config_free(config);
+		return NULL;
+	}
+
+	/* Sequenced-packet sockets will be used, so each scan will be read as a
+	 * single message and closing a socket gets noticed by the driver. Failed
+	 * devices must not be reconnected, as their sockets are gone. */
+	struct codereader_handle *handle = NULL;
+	bool ok = true;
+	int i;
+	for (i = 0; i < num && ok; i++) {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0) {
+			perror("Failed to create socket pair");
+			ok = false;
+			break;
+		}
+		fds[i] = pair[0];
+		peers[i] = pair[1];
+
+		char name[32];
+		snprintf(name, sizeof(name), "mock%d", i);
+		if (codereader_config_add_device(config, name, "mock") < 0 ||
+		    codereader_config_set_int(config, name, "fd", pair[1]) < 0 ||
+		    codereader_config_set_bool(config, name, "reconnect", 0) < 0) {
+			fprintf(stderr, "Failed to configure device %s.\n", name);
+			ok = false;
+		}
+	}
+
+	if (ok) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		handle = codereader_new_from(config);
+		*open_time = elapsed(&start);
+	} else
+		codereader_config_free(config);
+
+	/* The driver duplicated the receiving ends, so they aren't needed
+	 * anymore. */
+	for (int j = 0; j < i; j++)
+		close(peers[j]);
+	free(peers);
+	return handle;
+}
+
+
+/** \brief Send a batch of \p depth scans to each of the \p num devices.
+ *
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+send_batch(const int *fds, int num, int batch, int depth)
+{
+	for (int i = 0; i < num; i++)
+		for (int k = 0; k < depth; k++) {
+			char buffer[64];
+			int len = snprintf(buffer, sizeof(buffer), "%d-%d-%d\n", i, batch,
+			                   k);
+			if (send(fds[i], buffer, len, 0) != len) {
+				perror("Failed to send scan");
+				return false;
+			}
+		}
+	return true;
+}
+
+
+/** \brief Compare \p value with \p baseline multiplied by \p tolerance.
+ *
+ *
+ * \return If the value is within the tolerated baseline true will be
+ *  returned, otherwise false.
+ */
+static bool
+check(const char *name, double value, double baseline, double tolerance)
+{
+	if (baseline < 0 || value <= baseline * tolerance)
+		return true;
+
+	fprintf(stderr, "Regression: %s %.3f exceeds the baseline %.3f (x%.1f).\n",
+	        name, value, baseline, tolerance);
+	return false;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	/* Parse all command line arguments with argp. */
+	struct arguments args = {64, 16, 4, -1, -1, -1, -1, 1};
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+	if (args.devices <= 0 || args.batches <= 0 || args.depth <= 0) {
+		fprintf(stderr, "Devices, batches and depth must be positive.\n");
+		return EXIT_FAILURE;
+	}
+	if (args.tolerance < 1) {
+		fprintf(stderr, "The tolerance must be at least 1.\n");
+		return EXIT_FAILURE;
+	}
+	if (!raise_limit(args.devices))
+		return EXIT_FAILURE;
+
+	int num = args.devices;
+	int *fds = calloc(num, sizeof(int));
+	unsigned int *served = calloc(num, sizeof(unsigned int));
+	if (fds == NULL || served == NULL) {
+		fprintf(stderr, "Not enough memory for %d devices.\n", num);
+		return EXIT_FAILURE;
+	}
+
+	double open_time = 0;
+	struct codereader_handle *handle = open_devices(num, fds, &open_time);
+	if (handle == NULL)
+		return EXIT_FAILURE;
+
+	/* All devices will be backlogged with a batch of scans at the same time.
+	 * The spread between the most and the least served device will be checked
+	 * after half of the batch has been read. As all devices have the same
+	 * priority and weight, each device should have been served depth/2 times
+	 * by then. */
+	int ret = EXIT_SUCCESS;
+	unsigned int spread = 0;
+	double dispatch = 0;
+	long half = (long)num * args.depth / 2;
+	for (int batch = 0; batch < args.batches && ret == EXIT_SUCCESS;
+	     batch++) {
+		if (!send_batch(fds, num, batch, args.depth)) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		for (int i = 0; i < num; i++)
+			served[i] = 0;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long s = 0; s < (long)num * args.depth; s++) {
+			struct codereader_barcode barcode;
+			if (codereader_next(handle, &barcode, 1000) <= 0) {
+				fprintf(stderr, "Missing scans in batch %d.\n", batch);
+				ret = EXIT_FAILURE;
+				break;
+			}
+			int i = atoi(barcode.device + 4);
+			if (i >= 0 && i < num)
+				served[i]++;
+
+			if (s + 1 == half) {
+				unsigned int min = served[0], max = served[0];
+				for (int j = 1; j < num; j++) {
+					if (served[j] < min)
+						min = served[j];
+					if (served[j] > max)
+						max = served[j];
+				}
+				if (max - min > spread)
+					spread = max - min;
+			}
+		}
+		dispatch += elapsed(&start);
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (codereader_destroy(handle) != 0)
+		ret = EXIT_FAILURE;
+	double close_time = elapsed(&start);
+	for (int i = 0; i < num; i++)
+		close(fds[i]);
+	free(fds);
+	free(served);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	/* Print the results and compare them with the baselines. */
+	double scans = (double)num * args.depth * args.batches;
+	double per_scan = dispatch * 1e6 / scans;
+	printf("devices %d: open %.3f ms, close %.3f ms, dispatch %.3f us/scan, "
+	       "spread %u\n",
+	       num, open_time * 1e3, close_time * 1e3, per_scan, spread);
+
+	/* The spread doesn't depend on the speed of the machine, so it will be
+	 * checked without tolerance. */
+	double t = args.tolerance;
+	bool ok = check("open time", open_time * 1e3, args.max_open, t);
+	ok = check("close time", close_time * 1e3, args.max_close, t) && ok;
+	ok = check("dispatch time", per_scan, args.max_dispatch, t) && ok;
+	if (args.max_spread >= 0)
+		ok = check("spread", spread, args.max_spread, 1) && ok;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
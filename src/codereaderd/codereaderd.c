@@ -0,0 +1,609 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#define _GNU_SOURCE // SOCK_CLOEXEC
+
+
+#include <errno.h>      // errno, EAGAIN
+#include <fcntl.h>      // O_* constants
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_*
+#include <signal.h>     // sigaction, sigset_t, sig_atomic_t
+#include <stdbool.h>    // bool, false, true
+#include <stdint.h>     // uint64_t
+#include <stdio.h>      // fprintf
+#include <stdlib.h>     // free, realloc, strtoul, EXIT_SUCCESS, EXIT_FAILURE
+#include <string.h>     // memcpy, memset, strchr, strdup, strncpy
+#include <sys/mman.h>   // mmap, munmap, shm_open, shm_unlink
+#include <sys/socket.h> // socket, bind, listen, accept, recvmsg
+#include <sys/stat.h>   // fstat, stat, umask, S_* constants
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close, ftruncate, geteuid, readlink, unlink, write
+
+#include <libgen.h> // dirname
+
+#include <argp.h>       // argp functions
+#include <codereader.h> // codereader_*
+
+#include "config.h"
+#include "shm.h" // codereader_shm_*
+
+
+/* Configure argp.
+ *
+ * Argp is used to parse command line options. It handles the most common
+ * options like --help and --version, so that a manual coding of getopt code is
+ * not required anymore. For detailed information about the varaibles below, see
+ * the argp documentation.
+ */
+const char *argp_program_version = "crutils " CRUTILS_VERSION;
+
+const char *argp_program_bug_address =
+    "https://github.com/alehaa/crutils/issues";
+
+static char doc[] = "Share barcode readers between multiple processes";
+
+static struct argp_option options[] = {
+    {"config", 'c', "FILE", 0, "Configuration file"},
+    {"name", 's', "NAME", 0, "Name of the shared memory object"},
+    {"socket", 'l', "PATH", 0, "Path of the control socket"},
+    {"slots", 'n', "NUMBER", 0, "Number of scans kept in the ring buffer"},
+    {"slot-size", 'b', "BYTES", 0, "Maximum size of a single scan"},
+    {0}};
+
+/** \brief Maximum number of slots in the ring buffer.
+ */
+#define MAX_SLOTS (1U << 24)
+
+/** \brief Maximum payload size of a slot.
+ */
+#define MAX_SLOT_SIZE (1U << 20)
+
+/** \brief Interval in milliseconds to check for a received signal.
+ *
+ * \details A signal received just before waiting for the next scan doesn't
+ *  interrupt the wait, so the stop flag will be checked at least once in this
+ *  interval.
+ */
+#define STOP_INTERVAL 1000
+
+
+/** \brief Options of the daemon.
+ */
+struct arguments
+{
+	const char *name;   ///< Name of the shared memory object.
+	const char *socket; ///< Path of the control socket.
+	uint32_t num_slots; ///< Number of slots in the ring buffer.
+	uint32_t slot_size; ///< Maximum payload size of a slot.
+};
+
+/* Initialize argp parser. We'll use above defined parameters for documentation
+ * strings of argp. A forward declaration for parse_arguments is added to define
+ * parse_arguments together with the other functions below. */
+static error_t parse_arguments(int key, char *arg, struct argp_state *state);
+static struct argp argp = {options, &parse_arguments, NULL, doc};
+
+
+/** \brief Parse \p arg as a number between 1 and \p max.
+ *
+ *
+ * \param arg The argument to parse.
+ * \param max Maximum value of the number.
+ *
+ * \return The parsed number. If \p arg is not a number in the valid range,
+ *  zero will be returned.
+ */
+static uint32_t
+parse_number(const char *arg, uint32_t max)
+{
+	/* strtoul accepts negative numbers and negates them as unsigned, so they
+	 * need to be rejected before. */
+	char *end;
+	errno = 0;
+	unsigned long n = strtoul(arg, &end, 10);
+	if (strchr(arg, '-') != NULL || end == arg || *end != '\0' ||
+	    errno != 0 || n > max)
+		return 0;
+	return n;
+}
+
+
+/** \brief Argument parser for argp.
+ *
+ * \note See argp parser documentation for detailed information about the
+ *  structure and functionality of function.
+ */
+static error_t
+parse_arguments(int key, char *arg, struct argp_state *state)
+{
+	struct arguments *args = state->input;
+	switch (key) {
+		case 'c': setenv("CODEREADER_CONFIG", arg, 1); break;
+		case 's': args->name = arg; break;
+		case 'l': args->socket = arg; break;
+		case 'n':
+			if ((args->num_slots = parse_number(arg, MAX_SLOTS)) == 0)
+				argp_error(state, "Number of slots must be between 1 and %u.",
+				           MAX_SLOTS);
+			break;
+		case 'b':
+			if ((args->slot_size = parse_number(arg, MAX_SLOT_SIZE)) == 0)
+				argp_error(state, "Slot size must be between 1 and %u.",
+				           MAX_SLOT_SIZE);
+			break;
+
+		default: return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+
+/** \brief A process subscribed to the ring buffer.
+ */
+struct subscriber
+{
+	int connection; ///< Connection to the control socket.
+	int eventfd;    ///< Eventfd to notify about new scans.
+};
+
+/** \brief The mapped ring buffer.
+ */
+static struct codereader_shm_header *ring;
+
+/** \brief List of all subscribers.
+ *
+ * \details The list will be modified by the control thread and read by the
+ *  main thread to notify the subscribers, so it has to be locked by \ref lock.
+ */
+static struct subscriber *subscribers = NULL;
+static int num_subscribers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** \brief Create the ring buffer.
+ *
+ *
+ * \param args Options of the daemon.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+create_ring(const struct arguments *args)
+{
+	/* If an old daemon crashed, its ring buffer may be still available. It will
+	 * be removed, so its subscribers don't get any data from this daemon. */
+	shm_unlink(args->name);
+	int fd = shm_open(args->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Can't create shared memory %s!\n", args->name);
+		return false;
+	}
+
+	size_t size = codereader_shm_size(args->num_slots, args->slot_size);
+	if (ftruncate(fd, size) < 0 ||
+	    (ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+	        MAP_FAILED) {
+		fprintf(stderr, "Can't map shared memory %s!\n", args->name);
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	/* The ring buffer is zero initialized by ftruncate, so only the header
+	 * needs to be set. */
+	ring->magic = CODEREADER_SHM_MAGIC;
+	ring->version = CODEREADER_SHM_VERSION;
+	ring->num_slots = args->num_slots;
+	ring->slot_size = args->slot_size;
+	__atomic_store_n(&(ring->head), 0, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+
+/** \brief Publish a new scan in the ring buffer and notify all subscribers.
+ *
+ *
+ * \param buffer The scan to publish.
+ * \param length Length of \p buffer.
+ */
+static void
+publish(const char *buffer, uint32_t length)
+{
+	/* The daemon is the only writer, so the head doesn't need to be updated
+	 * atomically. The slot's sequence number will be reset before writing to
+	 * the slot, so subscribers can detect overwritten slots. */
+	uint64_t seq = ring->head;
+	struct codereader_shm_slot *slot = codereader_shm_slot(ring, seq);
+	__atomic_store_n(&(slot->seq), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot->data, buffer, length);
+	slot->length = length;
+	__atomic_store_n(&(slot->seq), seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(ring->head), seq + 1, __ATOMIC_RELEASE);
+
+	/* Notify all subscribers. Writing to an eventfd never blocks unless its
+	 * counter overflows, so a slow subscriber can't stall the others. */
+	uint64_t count = 1;
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_subscribers; i++)
+		if (write(subscribers[i].eventfd, &count, sizeof(count)) < 0 &&
+		    errno != EAGAIN)
+			fprintf(stderr, "Failed to notify subscriber.\n");
+	pthread_mutex_unlock(&lock);
+}
+
+
+/** \brief Check, if \p fd may be used to notify a subscriber.
+ *
+ * \details Only eventfds and pipes opened for writing will be accepted, as
+ *  anything else may block the daemon or have side effects when written to. The
+ *  file descriptor will be switched to non-blocking mode, so a full pipe can't
+ *  stall \ref publish.
+ *
+ *
+ * \param fd The file descriptor received from the subscriber.
+ *
+ * \return If \p fd is a valid eventfd or pipe true will be returned, otherwise
+ *  false.
+ */
+static bool
+check_eventfd(int fd)
+{
+	/* Eventfds are anonymous inodes without a file type, so they can only be
+	 * identified by their link in /proc. */
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return false;
+	if (!S_ISFIFO(st.st_mode)) {
+		char path[32], link[32] = {0};
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		if ((st.st_mode & S_IFMT) != 0 ||
+		    readlink(path, link, sizeof(link) - 1) < 0 ||
+		    strcmp(link, "anon_inode:[eventfd]") != 0)
+			return false;
+	}
+
+	int flags = fcntl(fd, F_GETFL);
+	return flags >= 0 && (flags & O_ACCMODE) != O_RDONLY &&
+	       fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+
+/** \brief Accept a new subscriber on \p server.
+ *
+ * \details The subscriber has to send its eventfd as ancillary data, which will
+ *  be stored together with the connection in the list of subscribers.
+ *
+ *
+ * \param server File descriptor of the control socket.
+ */
+static void
+accept_subscriber(int server)
+{
+	int connection = accept(server, NULL, NULL);
+	if (connection < 0)
+		return;
+
+	char byte;
+	struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+	union {
+		struct cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg = {.msg_iov = &iov,
+	                     .msg_iovlen = 1,
+	                     .msg_control = control.buffer,
+	                     .msg_controllen = sizeof(control.buffer)};
+	struct cmsghdr *cmsg;
+	if (recvmsg(connection, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+	    (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "Rejected subscriber without eventfd.\n");
+		close(connection);
+		return;
+	}
+
+	struct subscriber sub = {.connection = connection};
+	memcpy(&(sub.eventfd), CMSG_DATA(cmsg), sizeof(int));
+	if (!check_eventfd(sub.eventfd)) {
+		fprintf(stderr, "Rejected subscriber with invalid eventfd.\n");
+		close(sub.eventfd);
+		close(connection);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	struct subscriber *p =
+	    realloc(subscribers, (num_subscribers + 1) * sizeof(struct subscriber));
+	if (p != NULL) {
+		subscribers = p;
+		subscribers[num_subscribers++] = sub;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (p == NULL) {
+		fprintf(stderr, "Not enough memory for new subscriber.\n");
+		close(sub.eventfd);
+		close(connection);
+	}
+}
+
+
+/** \brief Remove subscriber \p n from the list of subscribers.
+ *
+ *
+ * \param n Index of the subscriber.
+ */
+static void
+remove_subscriber(int n)
+{
+	pthread_mutex_lock(&lock);
+	close(subscribers[n].connection);
+	close(subscribers[n].eventfd);
+	subscribers[n] = subscribers[--num_subscribers];
+	pthread_mutex_unlock(&lock);
+}
+
+
+/** \brief Check the directory of the control socket at \p path.
+ *
+ * \details The directory must be owned by root or the daemon's user and must
+ *  not be writable by other users, so nobody else can replace the socket.
+ *
+ *
+ * \param path Path of the control socket.
+ *
+ * \return If the directory is safe true will be returned, otherwise false.
+ */
+static bool
+check_socket_dir(const char *path)
+{
+	char *copy = strdup(path);
+	if (copy == NULL)
+		return false;
+
+	struct stat st;
+	bool ret = stat(dirname(copy), &st) == 0 && S_ISDIR(st.st_mode) &&
+	           (st.st_uid == 0 || st.st_uid == geteuid()) &&
+	           (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+	free(copy);
+	return ret;
+}
+
+
+/** \brief Free the poll list of the control thread.
+ *
+ * \details This function is a cleanup handler, so the list will be freed, if
+ *  the control thread gets cancelled.
+ *
+ *
+ * \param arg Pointer to the list.
+ */
+static void
+free_polls(void *arg)
+{
+	free(*((struct pollfd **)arg));
+}
+
+
+/** \brief Thread handling the control socket.
+ *
+ * \details This thread accepts new subscribers and removes subscribers, which
+ *  closed their connection. The list of subscribers will only be modified by
+ *  this thread, so it doesn't need to lock the list for reading.
+ *
+ *
+ * \param arg File descriptor of the control socket.
+ */
+static void *
+control_thread(void *arg)
+{
+	/* The thread may be cancelled only while waiting in poll, so it can't be
+	 * cancelled while holding the lock of the subscriber list. */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	/* The poll list will be rebuilt for each iteration, as the subscribers
+	 * may have changed. The control socket is the first entry and followed by
+	 * the connections of all subscribers in the same order. */
+	int server = *((int *)arg);
+	struct pollfd *fds = NULL;
+	pthread_cleanup_push(free_polls, &fds);
+	while (true) {
+		int num = num_subscribers;
+		struct pollfd *p = realloc(fds, (num + 1) * sizeof(struct pollfd));
+		if (p == NULL) {
+			fprintf(stderr, "Not enough memory to poll the control sockets.\n");
+			break;
+		}
+		fds = p;
+		fds[0] = (struct pollfd){.fd = server, .events = POLLIN};
+		for (int i = 0; i < num; i++)
+			fds[i + 1] = (struct pollfd){.fd = subscribers[i].connection,
+			                             .events = POLLIN};
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int ret = poll(fds, num + 1, -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to poll the control sockets.\n");
+			break;
+		}
+
+		/* Subscribers don't send any data after subscribing, so a readable
+		 * connection means the subscriber has closed the connection. The list
+		 * is iterated backwards, as removing a subscriber moves the last entry
+		 * to its position, which has been checked already. */
+		for (int i = num - 1; i >= 0; i--)
+			if (fds[i + 1].revents != 0)
+				remove_subscriber(i);
+
+		if (fds[0].revents != 0)
+			accept_subscriber(server);
+	}
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+
+/** \brief Flag set by \ref handle_signal to stop the daemon.
+ */
+static volatile sig_atomic_t stopped = 0;
+
+
+/** \brief Signal handler for SIGINT and SIGTERM.
+ *
+ * \details The handler sets \ref stopped, which will end the main loop after
+ *  the wait for the next scan has been interrupted.
+ */
+static void
+handle_signal(int signum)
+{
+	stopped = 1;
+}
+
+
+int
+main(int argc, char **argv)
+{
+	/* Parse our arguments. Parsed arguments will manipulate the current
+	 * environment to set options for libcodereader. The number of slots will be
+	 * rounded up to the next power of two, so sequence numbers can be mapped to
+	 * slots with a simple mask. */
+	struct arguments args = {.name = CODEREADER_SHM_DEFAULT_NAME,
+	                         .socket = CODEREADER_SHM_DEFAULT_SOCKET,
+	                         .num_slots = 1024,
+	                         .slot_size = 256};
+	argp_parse(&argp, argc, argv, 0, NULL, &args);
+	uint32_t num_slots = 1;
+	while (num_slots < args.num_slots)
+		num_slots <<= 1;
+	args.num_slots = num_slots;
+
+
+	/* Open the codereader handle first. As the devices will be grabbed
+	 * exclusively, this fails if another process uses the barcode readers
+	 * already and nothing else has to be set up. */
+	struct codereader_handle *handle = codereader_new();
+	if (handle == NULL) {
+		fprintf(stderr, "Can't open codereader!\n");
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_FAILURE;
+	if (!create_ring(&args))
+		goto close_codereader;
+
+	/* Create the control socket. An old socket of a crashed daemon will be
+	 * removed first. Like the ring buffer, the socket will be accessible by the
+	 * daemon's user only. */
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strncpy(addr.sun_path, args.socket, sizeof(addr.sun_path) - 1);
+	int server = -1;
+	if (!check_socket_dir(addr.sun_path)) {
+		fprintf(stderr, "Directory of control socket %s is missing or "
+		                "writable by other users!\n",
+		        args.socket);
+		goto unlink_ring;
+	}
+	unlink(addr.sun_path);
+	mode_t mask = umask(S_IRWXG | S_IRWXO);
+	server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server < 0 ||
+	    bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(server, SOMAXCONN) < 0) {
+		umask(mask);
+		fprintf(stderr, "Can't create control socket %s!\n", args.socket);
+		if (server >= 0)
+			close(server);
+		goto unlink_ring;
+	}
+	umask(mask);
+
+	/* Start the control thread. SIGINT and SIGTERM will be blocked for this
+	 * thread, so the signals will interrupt the main thread waiting for the
+	 * next scan. */
+	struct sigaction sa = {.sa_handler = handle_signal};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	sigset_t signals, old;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &old);
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, control_thread, &server);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		fprintf(stderr, "Can't start control thread!\n");
+		goto close_server;
+	}
+
+	/* Publish all scans in the ring buffer, until reading fails or the daemon
+	 * receives a signal. Subscribers get each slot as a single scan, so scans
+	 * longer than a slot will be dropped instead of being split. */
+	unsigned long dropped = 0;
+	ret = EXIT_SUCCESS;
+	while (!stopped) {
+		struct codereader_barcode barcode;
+		int n = codereader_next(handle, &barcode, STOP_INTERVAL);
+		if (n < 0) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		if (n == 0)
+			continue;
+
+		if (barcode.length > args.slot_size) {
+			fprintf(stderr, "Dropped scan of %zu bytes from %s, as it is "
+			                "larger than a slot.\n",
+			        barcode.length, barcode.device);
+			dropped++;
+			continue;
+		}
+		publish(barcode.data, barcode.length);
+	}
+	if (dropped > 0)
+		fprintf(stderr, "Dropped %lu scans larger than a slot.\n", dropped);
+
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+	for (int i = num_subscribers - 1; i >= 0; i--)
+		remove_subscriber(i);
+	free(subscribers);
+
+close_server:
+	if (server >= 0)
+		close(server);
+	unlink(addr.sun_path);
+unlink_ring:
+	shm_unlink(args.name);
+close_codereader:
+	if (codereader_destroy(handle) != 0)
+		ret = EXIT_FAILURE;
+
+	return ret;
+}
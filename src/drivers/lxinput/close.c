@@ -21,6 +21,7 @@
 #include "lxinput.h"
 
 #include <linux/input.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 
@@ -30,7 +31,7 @@
  *
  *
  * \param fd File-descriptor to be closed.
- * \param cookie Data cookie (unused).
+ * \param cookie Pointer to device data storage.
  *
  * \return Returns zero on success. On any error, a negative value inidicating
  *  the error will be returned.
@@ -38,6 +39,8 @@
 int
 device_close(int fd, void *cookie)
 {
+	free(cookie);
+
 	/* Try to ungrab device, so that other processes (e.g. by X11) may receive
 	 * events by this device. */
 	if (ioctl(fd, EVIOCGRAB, 0) < 0)
@@ -20,6 +20,8 @@
 
 #include <limits.h>
 #include <linux/input.h>
+#include <stdbool.h>
+#include <time.h>
 
 #include <libconfig.h> // libconfig API
 
@@ -33,6 +35,27 @@ typedef enum errorcodes {
 } errorcodes;
 
 
+/** \brief Data storage of an opened device.
+ */
+struct lxinput_cookie
+{
+	/** \brief Time of the first key event of the current scan.
+	 */
+	struct timespec time;
+
+	/** \brief Whether the first key event of the current scan has been read.
+	 */
+	bool started;
+
+	/** \brief Whether the event times are using CLOCK_MONOTONIC.
+	 *
+	 * \details If the kernel can't switch the clock of the device, the event
+	 *  times can't be compared with the times of other devices.
+	 */
+	bool monotonic;
+};
+
+
 const char *codereader_strerror(const int errno);
 
 int codereader_open(const config_setting_t *config, void **cookie);
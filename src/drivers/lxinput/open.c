@@ -22,6 +22,7 @@
 
 #include <fcntl.h>
 #include <linux/input.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 
@@ -32,7 +33,7 @@
  *
  *
  * \param config Pointer to device configuration.
- * \param cookie Pointer to device data storage (unused).
+ * \param cookie Pointer to device data storage.
  *
  * \return Returns the new file-descriptor on success. On any error, a negative
  *  value inidicating the error will be returned.
@@ -57,6 +58,21 @@ device_open(const config_setting_t *config, void **cookie)
 		return ERR_GRAB;
 	}
 
+	struct lxinput_cookie *data = calloc(1, sizeof(struct lxinput_cookie));
+	if (data == NULL) {
+		ioctl(fd, EVIOCGRAB, 0);
+		close(fd);
+		return ERR_OPEN;
+	}
+
+	/* Let the kernel use the monotonic clock for the event times, so the time
+	 * a scan happened can be compared with the scans of other devices. */
+#ifdef EVIOCSCLOCKID
+	int clock = CLOCK_MONOTONIC;
+	data->monotonic = (ioctl(fd, EVIOCSCLOCKID, &clock) == 0);
+#endif
+	*cookie = data;
+
 	// return file-descriptor
 	return fd;
 }
@@ -23,6 +23,8 @@
 #include <linux/input.h>
 #include <unistd.h>
 
+#include "probes.h"
+
 
 /** \brief Read single code from file-descriptor \p device_fd and stores it  in
  *  \p buffer
@@ -34,7 +36,7 @@
  * \param fd file-descriptor for opened device-file
  * \param buffer pointer to an array of char where code should be stored
  * \param size maximum bytes to be read
- * \param cookie Data cookie (unused)
+ * \param cookie Pointer to device data storage
  *
  * \return On success, the number of bytes read is returned. On any error, a
  *  negative value inidicating the error will be returned.
@@ -42,6 +44,7 @@
 int
 device_read(int fd, char *buffer, int size, void *cookie)
 {
+	struct lxinput_cookie *data = cookie;
 	struct input_event ev;
 	int key_press_counter = 0;
 	size_t num = 0;
@@ -64,6 +67,12 @@ device_read(int fd, char *buffer, int size, void *cookie)
 		 * be incremented.
 		 */
 		if (ev.value == 1) {
+			if (!data->started) {
+				CODEREADER_PROBE1(scan__first__key, fd);
+				data->time.tv_sec = ev.time.tv_sec;
+				data->time.tv_nsec = ev.time.tv_usec * 1000;
+				data->started = true;
+			}
 			*buffer = keytoc(&ev);
 
 			// increment key-press-counter
@@ -89,8 +98,11 @@ device_read(int fd, char *buffer, int size, void *cookie)
 				num++;
 
 				// check, if this was the last character of read code
-				if (*buffer == '\n')
+				if (*buffer == '\n') {
+					CODEREADER_PROBE2(scan__last__key, fd, num);
+					data->started = false;
 					break;
+				}
 
 				// increment buffer position
 				buffer++;
@@ -100,3 +112,61 @@ device_read(int fd, char *buffer, int size, void *cookie)
 
 	return num;
 }
+
+
+/** \brief Get the time the last scan happened.
+ *
+ * \details The time of the first key event of the scan will be used, which has
+ *  been set by the kernel when the key has been pressed.
+ *
+ *
+ * \param fd file-descriptor for opened device-file
+ * \param time where to store the time of the scan
+ * \param cookie Pointer to device data storage
+ *
+ * \return On success zero is returned. If the time is not available, -1 will
+ *  be returned.
+ */
+int
+device_timestamp(int fd, struct timespec *time, void *cookie)
+{
+	struct lxinput_cookie *data = cookie;
+	if (!data->monotonic)
+		return -1;
+
+	*time = data->time;
+	return 0;
+}
+
+
+/** \brief Discard pending input events of the device.
+ *
+ * \details The events will be read without translating them into characters,
+ *  so a quarantined device causes as little work as possible. A partially read
+ *  code will be dropped. Codes will be counted by their terminating key.
+ *
+ *
+ * \param fd file-descriptor for opened device-file
+ * \param cookie Pointer to device data storage
+ *
+ * \return On success the number of discarded codes is returned. On any error,
+ *  a negative value inidicating the error will be returned.
+ */
+int
+device_discard(int fd, void *cookie)
+{
+	struct lxinput_cookie *data = cookie;
+	struct input_event ev[64];
+	ssize_t n = read(fd, ev, sizeof(ev));
+	if (n < (ssize_t)sizeof(ev[0]))
+		return ERR_READ;
+
+	int codes = 0;
+	for (size_t i = 0; i < n / sizeof(ev[0]); i++)
+		if (ev[i].type == EV_KEY && ev[i].code == KEY_ENTER &&
+		    ev[i].value == 1)
+			codes++;
+
+	data->started = false;
+	return codes;
+}
@@ -0,0 +1,131 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Driver reading scans from a socket of the calling process.
+ *
+ * \details This driver doesn't access any hardware. Instead, the application
+ *  creates a datagram or sequenced-packet socket pair and passes one end as
+ *  option `fd` of the device, while it sends scans into the other end. Each
+ *  message will be read as a single scan. This allows test programs to drive
+ *  any number of devices in-process with exact control over the scans and
+ *  their timing, e.g. to measure the scalability of libcodereader.
+ */
+
+#include <errno.h>      // errno, EINTR
+#include <poll.h>       // poll
+#include <stdio.h>      // fprintf
+#include <sys/socket.h> // recv
+#include <unistd.h>     // close, dup
+
+#include <libconfig.h> // libconfig API
+
+
+/** \brief Prefix for error messages of this driver.
+ */
+#define MESSAGE_PREFIX "[codereader-mock] "
+
+
+/** \brief Mark this driver as reading datagrams.
+ *
+ * \details Each message is a complete scan, so libcodereader must not wait for
+ *  the rest of a scan filling the buffer. Messages larger than the buffer will
+ *  be reported with their full length, so they will be dropped.
+ */
+const int device_datagram = 1;
+
+
+/** \brief Open a new mock device.
+ *
+ * \details The socket passed in option `fd` will be duplicated, so the
+ *  application may close its descriptor after the handle has been opened.
+ *
+ *
+ * \param config Pointer to device configuration.
+ * \param cookie Pointer to device data storage (unused).
+ *
+ * \return On success the duplicated socket will be returned, otherwise -1.
+ */
+int
+device_open(const config_setting_t *config, void **cookie)
+{
+	int fd = -1;
+	if (config_setting_lookup_int(config, "fd", &fd) != CONFIG_TRUE ||
+	    fd < 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Option 'fd' must be a descriptor.\n");
+		return -1;
+	}
+
+	int ret = dup(fd);
+	if (ret < 0)
+		perror(MESSAGE_PREFIX "Failed to duplicate socket");
+	return ret;
+}
+
+
+/** \brief Read the next message as scan.
+ *
+ * \details Empty messages will be ignored. If the application closed its end
+ *  of a sequenced-packet socket pair, the device will be reported as failed.
+ *
+ *
+ * \param fd The socket of the device.
+ * \param buffer Where to store read data.
+ * \param size Size of \p buffer.
+ * \param cookie Pointer to the driver's data storage (unused).
+ *
+ * \return On success the length of the message will be returned, which may
+ *  exceed \p size, if the message has been truncated. For empty messages zero
+ *  and on errors -1 will be returned.
+ */
+int
+device_read(int fd, char *buffer, int size, void *cookie)
+{
+	ssize_t n;
+	do
+		n = recv(fd, buffer, size, MSG_TRUNC);
+	while (n < 0 && errno == EINTR);
+
+	/* Sequenced-packet sockets return zero at the end of file, too. The other
+	 * end has been closed, if the socket has been hung up. */
+	if (n == 0) {
+		struct pollfd p = {.fd = fd, .events = 0};
+		if (poll(&p, 1, 0) > 0 && (p.revents & POLLHUP))
+			return -1;
+	}
+
+	return (n >= 0) ? n : -1;
+}
+
+
+/** \brief Close the mock device.
+ *
+ *
+ * \param fd The socket of the device.
+ * \param cookie Pointer to device data storage (unused).
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+device_close(int fd, void *cookie)
+{
+	return close(fd);
+}
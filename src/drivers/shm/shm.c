@@ -0,0 +1,337 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Driver for subscribing to the scans published by `codereaderd`.
+ *
+ * \details The daemon owns all barcode readers and publishes their scans in a
+ *  shared memory ring buffer. This driver maps the ring buffer read-only and
+ *  reads the scans with its own cursor, so any number of processes may use the
+ *  same barcode readers at the same time.
+ */
+
+#define _GNU_SOURCE // SOCK_CLOEXEC
+
+
+#include <assert.h>       // assert
+#include <errno.h>        // errno, EAGAIN
+#include <fcntl.h>        // O_* constants
+#include <stdbool.h>      // bool, false, true
+#include <stdint.h>       // uint64_t
+#include <stdio.h>        // fprintf
+#include <stdlib.h>       // free, malloc
+#include <string.h>       // memcpy, memset, strncpy
+#include <sys/eventfd.h>  // eventfd
+#include <sys/mman.h>     // mmap, munmap, shm_open
+#include <sys/socket.h>   // socket, connect, sendmsg
+#include <sys/stat.h>     // fstat
+#include <sys/un.h>       // sockaddr_un
+#include <unistd.h>       // close, read, write
+
+#include <libconfig.h> // libconfig API
+
+#include "shm.h" // codereader_shm_*
+
+
+/** \brief Prefix for error messages of this driver.
+ */
+#define MESSAGE_PREFIX "[codereader-shm] "
+
+
+/** \brief Mark this driver as reading messages.
+ *
+ * \details Each slot of the ring buffer holds a complete scan, which can't be
+ *  continued by another read, so libcodereader will treat each read as scan.
+ */
+const int device_datagram = 1;
+
+
+/** \brief Storage for driver related information.
+ */
+struct codereader_shm_cookie
+{
+	struct codereader_shm_header *header; ///< Mapped ring buffer.
+	size_t size;                          ///< Size of the mapping.
+	uint64_t cursor; ///< Sequence number of the next scan to read.
+	int socket;      ///< Connection to the daemon's control socket.
+	int eventfd;     ///< Notification file descriptor.
+};
+
+
+/** \brief Map the ring buffer \p name read-only.
+ *
+ *
+ * \param name Name of the shared memory object.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return If the ring buffer could be mapped and is compatible with this driver
+ *  true will be returned, otherwise false.
+ */
+static bool
+map_ring(const char *name, struct codereader_shm_cookie *cookie)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to open shared memory %s. Is "
+		                               "codereaderd running?\n",
+		        name);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+	    (size_t)st.st_size < sizeof(struct codereader_shm_header)) {
+		fprintf(stderr, MESSAGE_PREFIX "Invalid shared memory %s.\n", name);
+		close(fd);
+		return false;
+	}
+
+	/* The mapping will be kept even after the file descriptor has been closed,
+	 * so there is no need to keep the descriptor open. */
+	cookie->size = st.st_size;
+	cookie->header = mmap(NULL, cookie->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cookie->header == MAP_FAILED) {
+		cookie->header = NULL;
+		fprintf(stderr, MESSAGE_PREFIX "Failed to map shared memory %s.\n",
+		        name);
+		return false;
+	}
+
+	if (cookie->header->magic != CODEREADER_SHM_MAGIC ||
+	    cookie->header->version != CODEREADER_SHM_VERSION ||
+	    cookie->header->num_slots == 0 ||
+	    (cookie->header->num_slots & (cookie->header->num_slots - 1)) != 0 ||
+	    cookie->size < codereader_shm_size(cookie->header->num_slots,
+	                                       cookie->header->slot_size)) {
+		fprintf(stderr, MESSAGE_PREFIX
+		        "Shared memory %s has an incompatible layout.\n",
+		        name);
+		return false;
+	}
+
+	return true;
+}
+
+
+/** \brief Register a new eventfd at the daemon's control socket \p path.
+ *
+ * \details The eventfd will be passed to the daemon, which increments it for
+ *  every published scan. The connection will be kept open, so the daemon can
+ *  detect when this subscriber has gone.
+ *
+ *
+ * \param path Path of the control socket.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+subscribe(const char *path, struct codereader_shm_cookie *cookie)
+{
+	if ((cookie->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to create eventfd.\n");
+		return false;
+	}
+
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if ((cookie->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    connect(cookie->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to connect to %s.\n", path);
+		return false;
+	}
+
+	/* Pass the eventfd to the daemon. At least one byte of real data has to be
+	 * sent together with the ancillary data. */
+	char byte = 0;
+	struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+	union {
+		struct cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {.msg_iov = &iov,
+	                     .msg_iovlen = 1,
+	                     .msg_control = control.buffer,
+	                     .msg_controllen = sizeof(control.buffer)};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &(cookie->eventfd), sizeof(int));
+
+	if (sendmsg(cookie->socket, &msg, MSG_NOSIGNAL) != 1) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to subscribe at %s.\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+
+/** \brief Subscribe to the scans published by `codereaderd`.
+ *
+ *
+ * \param config Pointer to device configuration.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return On success the eventfd to be watched for new scans will be returned,
+ *  otherwise -1.
+ */
+int
+device_open(const config_setting_t *config,
+            struct codereader_shm_cookie **cookie)
+{
+	/* Allocate memory for the internal cookie. We'll register the memory in the
+	 * cookie pointer first, so errors don't have to be specially handled in
+	 * this function, as the close function will be called on errors
+	 * automatically, which frees the allocated memory. */
+	*cookie = malloc(sizeof(struct codereader_shm_cookie));
+	if (*cookie == NULL) {
+		fprintf(stderr,
+		        MESSAGE_PREFIX "Failed to allocate memory for cookie.\n");
+		return -1;
+	}
+	memset(*cookie, 0, sizeof(struct codereader_shm_cookie));
+	(*cookie)->socket = -1;
+	(*cookie)->eventfd = -1;
+
+	/* Both the name of the shared memory and the path of the control socket
+	 * are optional, so the defaults of the daemon will be used, if the user
+	 * doesn't specify them. */
+	const char *name = CODEREADER_SHM_DEFAULT_NAME;
+	const char *path = CODEREADER_SHM_DEFAULT_SOCKET;
+	config_setting_lookup_string(config, "name", &name);
+	config_setting_lookup_string(config, "socket", &path);
+
+	if (!map_ring(name, *cookie) || !subscribe(path, *cookie))
+		return -1;
+
+	/* Only new scans should be read, so the cursor will start at the current
+	 * head of the ring buffer. */
+	(*cookie)->cursor =
+	    __atomic_load_n(&((*cookie)->header->head), __ATOMIC_ACQUIRE);
+
+	return (*cookie)->eventfd;
+}
+
+
+/** \brief Read the next scan from the ring buffer.
+ *
+ *
+ * \param fd The eventfd returned by \ref device_open.
+ * \param buffer Where to store read data.
+ * \param size Size of \p buffer.
+ * \param cookie Pointer to the driver's data storage.
+ *
+ * \return On success the length of the scan will be returned. If the scan is
+ *  longer than \p size, it has been truncated and libcodereader will drop it.
+ *  If no new scan is available, zero will be returned.
+ */
+int
+device_read(int fd, char *buffer, int size,
+            struct codereader_shm_cookie *cookie)
+{
+	assert(cookie);
+
+
+	/* Reset the eventfd's counter. The notifications will be coalesced, as
+	 * this driver doesn't count the notifications, but compares its cursor
+	 * with the head of the ring buffer. */
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -1;
+
+	uint64_t head = __atomic_load_n(&(cookie->header->head), __ATOMIC_ACQUIRE);
+	while (cookie->cursor < head) {
+		/* If the daemon did overtake this subscriber, the oldest scans have
+		 * been overwritten already. Skip them, so the oldest available scan
+		 * will be read next. */
+		if (head - cookie->cursor > cookie->header->num_slots) {
+			fprintf(stderr, MESSAGE_PREFIX "Lost %llu scans.\n",
+			        (unsigned long long)(head - cookie->cursor -
+			                             cookie->header->num_slots));
+			cookie->cursor = head - cookie->header->num_slots;
+		}
+
+		/* Copy the scan out of the slot. If the slot's sequence number changed
+		 * while copying, the daemon did overwrite the slot in the meantime and
+		 * the copied data can't be used. */
+		struct codereader_shm_slot *slot =
+		    codereader_shm_slot(cookie->header, cookie->cursor);
+		uint64_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		uint32_t length = slot->length;
+		memcpy(buffer, slot->data,
+		       (length < (uint32_t)size) ? length : (uint32_t)size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq != cookie->cursor + 1 || length > cookie->header->slot_size ||
+		    __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq) {
+			cookie->cursor++;
+			continue;
+		}
+		cookie->cursor++;
+
+		/* As only one scan will be returned per call, the eventfd needs to be
+		 * triggered again, if more scans are available. Otherwise they would
+		 * be read only after the next scan has been published. */
+		if (cookie->cursor < head) {
+			count = 1;
+			if (write(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				return -1;
+		}
+
+		return length;
+	}
+
+	return 0;
+}
+
+
+/** \brief Unsubscribe from the daemon and free allocated memory.
+ *
+ *
+ * \param fd The eventfd returned by \ref device_open.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+device_close(int fd, struct codereader_shm_cookie *cookie)
+{
+	/* If no storage for cookie has been reserved yet, nothing has to be freed
+	 * and this function has nothing to do. */
+	if (cookie == NULL)
+		return 0;
+
+	/* Closing the connection to the control socket will unsubscribe from the
+	 * daemon, which closes its copy of the eventfd. */
+	if (cookie->socket >= 0)
+		close(cookie->socket);
+	if (cookie->eventfd >= 0)
+		close(cookie->eventfd);
+	if (cookie->header != NULL)
+		munmap(cookie->header, cookie->size);
+
+	free(cookie);
+
+	return 0;
+}
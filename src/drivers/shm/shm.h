@@ -0,0 +1,138 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Layout of the shared memory ring buffer used by `codereaderd`.
+ *
+ * \details The daemon is the only writer of the ring buffer. It stores each
+ *  scan in the slot of its sequence number and publishes it by updating the
+ *  slot's sequence number and the global head afterwards. Subscribers keep
+ *  their own read cursor, so a slow subscriber just loses old scans instead of
+ *  stalling the daemon or other subscribers.
+ *
+ *  To get notified about new scans, subscribers connect to the daemon's control
+ *  socket and pass an eventfd via `SCM_RIGHTS`. The daemon will increment this
+ *  eventfd after each published scan.
+ */
+
+#ifndef CODEREADER_SHM_H
+#define CODEREADER_SHM_H
+
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint*_t
+
+
+/** \brief Magic number identifying a codereader ring buffer ("CRSH").
+ */
+#define CODEREADER_SHM_MAGIC 0x43525348
+
+/** \brief Version of the shared memory layout.
+ */
+#define CODEREADER_SHM_VERSION 1
+
+/** \brief Default name of the shared memory object.
+ */
+#define CODEREADER_SHM_DEFAULT_NAME "/codereader"
+
+/** \brief Default path of the daemon's control socket.
+ */
+#define CODEREADER_SHM_DEFAULT_SOCKET "/run/codereaderd.sock"
+
+
+/** \brief Header of the shared memory ring buffer.
+ */
+struct codereader_shm_header
+{
+	uint32_t magic;     ///< Must be \ref CODEREADER_SHM_MAGIC.
+	uint32_t version;   ///< Must be \ref CODEREADER_SHM_VERSION.
+	uint32_t num_slots; ///< Number of slots in the ring (power of two).
+	uint32_t slot_size; ///< Maximum payload size of a slot.
+	uint64_t head;      ///< Sequence number of the next scan to be written.
+};
+
+
+/** \brief A single slot of the ring buffer.
+ *
+ * \details \p seq will be zero while the daemon writes the slot and will be set
+ *  to the scan's sequence number plus one after the payload has been written.
+ *  Readers have to check \p seq before and after copying the payload to detect
+ *  slots that have been overwritten in the meantime.
+ */
+struct codereader_shm_slot
+{
+	uint64_t seq;    ///< Sequence number of the stored scan plus one.
+	uint32_t length; ///< Length of the stored scan.
+	char data[];     ///< Payload of the scan.
+};
+
+
+/** \brief Get the distance between two slots.
+ *
+ * \details Slots will be aligned to cache lines, so writing one slot doesn't
+ *  invalidate the cache lines of neighbouring slots for the readers.
+ *
+ *
+ * \param slot_size Maximum payload size of a slot.
+ *
+ * \return The stride of the slots in bytes.
+ */
+static inline size_t
+codereader_shm_stride(uint32_t slot_size)
+{
+	return (sizeof(struct codereader_shm_slot) + slot_size + 63) & ~(size_t)63;
+}
+
+
+/** \brief Get the size of the whole shared memory object.
+ *
+ *
+ * \param num_slots Number of slots in the ring.
+ * \param slot_size Maximum payload size of a slot.
+ *
+ * \return The size of the shared memory object in bytes.
+ */
+static inline size_t
+codereader_shm_size(uint32_t num_slots, uint32_t slot_size)
+{
+	return 64 + num_slots * codereader_shm_stride(slot_size);
+}
+
+
+/** \brief Get slot \p seq of the ring buffer starting at \p header.
+ *
+ *
+ * \param header Pointer to the mapped ring buffer.
+ * \param seq Sequence number of the requested scan.
+ *
+ * \return Pointer to the slot.
+ */
+static inline struct codereader_shm_slot *
+codereader_shm_slot(const struct codereader_shm_header *header, uint64_t seq)
+{
+	return (struct codereader_shm_slot *)((char *)header + 64 +
+	                                      (seq & (header->num_slots - 1)) *
+	                                          codereader_shm_stride(
+	                                              header->slot_size));
+}
+
+
+#endif
@@ -0,0 +1,681 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Driver generating synthetic scans for capacity testing.
+ *
+ * \details This driver simulates a configurable number of barcode readers,
+ *  which generate random barcodes of selected symbologies at a given rate. A
+ *  generator thread writes the scans of each virtual device into its own socket
+ *  pair, so the scans look like the ones of a real device to libcodereader and
+ *  a virtual device can't fill the socket of the others. The sockets will be
+ *  read in round-robin order. When the device gets closed, statistics about the
+ *  generated and delivered scans will be printed.
+ */
+
+#define _GNU_SOURCE // clock_nanosleep, RUSAGE_THREAD
+
+
+#include <assert.h>       // assert
+#include <errno.h>        // errno, EAGAIN, EINTR, EWOULDBLOCK
+#include <math.h>         // log
+#include <pthread.h>      // pthread_*
+#include <stdbool.h>      // bool, false, true
+#include <stdint.h>       // uint64_t
+#include <stdio.h>        // fprintf
+#include <stdlib.h>       // calloc, free, malloc
+#include <string.h>       // memset, strcmp
+#include <sys/epoll.h>    // epoll_*
+#include <sys/resource.h> // getrusage
+#include <sys/socket.h>   // socketpair, recv, send
+#include <time.h>         // clock_gettime, clock_nanosleep
+#include <unistd.h>       // close
+
+#include <libconfig.h> // libconfig API
+
+
+/** \brief Prefix for error messages of this driver.
+ */
+#define MESSAGE_PREFIX "[codereader-synthetic] "
+
+/** \brief Maximum length of a generated barcode.
+ */
+#define MAX_LENGTH 1024
+
+/** \brief Maximum number of symbologies in the config.
+ */
+#define MAX_SYMBOLOGIES 8
+
+
+/** \brief Mark this driver as reading messages.
+ *
+ * \details Each scan will be sent as a single datagram, which can't be
+ *  continued by another read, so libcodereader will treat each read as scan.
+ */
+const int device_datagram = 1;
+
+
+/** \brief Arrival processes for the scans of a virtual device.
+ */
+enum arrival
+{
+	ARRIVAL_CONSTANT, ///< Equidistant scans.
+	ARRIVAL_POISSON,  ///< Exponentially distributed gaps between scans.
+	ARRIVAL_BURST     ///< Equidistant bursts of back-to-back scans.
+};
+
+
+/** \brief Symbologies supported by the generator.
+ */
+enum symbology
+{
+	SYMBOLOGY_EAN8,    ///< EAN-8 with check digit.
+	SYMBOLOGY_EAN13,   ///< EAN-13 with check digit.
+	SYMBOLOGY_UPCA,    ///< UPC-A with check digit.
+	SYMBOLOGY_ITF,     ///< Interleaved 2 of 5 (even number of digits).
+	SYMBOLOGY_CODE39,  ///< Code 39 (upper case letters and digits).
+	SYMBOLOGY_CODE128, ///< Code 128 (printable ASCII).
+};
+
+
+/** \brief Storage for driver related information.
+ */
+struct codereader_synthetic_cookie
+{
+	int epoll;    ///< Epoll instance of the reading ends of all socket pairs.
+	int *readers; ///< Reading end of the socket pair of each virtual device.
+	int *writers; ///< Writing end of the socket pair of each virtual device.
+	int cursor;   ///< Index of the virtual device read last.
+	struct epoll_event *events; ///< Buffer for the ready virtual devices.
+
+	double rate;          ///< Scans per second and virtual device.
+	enum arrival arrival; ///< Arrival process.
+	int burst;            ///< Number of scans per burst.
+	int num_devices;      ///< Number of virtual devices.
+	int min_length;       ///< Minimum length of variable length barcodes.
+	int max_length;       ///< Maximum length of variable length barcodes.
+	uint64_t random;      ///< State of the random number generator.
+
+	enum symbology symbologies[MAX_SYMBOLOGIES]; ///< Symbologies to generate.
+	int num_symbologies; ///< Number of entries in \ref symbologies.
+
+	bool running;     ///< Whether \ref thread has been started.
+	pthread_t thread; ///< The generator thread.
+	double *next;     ///< Time of the next scan for each virtual device.
+	int *burst_left;  ///< Remaining scans of the current burst per device.
+
+	struct timespec start;   ///< Start of the generator.
+	struct rusage usage;     ///< Resource usage at the start.
+	struct rusage generator; ///< Resource usage of the generator thread.
+	unsigned long generated; ///< Number of generated scans.
+	unsigned long late;      ///< Number of scans generated behind schedule.
+	unsigned long dropped;   ///< Number of scans dropped for full sockets.
+	unsigned long delivered; ///< Number of scans read by libcodereader.
+	unsigned long *counts;   ///< Delivered scans of each virtual device.
+};
+
+
+/** \brief Get the current time of the monotonic clock in seconds.
+ */
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** \brief Get the next random number of the generator in \p cookie.
+ *
+ * \details A xorshift64* generator will be used, as it's fast and has its
+ *  state in the cookie, so it can be used from the generator thread without
+ *  any locks.
+ */
+static uint64_t
+next_random(struct codereader_synthetic_cookie *cookie)
+{
+	cookie->random ^= cookie->random >> 12;
+	cookie->random ^= cookie->random << 25;
+	cookie->random ^= cookie->random >> 27;
+	return cookie->random * 0x2545F4914F6CDD1DULL;
+}
+
+
+/** \brief Get a uniform random number in (0, 1].
+ */
+static double
+next_uniform(struct codereader_synthetic_cookie *cookie)
+{
+	return ((next_random(cookie) >> 11) + 1) / 9007199254740992.0;
+}
+
+
+/** \brief Fill \p buffer with \p n random digits.
+ */
+static void
+random_digits(struct codereader_synthetic_cookie *cookie, char *buffer, int n)
+{
+	for (int i = 0; i < n; i++)
+		buffer[i] = '0' + next_random(cookie) % 10;
+}
+
+
+/** \brief Append the EAN/UPC check digit for the \p n digits in \p buffer.
+ *
+ * \details The digits will be weighted alternating with 3 and 1, starting with
+ *  3 at the rightmost digit.
+ */
+static void
+append_check_digit(char *buffer, int n)
+{
+	int sum = 0;
+	for (int i = 0; i < n; i++)
+		sum += (buffer[n - 1 - i] - '0') * ((i % 2 == 0) ? 3 : 1);
+	buffer[n] = '0' + (10 - sum % 10) % 10;
+}
+
+
+/** \brief Generate a random barcode into \p buffer.
+ *
+ *
+ * \param cookie Pointer to the driver's data storage.
+ * \param buffer Where to store the barcode. Must have at least space for
+ *  \ref MAX_LENGTH plus one characters.
+ *
+ * \return The length of the barcode including the trailing newline.
+ */
+static int
+generate(struct codereader_synthetic_cookie *cookie, char *buffer)
+{
+	static const char code39[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ-. $/+%";
+
+	int span = cookie->max_length - cookie->min_length + 1;
+	int length = cookie->min_length + next_random(cookie) % span;
+
+	switch (cookie->symbologies[next_random(cookie) %
+	                            cookie->num_symbologies]) {
+		case SYMBOLOGY_EAN8: length = 7; break;
+		case SYMBOLOGY_EAN13: length = 12; break;
+		case SYMBOLOGY_UPCA: length = 11; break;
+
+		case SYMBOLOGY_ITF:
+			length += length % 2;
+			if (length > MAX_LENGTH)
+				length -= 2;
+			random_digits(cookie, buffer, length);
+			buffer[length] = '\n';
+			return length + 1;
+
+		case SYMBOLOGY_CODE39:
+			for (int i = 0; i < length; i++)
+				buffer[i] = code39[next_random(cookie) % (sizeof(code39) - 1)];
+			buffer[length] = '\n';
+			return length + 1;
+
+		case SYMBOLOGY_CODE128:
+			for (int i = 0; i < length; i++)
+				buffer[i] = ' ' + next_random(cookie) % ('~' - ' ' + 1);
+			buffer[length] = '\n';
+			return length + 1;
+	}
+
+	/* All fixed-length symbologies are numeric with a trailing check digit. */
+	random_digits(cookie, buffer, length);
+	append_check_digit(buffer, length);
+	buffer[length + 1] = '\n';
+	return length + 2;
+}
+
+
+/** \brief Calculate the time of the next scan of virtual device \p n.
+ *
+ *
+ * \param cookie Pointer to the driver's data storage.
+ * \param n Index of the virtual device.
+ */
+static void
+schedule(struct codereader_synthetic_cookie *cookie, int n)
+{
+	switch (cookie->arrival) {
+		case ARRIVAL_CONSTANT: cookie->next[n] += 1 / cookie->rate; break;
+		case ARRIVAL_POISSON:
+			cookie->next[n] += -log(next_uniform(cookie)) / cookie->rate;
+			break;
+
+		/* Scans of a burst will be generated back-to-back. The bursts will be
+		 * spaced, so the average rate matches the configured rate. */
+		case ARRIVAL_BURST:
+			if (--(cookie->burst_left[n]) > 0)
+				break;
+			cookie->burst_left[n] = cookie->burst;
+			cookie->next[n] += cookie->burst / cookie->rate;
+			break;
+	}
+}
+
+
+/** \brief Record the resource usage of the generator thread.
+ *
+ * \details This function is a cleanup handler of \ref generator_thread and
+ *  will be called by the thread itself, when it gets cancelled.
+ *
+ *
+ * \param arg Pointer to the driver's data storage.
+ */
+static void
+generator_usage(void *arg)
+{
+	struct codereader_synthetic_cookie *cookie = arg;
+	getrusage(RUSAGE_THREAD, &(cookie->generator));
+}
+
+
+/** \brief Thread generating the scans of all virtual devices.
+ *
+ *
+ * \param arg Pointer to the driver's data storage.
+ */
+static void *
+generator_thread(void *arg)
+{
+	struct codereader_synthetic_cookie *cookie = arg;
+	char buffer[MAX_LENGTH + 2];
+
+	/* The CPU time of the generator must not be accounted to libcodereader,
+	 * so the thread records its own usage, when it gets cancelled. */
+	pthread_cleanup_push(generator_usage, cookie);
+	while (true) {
+		/* Get the virtual device with the earliest next scan. The number of
+		 * virtual devices is small, so a linear search is fine. */
+		int n = 0;
+		for (int i = 1; i < cookie->num_devices; i++)
+			if (cookie->next[i] < cookie->next[n])
+				n = i;
+
+		/* Sleep until the scan is due. If the scan is overdue already, the
+		 * consumer can't keep up with the configured rate. */
+		double due = cookie->next[n];
+		if (due > now()) {
+			struct timespec ts = {.tv_sec = (time_t)due};
+			ts.tv_nsec = (due - ts.tv_sec) * 1e9;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		} else
+			cookie->late++;
+
+		/* If the socket of the virtual device is full, libcodereader doesn't
+		 * keep up with this device and the scan will be dropped. The other
+		 * virtual devices will not be delayed by this device. */
+		int length = generate(cookie, buffer);
+		if (send(cookie->writers[n], buffer, length, MSG_DONTWAIT) != length) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				break;
+			cookie->dropped++;
+		}
+		cookie->generated++;
+
+		schedule(cookie, n);
+	}
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+
+/** \brief Read the related configuration for this device.
+ *
+ *
+ * \param config Pointer to device configuration.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return If reading the configuration was successful, true will be returned,
+ *  otherwise false.
+ */
+static bool
+read_config(const config_setting_t *config,
+            struct codereader_synthetic_cookie *cookie)
+{
+	cookie->rate = 10;
+	cookie->burst = 10;
+	cookie->num_devices = 1;
+	cookie->min_length = 8;
+	cookie->max_length = 32;
+	cookie->random = 0x9E3779B97F4A7C15ULL;
+
+	/* libconfig distinguishes integer and float values, so the rate will be
+	 * read as integer, if it has been configured without a decimal point. */
+	int i;
+	if (config_setting_lookup_float(config, "rate", &(cookie->rate)) !=
+	        CONFIG_TRUE &&
+	    config_setting_lookup_int(config, "rate", &i) == CONFIG_TRUE)
+		cookie->rate = i;
+	config_setting_lookup_int(config, "burst", &(cookie->burst));
+	config_setting_lookup_int(config, "devices", &(cookie->num_devices));
+	if (config_setting_lookup_int(config, "seed", &i) == CONFIG_TRUE && i != 0)
+		cookie->random = i;
+	if (cookie->rate <= 0 || cookie->burst < 1 || cookie->num_devices < 1) {
+		fprintf(stderr, MESSAGE_PREFIX
+		        "Options 'rate', 'burst' and 'devices' must be positive.\n");
+		return false;
+	}
+
+	const char *arrival = "poisson";
+	config_setting_lookup_string(config, "arrival", &arrival);
+	if (strcmp(arrival, "constant") == 0)
+		cookie->arrival = ARRIVAL_CONSTANT;
+	else if (strcmp(arrival, "poisson") == 0)
+		cookie->arrival = ARRIVAL_POISSON;
+	else if (strcmp(arrival, "burst") == 0)
+		cookie->arrival = ARRIVAL_BURST;
+	else {
+		fprintf(stderr, MESSAGE_PREFIX "Unknown arrival '%s'.\n", arrival);
+		return false;
+	}
+
+	/* The length option is an array of minimum and maximum length, which will
+	 * be used for the variable length symbologies only. */
+	config_setting_t *length =
+	    config_setting_get_member((config_setting_t *)config, "length");
+	if (length != NULL) {
+		if (config_setting_length(length) != 2) {
+			fprintf(stderr, MESSAGE_PREFIX
+			        "Option 'length' must be an array [min, max].\n");
+			return false;
+		}
+		cookie->min_length = config_setting_get_int_elem(length, 0);
+		cookie->max_length = config_setting_get_int_elem(length, 1);
+	}
+	if (cookie->min_length < 1 || cookie->max_length > MAX_LENGTH ||
+	    cookie->min_length > cookie->max_length) {
+		fprintf(stderr, MESSAGE_PREFIX "Invalid length [%d, %d].\n",
+		        cookie->min_length, cookie->max_length);
+		return false;
+	}
+
+	static const char *names[] = {"ean8",  "ean13",  "upca",
+	                              "itf",   "code39", "code128"};
+	config_setting_t *symbologies =
+	    config_setting_get_member((config_setting_t *)config, "symbologies");
+	if (symbologies == NULL) {
+		cookie->symbologies[0] = SYMBOLOGY_EAN13;
+		cookie->num_symbologies = 1;
+		return true;
+	}
+	int n = config_setting_length(symbologies);
+	if (n < 1 || n > MAX_SYMBOLOGIES) {
+		fprintf(stderr, MESSAGE_PREFIX
+		        "Option 'symbologies' needs 1 to %d entries.\n",
+		        MAX_SYMBOLOGIES);
+		return false;
+	}
+	for (i = 0; i < n; i++) {
+		const char *p = config_setting_get_string_elem(symbologies, i);
+		int j;
+		for (j = 0; j < (int)(sizeof(names) / sizeof(names[0])); j++)
+			if (p != NULL && strcmp(p, names[j]) == 0)
+				break;
+		if (j == sizeof(names) / sizeof(names[0])) {
+			fprintf(stderr, MESSAGE_PREFIX "Unknown symbology '%s'.\n",
+			        (p != NULL) ? p : "");
+			return false;
+		}
+		cookie->symbologies[i] = j;
+	}
+	cookie->num_symbologies = n;
+
+	return true;
+}
+
+
+/** \brief Start generating scans.
+ *
+ *
+ * \param config Pointer to device configuration.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return On success the epoll instance of the reading ends of all socket
+ *  pairs will be returned, otherwise -1.
+ */
+int
+device_open(const config_setting_t *config,
+            struct codereader_synthetic_cookie **cookie)
+{
+	/* Allocate memory for the internal cookie. We'll register the memory in the
+	 * cookie pointer first, so errors don't have to be specially handled in
+	 * this function, as the close function will be called on errors
+	 * automatically, which frees the allocated memory. */
+	*cookie = malloc(sizeof(struct codereader_synthetic_cookie));
+	if (*cookie == NULL) {
+		fprintf(stderr,
+		        MESSAGE_PREFIX "Failed to allocate memory for cookie.\n");
+		return -1;
+	}
+	memset(*cookie, 0, sizeof(struct codereader_synthetic_cookie));
+	(*cookie)->epoll = -1;
+
+	if (!read_config(config, *cookie))
+		return -1;
+
+	int num = (*cookie)->num_devices;
+	(*cookie)->readers = malloc(num * sizeof(int));
+	(*cookie)->writers = malloc(num * sizeof(int));
+	(*cookie)->events = calloc(num, sizeof(struct epoll_event));
+	(*cookie)->counts = calloc(num, sizeof(unsigned long));
+	(*cookie)->next = calloc(num, sizeof(double));
+	(*cookie)->burst_left = calloc(num, sizeof(int));
+	if ((*cookie)->readers == NULL || (*cookie)->writers == NULL ||
+	    (*cookie)->events == NULL || (*cookie)->counts == NULL ||
+	    (*cookie)->next == NULL || (*cookie)->burst_left == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX
+		        "Failed to allocate memory for virtual devices.\n");
+		free((*cookie)->readers);
+		free((*cookie)->writers);
+		(*cookie)->readers = (*cookie)->writers = NULL;
+		return -1;
+	}
+	for (int i = 0; i < num; i++)
+		(*cookie)->readers[i] = (*cookie)->writers[i] = -1;
+
+	/* A datagram socket pair will be used for each virtual device instead of
+	 * a pipe, so each scan can be read with a single call. libcodereader gets
+	 * an epoll instance of all reading ends, which is readable, if any virtual
+	 * device has a scan pending. */
+	if (((*cookie)->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to create epoll instance.\n");
+		return -1;
+	}
+	for (int i = 0; i < num; i++) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) < 0) {
+			fprintf(stderr, MESSAGE_PREFIX "Failed to create socket pair.\n");
+			return -1;
+		}
+		(*cookie)->readers[i] = fds[0];
+		(*cookie)->writers[i] = fds[1];
+
+		struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+		if (epoll_ctl((*cookie)->epoll, EPOLL_CTL_ADD, fds[0], &ev) < 0) {
+			fprintf(stderr, MESSAGE_PREFIX "Failed to watch socket pair.\n");
+			return -1;
+		}
+	}
+	(*cookie)->cursor = num - 1;
+
+	/* Start all virtual devices now. The first scan of each device will be
+	 * scheduled like any other scan, so the virtual devices don't generate
+	 * their scans synchronously. */
+	double start = now();
+	for (int i = 0; i < (*cookie)->num_devices; i++) {
+		(*cookie)->next[i] = start;
+		(*cookie)->burst_left[i] = 1;
+		schedule(*cookie, i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &((*cookie)->start));
+	getrusage(RUSAGE_SELF, &((*cookie)->usage));
+
+	if (pthread_create(&((*cookie)->thread), NULL, generator_thread,
+	                   *cookie) != 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to start generator thread.\n");
+		return -1;
+	}
+	(*cookie)->running = true;
+
+	return (*cookie)->epoll;
+}
+
+
+/** \brief Read the next generated scan.
+ *
+ * \details The ready virtual devices will be read in round-robin order,
+ *  starting after the virtual device read last, so a busy virtual device can't
+ *  starve the others.
+ *
+ *
+ * \param fd The epoll instance returned by \ref device_open.
+ * \param buffer Where to store read data.
+ * \param size Size of \p buffer.
+ * \param cookie Pointer to the driver's data storage.
+ *
+ * \return On success the length of the scan will be returned. If the scan is
+ *  longer than \p size, it has been truncated and libcodereader will drop it.
+ *  If no scan is available, zero will be returned. On errors -1 will be
+ *  returned.
+ */
+int
+device_read(int fd, char *buffer, int size,
+            struct codereader_synthetic_cookie *cookie)
+{
+	assert(cookie);
+
+	int num = epoll_wait(fd, cookie->events, cookie->num_devices, 0);
+	if (num <= 0)
+		return (num < 0 && errno != EINTR) ? -1 : 0;
+
+	int next = -1, distance = cookie->num_devices;
+	for (int i = 0; i < num; i++) {
+		int n = cookie->events[i].data.u32;
+		int d = (n - cookie->cursor - 1 + cookie->num_devices) %
+		        cookie->num_devices;
+		if (d < distance) {
+			next = n;
+			distance = d;
+		}
+	}
+
+	ssize_t n = recv(cookie->readers[next], buffer, size,
+	                 MSG_DONTWAIT | MSG_TRUNC);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	cookie->cursor = next;
+	cookie->counts[next]++;
+	cookie->delivered++;
+	return n;
+}
+
+
+/** \brief Get the consumed CPU time between \p a and \p b in seconds.
+ */
+static double
+cpu_time(const struct rusage *a, const struct rusage *b)
+{
+	return (b->ru_utime.tv_sec - a->ru_utime.tv_sec) +
+	       (b->ru_utime.tv_usec - a->ru_utime.tv_usec) / 1e6 +
+	       (b->ru_stime.tv_sec - a->ru_stime.tv_sec) +
+	       (b->ru_stime.tv_usec - a->ru_stime.tv_usec) / 1e6;
+}
+
+
+/** \brief Stop the generator, print statistics and free allocated memory.
+ *
+ *
+ * \param fd The epoll instance returned by \ref device_open.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+device_close(int fd, struct codereader_synthetic_cookie *cookie)
+{
+	/* If no storage for cookie has been reserved yet, nothing has to be freed
+	 * and this function has nothing to do. */
+	if (cookie == NULL)
+		return 0;
+
+	/* Stop the generator thread. It can only be cancelled while sleeping or
+	 * sending a scan, so its counters are consistent afterwards. */
+	if (cookie->running) {
+		pthread_cancel(cookie->thread);
+		pthread_join(cookie->thread, NULL);
+
+		/* The generator thread has been started after recording the usage
+		 * of the process, so its whole usage will be subtracted. */
+		struct timespec end;
+		struct rusage usage;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		getrusage(RUSAGE_SELF, &usage);
+		double elapsed = (end.tv_sec - cookie->start.tv_sec) +
+		                 (end.tv_nsec - cookie->start.tv_nsec) / 1e9;
+		struct rusage none = {{0}};
+		double generator = cpu_time(&none, &(cookie->generator));
+		double cpu = cpu_time(&(cookie->usage), &usage) - generator;
+
+		/* The spread of the delivered scans between the virtual devices shows,
+		 * whether all virtual devices have been read fairly. */
+		unsigned long min = cookie->counts[0], max = cookie->counts[0];
+		for (int i = 1; i < cookie->num_devices; i++) {
+			if (cookie->counts[i] < min)
+				min = cookie->counts[i];
+			if (cookie->counts[i] > max)
+				max = cookie->counts[i];
+		}
+
+		fprintf(stderr,
+		        MESSAGE_PREFIX "%lu scans generated (%lu behind schedule, "
+		                       "%lu dropped), %lu delivered in %.3f s: %.1f "
+		                       "scans/s, %.2f us CPU per scan (%.3f s CPU in "
+		                       "the generator), %lu to %lu scans per virtual "
+		                       "device\n",
+		        cookie->generated, cookie->late, cookie->dropped,
+		        cookie->delivered, elapsed, cookie->delivered / elapsed,
+		        (cookie->delivered > 0) ? cpu * 1e6 / cookie->delivered : 0.0,
+		        generator, min, max);
+	}
+
+	if (cookie->readers != NULL)
+		for (int i = 0; i < cookie->num_devices; i++) {
+			if (cookie->readers[i] >= 0)
+				close(cookie->readers[i]);
+			if (cookie->writers[i] >= 0)
+				close(cookie->writers[i]);
+		}
+	if (cookie->epoll >= 0)
+		close(cookie->epoll);
+	free(cookie->readers);
+	free(cookie->writers);
+	free(cookie->events);
+	free(cookie->counts);
+	free(cookie->next);
+	free(cookie->burst_left);
+	free(cookie);
+
+	return 0;
+}
@@ -0,0 +1,1033 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Driver for fetching keyboard events from the X-server via XCB.
+ *
+ * \details This driver grabs selected keyboards like the xinput2 driver, but
+ *  uses libxcb instead of Xlib. Requests will be pipelined, so grabbing
+ *  devices needs a single round trip only, and the keymaps of all grabbed
+ *  devices will be kept locally by xkbcommon. Reading a barcode doesn't need
+ *  any round trip to the X-server, so this driver never blocks.
+ *
+ *  Devices connected later will be grabbed without waiting for the X-server:
+ *  the requests for a new device will be sent and their replies collected,
+ *  when they have been received. Loading a keymap needs several round trips,
+ *  so the keymaps of new devices will be loaded by a separate thread with its
+ *  own connection to the X-server.
+ *
+ * \note Unlike other drivers, only one invocation is needed for several devices
+ *  in the current X-session.
+ */
+
+/* The following define is required for memmem. */
+#define _GNU_SOURCE
+
+
+#include <assert.h>      // assert
+#include <pthread.h>     // pthread_*
+#include <stdbool.h>     // bool, true, false
+#include <stdint.h>      // uint*_t
+#include <stdio.h>       // fprintf
+#include <stdlib.h>      // calloc, free, malloc, realloc
+#include <string.h>      // memcpy, memmem, strdup, strlen
+#include <sys/epoll.h>   // epoll_*
+#include <sys/eventfd.h> // eventfd
+#include <unistd.h>      // close, read, write
+
+#include <libconfig.h>               // libconfig API
+#include <xcb/xcb.h>                 // XCB API
+#include <xcb/xcbext.h>              // xcb_poll_for_reply
+#include <xcb/xinput.h>              // XCB xinput extension API
+#include <xkbcommon/xkbcommon-x11.h> // xkbcommon X11 keymaps
+#include <xkbcommon/xkbcommon.h>     // xkbcommon API
+
+
+/** \brief Prefix for error messages of this driver.
+ */
+#define MESSAGE_PREFIX "[codereader-xcb] "
+
+
+/** \brief Keymap of a grabbed device.
+ */
+struct codereader_xcb_keymap
+{
+	xcb_input_device_id_t deviceid; ///< The device using this keymap.
+	struct xkb_keymap *keymap;      ///< The keymap of the device.
+	struct xkb_state *state;        ///< State used to translate keys.
+};
+
+
+/** \brief A new device, whose requests have not been answered yet.
+ */
+struct codereader_xcb_pending
+{
+	xcb_input_device_id_t deviceid; ///< The new device.
+	bool grabbing;         ///< Whether the device is being grabbed already.
+	unsigned int sequence; ///< Sequence number of the pending request.
+};
+
+
+/** \brief Thread loading the keymaps of new devices.
+ *
+ * \details The thread uses its own connection to the X-server, so the round
+ *  trips for loading a keymap don't block reading the barcodes. All reference
+ *  counts of xkbcommon objects will be modified by this thread only, while it
+ *  is running, so the keymaps of removed devices will be passed back to this
+ *  thread to be freed. All lists are protected by \ref lock.
+ */
+struct codereader_xcb_loader
+{
+	xcb_connection_t *conn; ///< Connection used to load the keymaps.
+	pthread_t thread;       ///< The loading thread.
+	bool running;           ///< Whether \ref thread has been started.
+	bool stop;              ///< Whether \ref thread should stop.
+	pthread_mutex_t lock;   ///< Lock for the lists below.
+	pthread_cond_t cond;    ///< Signalled, if there is work for the thread.
+
+	xcb_input_device_id_t *requests;       ///< Devices to load keymaps for.
+	size_t requests_num;                   ///< Number of \ref requests.
+	struct codereader_xcb_keymap *loaded;  ///< Keymaps loaded by the thread.
+	size_t loaded_num;                     ///< Number of \ref loaded.
+	struct codereader_xcb_keymap *garbage; ///< Keymaps to be freed.
+	size_t garbage_num;                    ///< Number of \ref garbage.
+};
+
+
+/** \brief Storage for driver related information.
+ */
+struct codereader_xcb_cookie
+{
+	xcb_connection_t *conn; ///< Connection to the X-server.
+	xcb_window_t root;      ///< Root window of the default screen.
+	uint8_t xi_opcode;      ///< Major opcode of the X input extension.
+
+	char **match_devices;  ///< Which device names to match.
+	int match_devices_num; ///< Number of entries in \ref match_devices.
+
+	struct xkb_context *xkb;               ///< Context for the keymaps.
+	struct codereader_xcb_keymap *keymaps; ///< Keymaps of grabbed devices.
+	size_t keymaps_num;                    ///< Number of \ref keymaps.
+
+	struct codereader_xcb_pending *pending; ///< New devices being grabbed.
+	size_t pending_num;                     ///< Number of \ref pending.
+	struct codereader_xcb_loader loader;    ///< Loader of new keymaps.
+
+	/** \brief The code currently read.
+	 *
+	 * \details Key events will be translated into this buffer, until the code
+	 *  is complete. Codes larger than the buffer of libcodereader will be
+	 *  delivered in parts.
+	 */
+	char *code;
+	size_t code_size; ///< Size of \ref code.
+	size_t code_len;  ///< Length of the code in \ref code.
+	size_t code_sent; ///< Bytes of \ref code delivered already.
+	bool code_done;   ///< Whether the code in \ref code is complete.
+
+	/** \brief Event queued by libxcb, but not processed yet.
+	 *
+	 * \details libxcb may read more events from the connection than required
+	 *  for a code. As these events won't be signalled by the connection's file
+	 *  descriptor anymore, \ref wakeup will be signalled instead.
+	 */
+	xcb_generic_event_t *queued;
+	int wakeup; ///< eventfd signalled, if events are queued.
+	int epfd;   ///< epoll instance watching the connection and \ref wakeup.
+};
+
+
+/** \brief Check if all required extensions are loaded into the X-server.
+ *
+ * \details The version of the X input extension will be negotiated and the
+ *  keyboard extension set up for xkbcommon.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ *
+ * \return If all required extensions are available true will be returned,
+ *  otherwise false.
+ */
+static bool
+check_x_extensions(struct codereader_xcb_cookie *cookie)
+{
+	const xcb_query_extension_reply_t *ext =
+	    xcb_get_extension_data(cookie->conn, &xcb_input_id);
+	if (ext == NULL || !ext->present) {
+		fprintf(stderr, MESSAGE_PREFIX "X Input extension is not available.\n");
+		return false;
+	}
+	cookie->xi_opcode = ext->major_opcode;
+
+	xcb_input_xi_query_version_reply_t *version =
+	    xcb_input_xi_query_version_reply(
+	        cookie->conn, xcb_input_xi_query_version(cookie->conn, 2, 0), NULL);
+	bool xi2 = (version != NULL && version->major_version >= 2);
+	free(version);
+	if (!xi2) {
+		fprintf(stderr,
+		        MESSAGE_PREFIX "X Input extension 2.0 is not available.\n");
+		return false;
+	}
+
+	if (!xkb_x11_setup_xkb_extension(
+	        cookie->conn, XKB_X11_MIN_MAJOR_XKB_VERSION,
+	        XKB_X11_MIN_MINOR_XKB_VERSION, XKB_X11_SETUP_XKB_EXTENSION_NO_FLAGS,
+	        NULL, NULL, NULL, NULL)) {
+		fprintf(stderr,
+		        MESSAGE_PREFIX "X keyboard extension is not available.\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+/** \brief Read the related configuration for this device.
+ *
+ * \details This function reads the related configuration for this device and
+ *  saves it in the persistent \p cookie.
+ *
+ *
+ * \param config Pointer to device configuration.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return If reading the configuration was successful, true will be returned,
+ *  otherwise false.
+ */
+static bool
+read_config(const config_setting_t *config,
+            struct codereader_xcb_cookie *cookie)
+{
+	config_setting_t *matches =
+	    config_setting_get_member((config_setting_t *)config, "match");
+	if (matches == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Missing config option 'match'.\n");
+		return false;
+	}
+
+	cookie->match_devices_num = config_setting_length(matches);
+	if (cookie->match_devices_num == 0) {
+		fprintf(stderr, MESSAGE_PREFIX
+		        "Config option 'match' needs to be a non-empty array.\n");
+		return false;
+	}
+
+	cookie->match_devices = calloc(cookie->match_devices_num, sizeof(char *));
+	if (cookie->match_devices == NULL) {
+		fprintf(stderr,
+		        MESSAGE_PREFIX "Failed to allocate memory for match-array.\n");
+		return false;
+	}
+
+	for (int i = 0; i < cookie->match_devices_num; i++) {
+		const char *p = config_setting_get_string_elem(matches, i);
+		if (p == NULL || p[0] == '\0') {
+			fprintf(stderr,
+			        MESSAGE_PREFIX "Match-entry %d must not be empty.\n", i);
+			return false;
+		}
+		if ((cookie->match_devices[i] = strdup(p)) == NULL) {
+			fprintf(stderr, MESSAGE_PREFIX "Failed to copy match-entry.\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/** \brief Load the keymap of device \p id.
+ *
+ *
+ * \param xkb The context for the keymap.
+ * \param conn The connection to the X-server used for loading.
+ * \param id The device.
+ * \param km Where to store the keymap.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+load_keymap(struct xkb_context *xkb, xcb_connection_t *conn,
+            xcb_input_device_id_t id, struct codereader_xcb_keymap *km)
+{
+	km->deviceid = id;
+	km->keymap = xkb_x11_keymap_new_from_device(xkb, conn, id,
+	                                            XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (km->keymap == NULL ||
+	    (km->state = xkb_x11_state_new_from_device(km->keymap, conn, id)) ==
+	        NULL) {
+		fprintf(stderr,
+		        MESSAGE_PREFIX "Failed to load keymap of device %d.\n", id);
+		xkb_keymap_unref(km->keymap);
+		return false;
+	}
+
+	return true;
+}
+
+
+/** \brief Append \p km to the list \p list of \p num keymaps.
+ *
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+append_keymap(struct codereader_xcb_keymap **list, size_t *num,
+              const struct codereader_xcb_keymap *km)
+{
+	struct codereader_xcb_keymap *p = realloc(*list, (*num + 1) * sizeof(*p));
+	if (p == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Not enough memory for keymap.\n");
+		return false;
+	}
+	*list = p;
+	p[(*num)++] = *km;
+	return true;
+}
+
+
+/** \brief Free all keymaps in the list \p list of \p num keymaps.
+ */
+static void
+free_keymaps(struct codereader_xcb_keymap **list, size_t *num)
+{
+	for (size_t i = 0; i < *num; i++) {
+		xkb_state_unref((*list)[i].state);
+		xkb_keymap_unref((*list)[i].keymap);
+	}
+	free(*list);
+	*list = NULL;
+	*num = 0;
+}
+
+
+/** \brief Pass the keymap of device \p id to the loader to be freed.
+ *
+ * \note The lock of the loader must be held by the caller.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param id The device.
+ */
+static void
+drop_keymap(struct codereader_xcb_cookie *cookie, xcb_input_device_id_t id)
+{
+	struct codereader_xcb_loader *loader = &(cookie->loader);
+	for (size_t i = 0; i < cookie->keymaps_num; i++)
+		if (cookie->keymaps[i].deviceid == id) {
+			append_keymap(&(loader->garbage), &(loader->garbage_num),
+			              &(cookie->keymaps[i]));
+			cookie->keymaps[i] = cookie->keymaps[--(cookie->keymaps_num)];
+			pthread_cond_signal(&(loader->cond));
+			return;
+		}
+}
+
+
+/** \brief Thread loading the keymaps of new devices.
+ *
+ * \details See \ref codereader_xcb_loader for details.
+ *
+ *
+ * \param arg Pointer to the driver's data storage.
+ */
+static void *
+loader_thread(void *arg)
+{
+	struct codereader_xcb_cookie *cookie = arg;
+	struct codereader_xcb_loader *loader = &(cookie->loader);
+
+	pthread_mutex_lock(&(loader->lock));
+	while (true) {
+		while (!loader->stop && loader->requests_num == 0 &&
+		       loader->garbage_num == 0)
+			pthread_cond_wait(&(loader->cond), &(loader->lock));
+		if (loader->stop)
+			break;
+
+		free_keymaps(&(loader->garbage), &(loader->garbage_num));
+		if (loader->requests_num == 0)
+			continue;
+
+		/* The lock will be released while loading the keymap, so the driver
+		 * can pass new requests meanwhile. The driver will be woken up to
+		 * pick up the loaded keymap. */
+		xcb_input_device_id_t id = loader->requests[--(loader->requests_num)];
+		pthread_mutex_unlock(&(loader->lock));
+		struct codereader_xcb_keymap km;
+		bool ok = load_keymap(cookie->xkb, loader->conn, id, &km);
+		pthread_mutex_lock(&(loader->lock));
+		if (!ok)
+			continue;
+		if (!append_keymap(&(loader->loaded), &(loader->loaded_num), &km)) {
+			xkb_state_unref(km.state);
+			xkb_keymap_unref(km.keymap);
+			continue;
+		}
+
+		uint64_t value = 1;
+		if (write(cookie->wakeup, &value, sizeof(value)) < 0)
+			fprintf(stderr, MESSAGE_PREFIX "Failed to signal new keymap.\n");
+	}
+	pthread_mutex_unlock(&(loader->lock));
+
+	return NULL;
+}
+
+
+/** \brief Request the keymap of device \p id from the loader.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param id The device.
+ */
+static void
+loader_request(struct codereader_xcb_cookie *cookie, xcb_input_device_id_t id)
+{
+	struct codereader_xcb_loader *loader = &(cookie->loader);
+
+	pthread_mutex_lock(&(loader->lock));
+	xcb_input_device_id_t *p =
+	    realloc(loader->requests, (loader->requests_num + 1) * sizeof(*p));
+	if (p != NULL) {
+		loader->requests = p;
+		loader->requests[loader->requests_num++] = id;
+		pthread_cond_signal(&(loader->cond));
+	} else
+		fprintf(stderr,
+		        MESSAGE_PREFIX "Not enough memory to load keymap of device "
+		                       "%d.\n",
+		        id);
+	pthread_mutex_unlock(&(loader->lock));
+}
+
+
+/** \brief Take the keymaps loaded by the loader.
+ *
+ * \details Keymaps loaded for a device again replace the previous keymap of
+ *  the device.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ */
+static void
+loader_collect(struct codereader_xcb_cookie *cookie)
+{
+	struct codereader_xcb_loader *loader = &(cookie->loader);
+
+	pthread_mutex_lock(&(loader->lock));
+	for (size_t i = 0; i < loader->loaded_num; i++) {
+		drop_keymap(cookie, loader->loaded[i].deviceid);
+		if (!append_keymap(&(cookie->keymaps), &(cookie->keymaps_num),
+		                   &(loader->loaded[i])))
+			append_keymap(&(loader->garbage), &(loader->garbage_num),
+			              &(loader->loaded[i]));
+	}
+	loader->loaded_num = 0;
+	pthread_mutex_unlock(&(loader->lock));
+}
+
+
+/** \brief Check whether \p info is a keyboard matching the configuration.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param info The device to check.
+ *
+ * \return If the device should be grabbed true will be returned, otherwise
+ *  false.
+ */
+static bool
+match_device(const struct codereader_xcb_cookie *cookie,
+             xcb_input_xi_device_info_t *info)
+{
+	if (info->type != XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD &&
+	    info->type != XCB_INPUT_DEVICE_TYPE_SLAVE_KEYBOARD)
+		return false;
+
+	/* The name of the device is not terminated by a null-character, so
+	 * memmem will be used for matching. */
+	const char *name = xcb_input_xi_device_info_name(info);
+	int len = xcb_input_xi_device_info_name_length(info);
+	for (int i = 0; i < cookie->match_devices_num; i++)
+		if (memmem(name, len, cookie->match_devices[i],
+		           strlen(cookie->match_devices[i])) != NULL)
+			return true;
+
+	return false;
+}
+
+
+/** \brief Send the request to grab device \p id.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param id The device to grab.
+ *
+ * \return The cookie of the grab request.
+ */
+static xcb_input_xi_grab_device_cookie_t
+grab_device(struct codereader_xcb_cookie *cookie, xcb_input_device_id_t id)
+{
+	const uint32_t mask = XCB_INPUT_XI_EVENT_MASK_KEY_PRESS;
+	return xcb_input_xi_grab_device(
+	    cookie->conn, cookie->root, XCB_CURRENT_TIME, XCB_NONE, id,
+	    XCB_INPUT_GRAB_MODE_22_ASYNC, XCB_INPUT_GRAB_MODE_22_ASYNC,
+	    XCB_INPUT_GRAB_OWNER_NO_OWNER, 1, &mask);
+}
+
+
+/** \brief Grab all matching devices.
+ *
+ * \details This function checks the list of devices of the current X-server
+ *  session and grabs all devices with a name matching the match-list of the
+ *  loaded configuration. The grab requests of all devices will be sent at once
+ *  and their replies collected afterwards, so grabbing needs one round trip
+ *  for the device list and one for all grabs. The keymaps of the grabbed
+ *  devices will be loaded, so no round trips are needed for reading codes.
+ *  Devices, which can't be grabbed, will be skipped.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ *
+ * \return If the device list could be processed, true will be returned,
+ *  otherwise false.
+ */
+static bool
+grab_devices(struct codereader_xcb_cookie *cookie)
+{
+	xcb_input_xi_query_device_reply_t *devices =
+	    xcb_input_xi_query_device_reply(
+	        cookie->conn,
+	        xcb_input_xi_query_device(cookie->conn, XCB_INPUT_DEVICE_ALL),
+	        NULL);
+	if (devices == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to get device list.\n");
+		return false;
+	}
+
+	int num = xcb_input_xi_query_device_infos_length(devices);
+	xcb_input_xi_grab_device_cookie_t *grabs =
+	    calloc(num, sizeof(xcb_input_xi_grab_device_cookie_t));
+	xcb_input_device_id_t *ids = calloc(num, sizeof(xcb_input_device_id_t));
+	if (grabs == NULL || ids == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX
+		        "Failed to allocate memory for device list.\n");
+		free(grabs);
+		free(ids);
+		free(devices);
+		return false;
+	}
+
+	/* Send the grab requests for all matching devices. */
+	size_t n = 0;
+	xcb_input_xi_device_info_iterator_t iter =
+	    xcb_input_xi_query_device_infos_iterator(devices);
+	for (; iter.rem; xcb_input_xi_device_info_next(&iter)) {
+		if (!match_device(cookie, iter.data))
+			continue;
+
+		ids[n] = iter.data->deviceid;
+		grabs[n++] = grab_device(cookie, iter.data->deviceid);
+	}
+	free(devices);
+
+	/* Collect the replies of all grab requests and load the keymaps of the
+	 * grabbed devices. All replies need to be fetched, even if a grab failed,
+	 * so libxcb can free them. */
+	for (size_t i = 0; i < n; i++) {
+		xcb_input_xi_grab_device_reply_t *reply =
+		    xcb_input_xi_grab_device_reply(cookie->conn, grabs[i], NULL);
+		bool grabbed =
+		    (reply != NULL && reply->status == XCB_GRAB_STATUS_SUCCESS);
+		free(reply);
+		if (!grabbed) {
+			fprintf(stderr, MESSAGE_PREFIX "Failed to grab device %d.\n",
+			        ids[i]);
+			continue;
+		}
+
+		struct codereader_xcb_keymap km;
+		if (load_keymap(cookie->xkb, cookie->conn, ids[i], &km) &&
+		    !append_keymap(&(cookie->keymaps), &(cookie->keymaps_num), &km)) {
+			xkb_state_unref(km.state);
+			xkb_keymap_unref(km.keymap);
+		}
+	}
+
+	free(grabs);
+	free(ids);
+	return true;
+}
+
+
+/** \brief Forget the device \p id, which has been removed or changed.
+ *
+ * \details Pending requests for the device will be discarded and its keymap
+ *  freed.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param id The device.
+ */
+static void
+forget_device(struct codereader_xcb_cookie *cookie, xcb_input_device_id_t id)
+{
+	for (size_t i = cookie->pending_num; i-- > 0;)
+		if (cookie->pending[i].deviceid == id) {
+			xcb_discard_reply(cookie->conn, cookie->pending[i].sequence);
+			cookie->pending[i] = cookie->pending[--(cookie->pending_num)];
+		}
+
+	struct codereader_xcb_loader *loader = &(cookie->loader);
+	pthread_mutex_lock(&(loader->lock));
+	for (size_t i = loader->requests_num; i-- > 0;)
+		if (loader->requests[i] == id)
+			loader->requests[i] = loader->requests[--(loader->requests_num)];
+	drop_keymap(cookie, id);
+	pthread_mutex_unlock(&(loader->lock));
+}
+
+
+/** \brief Handle a change of the device hierarchy.
+ *
+ * \details Only the devices added or removed by \p ev will be handled. The
+ *  information of new devices will be requested without waiting for the
+ *  reply, which will be processed by \ref collect_replies.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param ev The hierarchy event.
+ */
+static void
+hierarchy_changed(struct codereader_xcb_cookie *cookie,
+                  xcb_input_hierarchy_event_t *ev)
+{
+	const uint32_t added = XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED |
+	                       XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED |
+	                       XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED;
+	const uint32_t removed = XCB_INPUT_HIERARCHY_MASK_MASTER_REMOVED |
+	                         XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED |
+	                         XCB_INPUT_HIERARCHY_MASK_DEVICE_DISABLED;
+
+	xcb_input_hierarchy_info_iterator_t iter =
+	    xcb_input_hierarchy_infos_iterator(ev);
+	for (; iter.rem; xcb_input_hierarchy_info_next(&iter)) {
+		xcb_input_device_id_t id = iter.data->deviceid;
+		if (!(iter.data->flags & (added | removed)))
+			continue;
+		forget_device(cookie, id);
+		if (iter.data->flags & removed)
+			continue;
+
+		struct codereader_xcb_pending *p =
+		    realloc(cookie->pending,
+		            (cookie->pending_num + 1) * sizeof(*p));
+		if (p == NULL) {
+			fprintf(stderr,
+			        MESSAGE_PREFIX "Not enough memory to grab device %d.\n",
+			        id);
+			continue;
+		}
+		cookie->pending = p;
+		p[cookie->pending_num++] = (struct codereader_xcb_pending){
+		    .deviceid = id,
+		    .sequence = xcb_input_xi_query_device(cookie->conn, id).sequence};
+	}
+	xcb_flush(cookie->conn);
+}
+
+
+/** \brief Process the replies received for new devices.
+ *
+ * \details A new device matching the configuration will be grabbed and its
+ *  keymap requested from the loader, after it has been grabbed. Devices,
+ *  which vanished or can't be grabbed, will be skipped. Replies not received
+ *  yet will be processed by the next call.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ */
+static void
+collect_replies(struct codereader_xcb_cookie *cookie)
+{
+	bool sent = false;
+	for (size_t i = cookie->pending_num; i-- > 0;) {
+		struct codereader_xcb_pending *p = &(cookie->pending[i]);
+		void *reply = NULL;
+		xcb_generic_error_t *error = NULL;
+		if (!xcb_poll_for_reply(cookie->conn, p->sequence, &reply, &error))
+			continue;
+		free(error);
+
+		bool done = true;
+		if (!p->grabbing) {
+			xcb_input_xi_device_info_iterator_t iter;
+			if (reply != NULL &&
+			    (iter = xcb_input_xi_query_device_infos_iterator(reply))
+			        .rem &&
+			    match_device(cookie, iter.data)) {
+				p->sequence = grab_device(cookie, p->deviceid).sequence;
+				p->grabbing = true;
+				done = false;
+				sent = true;
+			}
+		} else {
+			xcb_input_xi_grab_device_reply_t *grab = reply;
+			if (grab != NULL && grab->status == XCB_GRAB_STATUS_SUCCESS)
+				loader_request(cookie, p->deviceid);
+			else
+				fprintf(stderr, MESSAGE_PREFIX "Failed to grab device %d.\n",
+				        p->deviceid);
+		}
+		free(reply);
+
+		if (done)
+			cookie->pending[i] = cookie->pending[--(cookie->pending_num)];
+	}
+
+	if (sent)
+		xcb_flush(cookie->conn);
+}
+
+
+/** \brief Connects to the X-server session and grabs all matching codereaders.
+ *
+ * \details This function opens a connection to the current X-server session and
+ *  loads the neccessary configuration. All required events will be registered
+ *  and (if already connected) codereaders grabbed to get their input exclusive.
+ *
+ *
+ * \param config Pointer to device configuration.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return On success a file descriptor for an epoll instance watching the
+ *  connection to the X-server will be returned, otherwise -1.
+ */
+int
+device_open(const config_setting_t *config,
+            struct codereader_xcb_cookie **cookie)
+{
+	/* Allocate memory for the internal cookie. We'll register the memory in the
+	 * cookie pointer first, so errors don't have to be specially handled in
+	 * this function, as the close function will be called on errors
+	 * automatically, which frees the allocated memory. */
+	*cookie = calloc(1, sizeof(struct codereader_xcb_cookie));
+	if (*cookie == NULL) {
+		fprintf(stderr,
+		        MESSAGE_PREFIX "Failed to allocate memory for cookie.\n");
+		return -1;
+	}
+	struct codereader_xcb_cookie *c = *cookie;
+	c->wakeup = c->epfd = -1;
+	pthread_mutex_init(&(c->loader.lock), NULL);
+	pthread_cond_init(&(c->loader.cond), NULL);
+
+	/* Open a connection to the X11 server. The display from the DISPLAY
+	 * environment variable will be used. */
+	int screen;
+	c->conn = xcb_connect(NULL, &screen);
+	if (xcb_connection_has_error(c->conn)) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to open display connection.\n");
+		return -1;
+	}
+	xcb_screen_iterator_t iter =
+	    xcb_setup_roots_iterator(xcb_get_setup(c->conn));
+	for (; screen > 0 && iter.rem; screen--)
+		xcb_screen_next(&iter);
+	c->root = iter.data->root;
+
+	if ((c->xkb = xkb_context_new(XKB_CONTEXT_NO_FLAGS)) == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to create xkb context.\n");
+		return -1;
+	}
+	if (!check_x_extensions(c) || !read_config(config, c))
+		return -1;
+
+	/* Register hierarchy changed events, which will be triggered, if a device
+	 * is con- or deconnected. They will be used to grab new devices, after the
+	 * initial open call has been done. */
+	struct
+	{
+		xcb_input_event_mask_t head;
+		uint32_t mask;
+	} hierarchy_mask = {{XCB_INPUT_DEVICE_ALL, 1},
+	                    XCB_INPUT_XI_EVENT_MASK_HIERARCHY};
+	xcb_input_xi_select_events(c->conn, c->root, 1, &(hierarchy_mask.head));
+
+	if (!grab_devices(c))
+		return -1;
+	xcb_flush(c->conn);
+
+	/* libxcb may read more events from the connection than required for a
+	 * single code. An epoll instance watching both, the connection and an
+	 * eventfd signalled for these queued events, will be returned, so
+	 * libcodereader will call this driver until all events are processed. */
+	if ((c->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+	    (c->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to create epoll instance.\n");
+		return -1;
+	}
+	struct epoll_event ev = {.events = EPOLLIN};
+	if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, xcb_get_file_descriptor(c->conn),
+	              &ev) < 0 ||
+	    epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wakeup, &ev) < 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to watch the connection.\n");
+		return -1;
+	}
+
+	/* Start the loader for the keymaps of devices grabbed later. It uses its
+	 * own connection, so loading keymaps doesn't interfere with the events
+	 * read from the connection above. */
+	c->loader.conn = xcb_connect(NULL, NULL);
+	if (xcb_connection_has_error(c->loader.conn) ||
+	    !xkb_x11_setup_xkb_extension(
+	        c->loader.conn, XKB_X11_MIN_MAJOR_XKB_VERSION,
+	        XKB_X11_MIN_MINOR_XKB_VERSION, XKB_X11_SETUP_XKB_EXTENSION_NO_FLAGS,
+	        NULL, NULL, NULL, NULL)) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to open loader connection.\n");
+		return -1;
+	}
+	if (pthread_create(&(c->loader.thread), NULL, loader_thread, c) != 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to start keymap loader.\n");
+		return -1;
+	}
+	c->loader.running = true;
+
+	return c->epfd;
+}
+
+
+/** \brief Append a key event to the current code.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param kev The key event.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+parse_key(struct codereader_xcb_cookie *cookie,
+          xcb_input_key_press_event_t *kev)
+{
+	/* Get the keymap of the grabbed device. Events of devices without keymap
+	 * will be ignored. */
+	struct xkb_state *state = NULL;
+	for (size_t i = 0; i < cookie->keymaps_num; i++)
+		if (cookie->keymaps[i].deviceid == kev->deviceid) {
+			state = cookie->keymaps[i].state;
+			break;
+		}
+	if (state == NULL)
+		return true;
+
+	/* The event contains the modifiers and group of the keyboard at the time
+	 * the key has been pressed, so the local state will be set to these
+	 * before translating the key. */
+	xkb_state_update_mask(state, kev->mods.base, kev->mods.latched,
+	                      kev->mods.locked, kev->group.base,
+	                      kev->group.latched, kev->group.locked);
+	char s[64];
+	int n = xkb_state_key_get_utf8(state, kev->detail, s, sizeof(s));
+	if (n <= 0)
+		return true;
+	if ((size_t)n >= sizeof(s))
+		n = sizeof(s) - 1;
+
+	/* If the end of the code is detected, replace the carriage return by a
+	 * newline. */
+	if (s[0] == '\r') {
+		s[0] = '\n';
+		n = 1;
+		cookie->code_done = true;
+	}
+
+	if (cookie->code_len + n > cookie->code_size) {
+		size_t size = (cookie->code_size > 0) ? 2 * cookie->code_size : 256;
+		char *p = realloc(cookie->code, size);
+		if (p == NULL) {
+			fprintf(stderr, MESSAGE_PREFIX "Not enough memory for code.\n");
+			return false;
+		}
+		cookie->code = p;
+		cookie->code_size = size;
+	}
+	memcpy(cookie->code + cookie->code_len, s, n);
+	cookie->code_len += n;
+
+	return true;
+}
+
+
+/** \brief Parse the X-server events to a valid code.
+ *
+ * \details Only events already received from the X-server will be processed,
+ *  so this function never blocks. If a code is incomplete, it will be kept
+ *  until the rest of its events have been received.
+ *
+ *
+ * \param fd File descriptor of the epoll instance (ignored).
+ * \param buffer Where to store read data.
+ * \param size Size of \p buffer.
+ * \param cookie Pointer to the driver's data storage.
+ *
+ * \return On success the number of read bytes will be returned, if no code has
+ *  been completed zero and on errors -1. If \p buffer is too small for the
+ *  code, \p size will be returned and the rest of the code will be delivered
+ *  by the next call.
+ */
+int
+device_read(int fd, char *buffer, int size,
+            struct codereader_xcb_cookie *cookie)
+{
+	assert(cookie);
+
+
+	/* Reset the wakeup signal. It will be set again below, if there are still
+	 * events queued after reading a code. */
+	uint64_t value;
+	while (read(cookie->wakeup, &value, sizeof(value)) > 0)
+		;
+	loader_collect(cookie);
+
+	while (!cookie->code_done) {
+		xcb_generic_event_t *ev = cookie->queued;
+		cookie->queued = NULL;
+		if (ev == NULL && (ev = xcb_poll_for_event(cookie->conn)) == NULL) {
+			if (xcb_connection_has_error(cookie->conn)) {
+				fprintf(stderr, MESSAGE_PREFIX "Lost X-server connection.\n");
+				return -1;
+			}
+			break;
+		}
+
+		/* We are only interested in events from the xinput2 extension. Other
+		 * events will be ignored. */
+		bool ok = true;
+		xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)ev;
+		if ((ev->response_type & 0x7f) == XCB_GE_GENERIC &&
+		    ge->extension == cookie->xi_opcode) {
+			switch (ge->event_type) {
+				/* If the hierarchy changed, grab the added devices. */
+				case XCB_INPUT_HIERARCHY:
+					hierarchy_changed(cookie,
+					                  (xcb_input_hierarchy_event_t *)ev);
+					break;
+
+				case XCB_INPUT_KEY_PRESS:
+					ok = parse_key(cookie, (xcb_input_key_press_event_t *)ev);
+					break;
+			}
+		}
+		free(ev);
+		if (!ok)
+			return -1;
+	}
+	collect_replies(cookie);
+
+	/* If libxcb queued more events while reading this code, signal the
+	 * eventfd, so libcodereader calls this function again, although there
+	 * might be no new data at the connection. */
+	if (cookie->queued == NULL &&
+	    (cookie->queued = xcb_poll_for_queued_event(cookie->conn)) != NULL) {
+		value = 1;
+		if (write(cookie->wakeup, &value, sizeof(value)) < 0)
+			fprintf(stderr, MESSAGE_PREFIX "Failed to signal queued events.\n");
+	}
+	if (!cookie->code_done)
+		return 0;
+
+	/* Deliver as much of the code as fits into the buffer. The code will be
+	 * reset, after it has been delivered completely. */
+	size_t n = cookie->code_len - cookie->code_sent;
+	if (n > (size_t)size)
+		n = size;
+	memcpy(buffer, cookie->code + cookie->code_sent, n);
+	cookie->code_sent += n;
+	if (cookie->code_sent == cookie->code_len) {
+		cookie->code_len = cookie->code_sent = 0;
+		cookie->code_done = false;
+	}
+
+	return n;
+}
+
+
+/** \brief Close the connection to the X-server and free allocated memory.
+ *
+ *
+ * \param fd The file descriptor to close.
+ * \param cookie Pointer to device data storage.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+device_close(int fd, struct codereader_xcb_cookie *cookie)
+{
+	/* If no storage for cookie has been reserved yet, nothing has to be freed
+	 * and this function has nothing to do. */
+	if (cookie == NULL)
+		return 0;
+
+	/* Stop the loader first, so all keymaps can be freed below. */
+	struct codereader_xcb_loader *loader = &(cookie->loader);
+	if (loader->running) {
+		pthread_mutex_lock(&(loader->lock));
+		loader->stop = true;
+		pthread_cond_signal(&(loader->cond));
+		pthread_mutex_unlock(&(loader->lock));
+		pthread_join(loader->thread, NULL);
+	}
+	free_keymaps(&(loader->loaded), &(loader->loaded_num));
+	free_keymaps(&(loader->garbage), &(loader->garbage_num));
+	free(loader->requests);
+	if (loader->conn != NULL)
+		xcb_disconnect(loader->conn);
+	pthread_cond_destroy(&(loader->cond));
+	pthread_mutex_destroy(&(loader->lock));
+
+	if (cookie->epfd >= 0)
+		close(cookie->epfd);
+	if (cookie->wakeup >= 0)
+		close(cookie->wakeup);
+
+	/* Grabbed devices don't have to be ungrabbed, as this will be done
+	 * automatically when closing the connection. */
+	free(cookie->queued);
+	free_keymaps(&(cookie->keymaps), &(cookie->keymaps_num));
+	free(cookie->pending);
+	if (cookie->xkb != NULL)
+		xkb_context_unref(cookie->xkb);
+	if (cookie->conn != NULL)
+		xcb_disconnect(cookie->conn);
+
+	if (cookie->match_devices != NULL) {
+		for (int i = 0; i < cookie->match_devices_num; i++)
+			free(cookie->match_devices[i]);
+		free(cookie->match_devices);
+	}
+
+	free(cookie->code);
+	free(cookie);
+
+	return 0;
+}
@@ -0,0 +1,151 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Multi-pattern substring matching.
+ *
+ * \details The patterns will be inserted into a trie, which will then be
+ *  converted into a deterministic automaton by following the failure links of
+ *  the Aho-Corasick algorithm. Each character of a device name needs a single
+ *  table lookup, no matter how many patterns are configured.
+ */
+
+#include "match.h"
+
+#include <stdlib.h> // calloc, free, malloc
+#include <string.h> // memset, strlen
+
+
+/** \brief Compile \p patterns into \p m.
+ *
+ *
+ * \param m The matcher to initialize.
+ * \param patterns The patterns to match. None of them may be empty.
+ * \param num Number of \p patterns.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+bool
+match_compile(struct match *m, char *const *patterns, int num)
+{
+	/* The trie has at most one state per character of all patterns and the
+	 * root state. */
+	size_t max = 1;
+	for (int i = 0; i < num; i++)
+		max += strlen(patterns[i]);
+
+	m->next = malloc(max * sizeof(*(m->next)));
+	m->accept = calloc(max, sizeof(bool));
+	int *fail = calloc(max, sizeof(int));
+	int *queue = malloc(max * sizeof(int));
+	if (m->next == NULL || m->accept == NULL || fail == NULL ||
+	    queue == NULL) {
+		free(fail);
+		free(queue);
+		match_free(m);
+		return false;
+	}
+	memset(m->next, -1, max * sizeof(*(m->next)));
+	m->states = 1;
+
+	/* Insert all patterns into the trie. Missing transitions are marked by
+	 * -1 and will be resolved below. */
+	for (int i = 0; i < num; i++) {
+		int state = 0;
+		for (const unsigned char *p = (const unsigned char *)patterns[i]; *p;
+		     p++) {
+			if (m->next[state][*p] < 0)
+				m->next[state][*p] = m->states++;
+			state = m->next[state][*p];
+		}
+		m->accept[state] = true;
+	}
+
+	/* Resolve the missing transitions in breadth-first order. A missing
+	 * transition of a state is the transition of its failure state, which is
+	 * closer to the root and therefore resolved already. A state accepts, if
+	 * its failure state accepts, as a pattern ends in its suffix. */
+	size_t head = 0, tail = 0;
+	for (int c = 0; c < 256; c++) {
+		int child = m->next[0][c];
+		if (child < 0)
+			m->next[0][c] = 0;
+		else {
+			fail[child] = 0;
+			queue[tail++] = child;
+		}
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		for (int c = 0; c < 256; c++) {
+			int child = m->next[state][c];
+			if (child < 0)
+				m->next[state][c] = m->next[fail[state]][c];
+			else {
+				fail[child] = m->next[fail[state]][c];
+				m->accept[child] |= m->accept[fail[child]];
+				queue[tail++] = child;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return true;
+}
+
+
+/** \brief Check whether \p s contains any pattern of \p m.
+ *
+ *
+ * \param m The compiled matcher.
+ * \param s The string to check.
+ *
+ * \return If any pattern is a substring of \p s true will be returned,
+ *  otherwise false.
+ */
+bool
+match_find(const struct match *m, const char *s)
+{
+	int state = 0;
+	for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+		state = m->next[state][*p];
+		if (m->accept[state])
+			return true;
+	}
+	return false;
+}
+
+
+/** \brief Free the memory allocated by \ref match_compile.
+ *
+ *
+ * \param m The matcher.
+ */
+void
+match_free(struct match *m)
+{
+	free(m->next);
+	free(m->accept);
+	m->next = NULL;
+	m->accept = NULL;
+	m->states = 0;
+}
@@ -0,0 +1,48 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_XINPUT2_MATCH_H
+#define CODEREADER_XINPUT2_MATCH_H
+
+
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+
+/** \brief Matcher for a set of substrings.
+ *
+ * \details The patterns will be compiled into a single automaton (Aho-
+ *  Corasick), so checking a string for all patterns needs a single pass over
+ *  the string, independent of the number of patterns.
+ */
+struct match
+{
+	int (*next)[256]; ///< Transitions of all states.
+	bool *accept;     ///< Whether a pattern ends in the state.
+	size_t states;    ///< Number of states.
+};
+
+
+bool match_compile(struct match *m, char *const *patterns, int num);
+bool match_find(const struct match *m, const char *s);
+void match_free(struct match *m);
+
+
+#endif
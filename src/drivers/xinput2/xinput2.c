@@ -32,28 +32,65 @@
 
 #include <assert.h>  // assert
 #include <stdbool.h> // bool, true, false
-#include <stdlib.h>  // free, malloc
-#include <string.h>  // memset, strdup
+#include <stdint.h>  // uint32_t
+#include <stdlib.h>  // free, malloc, realloc
+#include <string.h>  // memset
+#include <time.h>    // clock_gettime
 
 #include <X11/XKBlib.h>             // X11 xkb extension API
 #include <X11/Xlib.h>               // X11 API
+#include <X11/Xlibint.h>            // XESetError
 #include <X11/extensions/XInput2.h> // X11 xinput2 extension API
 #include <libconfig.h>              // libconfig API
 
+#include "match.h"  // match_*
+#include "probes.h" // CODEREADER_PROBE*
+
 
 /** \brief Prefix for error messages of this driver.
  */
 #define MESSAGE_PREFIX "[codereader-xinput2] "
 
 
+/** \brief Mark this driver as blocking.
+ *
+ * \details Reading a barcode requires synchronous round trips to the X-server,
+ *  so libcodereader will read devices of this driver in a worker thread by
+ *  default, which doesn't delay other devices.
+ */
+const int device_blocking = 1;
+
+
 /** \brief Storage for driver related information.
  */
 struct codereader_xinput2_cookie
 {
 	Display *display; ///< Pointer to the struct for the X-server connection.
 	int xi_opcode;    ///< Major opcode of X11 XI extension.
-	char **match_devices;  ///< Which device names to match.
-	int match_devices_num; ///< Number of entries in \ref match_devices.
+	struct match match;  ///< Matcher for the device names to grab.
+
+	/** \brief Event mask used for grabbing devices.
+	 */
+	unsigned char grab_mask[XIMaskLen(XI_KeyPress)];
+
+	/** \brief Devices grabbed by this driver.
+	 *
+	 * \details Only devices added by a hierarchy change need to be checked,
+	 *  so devices grabbed already will be skipped.
+	 */
+	int *grabbed;
+	int grabbed_num;  ///< Number of devices in \ref grabbed.
+	int grabbed_size; ///< Size of \ref grabbed.
+
+	/** \brief Times of the first and last key event of the current scan.
+	 *
+	 * \details The X-server's time is in ms and has an unknown base, so only
+	 *  the difference of these times will be used to get the time of the first
+	 *  key event relative to \ref done.
+	 */
+	Time first, last;
+	bool started;         ///< Whether \ref first has been set for this scan.
+	struct timespec done; ///< Time the last key event has been read.
 };
 
 
@@ -113,122 +150,231 @@ read_config(const config_setting_t *config,
 		return false;
 	}
 
-	/* Allocate memory to store all data of the match-array in a C-array. This
-	 * has to be done, as the parsed config structure will be destroyed after
-	 * all devices have been opened, but we'd like to grab new devices, when
-	 * they are connected. */
-	cookie->match_devices_num = config_setting_length(matches);
-	if (cookie->match_devices_num == 0) {
+	/* The patterns will be compiled into a single matcher, so checking the
+	 * name of a new device needs a single pass over its name, no matter how
+	 * many patterns are configured. */
+	int num = config_setting_length(matches);
+	if (num == 0) {
 		fprintf(stderr, MESSAGE_PREFIX
 		        "Config option 'match' needs to be a non-empty array.\n");
 		return false;
 	}
 
-	cookie->match_devices = malloc(cookie->match_devices_num * sizeof(char *));
-	if (cookie->match_devices == NULL) {
+	const char **patterns = malloc(num * sizeof(char *));
+	if (patterns == NULL) {
 		fprintf(stderr,
 		        MESSAGE_PREFIX "Failed to allocate memory for match-array.\n");
 		return false;
 	}
-	memset(cookie->match_devices, 0,
-	       sizeof(char *) * cookie->match_devices_num);
-
-	/* Duplicate the entries of the matches in the configuration and store the
-	 * copy in the internal data storage cookie, so it can be accessed at any
-	 * later time. */
-	for (int i = 0; i < cookie->match_devices_num; i++) {
-		const char *p = config_setting_get_string_elem(matches, i);
-		if (p[0] == '\0') {
+	for (int i = 0; i < num; i++) {
+		patterns[i] = config_setting_get_string_elem(matches, i);
+		if (patterns[i] == NULL || patterns[i][0] == '\0') {
 			fprintf(stderr,
 			        MESSAGE_PREFIX "Match-entry %d must not be empty.\n", i);
+			free(patterns);
 			return false;
 		}
-		if ((cookie->match_devices[i] = strdup(p)) == NULL) {
-			fprintf(stderr, MESSAGE_PREFIX "Failed to copy match-entry.\n");
+	}
+
+	bool ret = match_compile(&(cookie->match), (char *const *)patterns, num);
+	if (!ret)
+		fprintf(stderr, MESSAGE_PREFIX "Failed to compile match-array.\n");
+	free(patterns);
+	return ret;
+}
+
+
+/** \brief Where \ref trap_error stores the code of a trapped X error.
+ *
+ * \details Errors will only be trapped while this is not NULL. Each display
+ *  is used by a single thread only, so this is thread-local instead of being
+ *  stored per display.
+ */
+static __thread int *trapped_error = NULL;
+
+
+/** \brief Error hook recording errors instead of terminating the process.
+ *
+ * \details The default error handler of Xlib terminates the process. This hook
+ *  will be registered for the display in \ref device_open, so it will be
+ *  called for errors of this display only, before the global error handler of
+ *  the process. While grabbing devices added at runtime, errors will be
+ *  trapped, as these devices might have vanished already, which results in a
+ *  `BadDevice` error. Otherwise the error will be passed to the global
+ *  handler.
+ *
+ *
+ * \return If the error has been trapped true will be returned, otherwise
+ *  false.
+ */
+static int
+trap_error(Display *display, xError *error, XExtCodes *codes, int *ret)
+{
+	if (trapped_error == NULL)
+		return False;
+
+	*trapped_error = error->errorCode;
+	*ret = 0;
+	return True;
+}
+
+
+/** \brief Check whether device \p id has been grabbed by this driver.
+ */
+static int
+grabbed_find(const struct codereader_xinput2_cookie *cookie, int id)
+{
+	for (int i = 0; i < cookie->grabbed_num; i++)
+		if (cookie->grabbed[i] == id)
+			return i;
+	return -1;
+}
+
+
+/** \brief Grab the device \p info, if its name matches the configuration.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param info The device to check.
+ *
+ * \return If the device has been grabbed, or doesn't need to be grabbed, true
+ *  will be returned. If grabbing the device failed, false will be returned.
+ */
+static bool
+grab_device(struct codereader_xinput2_cookie *cookie, XIDeviceInfo *info)
+{
+	/* We're only interested in keyboards. Other pointing devices like mice
+	 * can savely be ignored. This will ignore already grabbed devices, too,
+	 * as these have the type 'XIFloatingSlave'. */
+	if (info->use != XIMasterKeyboard && info->use != XISlaveKeyboard)
+		return true;
+	if (grabbed_find(cookie, info->deviceid) >= 0 ||
+	    !match_find(&(cookie->match), info->name))
+		return true;
+
+	if (cookie->grabbed_num == cookie->grabbed_size) {
+		int size = (cookie->grabbed_size > 0) ? 2 * cookie->grabbed_size : 8;
+		int *p = realloc(cookie->grabbed, size * sizeof(int));
+		if (p == NULL) {
+			fprintf(stderr, MESSAGE_PREFIX
+			        "Failed to allocate memory for device list.\n");
 			return false;
 		}
+		cookie->grabbed = p;
+		cookie->grabbed_size = size;
 	}
 
+	/* Try to grab the device. If grabbing the device fails, an error message
+	 * will be printed and an error code returned. */
+	XIEventMask mask = {.deviceid = XIAllDevices,
+	                    .mask_len = sizeof(cookie->grab_mask),
+	                    .mask = cookie->grab_mask};
+	if (XIGrabDevice(cookie->display, info->deviceid,
+	                 DefaultRootWindow(cookie->display), CurrentTime, None,
+	                 GrabModeAsync, GrabModeAsync, False,
+	                 &mask) != GrabSuccess) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to grab device '%s'.\n",
+		        info->name);
+		return false;
+	}
+	cookie->grabbed[cookie->grabbed_num++] = info->deviceid;
+
 	return true;
 }
 
 
 /** \brief Grab all matching devices.
  *
- * \details This function will check the list of devices of the current X-server
- *  session and grabs all devices with a name matching the match-list of the
- *  loaded configuration.
+ * \details This function will query the device \p id (or all devices of the
+ *  current X-server session for `XIAllDevices`) and grabs all devices with a
+ *  name matching the match-list of the loaded configuration.
  *
  *
  * \param cookie Pointer to device data storage.
+ * \param id The device to query or `XIAllDevices`.
  *
  * \return If grabbing all devices was successful, true will be returned,
  *  otherwise false.
  */
 static bool
-grab_devices(struct codereader_xinput2_cookie *cookie)
+grab_devices(struct codereader_xinput2_cookie *cookie, int id)
 {
-	/* Get a list of all devices connected in the current X-session. If the list
-	 * can't be obtained, an error message will be printed and an error
-	 * returned. */
+	/* Get the list of devices. If the list can't be obtained, an error message
+	 * will be printed and an error returned. */
 	int num_devices;
-	XIDeviceInfo *devices =
-	    XIQueryDevice(cookie->display, XIAllDevices, &num_devices);
+	XIDeviceInfo *devices = XIQueryDevice(cookie->display, id, &num_devices);
 	if (devices == NULL) {
 		fprintf(stderr, MESSAGE_PREFIX "Failed to get device list.\n");
 		return false;
 	}
 
-	/* Create a new device mask to be used for grabbing devies later. */
-	XIEventMask mask = {.deviceid = XIAllDevices,
-	                    .mask_len = XIMaskLen(XI_KeyPress)};
-	mask.mask = calloc(mask.mask_len, sizeof(char));
-	if (mask.mask == NULL) {
-		fprintf(stderr, MESSAGE_PREFIX
-		        "Failed to allocate memory for device event mask.\n");
-		goto free_devices;
-	}
-	XISetMask(mask.mask, XI_KeyPress);
-
-
-	/* Iterate over the list of devices. If the name of a device includes one of
-	 * the matching strings, the device will be assumed to be a codereader and
-	 * will tried to be grabbed. */
-	for (int i = 0; i < num_devices; i++) {
-		/* We're only interested in keyboards. Other pointing devices like mice
-		 * can savely be ignored. This will ignore already grabbed devices, too,
-		 * as these have the type 'XIFloatingSlave'. */
-		if (devices[i].use != XIMasterKeyboard &&
-		    devices[i].use != XISlaveKeyboard)
-			continue;
-
-		for (int j = 0; j < cookie->match_devices_num; j++)
-			if (strstr(devices[i].name, cookie->match_devices[j]) != NULL)
-				/* Try to grab the device. There is no check needed, if the
-				 * device is already grabbed, as XIGrabDevice will simply ignore
-				 * it in this case. If grabbing the device fails, an error
-				 * message will be printed and an error code returned. */
-				if (XIGrabDevice(cookie->display, devices[i].deviceid,
-				                 DefaultRootWindow(cookie->display),
-				                 CurrentTime, None, GrabModeAsync,
-				                 GrabModeAsync, False, &mask) != GrabSuccess) {
-					fprintf(stderr,
-					        MESSAGE_PREFIX "Failed to grab device '%s'.\n",
-					        devices[i].name);
-					goto free_mask;
-				}
-	}
-	free(mask.mask);
+	bool ret = true;
+	for (int i = 0; ret && i < num_devices; i++)
+		ret = grab_device(cookie, &(devices[i]));
 	XIFreeDeviceInfo(devices);
 
-	return true;
+	return ret;
+}
 
 
-free_mask:
-	free(mask.mask);
-free_devices:
-	XIFreeDeviceInfo(devices);
-	return false;
+/** \brief Update the grabbed devices after a hierarchy change.
+ *
+ * \details Only devices added or enabled by the change will be queried and
+ *  checked for grabbing. Removed or disabled devices will be dropped from the
+ *  list of grabbed devices. Devices, which vanished before they could be
+ *  grabbed, will be skipped.
+ *
+ *
+ * \param cookie Pointer to device data storage.
+ * \param event The hierarchy event.
+ *
+ * \return If grabbing all new devices was successful, true will be returned,
+ *  otherwise false.
+ */
+static bool
+update_devices(struct codereader_xinput2_cookie *cookie,
+               const XIHierarchyEvent *event)
+{
+	const int added = XIMasterAdded | XISlaveAdded | XIDeviceEnabled;
+	const int removed = XIMasterRemoved | XISlaveRemoved | XIDeviceDisabled;
+	if (!(event->flags & (added | removed)))
+		return true;
+
+	for (int i = 0; i < event->num_info; i++) {
+		const XIHierarchyInfo *info = &(event->info[i]);
+		int index = grabbed_find(cookie, info->deviceid);
+
+		if (info->flags & removed) {
+			if (index >= 0)
+				cookie->grabbed[index] =
+				    cookie->grabbed[--(cookie->grabbed_num)];
+		} else if ((info->flags & added) && index < 0 &&
+		           (info->use == XIMasterKeyboard ||
+		            info->use == XISlaveKeyboard)) {
+			/* The device may have been removed again since the event has been
+			 * sent. Errors will be trapped while grabbing it, so the requests
+			 * sent before have to be processed first and the ones sent for
+			 * grabbing must be processed before errors aren't trapped
+			 * anymore. */
+			int error = Success;
+			XSync(cookie->display, False);
+			trapped_error = &error;
+			bool ok = grab_devices(cookie, info->deviceid);
+			XSync(cookie->display, False);
+			trapped_error = NULL;
+
+			if (error != Success) {
+				fprintf(stderr, MESSAGE_PREFIX "Device %d vanished before it "
+				                               "could be grabbed.\n",
+				        info->deviceid);
+				continue;
+			}
+			if (!ok)
+				return false;
+		}
+	}
+
+	return true;
 }
 
 
@@ -270,6 +416,16 @@ device_open(const config_setting_t *config,
 	if (!check_x_extensions(*cookie))
 		return -1;
 
+	/* Errors of devices vanishing while being grabbed will be trapped by a
+	 * hook of this display, so the global error handler of the process doesn't
+	 * need to be changed. */
+	XExtCodes *codes = XAddExtension((*cookie)->display);
+	if (codes == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Failed to register error hook.\n");
+		return -1;
+	}
+	XESetError((*cookie)->display, codes->extension, trap_error);
+
 	/* Register hierarchy changed events, which will be triggered, if a device
 	 * is con- or deconnected. They will be used to grab new devices, after the
 	 * initial open call has been done. */
@@ -290,7 +446,9 @@ device_open(const config_setting_t *config,
 	 * matching the matches array in the config. If an error occures in one of
 	 * the calls, an error will be returned, but no extra error message printed,
 	 * as the functions did already. */
-	if (!read_config(config, *cookie) || !grab_devices(*cookie))
+	XISetMask((*cookie)->grab_mask, XI_KeyPress);
+	if (!read_config(config, *cookie) ||
+	    !grab_devices(*cookie, XIAllDevices))
 		return -1;
 
 	/* Flush all actions to the X11 server. This is required, as this will be
@@ -315,7 +473,9 @@ device_open(const config_setting_t *config,
  * \param cookie Pointer to the driver's data storage.
  *
  * \return On success the number of read bytes will be returned, if the event
- *  was ignored zero and on errors -1.
+ *  was ignored zero and on errors -1. If \p buffer is full before the end of
+ *  the code, \p size will be returned and the rest of the code will be read
+ *  by the next call.
  */
 int
 device_read(int fd, char *buffer, int size,
@@ -330,6 +490,12 @@ device_read(int fd, char *buffer, int size,
 	XEvent ev;
 	int num_read = 0;
 	while (true) {
+		/* If the buffer is full, return before processing the next event, so
+		 * no character gets lost. libcodereader will call this function again
+		 * with a larger buffer to read the rest of the code. */
+		if (num_read == size)
+			return num_read;
+
 		XGenericEventCookie *event = &ev.xcookie;
 		XNextEvent(cookie->display, &ev);
 
@@ -348,12 +514,13 @@ device_read(int fd, char *buffer, int size,
 		}
 
 		switch (event->evtype) {
-			/* If the hierarchy changed, check the device list for new devices
-			 * and try to grab them. If this fails, return an error, otherwise
-			 * tell libcodereader that this event was not a read code. */
-			case XI_HierarchyChanged:
+			/* If the hierarchy changed, check the added devices and try to grab
+			 * them. If this fails, return an error, otherwise tell
+			 * libcodereader that this event was not a read code. */
+			case XI_HierarchyChanged: {
+				bool ok = update_devices(cookie, event->data);
 				XFreeEventData(cookie->display, event);
-				if (grab_devices(cookie)) {
+				if (ok) {
 					/* If recent events have been parsed yet and the code is not
 					 * full read, just skip this event but don't return. */
 					if (num_read > 0)
@@ -362,6 +529,7 @@ device_read(int fd, char *buffer, int size,
 						return 0;
 				} else
 					return -1;
+			}
 
 			/* If a key was pressed, parse the key event. If a key has been
 			 * composed, add this key to the buffer and process the next event,
@@ -369,6 +537,12 @@ device_read(int fd, char *buffer, int size,
 			case XI_KeyPress: {
 				/* Get the keyboard layout for this barcode reader. */
 				XIDeviceEvent *kev = event->data;
+				if (!cookie->started) {
+					CODEREADER_PROBE1(scan__first__key, kev->deviceid);
+					cookie->first = kev->time;
+					cookie->started = true;
+				}
+				cookie->last = kev->time;
 				XkbDescPtr kbd = XkbGetKeyboard(
 				    cookie->display, XkbAllComponentsMask, kev->deviceid);
 
@@ -377,25 +551,28 @@ device_read(int fd, char *buffer, int size,
 				 * filled into the buffer. */
 				KeySym keysym;
 				bool end_of_code = false;
+				int n;
 				if (XkbTranslateKeyCode(kbd, kev->detail, kev->mods.effective,
-				                        NULL, &keysym))
-					if (XkbTranslateKeySym(
-					        cookie->display, &keysym, kev->mods.effective,
-					        buffer + num_read, size - num_read, NULL) > 0) {
-						/* If the end of the code is detected, set the last byte
-						 * to a newline and add an extra terminating null-
-						 * character. */
-						if (buffer[num_read] == '\r') {
-							buffer[num_read] = '\n';
-							end_of_code = true;
-						}
-						num_read++;
+				                        NULL, &keysym) &&
+				    (n = XkbTranslateKeySym(
+				         cookie->display, &keysym, kev->mods.effective,
+				         buffer + num_read, size - num_read, NULL)) > 0) {
+					/* If the end of the code is detected, replace the carriage
+					 * return by a newline. */
+					if (buffer[num_read] == '\r') {
+						buffer[num_read] = '\n';
+						end_of_code = true;
 					}
+					num_read += (n < size - num_read) ? n : size - num_read;
+				}
 				XkbFreeKeyboard(kbd, XkbAllComponentsMask, True);
 
 				/* If the end of code was detected, finish parsing the X-server
 				 * events and return the number of read bytes. */
 				if (end_of_code) {
+					CODEREADER_PROBE2(scan__last__key, kev->deviceid, num_read);
+					clock_gettime(CLOCK_MONOTONIC, &(cookie->done));
+					cookie->started = false;
 					XFreeEventData(cookie->display, event);
 					return num_read;
 				}
@@ -412,6 +589,38 @@ device_read(int fd, char *buffer, int size,
 }
 
 
+/** \brief Get the time the last scan happened.
+ *
+ * \details The time of the first key event of the scan will be calculated by
+ *  the time elapsed between the first and last key event of the scan, which
+ *  has been set by the X-server.
+ *
+ *
+ * \param fd File descriptor of the X-server connection (ignored).
+ * \param time Where to store the time of the scan.
+ * \param cookie Pointer to the driver's data storage.
+ *
+ * \return This function always returns zero.
+ */
+int
+device_timestamp(int fd, struct timespec *time,
+                 struct codereader_xinput2_cookie *cookie)
+{
+	/* The X-server's time wraps around after about 49 days, which will be
+	 * handled by the unsigned subtraction. */
+	unsigned long ms = (uint32_t)(cookie->last - cookie->first);
+
+	*time = cookie->done;
+	time->tv_sec -= ms / 1000;
+	time->tv_nsec -= (long)(ms % 1000) * 1000000L;
+	if (time->tv_nsec < 0) {
+		time->tv_sec--;
+		time->tv_nsec += 1000000000L;
+	}
+	return 0;
+}
+
+
 /** \brief Close the connection to the X-server and free allocated memory.
  *
  *
@@ -434,13 +643,9 @@ device_close(int fd, struct codereader_xinput2_cookie *cookie)
 	if (cookie->display != NULL)
 		XCloseDisplay(cookie->display);
 
-	/* If the cookie contains a list of devices to match, free this list. */
-	if (cookie->match_devices != NULL) {
-		for (int i = 0; i < cookie->match_devices_num; i++)
-			if (cookie->match_devices[i] != NULL)
-				free(cookie->match_devices[i]);
-		free(cookie->match_devices);
-	}
+	/* Free the matcher and the list of grabbed devices. */
+	match_free(&(cookie->match));
+	free(cookie->grabbed);
 
 	/* Free the whole cookie. */
 	free(cookie);
@@ -0,0 +1,165 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Filter selecting scans by a regular expression.
+ *
+ * \details Scans not matching the POSIX extended regular expression will be
+ *  dropped (or, if inverted, scans matching it). If a group is configured, the
+ *  scan will be replaced by the text matched by this group, so fields may be
+ *  extracted from the scan.
+ */
+
+#include <regex.h>   // regcomp, regexec, regfree
+#include <stdbool.h> // bool
+#include <stdio.h>   // fprintf
+#include <stdlib.h>  // calloc, free
+#include <string.h>  // memmove
+
+#include <libconfig.h> // libconfig API
+
+
+/** \brief Prefix for error messages of this filter.
+ */
+#define MESSAGE_PREFIX "[codereader-regex] "
+
+/** \brief Maximum number of groups supported.
+ */
+#define MAX_GROUPS 10
+
+
+/** \brief Storage for filter related information.
+ */
+struct regex_cookie
+{
+	regex_t regex; ///< The compiled regular expression.
+	bool compiled; ///< Whether \ref regex has been compiled.
+	int group;     ///< Group to extract or -1 to keep the whole scan.
+	int invert;    ///< Whether to drop matching scans instead.
+};
+
+
+/** \brief Open a new instance of this filter.
+ *
+ *
+ * \param config The parsed configuration for this filter instance.
+ * \param cookie Pointer to instance data storage.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+filter_open(const config_setting_t *config, void **cookie)
+{
+	struct regex_cookie *c = calloc(1, sizeof(struct regex_cookie));
+	if (c == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Not enough memory for cookie.\n");
+		return -1;
+	}
+	*cookie = c;
+
+	const char *pattern;
+	if (config_setting_lookup_string(config, "pattern", &pattern) !=
+	    CONFIG_TRUE) {
+		fprintf(stderr, MESSAGE_PREFIX "No pattern specified.\n");
+		return -1;
+	}
+
+	c->group = -1;
+	config_setting_lookup_int(config, "group", &(c->group));
+	config_setting_lookup_bool(config, "invert", &(c->invert));
+	if (c->group >= MAX_GROUPS || (c->group >= 0 && c->invert)) {
+		fprintf(stderr, MESSAGE_PREFIX "Invalid group %d.\n", c->group);
+		return -1;
+	}
+
+	int flags = REG_EXTENDED | ((c->group < 0) ? REG_NOSUB : 0);
+	int ret = regcomp(&(c->regex), pattern, flags);
+	if (ret != 0) {
+		char buffer[256];
+		regerror(ret, &(c->regex), buffer, sizeof(buffer));
+		fprintf(stderr, MESSAGE_PREFIX "Invalid pattern '%s': %s\n", pattern,
+		        buffer);
+		return -1;
+	}
+	c->compiled = true;
+
+	return 0;
+}
+
+
+/** \brief Match a scan against the regular expression.
+ *
+ *
+ * \param buffer The scan.
+ * \param length Length of the scan in \p buffer.
+ * \param size Size of \p buffer.
+ * \param cookie Pointer to instance data storage.
+ *
+ * \return The new length of the scan or zero, if the scan has been dropped.
+ *  If the scan can't be terminated for matching, -1 will be returned.
+ */
+int
+filter_apply(char *buffer, int length, int size, void *cookie)
+{
+	struct regex_cookie *c = cookie;
+
+	/* regexec requires a terminated string. The terminator will be overwritten
+	 * by the line ending of the scan afterwards. */
+	if (length >= size)
+		return -1;
+	buffer[length] = '\0';
+
+	regmatch_t match[MAX_GROUPS];
+	bool matches = (regexec(&(c->regex), buffer, MAX_GROUPS, match, 0) == 0);
+	if (matches == (bool)c->invert)
+		return 0;
+	if (c->group < 0)
+		return length;
+
+	/* Replace the scan by the matched group. If the group didn't participate
+	 * in the match, the scan will be dropped. */
+	regmatch_t *m = &(match[c->group]);
+	if (m->rm_so < 0)
+		return 0;
+	memmove(buffer, buffer + m->rm_so, m->rm_eo - m->rm_so);
+	return m->rm_eo - m->rm_so;
+}
+
+
+/** \brief Close an instance of this filter.
+ *
+ *
+ * \param cookie Pointer to instance data storage.
+ *
+ * \return This function always returns zero.
+ */
+int
+filter_close(void *cookie)
+{
+	struct regex_cookie *c = cookie;
+	if (c != NULL) {
+		if (c->compiled)
+			regfree(&(c->regex));
+		free(c);
+	}
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Filter stripping a prefix and suffix from scans.
+ *
+ * \details Many barcode readers may be configured to add a prefix or suffix to
+ *  each scan, e.g. the AIM symbology identifier. This filter removes them, if
+ *  present. Scans without the prefix or suffix will be passed unchanged.
+ */
+
+#define _GNU_SOURCE // strdup
+
+
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // calloc, free
+#include <string.h> // memcmp, memmove, strdup, strlen
+
+#include <libconfig.h> // libconfig API
+
+
+/** \brief Prefix for error messages of this filter.
+ */
+#define MESSAGE_PREFIX "[codereader-strip] "
+
+
+/** \brief Storage for filter related information.
+ */
+struct strip_cookie
+{
+	char *prefix;      ///< Prefix to strip.
+	size_t prefix_len; ///< Length of \ref prefix.
+	char *suffix;      ///< Suffix to strip.
+	size_t suffix_len; ///< Length of \ref suffix.
+};
+
+
+/** \brief Open a new instance of this filter.
+ *
+ *
+ * \param config The parsed configuration for this filter instance.
+ * \param cookie Pointer to instance data storage.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+filter_open(const config_setting_t *config, void **cookie)
+{
+	struct strip_cookie *c = calloc(1, sizeof(struct strip_cookie));
+	if (c == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Not enough memory for cookie.\n");
+		return -1;
+	}
+	*cookie = c;
+
+	/* The configuration will be destroyed after opening all devices, so the
+	 * strings have to be copied. */
+	const char *prefix = "", *suffix = "";
+	config_setting_lookup_string(config, "prefix", &prefix);
+	config_setting_lookup_string(config, "suffix", &suffix);
+	if ((c->prefix = strdup(prefix)) == NULL ||
+	    (c->suffix = strdup(suffix)) == NULL) {
+		fprintf(stderr, MESSAGE_PREFIX "Not enough memory for config.\n");
+		return -1;
+	}
+	c->prefix_len = strlen(c->prefix);
+	c->suffix_len = strlen(c->suffix);
+
+	if (c->prefix_len == 0 && c->suffix_len == 0) {
+		fprintf(stderr, MESSAGE_PREFIX "Neither prefix nor suffix set.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/** \brief Strip the prefix and suffix of a scan.
+ *
+ *
+ * \param buffer The scan.
+ * \param length Length of the scan in \p buffer.
+ * \param size Size of \p buffer.
+ * \param cookie Pointer to instance data storage.
+ *
+ * \return The new length of the scan.
+ */
+int
+filter_apply(char *buffer, int length, int size, void *cookie)
+{
+	struct strip_cookie *c = cookie;
+	size_t n = length;
+
+	if (c->suffix_len > 0 && n >= c->suffix_len &&
+	    memcmp(buffer + n - c->suffix_len, c->suffix, c->suffix_len) == 0)
+		n -= c->suffix_len;
+
+	if (c->prefix_len > 0 && n >= c->prefix_len &&
+	    memcmp(buffer, c->prefix, c->prefix_len) == 0) {
+		n -= c->prefix_len;
+		memmove(buffer, buffer + c->prefix_len, n);
+	}
+
+	return n;
+}
+
+
+/** \brief Close an instance of this filter.
+ *
+ *
+ * \param cookie Pointer to instance data storage.
+ *
+ * \return This function always returns zero.
+ */
+int
+filter_close(void *cookie)
+{
+	struct strip_cookie *c = cookie;
+	if (c != NULL) {
+		free(c->prefix);
+		free(c->suffix);
+		free(c);
+	}
+
+	return 0;
+}
@@ -0,0 +1,349 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Building configurations in memory.
+ *
+ * \details Applications holding their configuration in memory may build the
+ *  configuration of their devices with these functions and open a handle with
+ *  \ref codereader_new_from, so neither a file nor the environment will be
+ *  read. Options will be addressed by the name of their group (a device or
+ *  `global`) and a path of nested groups separated by dots, e.g.
+ *  `dedup.window`. Missing groups will be created. Groups in lists, e.g. the
+ *  filters of a device, will be appended by \ref codereader_config_append_group
+ *  and addressed by their index in brackets like in paths of libconfig, e.g.
+ *  `filters.[0].name`.
+ */
+
+/* The following define is required for strdup and strtok_r. */
+#define _GNU_SOURCE
+
+
+#include "codereader.h" // codereader API declaration
+
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // free, malloc, strtol
+#include <string.h> // strcmp, strdup, strtok_r
+
+#include <libconfig.h> // libconfig API
+
+#include "handle.h"   // codereader_config
+#include "internal.h" // CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Create a new, empty configuration.
+ *
+ * \details Devices and their options may be added to the configuration by
+ *  \ref codereader_config_add_device and the `codereader_config_set_*`
+ *  functions.
+ *
+ *
+ * \return Pointer to the new configuration.
+ * \return NULL An error occured.
+ */
+struct codereader_config *
+codereader_config_new()
+{
+	struct codereader_config *config = malloc(sizeof(struct codereader_config));
+	if (config == NULL) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Not enough memory for configuration.\n");
+		return NULL;
+	}
+	config_init(&(config->cfg));
+
+	return config;
+}
+
+
+/** \brief Free the configuration \p config.
+ *
+ * \note Configurations passed to \ref codereader_new_from are owned by the
+ *  handle and must not be freed by the application.
+ *
+ *
+ * \param config The configuration to free.
+ */
+void
+codereader_config_free(struct codereader_config *config)
+{
+	config_destroy(&(config->cfg));
+	free(config);
+}
+
+
+/** \brief Get the member \p name of \p parent.
+ *
+ * \details If the member doesn't exist yet, it will be created with \p type.
+ *
+ *
+ * \param parent The group to get the member of.
+ * \param name Name of the member.
+ * \param type Type of the member.
+ *
+ * \return Pointer to the member or NULL, if the member has a different type
+ *  or can't be created.
+ */
+static config_setting_t *
+codereader_config_member(config_setting_t *parent, const char *name, int type)
+{
+	config_setting_t *member = NULL;
+	if (config_setting_is_group(parent)) {
+		member = config_setting_get_member(parent, name);
+		if (member == NULL)
+			member = config_setting_add(parent, name, type);
+		else if (config_setting_type(member) != type)
+			member = NULL;
+	}
+
+	if (member == NULL)
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option '%s' can't be set or has a different type.\n",
+		        name);
+	return member;
+}
+
+
+/** \brief Get the element \p name of the list \p parent.
+ *
+ * \details Unlike groups, elements of lists will not be created, but must have
+ *  been appended by \ref codereader_config_append_group before.
+ *
+ *
+ * \param parent The list to get the element of.
+ * \param name Index of the element in brackets, e.g. `[0]`.
+ * \param type Type of the element.
+ *
+ * \return Pointer to the element or NULL, if the element doesn't exist or has
+ *  a different type.
+ */
+static config_setting_t *
+codereader_config_element(config_setting_t *parent, const char *name, int type)
+{
+	char *end;
+	long index = strtol(name + 1, &end, 10);
+	config_setting_t *element = NULL;
+	if (config_setting_is_list(parent) && end != name + 1 &&
+	    strcmp(end, "]") == 0 && index >= 0)
+		element = config_setting_get_elem(parent, index);
+	if (element != NULL && config_setting_type(element) != type)
+		element = NULL;
+
+	if (element == NULL)
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Element '%s' doesn't exist or has a different type.\n",
+		        name);
+	return element;
+}
+
+
+/** \brief Get the option \p path of \p group.
+ *
+ * \details The option and all groups on its path will be created, if they
+ *  don't exist yet. Components of \p path in brackets address the elements of
+ *  lists by their index.
+ *
+ *
+ * \param config The configuration.
+ * \param group Name of the device or `global`.
+ * \param path Dot separated path of the option in \p group.
+ * \param type Type of the option.
+ *
+ * \return Pointer to the option or NULL, if an error occured.
+ */
+static config_setting_t *
+codereader_config_option(struct codereader_config *config, const char *group,
+                         const char *path, int type)
+{
+	config_setting_t *setting = codereader_config_member(
+	    config_root_setting(&(config->cfg)), group, CONFIG_TYPE_GROUP);
+	if (setting == NULL)
+		return NULL;
+
+	char *buffer = strdup(path);
+	if (buffer == NULL) {
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Not enough memory for option.\n");
+		return NULL;
+	}
+
+	/* All components of the path except the last one are groups. */
+	char *save;
+	char *name = strtok_r(buffer, ".", &save);
+	while (setting != NULL && name != NULL) {
+		char *next = strtok_r(NULL, ".", &save);
+		int t = (next != NULL) ? CONFIG_TYPE_GROUP : type;
+		setting = (name[0] == '[')
+		              ? codereader_config_element(setting, name, t)
+		              : codereader_config_member(setting, name, t);
+		name = next;
+	}
+
+	free(buffer);
+	return setting;
+}
+
+
+/** \brief Add the device \p name using \p driver to \p config.
+ *
+ *
+ * \param config The configuration.
+ * \param name Name of the device.
+ * \param driver Name of the driver to use for the device.
+ *
+ * \return 0 The device has been added.
+ * \return -1 An error occured, e.g. the device exists already.
+ */
+int
+codereader_config_add_device(struct codereader_config *config,
+                             const char *name, const char *driver)
+{
+	config_setting_t *root = config_root_setting(&(config->cfg));
+	if (config_setting_get_member(root, name) != NULL) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Device %s has been added already.\n",
+		        name);
+		return -1;
+	}
+
+	return codereader_config_set_string(config, name, "driver", driver);
+}
+
+
+/** \brief Set the string option \p path of \p group to \p value.
+ *
+ *
+ * \param config The configuration.
+ * \param group Name of the device or `global`.
+ * \param path Dot separated path of the option in \p group.
+ * \param value The value to set.
+ *
+ * \return 0 The option has been set.
+ * \return -1 An error occured.
+ */
+int
+codereader_config_set_string(struct codereader_config *config,
+                             const char *group, const char *path,
+                             const char *value)
+{
+	config_setting_t *setting =
+	    codereader_config_option(config, group, path, CONFIG_TYPE_STRING);
+	if (setting == NULL || !config_setting_set_string(setting, value))
+		return -1;
+	return 0;
+}
+
+
+/** \brief Set the integer option \p path of \p group to \p value.
+ *
+ * \details See \ref codereader_config_set_string for details.
+ */
+int
+codereader_config_set_int(struct codereader_config *config, const char *group,
+                          const char *path, int value)
+{
+	config_setting_t *setting =
+	    codereader_config_option(config, group, path, CONFIG_TYPE_INT);
+	if (setting == NULL || !config_setting_set_int(setting, value))
+		return -1;
+	return 0;
+}
+
+
+/** \brief Set the boolean option \p path of \p group to \p value.
+ *
+ * \details See \ref codereader_config_set_string for details.
+ */
+int
+codereader_config_set_bool(struct codereader_config *config, const char *group,
+                           const char *path, int value)
+{
+	config_setting_t *setting =
+	    codereader_config_option(config, group, path, CONFIG_TYPE_BOOL);
+	if (setting == NULL || !config_setting_set_bool(setting, value))
+		return -1;
+	return 0;
+}
+
+
+/** \brief Append \p value to the string array \p path of \p group.
+ *
+ * \details The array will be created, if it doesn't exist yet. See
+ *  \ref codereader_config_set_string for details.
+ */
+int
+codereader_config_append_string(struct codereader_config *config,
+                                const char *group, const char *path,
+                                const char *value)
+{
+	config_setting_t *setting =
+	    codereader_config_option(config, group, path, CONFIG_TYPE_ARRAY);
+	if (setting == NULL ||
+	    config_setting_set_string_elem(setting, -1, value) == NULL)
+		return -1;
+	return 0;
+}
+
+
+/** \brief Append \p value to the integer array \p path of \p group.
+ *
+ * \details The array will be created, if it doesn't exist yet. See
+ *  \ref codereader_config_set_string for details.
+ */
+int
+codereader_config_append_int(struct codereader_config *config,
+                             const char *group, const char *path, int value)
+{
+	config_setting_t *setting =
+	    codereader_config_option(config, group, path, CONFIG_TYPE_ARRAY);
+	if (setting == NULL ||
+	    config_setting_set_int_elem(setting, -1, value) == NULL)
+		return -1;
+	return 0;
+}
+
+
+/** \brief Append a new group to the list \p path of \p group.
+ *
+ * \details The list will be created, if it doesn't exist yet. The options of
+ *  the new group may be set by addressing it by its index, e.g. the name of the
+ *  first filter of a device by `filters.[0].name`. See
+ *  \ref codereader_config_set_string for details.
+ *
+ *
+ * \param config The configuration.
+ * \param group Name of the device or `global`.
+ * \param path Dot separated path of the list in \p group.
+ *
+ * \return The index of the new group in the list.
+ * \return -1 An error occured.
+ */
+int
+codereader_config_append_group(struct codereader_config *config,
+                               const char *group, const char *path)
+{
+	config_setting_t *setting =
+	    codereader_config_option(config, group, path, CONFIG_TYPE_LIST);
+	if (setting == NULL ||
+	    config_setting_add(setting, NULL, CONFIG_TYPE_GROUP) == NULL)
+		return -1;
+	return config_setting_length(setting) - 1;
+}
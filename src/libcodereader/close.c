@@ -18,34 +18,40 @@
  *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
  */
 
-#include <dlfcn.h>  // dlclose
-#include <stdlib.h> // free
+#include "codereader.h" // codereader API declaration
+
+#include <dlfcn.h>    // dlclose
+#include <stdlib.h>   // free
+#include <sys/mman.h> // munlock
+#include <unistd.h>   // close
 
 #include "device.h"   // codereader_device*
+#include "handle.h"   // codereader_handle, codereader_worker_stop
 #include "internal.h" // CODEREADER_INTERNAL, CODEREADER_SANITIZE_ADDRESS
+#include "probes.h"   // CODEREADER_PROBE*
 
 
-/** \brief Close the codereader stream.
+/** \brief Close a codereader handle.
  *
  * \details This function will close all opened devices and frees all internal
  *  memory allocated by previous function calls.
  *
  *
- * \param cookie Headpointer of \ref codereader_device list.
+ * \param handle The handle returned by \ref codereader_new.
  *
  * \return 0 All devices successfully destroyed.
  * \return -1 An error occured.
  */
-CODEREADER_INTERNAL
 int
-codereader_close(void *cookie)
+codereader_destroy(struct codereader_handle *handle)
 {
-	/* Restore the device list. Cookie is a pointer to the first element in the
-	 * list, so it will be set as first element of a temporary list. The list-
-	 * management-pointers in the cookie remain, so the list can be fully
-	 * restored with the cookie. */
-	struct codereader_device_list devices = SLIST_HEAD_INITIALIZER(devices);
-	SLIST_FIRST(&devices) = cookie;
+	struct codereader_device_list *devices = &(handle->devices);
+
+	/* Stop the multiplexer and all worker threads first, so no device will be
+	 * read while closing the devices below. */
+	codereader_dispatch_stop(handle);
+	codereader_worker_stop(handle);
+	codereader_realtime_restore(handle);
 
 	/* Iterate over the whole list and call the close function for all loaded
 	 * drivers. After the device has been closed, the loaded driver's shared
@@ -54,13 +60,19 @@ codereader_close(void *cookie)
 	 * closed, but an error will be returned at the end of the function.
 	 *
 	 * Note: The device has to be checked if it's fully initialized, as this
-	 *       function may be called in error situations, too. */
+	 *       function may be called in error situations, too. Failed devices,
+	 *       which have not been reconnected, have been closed already. */
 	int ret = 0;
 	struct codereader_device *iter;
-	while (!SLIST_EMPTY(&devices)) {
-		iter = SLIST_FIRST(&devices);
-		if ((iter->driver.close != NULL) &&
-		    (iter->driver.close(iter->fd, iter->cookie) != 0))
+	while (!SLIST_EMPTY(devices)) {
+		iter = SLIST_FIRST(devices);
+		if (iter->state == CODEREADER_DEVICE_UP) {
+			CODEREADER_PROBE2(device__close, iter->name, iter->fd);
+			if ((iter->driver.close != NULL) &&
+			    (iter->driver.close(iter->fd, iter->cookie) != 0))
+				ret = -1;
+		}
+		if (codereader_filter_close(iter) != 0)
 			ret = -1;
 #ifndef CODEREADER_SANITIZE_ADDRESS
 		/* If AddressSanitizer is activated, don't close the handle, so
@@ -70,9 +82,58 @@ codereader_close(void *cookie)
 			dlclose(iter->driver.dh);
 #endif
 
-		SLIST_REMOVE_HEAD(&devices, lmp);
+		/* Free all scans of the worker thread, which have not been delivered
+		 * yet. */
+		struct codereader_queue_node *node;
+		while ((node = codereader_queue_pop(&(iter->queue))) != NULL)
+			free(node);
+		free(iter->next);
+
+		SLIST_REMOVE_HEAD(devices, lmp);
+		free(iter->name);
+		if (iter->locked)
+			munlock(iter->buffer, iter->buffer_size);
+		free(iter->buffer);
+		free(iter->realtime.cpus);
 		free(iter);
 	}
 
+	/* Free all scans, which have not been delivered yet, and the handle
+	 * itself. */
+	free(handle->pending);
+	free(handle->polls);
+	codereader_order_free(handle);
+	free(handle->dedup);
+	free(handle->realtime.cpus);
+	if (handle->config != NULL)
+		codereader_config_free(handle->config);
+
+	if (handle->epoll >= 0)
+		close(handle->epoll);
+	if (handle->timer >= 0)
+		close(handle->timer);
+	for (int i = 0; i < 2; i++) {
+		if (handle->wakeup[i] >= 0)
+			close(handle->wakeup[i]);
+		if (handle->stop[i] >= 0)
+			close(handle->stop[i]);
+	}
+	free(handle);
+
 	return ret;
 }
+
+
+/** \brief Close the codereader stream.
+ *
+ *
+ * \param cookie Pointer to the \ref codereader_handle of the stream.
+ *
+ * \return The return value of \ref codereader_destroy will be passed through.
+ */
+CODEREADER_INTERNAL
+int
+codereader_close(void *cookie)
+{
+	return codereader_destroy(cookie);
+}
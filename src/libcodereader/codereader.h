@@ -22,7 +22,9 @@
 #define CODEREADER_H
 
 
-#include <stdio.h> // FILE
+#include <stddef.h> // size_t
+#include <stdio.h>  // FILE
+#include <time.h>   // struct timespec
 
 
 /* The crutils API should be C++ compatible, too. We have to add the extern "C"
@@ -33,7 +35,114 @@ extern "C" {
 #endif
 
 
+/** \brief Handle of an opened set of barcode readers.
+ *
+ * \details The contents of this struct are private to libcodereader.
+ */
+struct codereader_handle;
+
+/** \brief Configuration of devices built in memory.
+ *
+ * \details The contents of this struct are private to libcodereader.
+ */
+struct codereader_config;
+
+
+/** \brief Maximum number of GS1 fields of a single scan.
+ */
+#define CODEREADER_GS1_FIELDS 32
+
+
+/** \brief A field of a GS1 element string.
+ *
+ * \details The value of the field is stored at \ref offset of the parsed
+ *  data, so the fields remain valid, if the data is copied.
+ */
+struct codereader_gs1_field
+{
+	char ai[5];    ///< The Application Identifier (null-terminated).
+	size_t offset; ///< Offset of the value in the parsed data.
+	size_t length; ///< Length of the value.
+};
+
+
+/** \brief A single scan.
+ *
+ * \details The scan will be filled by \ref codereader_next. All pointers
+ *  remain valid until the next call of \ref codereader_next or
+ *  \ref codereader_destroy for the same handle.
+ */
+struct codereader_barcode
+{
+	const char *data;     ///< The scan without line ending (not terminated).
+	size_t length;        ///< Length of \ref data.
+	const char *device;   ///< Name of the device in the configuration.
+	struct timespec time; ///< Time the scan has been read (CLOCK_REALTIME).
+
+	/** \brief The GS1 fields of the scan.
+	 *
+	 * \details If GS1 parsing is enabled for the device and the scan is a
+	 *  valid GS1 element string, the fields will point to its values in
+	 *  \ref data. Otherwise \ref fields is NULL.
+	 */
+	const struct codereader_gs1_field *fields;
+	size_t num_fields; ///< Number of \ref fields.
+};
+
+
+/** \brief Number of buckets of the latency histogram.
+ *
+ * \details Bucket `i` counts the scans delivered within less than `2^i`
+ *  microseconds after they happened. The last bucket counts all slower scans,
+ *  too.
+ */
+#define CODEREADER_LATENCY_BUCKETS 32
+
+
 FILE *codereader_open();
+FILE *codereader_open_config(const char *text);
+FILE *codereader_open_from(struct codereader_config *config);
+
+struct codereader_handle *codereader_new();
+struct codereader_handle *codereader_new_config(const char *text);
+struct codereader_handle *codereader_new_from(struct codereader_config *config);
+int codereader_next(struct codereader_handle *handle,
+                    struct codereader_barcode *barcode, int timeout);
+int codereader_destroy(struct codereader_handle *handle);
+int codereader_fileno(struct codereader_handle *handle);
+
+int codereader_dispatch(struct codereader_handle *handle, size_t capacity);
+int codereader_take(struct codereader_handle *handle,
+                    struct codereader_barcode *barcode, int timeout);
+void codereader_release(struct codereader_barcode *barcode);
+
+struct codereader_config *codereader_config_new();
+void codereader_config_free(struct codereader_config *config);
+int codereader_config_add_device(struct codereader_config *config,
+                                 const char *name, const char *driver);
+int codereader_config_set_string(struct codereader_config *config,
+                                 const char *group, const char *path,
+                                 const char *value);
+int codereader_config_set_int(struct codereader_config *config,
+                              const char *group, const char *path, int value);
+int codereader_config_set_bool(struct codereader_config *config,
+                               const char *group, const char *path, int value);
+int codereader_config_append_string(struct codereader_config *config,
+                                    const char *group, const char *path,
+                                    const char *value);
+int codereader_config_append_int(struct codereader_config *config,
+                                 const char *group, const char *path,
+                                 int value);
+int codereader_config_append_group(struct codereader_config *config,
+                                   const char *group, const char *path);
+
+size_t codereader_latency(const struct codereader_handle *handle,
+                          unsigned long *buckets, size_t num);
+unsigned long codereader_dropped(const struct codereader_handle *handle,
+                                 const char *device);
+
+int codereader_gs1_parse(const char *data, size_t length,
+                         struct codereader_gs1_field *fields, size_t num);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,391 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Header-only C++20 interface of libcodereader.
+ *
+ * \details This header wraps the native codereader API in RAII classes. Scans
+ *  are returned as views into the buffers of libcodereader, so no memory will
+ *  be allocated for reading scans. In addition, scans may be awaited in
+ *  coroutines of any executor, which is able to wait for a file descriptor to
+ *  become readable.
+ */
+
+#ifndef CODEREADER_HPP
+#define CODEREADER_HPP
+
+
+#include <chrono>       // std::chrono::milliseconds
+#include <concepts>     // std::invocable
+#include <coroutine>    // std::coroutine_handle
+#include <cstddef>      // std::size_t
+#include <ctime>        // std::timespec
+#include <optional>     // std::optional
+#include <span>         // std::span
+#include <stdexcept>    // std::runtime_error
+#include <string_view>  // std::string_view
+#include <utility>      // std::exchange, std::move
+
+#include "codereader.h" // codereader API declaration
+
+
+namespace codereader
+{
+
+/** \brief Exception thrown, if libcodereader reports an error.
+ *
+ * \details A detailed error message has been printed to stderr by
+ *  libcodereader already.
+ */
+class error : public std::runtime_error
+{
+  public:
+	using std::runtime_error::runtime_error;
+};
+
+
+/** \brief A single scan.
+ *
+ * \details The views of a scan point into buffers owned by libcodereader. They
+ *  remain valid until the next scan is read from the same handle or the handle
+ *  is destroyed.
+ */
+class scan
+{
+  public:
+	explicit scan(const codereader_barcode &barcode) noexcept
+	    : barcode_(barcode)
+	{
+	}
+
+	/** \brief The scan without line ending.
+	 */
+	std::string_view
+	data() const noexcept
+	{
+		return {barcode_.data, barcode_.length};
+	}
+
+	/** \brief Name of the device in the configuration.
+	 */
+	std::string_view
+	device() const noexcept
+	{
+		return barcode_.device;
+	}
+
+	/** \brief Time the scan has been read (CLOCK_REALTIME).
+	 */
+	const std::timespec &
+	time() const noexcept
+	{
+		return barcode_.time;
+	}
+
+	/** \brief The GS1 fields of the scan.
+	 *
+	 * \details The span is empty, if the scan has not been parsed as GS1
+	 *  element string.
+	 */
+	std::span<const codereader_gs1_field>
+	fields() const noexcept
+	{
+		return {barcode_.fields, barcode_.num_fields};
+	}
+
+	/** \brief The value of the GS1 field \p ai, if the scan has one.
+	 */
+	std::optional<std::string_view>
+	field(std::string_view ai) const noexcept
+	{
+		for (const auto &f : fields())
+			if (ai == f.ai)
+				return data().substr(f.offset, f.length);
+		return std::nullopt;
+	}
+
+  private:
+	codereader_barcode barcode_;
+};
+
+
+/** \brief A handle of the configured barcode readers.
+ *
+ * \details The handle opens all devices of the configuration on construction
+ *  and closes them on destruction. Like the native API, a handle must not be
+ *  read by more than one thread at the same time.
+ */
+class handle
+{
+  public:
+	/** \brief Open all configured devices.
+	 *
+	 * \throws error The devices could not be opened.
+	 */
+	handle() : handle_(codereader_new())
+	{
+		if (handle_ == nullptr)
+			throw error("failed to open codereader devices");
+	}
+
+	/** \brief Open the devices of the configuration \p config.
+	 *
+	 * \details See \ref codereader_new_config for details.
+	 *
+	 * \throws error The devices could not be opened.
+	 */
+	explicit handle(const char *config)
+	    : handle_(codereader_new_config(config))
+	{
+		if (handle_ == nullptr)
+			throw error("failed to open codereader devices");
+	}
+
+	/** \brief Open the devices of the configuration built in \p config.
+	 *
+	 * \details The handle takes ownership of \p config. See
+	 *  \ref codereader_new_from for details.
+	 *
+	 * \throws error The devices could not be opened.
+	 */
+	explicit handle(codereader_config *config)
+	    : handle_(codereader_new_from(config))
+	{
+		if (handle_ == nullptr)
+			throw error("failed to open codereader devices");
+	}
+
+	handle(const handle &) = delete;
+	handle &operator=(const handle &) = delete;
+
+	handle(handle &&other) noexcept
+	    : handle_(std::exchange(other.handle_, nullptr))
+	{
+	}
+
+	handle &
+	operator=(handle &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	~handle() { close(); }
+
+
+	/** \brief The native handle for use with the codereader API.
+	 */
+	codereader_handle *
+	native_handle() const noexcept
+	{
+		return handle_;
+	}
+
+	/** \brief A file descriptor, which is readable, if a scan may be ready.
+	 *
+	 * \details The file descriptor is owned by the handle and must not be
+	 *  closed. See \ref codereader_fileno for details.
+	 *
+	 * \throws error No pollable file descriptor is available.
+	 */
+	int
+	fd() const
+	{
+		int fd = codereader_fileno(handle_);
+		if (fd < 0)
+			throw error("no pollable codereader file descriptor");
+		return fd;
+	}
+
+
+	/** \brief Wait for the next scan.
+	 *
+	 *
+	 * \param timeout Maximum time to wait or a negative duration to wait
+	 *  forever.
+	 *
+	 * \return The scan or an empty optional, if the timeout expired.
+	 *
+	 * \throws error An error occured while reading the devices.
+	 */
+	std::optional<scan>
+	next(std::chrono::milliseconds timeout)
+	{
+		codereader_barcode barcode;
+		int ms = timeout.count() < 0 ? -1 : static_cast<int>(timeout.count());
+		switch (codereader_next(handle_, &barcode, ms)) {
+			case 1: return scan(barcode);
+			case 0: return std::nullopt;
+			default: throw error("failed to read codereader devices");
+		}
+	}
+
+	/** \brief Get the next scan without waiting.
+	 *
+	 * \return The scan or an empty optional, if no scan is ready.
+	 *
+	 * \throws error An error occured while reading the devices.
+	 */
+	std::optional<scan>
+	try_next()
+	{
+		return next(std::chrono::milliseconds(0));
+	}
+
+	/** \brief Process all scans ready without waiting.
+	 *
+	 * \details \p f will be called for each scan. As scans are views into the
+	 *  buffers of libcodereader, \p f has to copy the data it needs to keep.
+	 *
+	 *
+	 * \param f Function called with each \ref scan.
+	 * \param max Maximum number of scans to process.
+	 *
+	 * \return The number of processed scans.
+	 *
+	 * \throws error An error occured while reading the devices.
+	 */
+	template <std::invocable<const scan &> F>
+	std::size_t
+	poll(F &&f, std::size_t max = static_cast<std::size_t>(-1))
+	{
+		std::size_t n = 0;
+		for (; n < max; n++) {
+			std::optional<scan> s = try_next();
+			if (!s)
+				break;
+			f(*s);
+		}
+		return n;
+	}
+
+
+	/** \brief Awaitable returned by \ref next for coroutines.
+	 *
+	 * \details If no scan is ready, \p Waiter will be called with the file
+	 *  descriptor of the handle and a callback. The waiter has to call the
+	 *  callback once, after the file descriptor became readable, e.g. from the
+	 *  completion handler of an asynchronous wait of its executor. The callback
+	 *  either resumes the coroutine or calls the waiter again, if the file
+	 *  descriptor was readable without a scan being ready.
+	 *
+	 * \note The awaitable is stored in the coroutine frame, so waiting for a
+	 *  scan doesn't allocate any memory beside the waiter's own allocations.
+	 */
+	template <class Waiter>
+	class awaitable
+	{
+	  public:
+		awaitable(handle &h, Waiter waiter)
+		    : handle_(h), waiter_(std::move(waiter))
+		{
+		}
+
+		bool
+		await_ready()
+		{
+			return ready();
+		}
+
+		void
+		await_suspend(std::coroutine_handle<> coroutine)
+		{
+			coroutine_ = coroutine;
+			waiter_(handle_.fd(), *this);
+		}
+
+		scan
+		await_resume()
+		{
+			if (!result_)
+				throw error("failed to read codereader devices");
+			return *result_;
+		}
+
+		/** \brief Callback for the waiter, if the file descriptor became
+		 *  readable.
+		 */
+		void
+		operator()()
+		{
+			if (ready())
+				coroutine_.resume();
+			else
+				waiter_(handle_.fd(), *this);
+		}
+
+	  private:
+		/** \brief Try to get the next scan.
+		 *
+		 * \return Whether the coroutine may be resumed, i.e. a scan has been
+		 *  read or an error occured.
+		 */
+		bool
+		ready()
+		{
+			codereader_barcode barcode;
+			switch (codereader_next(handle_.native_handle(), &barcode, 0)) {
+				case 1: result_.emplace(barcode); return true;
+				case 0: return false;
+				default: return true;
+			}
+		}
+
+		handle &handle_;
+		Waiter waiter_;
+		std::optional<scan> result_;
+		std::coroutine_handle<> coroutine_;
+	};
+
+	/** \brief Await the next scan in a coroutine.
+	 *
+	 *
+	 * \param waiter Function called with the file descriptor of the handle
+	 *  and a callback to be called, after the file descriptor became readable.
+	 *
+	 * \return An awaitable resulting in the next \ref scan.
+	 */
+	template <class Waiter>
+	requires std::invocable<Waiter &, int, awaitable<Waiter> &>
+	awaitable<Waiter>
+	next(Waiter waiter)
+	{
+		return awaitable<Waiter>(*this, std::move(waiter));
+	}
+
+  private:
+	void
+	close() noexcept
+	{
+		if (handle_ != nullptr)
+			codereader_destroy(std::exchange(handle_, nullptr));
+	}
+
+	codereader_handle *handle_;
+};
+
+} // namespace codereader
+
+
+#endif
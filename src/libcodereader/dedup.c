@@ -0,0 +1,210 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Suppression of duplicate scans.
+ *
+ * \details Recently delivered scans will be remembered in a fixed-size open
+ *  addressing hash table. Only the hash of each scan and the time its window
+ *  expires will be stored, so checking a scan needs no allocation and touches
+ *  at most two cache lines. Expired entries will be reused by new scans, so no
+ *  explicit cleanup is required.
+ */
+
+#include <stdint.h> // uint64_t
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // calloc
+#include <string.h> // strcmp
+#include <time.h>   // clock_gettime
+
+#include "handle.h"   // codereader_handle, codereader_dedup_*
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Number of entries in the hash table. Must be a power of two.
+ */
+#define CODEREADER_DEDUP_SIZE 1024
+
+/** \brief Number of entries checked for each scan.
+ */
+#define CODEREADER_DEDUP_PROBES 8
+
+
+/** \brief Entry of the hash table.
+ */
+struct codereader_dedup_entry
+{
+	uint64_t hash;   ///< Hash of the scan.
+	uint64_t expire; ///< Time in ms, when the window of the scan expires.
+};
+
+
+/** \brief Hash table of recently delivered scans.
+ */
+struct codereader_dedup
+{
+	struct codereader_dedup_entry entries[CODEREADER_DEDUP_SIZE];
+};
+
+
+/** \brief Get the current time of the monotonic clock in milliseconds.
+ */
+static uint64_t
+codereader_dedup_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/** \brief Calculate the hash of a scan.
+ *
+ * \details The FNV-1a hash of the payload will be used. If the device is part
+ *  of the key, its address will be mixed into the hash.
+ *
+ *
+ * \param device The device that read the scan.
+ * \param buffer The scan.
+ * \param length Length of \p buffer.
+ *
+ * \return The hash of the scan. Zero is reserved for empty entries, so it will
+ *  never be returned.
+ */
+static uint64_t
+codereader_dedup_hash(const struct codereader_device *device,
+                      const char *buffer, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)buffer[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	if (device->dedup_device) {
+		hash ^= (uintptr_t)device;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (hash != 0) ? hash : 1;
+}
+
+
+/** \brief Read the dedup configuration \p config of \p device.
+ *
+ * \details The hash table will be allocated, when the first device enables
+ *  duplicate suppression.
+ *
+ *
+ * \param device The device to configure.
+ * \param config The `dedup` group of the device's configuration.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_dedup_config(struct codereader_device *device,
+                        const config_setting_t *config)
+{
+	int window;
+	if (config_setting_lookup_int(config, "window", &window) != CONFIG_TRUE ||
+	    window <= 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'dedup.window' must be a positive number of ms.\n");
+		return false;
+	}
+	device->dedup_window = window;
+
+	/* By default, duplicates will be suppressed across all devices. If the
+	 * device is part of the key, only duplicates of the same device will be
+	 * suppressed. */
+	const char *key = "payload";
+	config_setting_lookup_string(config, "key", &key);
+	if (strcmp(key, "device") == 0)
+		device->dedup_device = true;
+	else if (strcmp(key, "payload") != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Unknown dedup key '%s'.\n", key);
+		return false;
+	}
+
+	struct codereader_handle *handle = device->handle;
+	if (handle->dedup == NULL &&
+	    (handle->dedup = calloc(1, sizeof(struct codereader_dedup))) == NULL) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Not enough memory for dedup table.\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+/** \brief Check, if a scan is a duplicate.
+ *
+ * \details If the scan is not a duplicate, it will be remembered for the
+ *  window of \p device. A duplicate will extend the window, so a scan will be
+ *  suppressed as long as the device keeps re-reading it.
+ *
+ *
+ * \param device The device that read the scan.
+ * \param buffer The scan.
+ * \param length Length of \p buffer.
+ *
+ * \return If the scan is a duplicate true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_dedup_check(struct codereader_device *device, const char *buffer,
+                       size_t length)
+{
+	if (device->dedup_window == 0)
+		return false;
+
+	struct codereader_dedup *table = device->handle->dedup;
+	uint64_t hash = codereader_dedup_hash(device, buffer, length);
+	uint64_t now = codereader_dedup_now();
+	uint64_t expire = now + device->dedup_window;
+
+	/* Probe a fixed number of entries. If the scan is found and its window has
+	 * not expired yet, it's a duplicate. Otherwise the scan will be stored in
+	 * the first expired entry or, if all probed entries are in use, in the one
+	 * expiring first. */
+	struct codereader_dedup_entry *victim = NULL;
+	for (size_t i = 0; i < CODEREADER_DEDUP_PROBES; i++) {
+		struct codereader_dedup_entry *entry =
+		    &(table->entries[(hash + i) & (CODEREADER_DEDUP_SIZE - 1)]);
+		if (entry->expire > now) {
+			if (entry->hash == hash) {
+				entry->expire = expire;
+				return true;
+			}
+			if (victim == NULL ||
+			    (victim->expire > now && entry->expire < victim->expire))
+				victim = entry;
+		} else if (victim == NULL || victim->expire > now)
+			victim = entry;
+	}
+
+	victim->hash = hash;
+	victim->expire = expire;
+	return false;
+}
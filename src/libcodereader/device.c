@@ -0,0 +1,223 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Assembling of scans in per-device buffers.
+ *
+ * \details Drivers write scans into the buffer passed to their read hook and
+ *  stop, if the buffer is full. To support codes of any length, each device
+ *  has its own buffer, which will be doubled and the driver called again to
+ *  continue the scan, whenever the driver filled the buffer completely without
+ *  finishing the scan. The driver writes into the buffer directly, so no
+ *  characters need to be copied while assembling the scan.
+ *
+ *  Drivers reading messages, e.g. from a datagram socket, can't continue a
+ *  scan in a second call, as the rest of the message is lost. These drivers
+ *  export `device_datagram`, so each call returns a complete scan. If the scan
+ *  didn't fit into the buffer, they return its full length instead and the
+ *  truncated scan will be dropped.
+ */
+
+#include <errno.h>    // errno
+#include <stdio.h>    // fprintf
+#include <stdlib.h>   // free, malloc
+#include <string.h>   // memcpy, strerror
+#include <sys/mman.h> // mlock, munlock
+#include <time.h>     // clock_gettime
+
+#include "device.h"   // codereader_device
+#include "handle.h"   // CODEREADER_BUFFER_SIZE, CODEREADER_SCAN_MAX
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+#include "probes.h"   // CODEREADER_PROBE*
+
+
+/** \brief Double the buffer of \p device.
+ *
+ * \details If the buffer is locked, the new buffer will be locked, too, and the
+ *  old one unlocked before it will be freed. If locking fails, the buffer still
+ *  will be used, but not locked anymore.
+ *
+ *
+ * \param device The device.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+codereader_device_grow(struct codereader_device *device)
+{
+	size_t size = (device->buffer_size > 0) ? 2 * device->buffer_size
+	                                        : CODEREADER_BUFFER_SIZE;
+	char *buffer = malloc(size);
+	if (buffer == NULL) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Not enough memory for scan of device %s.\n",
+		        device->name);
+		return false;
+	}
+
+	if (device->buffer != NULL) {
+		memcpy(buffer, device->buffer, device->buffer_size);
+		if (device->locked)
+			munlock(device->buffer, device->buffer_size);
+		free(device->buffer);
+	}
+	device->buffer = buffer;
+	device->buffer_size = size;
+
+	if (device->locked && mlock(buffer, size) != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to lock buffer of device %s: %s\n",
+		        device->name, strerror(errno));
+		device->locked = false;
+	}
+
+	return true;
+}
+
+
+/** \brief Lock the buffer of \p device into memory.
+ *
+ * \details The buffer will be allocated immediately, so reading the first
+ *  scan doesn't cause any page faults. Buffers grown later will be locked,
+ *  too.
+ *
+ *
+ * \param device The device.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_device_lock(struct codereader_device *device)
+{
+	device->locked = true;
+	return codereader_device_grow(device) && device->locked;
+}
+
+
+/** \brief Drop the truncated scan of \p device.
+ *
+ * \details The buffer will be grown to fit scans of \p length bytes, so the
+ *  next scan of this size will be read completely, unless it exceeds the
+ *  maximum length of scans.
+ *
+ *
+ * \param device The device.
+ * \param length Length of the truncated scan as reported by the driver.
+ */
+static void
+codereader_device_truncated(struct codereader_device *device, size_t length)
+{
+	fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+	        "Dropped scan of %zu bytes exceeding the buffer of device %s.\n",
+	        length, device->name);
+
+	device->length = 0;
+	while (device->buffer_size < length &&
+	       device->buffer_size < CODEREADER_SCAN_MAX &&
+	       codereader_device_grow(device))
+		;
+}
+
+
+/** \brief Read a scan of \p device into its buffer.
+ *
+ * \details A scan is complete, if the driver returned less bytes than space was
+ *  left in the buffer, or the scan ends with a newline. Otherwise the buffer
+ *  will be grown and the driver called again. If the driver returns zero while
+ *  a scan is incomplete, the partial scan will be kept for the next call.
+ *  Datagram drivers return a complete scan with each call, so their scans are
+ *  complete regardless of their length and ending.
+ *
+ * \note The returned scan is stored in `device->buffer` and valid until the
+ *  next call of this function for the same device.
+ *
+ *
+ * \param device The device to read from.
+ *
+ * \return The length of the complete scan. If the scan is not complete yet,
+ *  zero will be returned. On errors -1 will be returned.
+ */
+CODEREADER_INTERNAL
+ssize_t
+codereader_device_read(struct codereader_device *device)
+{
+	/* The scan returned by the previous call has been processed already. */
+	if (device->complete) {
+		device->length = 0;
+		device->complete = false;
+	}
+
+	/* If the device is quarantined for exceeding its rate limit, its input
+	 * will be discarded without being translated by the driver. */
+	int discarded = codereader_flood_discard(device);
+	if (discarded != 0)
+		return (discarded < 0) ? -1 : 0;
+
+	while (true) {
+		if (device->length == device->buffer_size &&
+		    !codereader_device_grow(device))
+			return -1;
+
+		size_t space = device->buffer_size - device->length;
+		CODEREADER_PROBE2(driver__read__entry, device->name, device->fd);
+		int n = device->driver.read(device->fd, device->buffer + device->length,
+		                            space, device->cookie);
+		CODEREADER_PROBE2(driver__read__return, device->name, n);
+		if (n <= 0) {
+			if (n < 0)
+				device->length = 0;
+			return n;
+		}
+		if (device->driver.datagram && (size_t)n > space) {
+			codereader_device_truncated(device, n);
+			return 0;
+		}
+		device->length += n;
+
+		/* If the driver didn't fill the buffer, or the scan has been
+		 * terminated, the scan is complete. Scans exceeding the maximum length
+		 * will be delivered in parts to limit the memory used per device. */
+		if (device->driver.datagram || (size_t)n < space ||
+		    device->buffer[device->length - 1] == '\n' ||
+		    device->length >= CODEREADER_SCAN_MAX) {
+			/* Filters and validation may extend the scan, so some space should
+			 * be left in the buffer. If growing fails, they will drop the scan
+			 * instead. */
+			if (device->length == device->buffer_size)
+				codereader_device_grow(device);
+
+			/* The time the scan happened will be used to order the scans of
+			 * all devices. If the driver doesn't know the time of the input
+			 * events, the time the scan has been read will be used. */
+			if (device->driver.timestamp == NULL ||
+			    device->driver.timestamp(device->fd, &(device->stamp),
+			                             device->cookie) != 0)
+				clock_gettime(CLOCK_MONOTONIC, &(device->stamp));
+
+			/* Scans exceeding the rate limit of the device will be dropped. */
+			device->complete = true;
+			if (!codereader_flood_admit(device))
+				return 0;
+			return device->length;
+		}
+	}
+}
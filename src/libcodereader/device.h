@@ -22,10 +22,17 @@
 #define CODEREADER_PRIVATE_DEVICE_H
 
 
+#include <poll.h>      // struct pollfd
+#include <pthread.h>   // pthread_t
+#include <stdbool.h>   // bool
+#include <stddef.h>    // size_t
 #include <sys/queue.h> // SLIST_* macros
+#include <time.h>      // struct timespec
 
 #include <libconfig.h> // libconfig API
 
+#include "queue.h" // codereader_queue
+
 
 /** \brief Hook provided by the driver to open a device.
  *
@@ -66,9 +73,109 @@ typedef int (*codereader_hook_read)(int fd, char *buffer, int size,
  */
 typedef int (*codereader_hook_close)(int fd, void *cookie);
 
+/** \brief Optional hook provided by the driver to get the time of a scan.
+ *
+ * \details This hook will be called after a scan has been read completely.
+ *  Drivers with access to the time of the input events (e.g. the kernel's
+ *  event timestamps) should provide it, so the scans of all devices can be
+ *  ordered by the time they happened.
+ *
+ *
+ * \param fd The previously opened file-descriptor.
+ * \param time Where to store the time the scan happened (CLOCK_MONOTONIC).
+ * \param cookie Pointer to the driver's data storage.
+ *
+ * \return If the time is available zero should be returned, otherwise -1.
+ */
+typedef int (*codereader_hook_timestamp)(int fd, struct timespec *time,
+                                         void *cookie);
+
+/** \brief Optional hook provided by the driver to discard pending input.
+ *
+ * \details This hook will be called instead of the read hook, while the device
+ *  is quarantined for exceeding its rate limit. Drivers should consume the
+ *  pending input of the device without translating it into a scan, but count
+ *  the scans ended in the consumed input, e.g. by their terminating key.
+ *
+ *
+ * \param fd The previously opened file-descriptor.
+ * \param cookie Pointer to the driver's data storage.
+ *
+ * \return On success the number of scans ended in the discarded input should
+ *  be returned, otherwise -1.
+ */
+typedef int (*codereader_hook_discard)(int fd, void *cookie);
+
+
+/** \brief Real-time settings of a thread reading devices.
+ *
+ * \details These settings may be configured globally for the thread reading
+ *  the codereader stream and per device for worker threads.
+ */
+struct codereader_realtime
+{
+	bool enabled; ///< Whether real-time settings have been configured.
+	int policy;   ///< Scheduling policy of the thread.
+	int priority; ///< Static scheduling priority of the thread.
+	int *cpus;    ///< CPUs the thread will be pinned to.
+	size_t cpus_num; ///< Number of \ref cpus or zero to not pin the thread.
+	bool mlock;      ///< Whether the buffers of the thread will be locked.
+};
+
 
-/* Forward declaration required for the following struct. */
+/** \brief A driver linked into libcodereader.
+ *
+ * \details Drivers listed in the `STATIC_DRIVERS` CMake option will be linked
+ *  into libcodereader and used instead of loading a shared object.
+ */
+struct codereader_static_driver
+{
+	const char *name;            ///< Name of the driver.
+	codereader_hook_open open;   ///< Driver hook to open a device.
+	codereader_hook_read read;   ///< Driver hook to read from a device.
+	codereader_hook_close close; ///< Driver hook to close a device.
+	codereader_hook_timestamp timestamp; ///< Optional timestamp hook or NULL.
+	codereader_hook_discard discard;     ///< Optional discard hook or NULL.
+	const int *blocking; ///< The driver's `device_blocking` symbol or NULL.
+	const int *datagram; ///< The driver's `device_datagram` symbol or NULL.
+};
+
+extern const struct codereader_static_driver codereader_static_drivers[];
+
+
+/** \brief Rate limit of a device.
+ *
+ * \details See flood.c for details.
+ */
+struct codereader_flood
+{
+	bool enabled;            ///< Whether the scan rate is limited.
+	double rate;             ///< Tokens added to the bucket per second.
+	double burst;            ///< Maximum number of tokens in the bucket.
+	double tokens;           ///< Tokens left in the bucket.
+	struct timespec last;    ///< Time the bucket has been refilled.
+	unsigned int quarantine; ///< Quarantine in ms or 0 to drop scans only.
+	bool quarantined;        ///< Whether the device is quarantined.
+	struct timespec until;   ///< End of the quarantine (CLOCK_MONOTONIC).
+	bool limited; ///< Whether scans have been dropped since the last scan.
+	unsigned long dropped; ///< Number of dropped scans.
+};
+
+
+/** \brief Health state of a device.
+ */
+enum codereader_device_state
+{
+	CODEREADER_DEVICE_UP = 0, ///< The device is opened and will be read.
+	CODEREADER_DEVICE_DOWN,   ///< The device failed and will be reconnected.
+};
+
+
+/* Forward declarations required for the following structs. */
 struct codereader_device;
+struct codereader_filter;
+struct codereader_handle;
+struct codereader_scan;
 
 /** \brief Struct storing all information about the used device driver.
  *
@@ -77,11 +184,30 @@ struct codereader_device;
  */
 struct codereader_driver
 {
-	void *dh; ///< Handle for the loaded shared object of the driver.
+	void *dh; ///< Handle for the loaded shared object of the driver or NULL.
 
 	codereader_hook_open open;   ///< Driver hook to open a device.
 	codereader_hook_read read;   ///< Driver hook to read from a device.
 	codereader_hook_close close; ///< Driver hook to close a device.
+	codereader_hook_timestamp timestamp; ///< Optional timestamp hook or NULL.
+	codereader_hook_discard discard;     ///< Optional discard hook or NULL.
+
+	/** \brief Whether the driver may block while reading.
+	 *
+	 * \details Drivers may export the symbol `device_blocking` with a non-zero
+	 *  value to indicate, that their read hook may block for a long time, e.g.
+	 *  for round trips to a server. Devices of these drivers will be read by a
+	 *  worker thread by default.
+	 */
+	bool blocking;
+
+	/** \brief Whether each read of the driver returns a complete scan.
+	 *
+	 * \details Drivers may export the symbol `device_datagram` to indicate,
+	 *  that they read messages, which can't be continued by another call of
+	 *  the read hook. See device.c for details.
+	 */
+	bool datagram;
 };
 
 
@@ -95,9 +221,72 @@ struct codereader_driver
  */
 struct codereader_device
 {
+	char *name;                      ///< Name of the device in the config.
 	int fd;                          ///< File-descriptor of the device.
 	struct codereader_driver driver; ///< The driver used by this device.
 	void *cookie;                    ///< Optional pointer to data storage.
+	const config_setting_t *config;  ///< Configuration of the device.
+
+	/** \brief Health state of the device.
+	 *
+	 * \details If the driver's read hook fails, the device will be removed
+	 *  from the set of polled devices and reopened in the background. See
+	 *  \ref codereader_reconnect_start for details.
+	 */
+	enum codereader_device_state state;
+	bool reopened;  ///< Whether the device needs to be polled again.
+	bool reconnect; ///< Whether the device will be reopened after failures.
+	unsigned int reconnect_min; ///< Initial delay in ms to reopen the device.
+	unsigned int reconnect_max; ///< Maximum delay in ms to reopen the device.
+
+	struct codereader_handle *handle; ///< The stream this device belongs to.
+	bool threaded;    ///< Whether the device is read by a worker thread.
+	bool running;     ///< Whether \ref thread has been started.
+	bool finished;    ///< Whether the worker thread returned (atomic).
+	pthread_t thread; ///< The worker or reconnect thread of this device.
+
+	/** \brief Scans read by the worker thread of this device.
+	 *
+	 * \details Each device has its own queue, so the reader of the stream can
+	 *  select the device to be served next. See lane.c for details.
+	 */
+	struct codereader_queue queue;
+	struct codereader_scan *next; ///< Scan taken from \ref queue already.
+	int priority;        ///< Devices with a higher priority are served first.
+	unsigned int weight; ///< Share of the device within its priority.
+	int current;         ///< Current weight of the round-robin.
+	struct pollfd *poll; ///< Entry in the poll list of the stream or NULL.
+
+	/** \brief Buffer the scans of this device are assembled in.
+	 *
+	 * \details The buffer will be grown as needed, so scans of any length can
+	 *  be read. It will be accessed by the thread reading the device only.
+	 */
+	char *buffer;
+	size_t buffer_size; ///< Size of \ref buffer.
+	size_t length;      ///< Number of bytes of the scan in \ref buffer.
+	bool complete;      ///< Whether the scan in \ref buffer is complete.
+	bool locked;        ///< Whether \ref buffer is locked into memory.
+	struct timespec stamp; ///< Time the scan happened (CLOCK_MONOTONIC).
+	size_t ordered; ///< Number of scans held back for ordering.
+
+	/** \brief Real-time settings of the worker thread reading this device.
+	 *
+	 * \details If not enabled, the global settings of the handle will be used.
+	 */
+	struct codereader_realtime realtime;
+
+	unsigned int dedup_window; ///< Dedup window in ms or 0, if disabled.
+	bool dedup_device; ///< Whether the device is part of the dedup key.
+
+	struct codereader_filter *filters; ///< Filter chain of this device.
+	size_t filters_num;                ///< Number of \ref filters.
+
+	unsigned int validate; ///< Mask of symbologies to validate scans against.
+	char validate_tag[16]; ///< Prefix for invalid scans or empty to drop them.
+
+	struct codereader_flood flood; ///< Rate limit of the device.
+	bool gs1; ///< Whether scans will be parsed as GS1 element strings.
 
 	SLIST_ENTRY(codereader_device) lmp; ///< List management struct.
 };
@@ -0,0 +1,360 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Distribution of scans to multiple consumer threads.
+ *
+ * \details A multiplexer thread reads all scans of a handle with
+ *  \ref codereader_next and pushes a copy of each scan into a bounded lock-free
+ *  queue. Any number of consumer threads may take scans from this queue, so
+ *  each scan will be delivered to exactly one of them. Two counters protected
+ *  by a mutex count the queued scans and the free slots, so consumers may
+ *  block on an empty queue and the multiplexer on a full one. Semaphores are
+ *  not used, as unnamed ones are unsupported on some platforms.
+ */
+
+#include "codereader.h" // codereader API declaration
+
+#include <errno.h>  // ETIMEDOUT
+#include <stddef.h> // offsetof
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // free, malloc
+#include <string.h> // memcpy
+#include <time.h>   // clock_gettime
+#include <unistd.h> // close
+
+#include "handle.h"   // codereader_handle
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+#include "probes.h"   // CODEREADER_PROBE*
+
+
+/** \brief A scan owned by a consumer.
+ *
+ * \details The data of \ref barcode points to \ref data, so the scan can be
+ *  found by the barcode in \ref codereader_release. The GS1 fields of the
+ *  scan will be stored behind the data.
+ */
+struct codereader_dispatch_scan
+{
+	struct codereader_barcode barcode; ///< The scan passed to the consumer.
+	char data[];                       ///< Data of the scan.
+};
+
+
+/** \brief Wait until \p count is positive and decrement it.
+ *
+ *
+ * \param handle The handle \p count belongs to.
+ * \param count The counter, i.e. \ref codereader_handle::dispatch_items or
+ *  \ref codereader_handle::dispatch_slots.
+ * \param cond The condition signalled, when \p count has been incremented.
+ * \param deadline The deadline (CLOCK_REALTIME) or NULL to wait forever.
+ *
+ * \return 1 The counter has been decremented.
+ * \return 0 The deadline has been passed.
+ * \return -1 An error occured.
+ */
+static int
+codereader_dispatch_wait(struct codereader_handle *handle, size_t *count,
+                         pthread_cond_t *cond, const struct timespec *deadline)
+{
+	int ret = 0;
+	pthread_mutex_lock(&(handle->dispatch_lock));
+	while (*count == 0 && ret == 0) {
+		if (deadline != NULL)
+			ret = pthread_cond_timedwait(cond, &(handle->dispatch_lock),
+			                             deadline);
+		else
+			ret = pthread_cond_wait(cond, &(handle->dispatch_lock));
+	}
+	if (*count > 0) {
+		(*count)--;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&(handle->dispatch_lock));
+
+	if (ret == 0)
+		return 1;
+	return (ret == ETIMEDOUT) ? 0 : -1;
+}
+
+
+/** \brief Increment \p count and wake up one thread waiting for it.
+ *
+ *
+ * \param handle The handle \p count belongs to.
+ * \param count The counter to increment.
+ * \param cond The condition to signal.
+ */
+static void
+codereader_dispatch_post(struct codereader_handle *handle, size_t *count,
+                         pthread_cond_t *cond)
+{
+	pthread_mutex_lock(&(handle->dispatch_lock));
+	(*count)++;
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&(handle->dispatch_lock));
+}
+
+
+/** \brief Multiplexer thread of \p arg.
+ *
+ *
+ * \param arg Pointer to the \ref codereader_handle to read.
+ */
+static void *
+codereader_dispatcher(void *arg)
+{
+	struct codereader_handle *handle = arg;
+
+	while (!__atomic_load_n(&(handle->dispatch_stop), __ATOMIC_ACQUIRE)) {
+		/* Zero will be returned, if the handle is about to be destroyed, so
+		 * the loop condition will stop the thread. */
+		struct codereader_barcode barcode;
+		int ret = codereader_next(handle, &barcode, -1);
+		if (ret == 0)
+			continue;
+		if (ret < 0)
+			break;
+
+		size_t align = sizeof(struct codereader_gs1_field);
+		size_t offset = (barcode.length + align - 1) / align * align;
+		size_t fields = barcode.num_fields * align;
+		struct codereader_dispatch_scan *scan =
+		    malloc(sizeof(struct codereader_dispatch_scan) + offset + fields);
+		if (scan == NULL) {
+			fprintf(stderr,
+			        CODEREADER_MESSAGE_PREFIX "Not enough memory for scan.\n");
+			break;
+		}
+		memcpy(scan->data, barcode.data, barcode.length);
+		scan->barcode = barcode;
+		scan->barcode.data = scan->data;
+		if (barcode.fields != NULL) {
+			memcpy(scan->data + offset, barcode.fields, fields);
+			scan->barcode.fields =
+			    (struct codereader_gs1_field *)(scan->data + offset);
+		}
+
+		/* Wait for a free slot, so the push below can't fail. If the handle
+		 * is destroyed meanwhile, a slot will be posted to wake up this
+		 * thread. */
+		if (codereader_dispatch_wait(handle, &(handle->dispatch_slots),
+		                             &(handle->dispatch_taken), NULL) < 0 ||
+		    __atomic_load_n(&(handle->dispatch_stop), __ATOMIC_ACQUIRE)) {
+			free(scan);
+			break;
+		}
+		codereader_ring_push(&(handle->dispatch_ring), scan);
+		codereader_dispatch_post(handle, &(handle->dispatch_items),
+		                         &(handle->dispatch_pushed));
+	}
+
+	/* If reading scans failed, all consumers will be woken up. As the queue
+	 * will not get new scans, the consumers will return an error, after all
+	 * queued scans have been taken. */
+	__atomic_store_n(&(handle->dispatch_failed), true, __ATOMIC_RELEASE);
+	codereader_dispatch_post(handle, &(handle->dispatch_items),
+	                         &(handle->dispatch_pushed));
+	return NULL;
+}
+
+
+/** \brief Distribute the scans of \p handle to multiple consumer threads.
+ *
+ * \details This function starts a multiplexer thread, which reads all scans
+ *  of \p handle. Afterwards any number of threads may call
+ *  \ref codereader_take concurrently and each scan will be delivered to
+ *  exactly one of them. \ref codereader_next and the stream must not be used
+ *  for \p handle anymore.
+ *
+ *
+ * \param handle The handle returned by \ref codereader_new.
+ * \param capacity Maximum number of scans waiting for a consumer. If the queue
+ *  is full, reading new scans will be delayed.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+int
+codereader_dispatch(struct codereader_handle *handle, size_t capacity)
+{
+	if (handle->dispatching) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "The scans of this handle are distributed already.\n");
+		return -1;
+	}
+
+	if (!codereader_ring_init(&(handle->dispatch_ring), capacity)) {
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Not enough memory for queue.\n");
+		return -1;
+	}
+	handle->dispatch_items = 0;
+	handle->dispatch_slots = handle->dispatch_ring.mask + 1;
+	if (pthread_mutex_init(&(handle->dispatch_lock), NULL) != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to initialize the lock of the queue.\n");
+		goto free_ring;
+	}
+	if (pthread_cond_init(&(handle->dispatch_pushed), NULL) != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to initialize the conditions of the queue.\n");
+		goto destroy_lock;
+	}
+	if (pthread_cond_init(&(handle->dispatch_taken), NULL) != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to initialize the conditions of the queue.\n");
+		goto destroy_pushed;
+	}
+
+	if (pthread_create(&(handle->dispatcher), NULL, codereader_dispatcher,
+	                   handle) != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to start multiplexer thread.\n");
+		goto destroy_taken;
+	}
+
+	handle->dispatching = true;
+	return 0;
+
+destroy_taken:
+	pthread_cond_destroy(&(handle->dispatch_taken));
+destroy_pushed:
+	pthread_cond_destroy(&(handle->dispatch_pushed));
+destroy_lock:
+	pthread_mutex_destroy(&(handle->dispatch_lock));
+free_ring:
+	codereader_ring_free(&(handle->dispatch_ring));
+	return -1;
+}
+
+
+/** \brief Take the next scan distributed by \p handle.
+ *
+ * \details This function may be called by any number of threads
+ *  concurrently. Each scan will be returned to exactly one thread, which
+ *  owns the scan until it calls \ref codereader_release.
+ *
+ *
+ * \param handle The handle passed to \ref codereader_dispatch.
+ * \param barcode Where to store the scan.
+ * \param timeout Maximum time to wait in milliseconds or -1 to wait forever.
+ *
+ * \return 1 A scan has been stored in \p barcode.
+ * \return 0 No scan has been read until the timeout expired.
+ * \return -1 An error occured.
+ */
+int
+codereader_take(struct codereader_handle *handle,
+                struct codereader_barcode *barcode, int timeout)
+{
+	if (!handle->dispatching) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "The scans of this handle are not distributed.\n");
+		return -1;
+	}
+
+	struct timespec deadline, *dp = NULL;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		dp = &deadline;
+	}
+	int ret = codereader_dispatch_wait(handle, &(handle->dispatch_items),
+	                                   &(handle->dispatch_pushed), dp);
+	if (ret <= 0)
+		return ret;
+
+	/* Each post of the counter belongs to a scan pushed into the queue
+	 * before, except the post of a failed multiplexer. In this case the post
+	 * will be passed to the next consumer, so all of them return an error. */
+	struct codereader_dispatch_scan *scan =
+	    codereader_ring_pop(&(handle->dispatch_ring));
+	if (scan == NULL) {
+		codereader_dispatch_post(handle, &(handle->dispatch_items),
+		                         &(handle->dispatch_pushed));
+		return -1;
+	}
+	codereader_dispatch_post(handle, &(handle->dispatch_slots),
+	                         &(handle->dispatch_taken));
+
+	*barcode = scan->barcode;
+	CODEREADER_PROBE3(scan__deliver, barcode->device, barcode->data,
+	                  barcode->length);
+	return 1;
+}
+
+
+/** \brief Release a scan returned by \ref codereader_take.
+ *
+ *
+ * \param barcode The scan to release.
+ */
+void
+codereader_release(struct codereader_barcode *barcode)
+{
+	if (barcode->data != NULL)
+		free((char *)barcode->data -
+		     offsetof(struct codereader_dispatch_scan, data));
+	barcode->data = NULL;
+}
+
+
+/** \brief Stop the multiplexer thread of \p handle.
+ *
+ * \details The stop pipe will be closed, which wakes up the multiplexer, if it
+ *  is waiting for new scans. Scans not taken by any consumer will be freed.
+ *
+ * \note No consumer may wait for scans anymore, when this function is called.
+ *
+ *
+ * \param handle The handle.
+ */
+CODEREADER_INTERNAL
+void
+codereader_dispatch_stop(struct codereader_handle *handle)
+{
+	if (!handle->dispatching)
+		return;
+
+	__atomic_store_n(&(handle->dispatch_stop), true, __ATOMIC_RELEASE);
+	if (handle->stop[1] >= 0) {
+		close(handle->stop[1]);
+		handle->stop[1] = -1;
+	}
+	codereader_dispatch_post(handle, &(handle->dispatch_slots),
+	                         &(handle->dispatch_taken));
+	pthread_join(handle->dispatcher, NULL);
+
+	struct codereader_dispatch_scan *scan;
+	while ((scan = codereader_ring_pop(&(handle->dispatch_ring))) != NULL)
+		free(scan);
+	codereader_ring_free(&(handle->dispatch_ring));
+	pthread_cond_destroy(&(handle->dispatch_taken));
+	pthread_cond_destroy(&(handle->dispatch_pushed));
+	pthread_mutex_destroy(&(handle->dispatch_lock));
+	handle->dispatching = false;
+}
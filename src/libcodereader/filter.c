@@ -0,0 +1,213 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Post-processing filters.
+ *
+ * \details Filters are loaded from \ref CODEREADER_FILTER_DIR the same way as
+ *  drivers. Each device may have a chain of filters, which will be applied in
+ *  order to each scan of the device by the thread reading the device.
+ */
+
+#include <dlfcn.h>  // dlopen, dlclose
+#include <stdio.h>  // fprintf, snprintf
+#include <stdlib.h> // calloc, free
+#include <string.h> // memcpy
+
+#include "config.h"   // CODEREADER_FILTER_DIR
+#include "device.h"   // codereader_device
+#include "filter.h"   // codereader_filter*
+#include "handle.h"   // codereader_filter_*
+#include "internal.h" // CODEREADER_INTERNAL, codereader_dlsym
+
+
+/** \brief Load filter \p name into \p filter.
+ *
+ *
+ * \param name Filter name.
+ * \param filter Pointer to \ref codereader_filter to store the information in.
+ *
+ * \return true The filter was loaded successfully.
+ * \return false The filter could not be loaded.
+ */
+static bool
+codereader_filter_load(const char *name, struct codereader_filter *filter)
+{
+	char buffer[FILENAME_MAX];
+	snprintf(buffer, FILENAME_MAX, "%s/%s.so", CODEREADER_FILTER_DIR, name);
+	filter->dh = dlopen(buffer, RTLD_NOW);
+	if (filter->dh == NULL)
+		return false;
+
+	/* See codereader_driver_load for details about these casts. */
+	*(void **)(&(filter->open)) = codereader_dlsym(filter->dh, "filter_open");
+	*(void **)(&(filter->apply)) = codereader_dlsym(filter->dh, "filter_apply");
+	*(void **)(&(filter->close)) = codereader_dlsym(filter->dh, "filter_close");
+
+	return (filter->open != NULL && filter->apply != NULL &&
+	        filter->close != NULL);
+}
+
+
+/** \brief Load and open the filter chain \p config of \p device.
+ *
+ * \details If loading any filter fails, the filters loaded so far will be
+ *  closed by \ref codereader_filter_close, when the device gets closed.
+ *
+ *
+ * \param device The device to configure.
+ * \param config The `filters` list of the device's configuration.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_filter_config(struct codereader_device *device,
+                         const config_setting_t *config)
+{
+	int n = config_setting_length(config);
+	if (!config_setting_is_list(config) || n == 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'filters' must be a non-empty list.\n");
+		return false;
+	}
+
+	device->filters = calloc(n, sizeof(struct codereader_filter));
+	if (device->filters == NULL) {
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Not enough memory for filters.\n");
+		return false;
+	}
+
+	for (int i = 0; i < n; i++) {
+		config_setting_t *iter = config_setting_get_elem(config, i);
+		struct codereader_filter *filter = &(device->filters[i]);
+		device->filters_num++;
+
+		const char *name;
+		if (config_setting_lookup_string(iter, "name", &name) != CONFIG_TRUE) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "No name specified for filter %d.\n", i);
+			return false;
+		}
+
+		/* The open hook will be reset, if loading the filter fails, so
+		 * codereader_filter_close knows the filter must not be closed. Like
+		 * for drivers, the close hook will be called even if opening the
+		 * filter fails, so the filter can free its cookie. */
+		if (!codereader_filter_load(name, filter)) {
+			fprintf(stderr,
+			        CODEREADER_MESSAGE_PREFIX "Failed to load filter %s.\n",
+			        name);
+			filter->open = NULL;
+			return false;
+		}
+
+		if (filter->open(iter, &(filter->cookie)) != 0) {
+			fprintf(stderr,
+			        CODEREADER_MESSAGE_PREFIX "Failed to open filter %s.\n",
+			        name);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/** \brief Apply the filter chain of \p device to a scan.
+ *
+ * \details The line ending of the scan will be stripped before calling the
+ *  filters and re-appended afterwards, so filters only have to deal with the
+ *  payload.
+ *
+ *
+ * \param device The device that read the scan.
+ * \param buffer The scan.
+ * \param length Length of \p buffer.
+ * \param size Size of \p buffer.
+ *
+ * \return The new length of the scan. If the scan has been dropped, zero will
+ *  be returned.
+ */
+CODEREADER_INTERNAL
+size_t
+codereader_filter_apply(struct codereader_device *device, char *buffer,
+                        size_t length, size_t size)
+{
+	if (device->filters_num == 0)
+		return length;
+
+	size_t n = length;
+	if (n > 0 && buffer[n - 1] == '\n')
+		n--;
+	if (n > 0 && buffer[n - 1] == '\r')
+		n--;
+	char ending[2];
+	size_t ending_len = length - n;
+	memcpy(ending, buffer + n, ending_len);
+
+	for (size_t i = 0; i < device->filters_num; i++) {
+		struct codereader_filter *filter = &(device->filters[i]);
+		int ret = filter->apply(buffer, n, size - ending_len, filter->cookie);
+		if (ret <= 0 || (size_t)ret > size - ending_len) {
+			if (ret != 0)
+				fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+				        "Filter failed, dropping scan.\n");
+			return 0;
+		}
+		n = ret;
+	}
+
+	memcpy(buffer + n, ending, ending_len);
+	return n + ending_len;
+}
+
+
+/** \brief Close and unload all filters of \p device.
+ *
+ *
+ * \param device The device to close the filters for.
+ *
+ * \return On success zero will be returned, otherwise -1.
+ */
+CODEREADER_INTERNAL
+int
+codereader_filter_close(struct codereader_device *device)
+{
+	int ret = 0;
+	for (size_t i = 0; i < device->filters_num; i++) {
+		struct codereader_filter *filter = &(device->filters[i]);
+		if (filter->open != NULL && filter->close != NULL &&
+		    filter->close(filter->cookie) != 0)
+			ret = -1;
+#ifndef CODEREADER_SANITIZE_ADDRESS
+		/* See codereader_close for details. */
+		if (filter->dh != NULL)
+			dlclose(filter->dh);
+#endif
+	}
+
+	free(device->filters);
+	device->filters = NULL;
+	device->filters_num = 0;
+	return ret;
+}
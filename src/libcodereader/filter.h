@@ -0,0 +1,84 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_PRIVATE_FILTER_H
+#define CODEREADER_PRIVATE_FILTER_H
+
+
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+#include <libconfig.h> // libconfig API
+
+
+/** \brief Hook provided by the filter to open a new filter instance.
+ *
+ *
+ * \param config The parsed configuration for this filter instance.
+ * \param cookie Pointer to a void-pointer, a filter can set to it's allocated
+ *  data storage.
+ *
+ * \return On success zero should be returned, otherwise -1.
+ */
+typedef int (*codereader_filter_hook_open)(const config_setting_t *config,
+                                           void **cookie);
+
+/** \brief Hook provided by the filter to process a scan.
+ *
+ * \details The filter modifies the scan in place. The line ending of the scan
+ *  is not part of \p buffer and will be re-appended after all filters have
+ *  been applied.
+ *
+ *
+ * \param buffer The scan.
+ * \param length Length of the scan in \p buffer.
+ * \param size Size of \p buffer.
+ * \param cookie Pointer to the filter's data storage.
+ *
+ * \return The new length of the scan. If the scan should be dropped, zero
+ *  should be returned. On error -1 should be returned.
+ */
+typedef int (*codereader_filter_hook_apply)(char *buffer, int length, int size,
+                                            void *cookie);
+
+/** \brief Hook provided by the filter to close a filter instance.
+ *
+ *
+ * \param cookie Pointer to the filter's data storage.
+ *
+ * \return On success zero should be returned, otherwise -1.
+ */
+typedef int (*codereader_filter_hook_close)(void *cookie);
+
+
+/** \brief Struct storing all information about a filter instance.
+ */
+struct codereader_filter
+{
+	void *dh;     ///< Handle for the loaded shared object of the filter.
+	void *cookie; ///< Optional pointer to data storage.
+
+	codereader_filter_hook_open open;   ///< Filter hook to open an instance.
+	codereader_filter_hook_apply apply; ///< Filter hook to process a scan.
+	codereader_filter_hook_close close; ///< Filter hook to close an instance.
+};
+
+
+#endif
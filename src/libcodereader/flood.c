@@ -0,0 +1,256 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Limiting the scan rate of devices.
+ *
+ * \details A device with a stuck trigger or a misconfigured device may send
+ *  thousands of scans per second, which would delay the scans of all other
+ *  devices. If a limit is configured, each scan of the device takes a token of
+ *  a token bucket, which is refilled with the configured rate up to the burst
+ *  size. Scans without a token will be dropped. If a quarantine is configured,
+ *  the device will be quarantined for this time when it exceeds its limit: the
+ *  input of the device will be discarded by the driver's discard hook without
+ *  translating it into scans, if the driver provides one, otherwise all scans
+ *  read will be dropped.
+ */
+
+#include "codereader.h" // codereader API declaration
+
+#include <stdio.h>  // fprintf
+#include <string.h> // strcmp
+#include <time.h>   // clock_gettime
+
+#include "device.h"   // codereader_device, codereader_flood
+#include "handle.h"   // codereader_handle, codereader_flood_*
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Read the rate limit of \p device.
+ *
+ *
+ * \param device The device to configure.
+ * \param config The `limit` group of the device.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_flood_config(struct codereader_device *device,
+                        const config_setting_t *config)
+{
+	int rate = 0, quarantine = 0;
+	config_setting_lookup_int(config, "rate", &rate);
+	if (rate <= 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'limit.rate' must be positive.\n");
+		return false;
+	}
+	int burst = rate;
+	config_setting_lookup_int(config, "burst", &burst);
+	config_setting_lookup_int(config, "quarantine", &quarantine);
+	if (burst <= 0 || quarantine < 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'limit.burst' must be positive and "
+		        "'limit.quarantine' must not be negative.\n");
+		return false;
+	}
+
+	struct codereader_flood *flood = &(device->flood);
+	flood->enabled = true;
+	flood->rate = rate;
+	flood->burst = burst;
+	flood->tokens = burst;
+	flood->quarantine = quarantine;
+	clock_gettime(CLOCK_MONOTONIC, &(flood->last));
+	return true;
+}
+
+
+/** \brief Count \p num scans of \p device dropped by the limit.
+ */
+static inline void
+codereader_flood_drop(struct codereader_device *device, unsigned long num)
+{
+	__atomic_add_fetch(&(device->flood.dropped), num, __ATOMIC_RELAXED);
+}
+
+
+/** \brief Check whether \p device is quarantined.
+ *
+ * \details If the quarantine of the device ended, the device will be released
+ *  from quarantine.
+ *
+ *
+ * \param device The device to check.
+ * \param now The current time (CLOCK_MONOTONIC).
+ *
+ * \return If the device is quarantined true will be returned, otherwise false.
+ */
+static bool
+codereader_flood_check(struct codereader_device *device,
+                       const struct timespec *now)
+{
+	struct codereader_flood *flood = &(device->flood);
+	if (!flood->quarantined)
+		return false;
+
+	if (now->tv_sec < flood->until.tv_sec ||
+	    (now->tv_sec == flood->until.tv_sec &&
+	     now->tv_nsec < flood->until.tv_nsec))
+		return true;
+
+	fprintf(stderr,
+	        CODEREADER_MESSAGE_PREFIX "Device %s released from quarantine.\n",
+	        device->name);
+	flood->quarantined = false;
+	flood->limited = false;
+	return false;
+}
+
+
+/** \brief Discard the input of \p device, if it is quarantined.
+ *
+ * \details This function must be called by the thread reading \p device before
+ *  reading a scan. If the device is quarantined and its driver provides a
+ *  discard hook, the input of the device will be discarded without translating
+ *  it into a scan. The scans ended in the discarded input will be counted as
+ *  dropped. A partial scan read before will be dropped, too, so it doesn't
+ *  become the prefix of the next scan.
+ *
+ *
+ * \param device The device to read.
+ *
+ * \return If the input has been discarded 1 will be returned, if the device
+ *  should be read 0, and -1 if the discard hook failed.
+ */
+CODEREADER_INTERNAL
+int
+codereader_flood_discard(struct codereader_device *device)
+{
+	if (!device->flood.enabled || device->driver.discard == NULL)
+		return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!codereader_flood_check(device, &now))
+		return 0;
+
+	int n = device->driver.discard(device->fd, device->cookie);
+	if (n < 0)
+		return -1;
+	device->length = 0;
+	device->complete = false;
+	codereader_flood_drop(device, n);
+	return 1;
+}
+
+
+/** \brief Check whether a scan of \p device is within its limit.
+ *
+ * \details This function must be called by the thread reading \p device for
+ *  each complete scan. It takes a token of the device's bucket. If no token is
+ *  left, the scan should be dropped and the device will be quarantined, if
+ *  configured.
+ *
+ *
+ * \param device The device that read the scan.
+ *
+ * \return If the scan may be delivered true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_flood_admit(struct codereader_device *device)
+{
+	struct codereader_flood *flood = &(device->flood);
+	if (!flood->enabled)
+		return true;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (codereader_flood_check(device, &now)) {
+		codereader_flood_drop(device, 1);
+		return false;
+	}
+
+	/* Refill the bucket with the tokens earned since the last scan. */
+	double elapsed = (now.tv_sec - flood->last.tv_sec) +
+	                 (now.tv_nsec - flood->last.tv_nsec) / 1e9;
+	flood->last = now;
+	flood->tokens += elapsed * flood->rate;
+	if (flood->tokens > flood->burst)
+		flood->tokens = flood->burst;
+
+	if (flood->tokens >= 1) {
+		flood->tokens -= 1;
+		flood->limited = false;
+		return true;
+	}
+
+	/* The limit has been exceeded. A message will be printed only once until
+	 * the device is within its limit again, so the log isn't flooded, too. */
+	codereader_flood_drop(device, 1);
+	if (flood->quarantine > 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Device %s exceeded its scan rate, quarantined for %u ms.\n",
+		        device->name, flood->quarantine);
+		flood->quarantined = true;
+		flood->until = now;
+		flood->until.tv_sec += flood->quarantine / 1000;
+		flood->until.tv_nsec += (flood->quarantine % 1000) * 1000000L;
+		if (flood->until.tv_nsec >= 1000000000L) {
+			flood->until.tv_sec++;
+			flood->until.tv_nsec -= 1000000000L;
+		}
+	} else if (!flood->limited)
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Device %s exceeded its scan rate, dropping scans.\n",
+		        device->name);
+	flood->limited = true;
+
+	return false;
+}
+
+
+/** \brief Get the number of scans dropped by the rate limits of \p handle.
+ *
+ * \details While a device is quarantined, the scans in its discarded input
+ *  will be counted, too.
+ *
+ *
+ * \param handle The handle returned by \ref codereader_new.
+ * \param device Name of the device or NULL for all devices.
+ *
+ * \return The number of dropped scans.
+ */
+unsigned long
+codereader_dropped(const struct codereader_handle *handle, const char *device)
+{
+	unsigned long dropped = 0;
+	const struct codereader_device *iter;
+	SLIST_FOREACH(iter, &(handle->devices), lmp)
+	{
+		if (device == NULL || strcmp(iter->name, device) == 0)
+			dropped += __atomic_load_n(&(iter->flood.dropped),
+			                           __ATOMIC_RELAXED);
+	}
+	return dropped;
+}
@@ -0,0 +1,256 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Parsing GS1 element strings.
+ *
+ * \details GS1-128, GS1 DataMatrix and other GS1 symbols encode a sequence of
+ *  fields, each starting with an Application Identifier (AI), e.g. `01` for
+ *  the GTIN or `17` for the expiry date. Fields of a predefined length are
+ *  concatenated directly, while fields of variable length are terminated by
+ *  the FNC1 character, which will be transmitted as group separator (GS) by
+ *  the scanner. The number of digits of an AI is determined by its first two
+ *  digits and the length of its value by the AI, so the scan can be parsed in
+ *  a single pass with the tables below.
+ */
+
+#include "codereader.h" // codereader API declaration
+
+#include <stdbool.h> // bool
+#include <stdlib.h>  // bsearch
+#include <string.h>  // memchr, memcpy, strlen, strncmp
+
+
+/** \brief The group separator terminating fields of variable length.
+ */
+#define GS1_GS '\x1d'
+
+
+/** \brief Number of digits of the AIs by their first two digits.
+ *
+ * \details Zero marks AIs, which are not assigned.
+ */
+static const unsigned char codereader_gs1_digits[100] = {
+    2, 2, 2, 0, 0, 0, 0, 0, 0, 0, // 00-09
+    2, 2, 2, 2, 0, 2, 2, 2, 0, 0, // 10-19
+    2, 2, 2, 3, 3, 3, 0, 0, 0, 0, // 20-29
+    2, 4, 4, 4, 4, 4, 4, 2, 0, 4, // 30-39
+    3, 3, 3, 4, 0, 0, 0, 0, 0, 0, // 40-49
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 50-59
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60-69
+    4, 3, 4, 0, 0, 0, 0, 0, 0, 0, // 70-79
+    4, 4, 4, 0, 0, 0, 0, 0, 0, 0, // 80-89
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2  // 90-99
+};
+
+
+/** \brief Definition of an AI.
+ *
+ * \details An entry may define a range of AIs by omitting the last digits,
+ *  e.g. `31` for the AIs `3100` to `3169`.
+ */
+struct codereader_gs1_ai
+{
+	const char *ai;       ///< The AI or its common prefix.
+	bool fixed;           ///< Whether the value has a predefined length.
+	unsigned char length; ///< Length or maximum length of the value.
+};
+
+
+/** \brief Definitions of the AIs.
+ *
+ * \details The entries are sorted by their AI and no entry is a prefix of
+ *  another one, so they can be searched by \ref codereader_gs1_compare.
+ */
+static const struct codereader_gs1_ai codereader_gs1_ais[] = {
+    {"00", true, 18},   {"01", true, 14},   {"02", true, 14},
+    {"10", false, 20},  {"11", true, 6},    {"12", true, 6},
+    {"13", true, 6},    {"15", true, 6},    {"16", true, 6},
+    {"17", true, 6},    {"20", true, 2},    {"21", false, 20},
+    {"22", false, 20},  {"235", false, 28}, {"240", false, 30},
+    {"241", false, 30}, {"242", false, 6},  {"243", false, 20},
+    {"250", false, 30}, {"251", false, 30}, {"253", false, 30},
+    {"254", false, 20}, {"255", false, 25}, {"30", false, 8},
+    {"31", true, 6},    {"32", true, 6},    {"33", true, 6},
+    {"34", true, 6},    {"35", true, 6},    {"36", true, 6},
+    {"37", false, 8},   {"390", false, 15}, {"391", false, 18},
+    {"392", false, 15}, {"393", false, 18}, {"394", true, 4},
+    {"395", true, 6},   {"400", false, 30}, {"401", false, 30},
+    {"402", true, 17},  {"403", false, 30}, {"41", true, 13},
+    {"420", false, 20}, {"421", false, 12}, {"422", true, 3},
+    {"423", false, 15}, {"424", true, 3},   {"425", false, 15},
+    {"426", true, 3},   {"427", false, 3},  {"43", false, 70},
+    {"7001", true, 13}, {"7002", false, 30}, {"7003", true, 10},
+    {"7004", false, 4}, {"7005", false, 12}, {"7006", true, 6},
+    {"7007", false, 12}, {"7008", false, 3}, {"7009", false, 10},
+    {"7010", false, 2}, {"7011", false, 10}, {"7020", false, 20},
+    {"7021", false, 20}, {"7022", false, 20}, {"7023", false, 30},
+    {"703", false, 30}, {"7040", true, 4},  {"71", false, 20},
+    {"723", false, 30}, {"724", false, 20}, {"8001", true, 14},
+    {"8002", false, 20}, {"8003", false, 30}, {"8004", false, 30},
+    {"8005", true, 6},  {"8006", true, 18}, {"8007", false, 34},
+    {"8008", false, 12}, {"8009", false, 50}, {"8010", false, 30},
+    {"8011", false, 12}, {"8012", false, 20}, {"8013", false, 25},
+    {"8017", true, 18}, {"8018", true, 18}, {"8019", false, 10},
+    {"8020", false, 25}, {"8026", true, 18}, {"8110", false, 70},
+    {"8111", true, 4},  {"8112", false, 70}, {"8200", false, 70},
+    {"90", false, 30},  {"91", false, 90},  {"92", false, 90},
+    {"93", false, 90},  {"94", false, 90},  {"95", false, 90},
+    {"96", false, 90},  {"97", false, 90},  {"98", false, 90},
+    {"99", false, 90}};
+
+
+/** \brief Compare the AI \p key with the definition \p elem.
+ *
+ * \details The AI matches the definition, if it starts with the definition's
+ *  AI. As the definitions are free of prefixes, this is consistent with their
+ *  order.
+ */
+static int
+codereader_gs1_compare(const void *key, const void *elem)
+{
+	const char *ai = ((const struct codereader_gs1_ai *)elem)->ai;
+	return strncmp(key, ai, strlen(ai));
+}
+
+
+/** \brief Check whether \p c is a digit.
+ */
+static inline bool
+codereader_gs1_isdigit(char c)
+{
+	return (c >= '0' && c <= '9');
+}
+
+
+/** \brief Skip the symbology identifier of \p data.
+ *
+ * \details Scanners may prefix each scan with its symbology identifier. Only
+ *  identifiers of GS1 symbols will be accepted.
+ *
+ *
+ * \param data The scan.
+ * \param length Length of \p data.
+ * \param pos Where to store the position of the element string.
+ *
+ * \return If \p data has no identifier or the identifier of a GS1 symbol true
+ *  will be returned, otherwise false.
+ */
+static bool
+codereader_gs1_symbology(const char *data, size_t length, size_t *pos)
+{
+	static const char *const ids[] = {"C1", "e0", "d2", "Q3", "J1"};
+
+	*pos = 0;
+	if (length == 0 || data[0] != ']')
+		return true;
+
+	if (length < 3)
+		return false;
+	for (size_t i = 0; i < sizeof(ids) / sizeof(*ids); i++)
+		if (data[1] == ids[i][0] && data[2] == ids[i][1]) {
+			*pos = 3;
+			return true;
+		}
+	return false;
+}
+
+
+/** \brief Parse \p data as GS1 element string.
+ *
+ * \details The scan may start with the symbology identifier of a GS1 symbol
+ *  and a leading FNC1. Fields of a predefined length may be terminated by a
+ *  group separator, too. The values of the fields will not be validated, but
+ *  the AIs must be known and the values must have a valid length.
+ *
+ *
+ * \param data The scan.
+ * \param length Length of \p data.
+ * \param fields Where to store the fields. The offsets of the values are
+ *  relative to \p data.
+ * \param num Maximum number of fields to store in \p fields.
+ *
+ * \return The number of fields will be returned. If \p data is no valid GS1
+ *  element string or has more than \p num fields, -1 will be returned.
+ */
+int
+codereader_gs1_parse(const char *data, size_t length,
+                     struct codereader_gs1_field *fields, size_t num)
+{
+	size_t pos;
+	if (!codereader_gs1_symbology(data, length, &pos))
+		return -1;
+	if (pos < length && data[pos] == GS1_GS)
+		pos++;
+	if (pos == length)
+		return -1;
+
+	size_t n = 0;
+	while (pos < length) {
+		if (n == num || length - pos < 2 ||
+		    !codereader_gs1_isdigit(data[pos]) ||
+		    !codereader_gs1_isdigit(data[pos + 1]))
+			return -1;
+
+		/* Get the AI and its definition. */
+		size_t digits = codereader_gs1_digits[(data[pos] - '0') * 10 +
+		                                      (data[pos + 1] - '0')];
+		if (digits == 0 || length - pos < digits)
+			return -1;
+		for (size_t i = 2; i < digits; i++)
+			if (!codereader_gs1_isdigit(data[pos + i]))
+				return -1;
+		const struct codereader_gs1_ai *ai =
+		    bsearch(data + pos, codereader_gs1_ais,
+		            sizeof(codereader_gs1_ais) / sizeof(*codereader_gs1_ais),
+		            sizeof(*codereader_gs1_ais), codereader_gs1_compare);
+		if (ai == NULL)
+			return -1;
+		memcpy(fields[n].ai, data + pos, digits);
+		fields[n].ai[digits] = '\0';
+		pos += digits;
+
+		/* Get the value. Values of variable length end at the next group
+		 * separator, which will be found by memchr, as its optimized
+		 * implementations compare many bytes at once. */
+		size_t len = length - pos;
+		if (ai->fixed) {
+			if (len < ai->length)
+				return -1;
+			len = ai->length;
+		} else {
+			const char *end = memchr(data + pos, GS1_GS, len);
+			if (end != NULL)
+				len = end - (data + pos);
+			if (len == 0 || len > ai->length)
+				return -1;
+		}
+		fields[n].offset = pos;
+		fields[n].length = len;
+		n++;
+
+		pos += len;
+		if (pos < length && data[pos] == GS1_GS)
+			pos++;
+	}
+
+	return n;
+}
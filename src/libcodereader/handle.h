@@ -0,0 +1,294 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_PRIVATE_HANDLE_H
+#define CODEREADER_PRIVATE_HANDLE_H
+
+
+#include <poll.h>      // struct pollfd
+#include <pthread.h>   // pthread_*
+#include <stdbool.h>   // bool
+#include <sys/types.h> // size_t, ssize_t
+#include <time.h>      // struct timespec
+
+#include "codereader.h" // codereader_barcode, CODEREADER_LATENCY_BUCKETS
+#include "device.h"     // codereader_device*
+#include "queue.h"      // codereader_queue*
+#include "ring.h"       // codereader_ring*
+
+
+/** \brief Initial size of the buffers scans are read into.
+ */
+#define CODEREADER_BUFFER_SIZE 4096
+
+/** \brief Maximum length of a scan.
+ *
+ * \details Longer scans will be delivered in parts of this size.
+ */
+#define CODEREADER_SCAN_MAX (1024 * 1024)
+
+
+/* Forward declaration of the private dedup table. */
+struct codereader_dedup;
+
+
+/** \brief A configuration of devices.
+ *
+ * \details The configuration may be read from the configuration file, a
+ *  string or be built by the functions of the configuration builder.
+ */
+struct codereader_config
+{
+	config_t cfg; ///< The libconfig configuration.
+};
+
+
+/** \brief A scan read by a worker thread.
+ *
+ * \details Scans read by worker threads will be passed to the thread reading
+ *  the codereader stream in these structs.
+ */
+struct codereader_scan
+{
+	struct codereader_queue_node node; ///< Queue management struct.
+	struct codereader_device *device;  ///< The device that read this scan.
+	struct timespec time; ///< Time the scan has been read.
+	struct timespec stamp; ///< Time the scan happened (CLOCK_MONOTONIC).
+	ssize_t length; ///< Length of \ref data or -1, if the device failed.
+	char data[];    ///< The scan.
+};
+
+
+/** \brief Scans held back to be delivered in the order they happened.
+ *
+ * \details The scans will be stored in a min-heap ordered by the time they
+ *  happened. See order.c for details.
+ */
+struct codereader_order
+{
+	bool enabled;                 ///< Whether scans will be ordered.
+	unsigned int window;          ///< Reorder window in ms.
+	struct codereader_scan **heap; ///< Min-heap of the held back scans.
+	size_t num;                   ///< Number of scans in \ref heap.
+	size_t size;                  ///< Size of \ref heap.
+};
+
+
+/** \brief Struct storing all information about an opened codereader stream.
+ *
+ * \details A pointer to this struct will be returned by \ref codereader_new
+ *  and used as cookie of the stream returned by \ref codereader_open.
+ */
+struct codereader_handle
+{
+	struct codereader_device_list devices; ///< List of all opened devices.
+
+	/** \brief The parsed configuration.
+	 *
+	 * \details The configuration will be kept for the lifetime of the handle,
+	 *  so failed devices can be reopened with their configuration.
+	 */
+	struct codereader_config *config;
+
+	/** \brief Pipe to wake up the reader of the stream.
+	 *
+	 * \details If a worker pushed a scan into the queue of its device and
+	 *  \ref signalled is not set, it will write a byte into \ref wakeup, so a
+	 *  reader waiting for new scans wakes up.
+	 */
+	int wakeup[2];  ///< Pipe to wake up the reader of the stream.
+	bool signalled; ///< Whether a byte has been written into \ref wakeup.
+	int stop[2];    ///< Pipe closed to stop all worker threads.
+	int epoll;      ///< Pollable descriptor of \ref codereader_fileno.
+	int timer;      ///< Timer of \ref epoll for scans held back.
+
+	/** \brief File descriptors polled by \ref codereader_next.
+	 *
+	 * \details The list has an entry for each device and both pipes, so it
+	 *  doesn't need to be resized, when it is rebuilt for a wakeup.
+	 */
+	struct pollfd *polls;
+
+	struct codereader_scan *pending; ///< Scan returned by the last call.
+	struct codereader_order order;   ///< Scans held back for ordering.
+
+	/** \brief GS1 fields of the scan returned by the last call.
+	 */
+	struct codereader_gs1_field gs1[CODEREADER_GS1_FIELDS];
+
+	/** \brief State of the stream returned by \ref codereader_open.
+	 *
+	 * \details The stream delivers the scans of \ref codereader_next with
+	 *  the line ending the driver terminated the scan with.
+	 */
+	struct codereader_barcode current;
+	size_t ending; ///< Length of the stripped line ending of \ref current.
+	size_t offset; ///< Number of delivered bytes of \ref current.
+
+	/** \brief Recently delivered scans.
+	 *
+	 * \details The table will be allocated only, if at least one device has
+	 *  duplicate suppression enabled.
+	 */
+	struct codereader_dedup *dedup;
+
+	/** \brief Real-time settings of the `global` configuration group.
+	 *
+	 * \details These settings will be applied to the thread reading the
+	 *  stream, when it calls \ref codereader_next the first time, and to all
+	 *  worker threads without settings of their own.
+	 */
+	struct codereader_realtime realtime;
+	bool realtime_applied; ///< Whether \ref realtime has been applied.
+
+	/** \brief Scheduling of the thread reading the stream before
+	 *  \ref realtime has been applied or NULL.
+	 */
+	struct codereader_realtime_saved *realtime_saved;
+
+	/** \brief Histogram of the latency of all delivered scans.
+	 *
+	 * \details Bucket `i` counts scans delivered within less than `2^i` us
+	 *  after the scan has been read from the device.
+	 */
+	unsigned long latency[CODEREADER_LATENCY_BUCKETS];
+
+	/** \brief Scans distributed to multiple consumers.
+	 *
+	 * \details If enabled by \ref codereader_dispatch, the \ref dispatcher
+	 *  thread reads all scans and pushes them into \ref dispatch_ring.
+	 *  \ref dispatch_items counts the queued scans and \ref dispatch_slots
+	 *  the free slots of the queue. Both are protected by \ref dispatch_lock
+	 *  and waited for with \ref dispatch_pushed and \ref dispatch_taken.
+	 */
+	struct codereader_ring dispatch_ring;
+	size_t dispatch_items; ///< Number of scans in \ref dispatch_ring.
+	size_t dispatch_slots; ///< Number of free slots in \ref dispatch_ring.
+	pthread_mutex_t dispatch_lock;  ///< Lock of the counters above.
+	pthread_cond_t dispatch_pushed; ///< Signalled for new scans.
+	pthread_cond_t dispatch_taken;  ///< Signalled for new free slots.
+	pthread_t dispatcher;  ///< Thread reading the scans for the consumers.
+	bool dispatching;      ///< Whether \ref dispatcher has been started.
+	bool dispatch_stop;    ///< Whether \ref dispatcher should stop.
+	bool dispatch_failed;  ///< Whether \ref dispatcher failed.
+};
+
+
+ssize_t codereader_device_read(struct codereader_device *device);
+bool codereader_device_lock(struct codereader_device *device);
+
+void codereader_dispatch_stop(struct codereader_handle *handle);
+
+bool codereader_worker_start(struct codereader_device *device);
+void codereader_worker_stop(struct codereader_handle *handle);
+void codereader_worker_wakeup(struct codereader_handle *handle);
+struct codereader_scan *codereader_scan_new(struct codereader_device *device,
+                                            const char *buffer,
+                                            ssize_t length);
+
+bool codereader_lane_config(struct codereader_device *device,
+                            const config_setting_t *config);
+void codereader_lane_sort(struct codereader_handle *handle);
+bool codereader_lane_pending(struct codereader_handle *handle);
+struct codereader_device *codereader_lane_pick(struct codereader_handle *handle,
+                                               bool polled);
+struct codereader_scan *codereader_lane_take(struct codereader_device *device);
+
+bool codereader_flood_config(struct codereader_device *device,
+                             const config_setting_t *config);
+int codereader_flood_discard(struct codereader_device *device);
+bool codereader_flood_admit(struct codereader_device *device);
+
+bool codereader_order_config(struct codereader_handle *handle,
+                             const config_setting_t *config);
+bool codereader_order_push(struct codereader_handle *handle,
+                           struct codereader_scan *scan);
+struct codereader_scan *codereader_order_pop(struct codereader_handle *handle);
+bool codereader_order_timeout(const struct codereader_handle *handle,
+                              struct timespec *ts);
+void codereader_order_free(struct codereader_handle *handle);
+
+bool codereader_reconnect_config(struct codereader_device *device,
+                                 const config_setting_t *config);
+bool codereader_reconnect_start(struct codereader_device *device);
+
+bool codereader_dedup_config(struct codereader_device *device,
+                             const config_setting_t *config);
+bool codereader_dedup_check(struct codereader_device *device,
+                            const char *buffer, size_t length);
+
+bool codereader_filter_config(struct codereader_device *device,
+                              const config_setting_t *config);
+size_t codereader_filter_apply(struct codereader_device *device, char *buffer,
+                               size_t length, size_t size);
+int codereader_filter_close(struct codereader_device *device);
+
+bool codereader_realtime_config(struct codereader_realtime *rt,
+                                const config_setting_t *config);
+bool codereader_realtime_apply(const struct codereader_realtime *rt);
+bool codereader_realtime_enter(struct codereader_handle *handle);
+void codereader_realtime_restore(struct codereader_handle *handle);
+
+bool codereader_validate_config(struct codereader_device *device,
+                                const config_setting_t *config);
+size_t codereader_validate(struct codereader_device *device, char *buffer,
+                           size_t length, size_t size);
+
+
+/** \brief Get the real-time settings of the thread reading \p device.
+ *
+ * \details Devices read by a worker thread may have settings of their own.
+ *  Otherwise the global settings of the handle will be used.
+ */
+static inline const struct codereader_realtime *
+codereader_realtime_get(const struct codereader_device *device)
+{
+	return (device->threaded && device->realtime.enabled)
+	           ? &(device->realtime)
+	           : &(device->handle->realtime);
+}
+
+
+/** \brief Apply the filters and validation of \p device to a scan.
+ *
+ * \details These stages will be run by the thread reading \p device, i.e. a
+ *  worker thread for threaded devices.
+ *
+ *
+ * \param device The device that read the scan.
+ * \param buffer The scan.
+ * \param length Length of \p buffer.
+ * \param size Size of \p buffer.
+ *
+ * \return The new length of the scan. If the scan has been dropped, zero will
+ *  be returned.
+ */
+static inline size_t
+codereader_process(struct codereader_device *device, char *buffer,
+                   size_t length, size_t size)
+{
+	length = codereader_filter_apply(device, buffer, length, size);
+	if (length > 0)
+		length = codereader_validate(device, buffer, length, size);
+	return length;
+}
+
+
+#endif
@@ -79,6 +79,7 @@
 CODEREADER_READ_RETURN_TYPE codereader_read(void *cookie, char *buf,
                                             CODEREADER_READ_SIZE_TYPE size);
 int codereader_close(void *cookie);
+void *codereader_dlsym(void *handle, const char *name);
 
 
 #endif
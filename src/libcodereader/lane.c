@@ -0,0 +1,208 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Selecting the device to be served next.
+ *
+ * \details Each device has a priority and a weight. If more than one device
+ *  has a scan ready, the devices with the highest priority will be served
+ *  first. Devices with the same priority share the stream by their weights
+ *  using a smooth weighted round-robin, i.e. a device with weight 3 will be
+ *  served three times as often as a device with weight 1, but not three times
+ *  in a row. Scans of worker threads will be queued per device, so a backlog
+ *  of one device doesn't delay the scans of devices with a higher priority.
+ */
+
+#include <stdio.h> // fprintf
+
+#include "device.h"   // codereader_device
+#include "handle.h"   // codereader_handle, codereader_lane_*
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Read the priority and weight of \p device.
+ *
+ *
+ * \param device The device to configure.
+ * \param config The configuration of the device.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_lane_config(struct codereader_device *device,
+                       const config_setting_t *config)
+{
+	int priority = 0, weight = 1;
+	config_setting_lookup_int(config, "priority", &priority);
+	config_setting_lookup_int(config, "weight", &weight);
+	if (weight <= 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'weight' must be positive.\n");
+		return false;
+	}
+
+	device->priority = priority;
+	device->weight = weight;
+	return true;
+}
+
+
+/** \brief Sort the devices of \p handle by their priority.
+ *
+ * \details Devices with a higher priority will be moved to the front of the
+ *  list. The order of devices with the same priority will be preserved, so
+ *  all loops over the devices check the devices with a higher priority first.
+ *
+ *
+ * \param handle The handle of the stream.
+ */
+CODEREADER_INTERNAL
+void
+codereader_lane_sort(struct codereader_handle *handle)
+{
+	struct codereader_device_list sorted = SLIST_HEAD_INITIALIZER(sorted);
+	struct codereader_device *device;
+	while ((device = SLIST_FIRST(&(handle->devices))) != NULL) {
+		SLIST_REMOVE_HEAD(&(handle->devices), lmp);
+
+		/* Insert the device behind all devices with at least its priority. */
+		struct codereader_device *iter = SLIST_FIRST(&sorted), *prev = NULL;
+		while (iter != NULL && iter->priority >= device->priority) {
+			prev = iter;
+			iter = SLIST_NEXT(iter, lmp);
+		}
+		if (prev == NULL)
+			SLIST_INSERT_HEAD(&sorted, device, lmp);
+		else
+			SLIST_INSERT_AFTER(prev, device, lmp);
+	}
+	handle->devices = sorted;
+}
+
+
+/** \brief Check whether the worker thread of \p device queued a scan.
+ *
+ * \details The next scan of the device's queue will be moved to \ref next, so
+ *  the queue can be checked without taking the scan.
+ *
+ *
+ * \param device The device to check.
+ *
+ * \return If a scan is ready true will be returned, otherwise false.
+ */
+static bool
+codereader_lane_queued(struct codereader_device *device)
+{
+	if (!device->threaded)
+		return false;
+	if (device->next == NULL)
+		device->next = (struct codereader_scan *)codereader_queue_pop(
+		    &(device->queue));
+	return (device->next != NULL);
+}
+
+
+/** \brief Check whether any worker thread of \p handle queued a scan.
+ *
+ *
+ * \param handle The handle of the stream.
+ *
+ * \return If a scan is ready true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_lane_pending(struct codereader_handle *handle)
+{
+	struct codereader_device *iter;
+	SLIST_FOREACH(iter, &(handle->devices), lmp)
+	{
+		if (codereader_lane_queued(iter))
+			return true;
+	}
+	return false;
+}
+
+
+/** \brief Select the device of \p handle to be served next.
+ *
+ * \details Devices with a queued scan and devices read by the calling thread,
+ *  whose file descriptor has been returned by the last poll, are ready. The
+ *  ready device with the highest priority will be selected. If more than one
+ *  device with this priority is ready, the device will be selected by the
+ *  weights of these devices.
+ *
+ *
+ * \param handle The handle of the stream.
+ * \param polled Whether the poll list of \p handle has been polled. If not,
+ *  only the queues of the worker threads will be checked.
+ *
+ * \return The selected device or NULL, if no device is ready.
+ */
+CODEREADER_INTERNAL
+struct codereader_device *
+codereader_lane_pick(struct codereader_handle *handle, bool polled)
+{
+	struct codereader_device *iter, *best = NULL;
+	int total = 0;
+	SLIST_FOREACH(iter, &(handle->devices), lmp)
+	{
+		/* As the devices are sorted by their priority, no other device needs
+		 * to be checked, if a device with a higher priority is ready. */
+		if (best != NULL && iter->priority < best->priority)
+			break;
+
+		bool ready = (iter->threaded)
+		                 ? codereader_lane_queued(iter)
+		                 : (polled && iter->poll != NULL &&
+		                    iter->poll->revents != 0);
+		if (!ready)
+			continue;
+
+		iter->current += iter->weight;
+		total += iter->weight;
+		if (best == NULL || iter->current > best->current)
+			best = iter;
+	}
+
+	if (best != NULL)
+		best->current -= total;
+	return best;
+}
+
+
+/** \brief Take the queued scan of \p device.
+ *
+ * \details \ref codereader_lane_pick must have selected \p device before.
+ *
+ *
+ * \param device The device.
+ *
+ * \return The scan, which will be owned by the caller.
+ */
+CODEREADER_INTERNAL
+struct codereader_scan *
+codereader_lane_take(struct codereader_device *device)
+{
+	struct codereader_scan *scan = device->next;
+	device->next = NULL;
+	return scan;
+}
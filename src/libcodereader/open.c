@@ -27,16 +27,20 @@
 
 #include <assert.h>  // assert
 #include <dlfcn.h>   // dl* functions
+#include <poll.h>    // struct pollfd
 #include <stdbool.h> // bool, false, true
 #include <stdio.h>   // IO functions, types and macros
 #include <stdlib.h>  // getenv, malloc
-#include <string.h>  // memset
+#include <string.h>  // memset, strcmp, strdup
+#include <unistd.h>  // pipe
 
 #include <libconfig.h> // libconfig API
 
 #include "config.h"   // CMake configuration values
 #include "device.h"   // codereader_source* and codereader_hook*
+#include "handle.h"   // codereader_handle, codereader_worker_*
 #include "internal.h" // CODEREADER_MESSAGE_PREFIX, codereader_* functions
+#include "probes.h"   // CODEREADER_PROBE*
 
 
 /** \brief Get the config file to use.
@@ -56,6 +60,24 @@ codereader_config_file()
 }
 
 
+/** \brief Get the directory to load drivers from.
+ *
+ * \details By default the drivers in \ref CODEREADER_DRIVER_DIR will be
+ *  loaded. However, if the user defines the environment variable
+ *  `CODEREADER_DRIVER_DIR`, drivers will be loaded from this directory instead,
+ *  e.g. to use drivers of a build directory in tests.
+ *
+ *
+ * \return Pointer to the char-array to be used as directory.
+ */
+static inline const char *
+codereader_driver_dir()
+{
+	const char *p = getenv("CODEREADER_DRIVER_DIR");
+	return (p != NULL) ? p : CODEREADER_DRIVER_DIR;
+}
+
+
 /** \brief Resolve symbol \p name in \p handle.
  *
  * \details This function is a wrapper for `dlsym` to print an error message, if
@@ -67,7 +89,8 @@ codereader_config_file()
  *
  * \return The return value of `dlsym` will be pass through.
  */
-static inline void *
+CODEREADER_INTERNAL
+void *
 codereader_dlsym(void *handle, const char *name)
 {
 	dlerror();
@@ -101,11 +124,28 @@ codereader_driver_load(const char *name, struct codereader_driver *driver)
 	assert(driver);
 
 
+	/* Drivers linked into libcodereader don't need to be loaded. Their hooks
+	 * can be used directly. */
+	const struct codereader_static_driver *iter;
+	for (iter = codereader_static_drivers; iter->name != NULL; iter++) {
+		if (strcmp(iter->name, name) == 0) {
+			driver->dh = NULL;
+			driver->open = iter->open;
+			driver->read = iter->read;
+			driver->close = iter->close;
+			driver->timestamp = iter->timestamp;
+			driver->discard = iter->discard;
+			driver->blocking = (iter->blocking != NULL && *iter->blocking);
+			driver->datagram = (iter->datagram != NULL && *iter->datagram);
+			return true;
+		}
+	}
+
 	/* Load the reqested driver. RTLD_NOW will be used, to resolve all symbols
 	 * before using the driver, so that there can't be any resolving issues at
 	 * any later time. */
 	char buffer[FILENAME_MAX];
-	snprintf(buffer, FILENAME_MAX, "%s/%s.so", CODEREADER_DRIVER_DIR, name);
+	snprintf(buffer, FILENAME_MAX, "%s/%s.so", codereader_driver_dir(), name);
 	driver->dh = dlopen(buffer, RTLD_NOW);
 	if (driver->dh == NULL)
 		return false;
@@ -122,56 +162,98 @@ codereader_driver_load(const char *name, struct codereader_driver *driver)
 	*(void **)(&(driver->read)) = codereader_dlsym(driver->dh, "device_read");
 	*(void **)(&(driver->close)) = codereader_dlsym(driver->dh, "device_close");
 
+	/* The blocking and datagram classifications, the timestamp and discard
+	 * hooks are optional, so dlsym will be called directly and no error
+	 * message printed, if the symbol is missing. */
+	const int *blocking = dlsym(driver->dh, "device_blocking");
+	driver->blocking = (blocking != NULL && *blocking);
+	const int *datagram = dlsym(driver->dh, "device_datagram");
+	driver->datagram = (datagram != NULL && *datagram);
+	*(void **)(&(driver->timestamp)) = dlsym(driver->dh, "device_timestamp");
+	*(void **)(&(driver->discard)) = dlsym(driver->dh, "device_discard");
+
 	return (driver->open != NULL && driver->read != NULL &&
 	        driver->close != NULL);
 }
 
 
-/** \brief Open a new handle to read data from barcode readers.
+/** \brief Open a new handle for the devices of \p config.
  *
- * \details This function will setup all necessary internal data structures and
- *  read the configuration files to support an interface to read barcodes read
- *  by all connected barcode scanners with a single call to fread or similar
- *  functions.
+ * \details This function will setup all necessary internal data structures to
+ *  support an interface to read barcodes read by all configured barcode
+ *  scanners with calls to \ref codereader_next.
  *
  *
- * \return Pointer to a new created file handle.
+ * \param config The configuration of the devices. It will be owned by the new
+ *  handle and freed on errors. If NULL, this function fails.
+ *
+ * \return Pointer to a new created handle.
  * \return NULL An error occured.
  */
-FILE *
-codereader_open()
+static struct codereader_handle *
+codereader_new_handle(struct codereader_config *config)
 {
-	/* Load the configuration file. If reading the configuration file fails, a
-	 * message will be printed on stderr and no further processing happens. */
-	config_t cfg;
-	config_init(&cfg);
-	if (!config_read_file(&cfg, codereader_config_file())) {
-		if (config_error_type(&cfg) == CONFIG_ERR_FILE_IO)
-			fprintf(stderr,
-			        CODEREADER_MESSAGE_PREFIX "Can't read config in %s\n",
-			        codereader_config_file());
-		else
-			fprintf(stderr, CODEREADER_MESSAGE_PREFIX "%s:%d - %s\n",
-			        config_error_file(&cfg), config_error_line(&cfg),
-			        config_error_text(&cfg));
+	if (config == NULL)
+		return NULL;
 
-		config_destroy(&cfg);
+	/* Initialize the handle. It stores the list of all loaded codereader
+	 * sources, which will be used below to store all configuration and
+	 * driver-related data. The handle will not be global, so an application
+	 * may open more than one handle. */
+	struct codereader_handle *handle =
+	    malloc(sizeof(struct codereader_handle));
+	if (handle == NULL) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Not enough memory in %s:%d for handle.\n",
+		        __FILE__, __LINE__);
+		codereader_config_free(config);
 		return NULL;
 	}
+	memset(handle, 0, sizeof(struct codereader_handle));
+	handle->config = config;
+	SLIST_INIT(&(handle->devices));
+	handle->wakeup[0] = handle->wakeup[1] = -1;
+	handle->stop[0] = handle->stop[1] = -1;
+	handle->epoll = handle->timer = -1;
+	if (pipe(handle->wakeup) < 0 || pipe(handle->stop) < 0) {
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Failed to create internal pipes.\n");
+		goto free_device_list;
+	}
+
+	/* The configuration will be kept in the handle, so failed devices can be
+	 * reopened later. */
+	config_t *cfg = &(config->cfg);
+
+	/* The group 'global' is reserved for settings, which are not related to a
+	 * specific device. */
+	config_setting_t *global = config_lookup(cfg, "global");
+	if (global != NULL) {
+		config_setting_t *realtime =
+		    config_setting_get_member(global, "realtime");
+		if (realtime != NULL &&
+		    !codereader_realtime_config(&(handle->realtime), realtime)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid global realtime configuration.\n");
+			goto free_device_list;
+		}
 
-	/* Initialize the list of all loaded codereader sources. The list will be
-	 * used below to store all configuration and driver-related data. The head-
-	 * pointer will not be global, as it will be stored in the cookie inside the
-	 * FILE struct (below). */
-	struct codereader_device_list head = SLIST_HEAD_INITIALIZER(head);
-	SLIST_INIT(&head);
+		config_setting_t *order = config_setting_get_member(global, "order");
+		if (order != NULL && !codereader_order_config(handle, order)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid global order configuration.\n");
+			goto free_device_list;
+		}
+	}
 
 	/* Iterate over all config entries - each entry is one driver to load (which
 	 * handles one or more devices). */
-	config_setting_t *root = config_root_setting(&cfg);
+	config_setting_t *root = config_root_setting(cfg);
 	int n = config_setting_length(root);
 	for (size_t i = 0; i < n; i++) {
 		config_setting_t *iter = config_setting_get_elem(root, i);
+		if (iter == global)
+			continue;
 
 		/* Allocate memory for the device struct. Default values will be set, so
 		 * the close function can detect what is initialized yet on errors. */
@@ -188,7 +270,19 @@ codereader_open()
 		/* Append device to the list of all loaded devices. This will be done
 		 * first after allocating the memory, so the 'free_device_list' label
 		 * will free the memory for this device, too. */
-		SLIST_INSERT_HEAD(&head, device, lmp);
+		SLIST_INSERT_HEAD(&(handle->devices), device, lmp);
+		device->handle = handle;
+		device->config = iter;
+		codereader_queue_init(&(device->queue));
+
+		/* The name of the device will be copied, so it remains independent of
+		 * the configuration. */
+		if ((device->name = strdup(config_setting_name(iter))) == NULL) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Not enough memory in %s:%d for device %s.\n",
+			        __FILE__, __LINE__, config_setting_name(iter));
+			goto free_device_list;
+		}
 
 		/* Get the driver used by this device and load it. If no driver is
 		 * specified, or the driver can't be loaded, an error message will be
@@ -221,10 +315,238 @@ codereader_open()
 			        config_setting_name(iter));
 			goto free_device_list;
 		}
+		CODEREADER_PROBE2(device__open, device->name, device->fd);
+
+		/* Real-time settings of a device apply to its worker thread only, so
+		 * a device with real-time settings will be read by a worker thread by
+		 * default. */
+		config_setting_t *realtime =
+		    config_setting_get_member(iter, "realtime");
+		if (realtime != NULL &&
+		    !codereader_realtime_config(&(device->realtime), realtime)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid realtime configuration for device %s.\n",
+			        config_setting_name(iter));
+			goto free_device_list;
+		}
+
+		/* Check whether this device should be read by a worker thread. By
+		 * default, only devices of blocking drivers or with real-time settings
+		 * will be read by a worker thread, but the user may override this in
+		 * the configuration. */
+		int threaded = device->driver.blocking || device->realtime.enabled;
+		config_setting_lookup_bool(iter, "thread", &threaded);
+		device->threaded = threaded;
+
+		int gs1 = 0;
+		config_setting_lookup_bool(iter, "gs1", &gs1);
+		device->gs1 = gs1;
+
+		if (!codereader_lane_config(device, iter)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid priority configuration for device %s.\n",
+			        config_setting_name(iter));
+			goto free_device_list;
+		}
+
+		/* Load the filter chain and enable check digit validation and
+		 * duplicate suppression, if configured for the device. */
+		config_setting_t *filters = config_setting_get_member(iter, "filters");
+		if (filters != NULL && !codereader_filter_config(device, filters)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Failed to load filters for device %s.\n",
+			        config_setting_name(iter));
+			goto free_device_list;
+		}
+
+		config_setting_t *validate =
+		    config_setting_get_member(iter, "validate");
+		if (validate != NULL &&
+		    !codereader_validate_config(device, validate)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid validate configuration for device %s.\n",
+			        config_setting_name(iter));
+			goto free_device_list;
+		}
+
+		config_setting_t *dedup = config_setting_get_member(iter, "dedup");
+		if (dedup != NULL && !codereader_dedup_config(device, dedup)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid dedup configuration for device %s.\n",
+			        config_setting_name(iter));
+			goto free_device_list;
+		}
+
+		config_setting_t *limit = config_setting_get_member(iter, "limit");
+		if (limit != NULL && !codereader_flood_config(device, limit)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid limit configuration for device %s.\n",
+			        config_setting_name(iter));
+			goto free_device_list;
+		}
+
+		/* Failed devices will be reconnected by default, so a single device
+		 * doesn't stop the whole stream. */
+		if (!codereader_reconnect_config(
+		        device, config_setting_get_member(iter, "reconnect"))) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Invalid reconnect configuration for device %s.\n",
+			        config_setting_name(iter));
+			goto free_device_list;
+		}
+	}
+
+	/* Lock the buffers of the devices, if the thread reading them should lock
+	 * its buffers. The worker threads will be started after all devices have
+	 * been opened, so no worker thread needs to be stopped, if opening a
+	 * device fails. The devices will be sorted by their priority first, so
+	 * devices with a higher priority will be checked first for scans. */
+	codereader_lane_sort(handle);
+	size_t num_polls = 2;
+	struct codereader_device *device;
+	SLIST_FOREACH(device, &(handle->devices), lmp)
+	{
+		num_polls++;
+		const struct codereader_realtime *rt = codereader_realtime_get(device);
+		if (rt->enabled && rt->mlock && !codereader_device_lock(device)) {
+			codereader_destroy(handle);
+			return NULL;
+		}
+		if (device->threaded && !codereader_worker_start(device)) {
+			codereader_destroy(handle);
+			return NULL;
+		}
+	}
+
+	/* The poll list of the stream will be allocated once for all devices. A
+	 * poll list is used instead of select, as select can't handle file
+	 * descriptors beyond FD_SETSIZE, which will be reached by streams with a
+	 * large number of devices. */
+	handle->polls = malloc(num_polls * sizeof(struct pollfd));
+	if (handle->polls == NULL) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Not enough memory in %s:%d for poll list.\n",
+		        __FILE__, __LINE__);
+		codereader_destroy(handle);
+		return NULL;
+	}
+
+	return handle;
+
+
+free_device_list:
+	/* The following code will be called in error-situations. All opened devices
+	 * will be closed immediately and the memory for the list and configuration
+	 * freed. */
+	codereader_destroy(handle);
+	return NULL;
+}
+
+
+/** \brief Open a new handle to read data from barcode readers.
+ *
+ * \details This function reads the configuration file and opens a new handle
+ *  for the configured devices.
+ *
+ *
+ * \return Pointer to a new created handle.
+ * \return NULL An error occured.
+ */
+struct codereader_handle *
+codereader_new()
+{
+	/* Load the configuration file. If reading the configuration file fails, a
+	 * message will be printed on stderr and no further processing happens. */
+	struct codereader_config *config = codereader_config_new();
+	if (config == NULL)
+		return NULL;
+
+	config_t *cfg = &(config->cfg);
+	if (!config_read_file(cfg, codereader_config_file())) {
+		if (config_error_type(cfg) == CONFIG_ERR_FILE_IO)
+			fprintf(stderr,
+			        CODEREADER_MESSAGE_PREFIX "Can't read config in %s\n",
+			        codereader_config_file());
+		else
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX "%s:%d - %s\n",
+			        config_error_file(cfg), config_error_line(cfg),
+			        config_error_text(cfg));
+
+		codereader_config_free(config);
+		return NULL;
+	}
+
+	return codereader_new_handle(config);
+}
+
+
+/** \brief Open a new handle with the configuration \p text.
+ *
+ * \details Unlike \ref codereader_new, no configuration file and no
+ *  environment variable will be read, so handles with different
+ *  configurations may be opened concurrently.
+ *
+ *
+ * \param text The configuration in the syntax of the configuration file.
+ *
+ * \return Pointer to a new created handle.
+ * \return NULL An error occured.
+ */
+struct codereader_handle *
+codereader_new_config(const char *text)
+{
+	struct codereader_config *config = codereader_config_new();
+	if (config == NULL)
+		return NULL;
+
+	config_t *cfg = &(config->cfg);
+	if (!config_read_string(cfg, text)) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX "Configuration:%d - %s\n",
+		        config_error_line(cfg), config_error_text(cfg));
+		codereader_config_free(config);
+		return NULL;
 	}
 
-	/* Free the space allocated for the configuration. */
-	config_destroy(&cfg);
+	return codereader_new_handle(config);
+}
+
+
+/** \brief Open a new handle with the configuration built in \p config.
+ *
+ * \details See \ref codereader_config_new for building a configuration. Like
+ *  \ref codereader_new_config, no file and no environment variable will be
+ *  read.
+ *
+ *
+ * \param config The configuration. It will be owned by the new handle, or
+ *  freed if an error occurs, so it must not be used after this call.
+ *
+ * \return Pointer to a new created handle.
+ * \return NULL An error occured.
+ */
+struct codereader_handle *
+codereader_new_from(struct codereader_config *config)
+{
+	return codereader_new_handle(config);
+}
+
+
+/** \brief Wrap \p handle into a new stream.
+ *
+ * \details The stream allows barcodes read by all connected barcode scanners
+ *  to be read with a single call to fread or similar functions.
+ *
+ *
+ * \param handle The handle to wrap or NULL.
+ *
+ * \return Pointer to a new created file handle.
+ * \return NULL An error occured or \p handle is NULL.
+ */
+static FILE *
+codereader_stream(struct codereader_handle *handle)
+{
+	if (handle == NULL)
+		return NULL;
 
 
 #ifdef HAVE_FOPENCOOKIE
@@ -235,31 +557,75 @@ codereader_open()
 	hooks.read = codereader_read;
 	hooks.close = codereader_close;
 
-	/* Setup the new codereader stream. A pointer to the device list will be
-	 * passed, so the read and close functions can access the list of devices.
-	 * On success fopencookie() returns a pointer to the new stream. On error,
-	 * NULL is returned, so we don't have to evaluate the result and simply
-	 * return it. */
-	return fopencookie(SLIST_FIRST(&head), "r", hooks);
+	/* Setup the new codereader stream. A pointer to the handle will be passed,
+	 * so the read and close functions can access the list of devices. On
+	 * success fopencookie() returns a pointer to the new stream. On error, the
+	 * handle has to be closed. */
+	FILE *stream = fopencookie(handle, "r", hooks);
 
 #else
-	/* Setup the new codereader stream. A pointer to the device list will be
-	 * passed, so the read and close functions can access the list of devices.
-	 * Thus the codereader stream is readonly and unable to seek, write and seek
+	/* Setup the new codereader stream. A pointer to the handle will be passed,
+	 * so the read and close functions can access the list of devices. Thus the
+	 * codereader stream is readonly and unable to seek, write and seek
 	 * functions don't have to be defined. The read and close hooks will be
 	 * mapped to internal codereader functions. On success funopen returns a
-	 * pointer to the new stream. On error, NULL is returned, so we don't have
-	 * to evaluate the result and simply return it. */
-	return funopen(SLIST_FIRST(&head), codereader_read, NULL, NULL,
-	               codereader_close);
+	 * pointer to the new stream. On error, the handle has to be closed. */
+	FILE *stream =
+	    funopen(handle, codereader_read, NULL, NULL, codereader_close);
 #endif
 
+	if (stream == NULL)
+		codereader_destroy(handle);
+	return stream;
+}
 
-free_device_list:
-	/* The following code will be called in error-situations. All opened devices
-	 * will be closed immediately and the memory for the list and configuration
-	 * freed. */
-	codereader_close(SLIST_FIRST(&head));
-	config_destroy(&cfg);
-	return NULL;
+
+/** \brief Open a new stream to read data from barcode readers.
+ *
+ * \details This function opens a new handle by \ref codereader_new and wraps
+ *  it into a stream, so barcodes read by all connected barcode scanners can be
+ *  read with a single call to fread or similar functions.
+ *
+ *
+ * \return Pointer to a new created file handle.
+ * \return NULL An error occured.
+ */
+FILE *
+codereader_open()
+{
+	return codereader_stream(codereader_new());
+}
+
+
+/** \brief Open a new stream with the configuration \p text.
+ *
+ * \details See \ref codereader_new_config for details.
+ *
+ *
+ * \param text The configuration in the syntax of the configuration file.
+ *
+ * \return Pointer to a new created file handle.
+ * \return NULL An error occured.
+ */
+FILE *
+codereader_open_config(const char *text)
+{
+	return codereader_stream(codereader_new_config(text));
+}
+
+
+/** \brief Open a new stream with the configuration built in \p config.
+ *
+ * \details See \ref codereader_new_from for details.
+ *
+ *
+ * \param config The configuration. It will be owned by the stream.
+ *
+ * \return Pointer to a new created file handle.
+ * \return NULL An error occured.
+ */
+FILE *
+codereader_open_from(struct codereader_config *config)
+{
+	return codereader_stream(codereader_new_from(config));
 }
@@ -0,0 +1,245 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Delivering scans of all devices in the order they happened.
+ *
+ * \details If enabled, scans will be held back in a min-heap ordered by the
+ *  time they happened, until either their reorder window elapsed, or all
+ *  devices have a newer scan pending. As the scans of each device are read in
+ *  order, the oldest scan can't be preceded by any scan read later in the
+ *  latter case, so it will be delivered without waiting for the window.
+ */
+
+#include <stdio.h>  // fprintf
+#include <stdlib.h> // free, realloc
+#include <time.h>   // clock_gettime
+
+#include "handle.h"   // codereader_handle, codereader_order_*
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Default reorder window in ms.
+ */
+#define CODEREADER_ORDER_WINDOW 20
+
+
+/** \brief Read the ordering configuration of \p handle.
+ *
+ *
+ * \param handle The handle to configure.
+ * \param config The `order` group of the global configuration.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_order_config(struct codereader_handle *handle,
+                        const config_setting_t *config)
+{
+	int window = CODEREADER_ORDER_WINDOW;
+	config_setting_lookup_int(config, "window", &window);
+	if (window < 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'order.window' must not be negative.\n");
+		return false;
+	}
+
+	handle->order.enabled = true;
+	handle->order.window = window;
+	return true;
+}
+
+
+/** \brief Compare the times two scans happened.
+ *
+ * \return If \p a happened before \p b true will be returned, otherwise false.
+ */
+static inline bool
+codereader_order_before(const struct codereader_scan *a,
+                        const struct codereader_scan *b)
+{
+	return (a->stamp.tv_sec < b->stamp.tv_sec) ||
+	       (a->stamp.tv_sec == b->stamp.tv_sec &&
+	        a->stamp.tv_nsec < b->stamp.tv_nsec);
+}
+
+
+/** \brief Add \p scan to the scans held back by \p handle.
+ *
+ *
+ * \param handle The handle of the stream.
+ * \param scan The scan to add. It will be owned by \p handle.
+ *
+ * \return On success true will be returned. Otherwise \p scan will be freed
+ *  and false returned.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_order_push(struct codereader_handle *handle,
+                      struct codereader_scan *scan)
+{
+	struct codereader_order *order = &(handle->order);
+	if (order->num == order->size) {
+		size_t size = (order->size > 0) ? order->size * 2 : 16;
+		struct codereader_scan **heap =
+		    realloc(order->heap, size * sizeof(struct codereader_scan *));
+		if (heap == NULL) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Not enough memory to order scans.\n");
+			free(scan);
+			return false;
+		}
+		order->heap = heap;
+		order->size = size;
+	}
+
+	/* Sift the new scan up to its position in the heap. */
+	size_t i = order->num++;
+	while (i > 0 && codereader_order_before(scan, order->heap[(i - 1) / 2])) {
+		order->heap[i] = order->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	order->heap[i] = scan;
+	scan->device->ordered++;
+
+	return true;
+}
+
+
+/** \brief Check whether the oldest scan of \p handle may be delivered.
+ *
+ *
+ * \param handle The handle of the stream.
+ * \param now The current time (CLOCK_MONOTONIC).
+ *
+ * \return The time in ns until the oldest scan may be delivered, zero if it
+ *  may be delivered now, or -1 if there is no scan held back.
+ */
+static long long
+codereader_order_remaining(const struct codereader_handle *handle,
+                           const struct timespec *now)
+{
+	const struct codereader_order *order = &(handle->order);
+	if (order->num == 0)
+		return -1;
+
+	const struct codereader_scan *oldest = order->heap[0];
+	long long ns = (oldest->stamp.tv_sec - now->tv_sec) * 1000000000LL +
+	               (oldest->stamp.tv_nsec - now->tv_nsec) +
+	               order->window * 1000000LL;
+	if (ns <= 0)
+		return 0;
+
+	/* If all devices, which are up, have a scan held back, no older scan can
+	 * be read anymore. */
+	const struct codereader_device *iter;
+	SLIST_FOREACH(iter, &(handle->devices), lmp)
+	{
+		if (iter->ordered == 0 &&
+		    __atomic_load_n(&(iter->state), __ATOMIC_SEQ_CST) ==
+		        CODEREADER_DEVICE_UP)
+			return ns;
+	}
+	return 0;
+}
+
+
+/** \brief Get the oldest scan of \p handle, if it may be delivered.
+ *
+ *
+ * \param handle The handle of the stream.
+ *
+ * \return The oldest scan, which will be owned by the caller, or NULL, if no
+ *  scan may be delivered yet.
+ */
+CODEREADER_INTERNAL
+struct codereader_scan *
+codereader_order_pop(struct codereader_handle *handle)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (codereader_order_remaining(handle, &now) != 0)
+		return NULL;
+
+	/* Move the last scan to the root and sift it down to its position. */
+	struct codereader_order *order = &(handle->order);
+	struct codereader_scan *scan = order->heap[0];
+	struct codereader_scan *last = order->heap[--order->num];
+	size_t i = 0;
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= order->num)
+			break;
+		if (child + 1 < order->num &&
+		    codereader_order_before(order->heap[child + 1],
+		                            order->heap[child]))
+			child++;
+		if (!codereader_order_before(order->heap[child], last))
+			break;
+		order->heap[i] = order->heap[child];
+		i = child;
+	}
+	order->heap[i] = last;
+	scan->device->ordered--;
+
+	return scan;
+}
+
+
+/** \brief Get the time until the oldest scan of \p handle may be delivered.
+ *
+ *
+ * \param handle The handle of the stream.
+ * \param ts Where to store the remaining time.
+ *
+ * \return If a scan is held back true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_order_timeout(const struct codereader_handle *handle,
+                         struct timespec *ts)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long ns = codereader_order_remaining(handle, &now);
+	if (ns < 0)
+		return false;
+
+	ts->tv_sec = ns / 1000000000LL;
+	ts->tv_nsec = ns % 1000000000LL;
+	return true;
+}
+
+
+/** \brief Free all scans held back by \p handle.
+ *
+ *
+ * \param handle The handle of the stream.
+ */
+CODEREADER_INTERNAL
+void
+codereader_order_free(struct codereader_handle *handle)
+{
+	for (size_t i = 0; i < handle->order.num; i++)
+		free(handle->order.heap[i]);
+	free(handle->order.heap);
+}
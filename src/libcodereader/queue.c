@@ -0,0 +1,117 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/* The queue is based on the intrusive MPSC node-based queue by Dmitry Vyukov,
+ * see http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-
+ * node-based-queue for details. */
+
+#include "queue.h"
+
+#include <stddef.h> // NULL
+
+#include "internal.h" // CODEREADER_INTERNAL
+
+
+/** \brief Initialize an empty \p queue.
+ *
+ *
+ * \param queue The queue to initialize.
+ */
+CODEREADER_INTERNAL
+void
+codereader_queue_init(struct codereader_queue *queue)
+{
+	queue->stub.next = NULL;
+	queue->head = &(queue->stub);
+	queue->tail = &(queue->stub);
+}
+
+
+/** \brief Push \p node into \p queue.
+ *
+ * \details This function may be called by any thread at any time.
+ *
+ *
+ * \param queue The queue.
+ * \param node The node to push.
+ */
+CODEREADER_INTERNAL
+void
+codereader_queue_push(struct codereader_queue *queue,
+                      struct codereader_queue_node *node)
+{
+	/* Exchange the head first and link the previous head to the new node
+	 * afterwards. Between both operations the queue is inconsistent, but this
+	 * will be detected by the consumer. */
+	__atomic_store_n(&(node->next), NULL, __ATOMIC_RELAXED);
+	struct codereader_queue_node *prev =
+	    __atomic_exchange_n(&(queue->head), node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&(prev->next), node, __ATOMIC_RELEASE);
+}
+
+
+/** \brief Pop the oldest node from \p queue.
+ *
+ * \details This function may be called by the consumer thread only.
+ *
+ *
+ * \param queue The queue.
+ *
+ * \return The oldest node of the queue. If the queue is empty, or a producer
+ *  is just pushing the only node, NULL will be returned.
+ */
+CODEREADER_INTERNAL
+struct codereader_queue_node *
+codereader_queue_pop(struct codereader_queue *queue)
+{
+	struct codereader_queue_node *tail = queue->tail;
+	struct codereader_queue_node *next =
+	    __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+
+	/* Skip the stub node, if it is at the tail of the queue. */
+	if (tail == &(queue->stub)) {
+		if (next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+
+	/* The tail is the last node of the queue. It can only be popped after the
+	 * stub node has been pushed behind it, as the queue must not become empty.
+	 * If a producer is pushing a node right now, the tail can't be popped
+	 * until the producer linked its node. */
+	if (tail != __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE))
+		return NULL;
+	codereader_queue_push(queue, &(queue->stub));
+
+	next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
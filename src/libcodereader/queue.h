@@ -0,0 +1,57 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_PRIVATE_QUEUE_H
+#define CODEREADER_PRIVATE_QUEUE_H
+
+
+/** \brief Node of a \ref codereader_queue.
+ *
+ * \details The queue is intrusive, i.e. this struct has to be embedded into
+ *  the queued elements.
+ */
+struct codereader_queue_node
+{
+	struct codereader_queue_node *next; ///< Next node in the queue.
+};
+
+
+/** \brief Lock-free multi-producer single-consumer queue.
+ *
+ * \details Any number of threads may push nodes into the queue concurrently,
+ *  but only a single thread may pop nodes from it. Pushing is wait-free and
+ *  needs a single atomic exchange.
+ */
+struct codereader_queue
+{
+	struct codereader_queue_node *head; ///< Last pushed node (producers).
+	struct codereader_queue_node *tail; ///< Next node to pop (consumer).
+	struct codereader_queue_node stub;  ///< Placeholder for empty queues.
+};
+
+
+void codereader_queue_init(struct codereader_queue *queue);
+void codereader_queue_push(struct codereader_queue *queue,
+                           struct codereader_queue_node *node);
+struct codereader_queue_node *
+codereader_queue_pop(struct codereader_queue *queue);
+
+
+#endif
@@ -18,25 +18,581 @@
  *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
  */
 
-#include <stdio.h>      // fprintf
-#include <sys/select.h> // select and FD_* macros
+#include "codereader.h" // codereader API declaration
+
+#include <errno.h>    // errno, EINTR, EEXIST
+#include <poll.h>     // poll
+#include <pthread.h>  // pthread_join
+#include <stdio.h>    // fprintf
+#include <stdlib.h>   // free
+#include <string.h>   // memcpy, memset
+#include <time.h>     // clock_gettime
+#include <unistd.h>   // read
+
+#include "config.h" // HAVE_SYS_EPOLL_H
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>   // epoll_*
+#include <sys/timerfd.h> // timerfd_*
+#endif
 
 #include "device.h"   // codereader_device*
+#include "handle.h"   // codereader_handle, codereader_scan
 #include "internal.h" // internal macros and functions
+#include "probes.h"   // CODEREADER_PROBE*
 
 
-/** \brief Read data from codereader devices.
+/** \brief Fill \p barcode with a scan of \p device.
+ *
+ * \details The line ending of the scan will be stripped. Its length will be
+ *  stored in the handle, so the stream can restore it byte by byte.
+ *  If enabled for \p device, the scan will be parsed as GS1 element string
+ *  once, so the consumers get its fields without parsing it again.
+ *
+ *
+ * \param handle The handle of the stream.
+ * \param barcode The barcode to fill.
+ * \param device The device that read the scan.
+ * \param data The scan.
+ * \param length Length of \p data.
+ * \param time Time the scan has been read.
+ */
+static void
+codereader_fill(struct codereader_handle *handle,
+                struct codereader_barcode *barcode,
+                const struct codereader_device *device, const char *data,
+                size_t length, const struct timespec *time)
+{
+	handle->ending = 0;
+	if (length > 0 && data[length - 1] == '\n') {
+		handle->ending = 1;
+		if (length > 1 && data[length - 2] == '\r')
+			handle->ending = 2;
+	}
+	length -= handle->ending;
+
+	barcode->data = data;
+	barcode->length = length;
+	barcode->device = device->name;
+	barcode->time = *time;
+	barcode->fields = NULL;
+	barcode->num_fields = 0;
+
+	if (device->gs1) {
+		int n = codereader_gs1_parse(data, length, handle->gs1,
+		                             CODEREADER_GS1_FIELDS);
+		if (n > 0) {
+			barcode->fields = handle->gs1;
+			barcode->num_fields = n;
+		}
+	}
+
+	CODEREADER_PROBE3(scan__deliver, device->name, data, length);
+}
+
+
+/** \brief Check whether \p device is up and should be polled.
+ *
+ * \details If the device has been reconnected by its reconnect thread, the
+ *  thread will be joined and the new file descriptor of the device added to
+ *  the descriptor returned by \ref codereader_fileno.
+ *
+ *
+ * \param handle The handle of the stream.
+ * \param device The device to check.
+ *
+ * \return If the device is up true will be returned, otherwise false.
+ */
+static bool
+codereader_device_up(struct codereader_handle *handle,
+                     struct codereader_device *device)
+{
+	if (__atomic_load_n(&(device->state), __ATOMIC_SEQ_CST) !=
+	    CODEREADER_DEVICE_UP)
+		return false;
+
+	if (__atomic_exchange_n(&(device->reopened), false, __ATOMIC_SEQ_CST)) {
+		pthread_join(device->thread, NULL);
+		device->running = false;
+
+#ifdef HAVE_SYS_EPOLL_H
+		/* The device may have been added by codereader_fileno already, if it
+		 * has been called after the device has been reconnected. */
+		struct epoll_event ev = {.events = EPOLLIN};
+		if (handle->epoll >= 0 &&
+		    epoll_ctl(handle->epoll, EPOLL_CTL_ADD, device->fd, &ev) != 0 &&
+		    errno != EEXIST)
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Failed to add device %s to epoll instance.\n",
+			        device->name);
+#endif
+	}
+
+	return true;
+}
+
+
+/** \brief Add the latency of a scan to the histogram of \p handle.
+ *
+ *
+ * \param handle The handle of the stream.
+ * \param stamp Time the scan happened (CLOCK_MONOTONIC). This is the time
+ *  reported by the driver or, if it doesn't support timestamps, the time the
+ *  scan has been read.
+ */
+static void
+codereader_latency_add(struct codereader_handle *handle,
+                       const struct timespec *stamp)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long us = (now.tv_sec - stamp->tv_sec) * 1000000LL +
+	               (now.tv_nsec - stamp->tv_nsec) / 1000;
+
+	/* The bucket is the number of significant bits of the latency, so each
+	 * bucket covers twice the range of the previous one. */
+	size_t bucket = (us > 0) ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= CODEREADER_LATENCY_BUCKETS)
+		bucket = CODEREADER_LATENCY_BUCKETS - 1;
+	handle->latency[bucket]++;
+}
+
+
+/** \brief Convert \p ns nanoseconds into a timeout for poll.
+ *
+ * \details The time will be rounded up to full milliseconds, so the poll
+ *  doesn't return early.
+ */
+static inline int
+codereader_timeout_ms(long long ns)
+{
+	return (ns + 999999) / 1000000;
+}
+
+
+/** \brief Get the remaining time until \p deadline.
+ *
+ *
+ * \param deadline The deadline (CLOCK_MONOTONIC).
+ *
+ * \return The remaining time in milliseconds. If the deadline has been passed
+ *  already -1 will be returned.
+ */
+static int
+codereader_remaining(const struct timespec *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long long ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL +
+	               (deadline->tv_nsec - now.tv_nsec);
+	return (ns > 0) ? codereader_timeout_ms(ns) : -1;
+}
+
+
+/** \brief Deliver \p scan of a worker thread or held back for ordering.
  *
- * \details This function behaves like a proxy to the system's `read` function.
- *  It will read one barcode from all devices defined in \p cookie and route the
- *  request to one of the opened devices ready to read data from.
+ * \details Duplicates will be dropped. Otherwise the scan will be kept until
+ *  the next call of \ref codereader_next, as \p barcode points to its data.
  *
- * \note As the purpose of this function is to read a whole barcode, the buffer
- *  needs to big enough to store a whole barcode plus the terminating null-
- *  character. Otherwise the driver's function will return an error.
  *
+ * \param handle The handle of the stream.
+ * \param barcode Where to store the scan.
+ * \param scan The scan to deliver. It will be owned by \p handle.
+ *
+ * \return 1 The scan has been stored in \p barcode.
+ * \return 0 The scan has been dropped.
+ * \return -1 The device of the scan failed.
+ */
+static int
+codereader_deliver(struct codereader_handle *handle,
+                   struct codereader_barcode *barcode,
+                   struct codereader_scan *scan)
+{
+	if (scan->length < 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to read from threaded device.\n");
+		free(scan);
+		return -1;
+	}
+	if (codereader_dedup_check(scan->device, scan->data, scan->length)) {
+		free(scan);
+		return 0;
+	}
+
+	handle->pending = scan;
+	codereader_latency_add(handle, &(scan->stamp));
+	codereader_fill(handle, barcode, scan->device, scan->data, scan->length,
+	                &(scan->time));
+	return 1;
+}
+
+
+/** \brief Wait for the next scan of any device.
  *
- * \param cookie Headpointer of \ref codereader_device list.
+ * \details See \ref codereader_next.
+ */
+static int
+codereader_wait(struct codereader_handle *handle,
+                struct codereader_barcode *barcode, int timeout)
+{
+	/* The scan returned by the previous call is not needed anymore. */
+	free(handle->pending);
+	handle->pending = NULL;
+
+	/* The global real-time settings will be applied to the thread reading the
+	 * stream, when it calls this function the first time. */
+	if (!handle->realtime_applied) {
+		handle->realtime_applied = true;
+		if (!codereader_realtime_enter(handle))
+			return -1;
+	}
+
+	struct timespec deadline;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	while (true) {
+		/* If the scans shall be ordered, all scans of the worker threads will
+		 * be held back first and the oldest one returned, as soon as it may be
+		 * delivered. Failures of worker threads will be returned at once. */
+		if (handle->order.enabled) {
+			struct codereader_scan *scan = NULL;
+			struct codereader_device *device;
+			while (scan == NULL &&
+			       (device = codereader_lane_pick(handle, false)) != NULL) {
+				scan = codereader_lane_take(device);
+				if (scan->length >= 0) {
+					codereader_order_push(handle, scan);
+					scan = NULL;
+				}
+			}
+			if (scan == NULL)
+				scan = codereader_order_pop(handle);
+			if (scan != NULL) {
+				int ret = codereader_deliver(handle, barcode, scan);
+				if (ret != 0)
+					return ret;
+				continue;
+			}
+		}
+
+		/* Build a list of all file descriptors, so a poll can be done on
+		 * them below. Devices read by worker threads will be skipped, but the
+		 * wakeup pipe of the worker threads will be added instead. The stop
+		 * pipe wakes up the multiplexer thread, when the handle is destroyed.
+		 * The list will be rebuilt after each wakeup, as failed devices will
+		 * be skipped until they have been reconnected. */
+		struct pollfd *fds = handle->polls;
+		fds[0].fd = handle->stop[0];
+		fds[1].fd = handle->wakeup[0];
+		nfds_t num = 2;
+		struct codereader_device *iter;
+		SLIST_FOREACH(iter, &(handle->devices), lmp)
+		{
+			iter->poll = NULL;
+			if (iter->threaded || !codereader_device_up(handle, iter))
+				continue;
+			iter->poll = &(fds[num++]);
+			iter->poll->fd = iter->fd;
+		}
+		for (nfds_t i = 0; i < num; i++) {
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+
+		/* Do a poll on all device file descriptors, to wait for available
+		 * data on any of them. If no timeout is given, there will be no
+		 * time-limit. If a worker thread queued a scan already, the devices
+		 * will be polled only, so a device with a higher priority may be
+		 * served first. If scans are held back for ordering, the poll will
+		 * return in time to deliver the oldest one. */
+		int ms = -1;
+		bool queued = !handle->order.enabled && codereader_lane_pending(handle);
+		if (queued)
+			ms = 0;
+		else if (timeout >= 0 && (ms = codereader_remaining(&deadline)) < 0)
+			return 0;
+		struct timespec hold;
+		bool held =
+		    handle->order.enabled && codereader_order_timeout(handle, &hold);
+		if (held) {
+			int hold_ms = codereader_timeout_ms(hold.tv_sec * 1000000000LL +
+			                                    hold.tv_nsec);
+			if (ms < 0 || hold_ms < ms)
+				ms = hold_ms;
+		}
+		int ret = poll(fds, num, ms);
+		if (ret < 0) {
+			/* If the wait has been interrupted by a signal, the application
+			 * may want to stop reading, so no scan will be returned. */
+			if (errno == EINTR)
+				return 0;
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Failed to poll a device file descriptor.\n");
+			return -1;
+		} else if (ret == 0) {
+			if (held)
+				continue;
+			if (!queued)
+				return 0;
+		} else {
+			CODEREADER_PROBE1(poll__wakeup, ret);
+
+			/* If the handle is about to be destroyed, the multiplexer thread
+			 * waiting for new scans needs to stop. */
+			if (fds[0].revents != 0)
+				return 0;
+
+			/* If a worker thread woke up this reader, reset the wakeup pipe
+			 * and check the queues again. The signalled flag has to be reset
+			 * before checking the queues, so no notification can get lost. */
+			if (fds[1].revents != 0) {
+				char buffer[64];
+				if (read(handle->wakeup[0], buffer, sizeof(buffer)) < 0) {
+					fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+					        "Failed to read from wakeup pipe.\n");
+					return -1;
+				}
+				__atomic_store_n(&(handle->signalled), false,
+				                 __ATOMIC_SEQ_CST);
+				continue;
+			}
+		}
+
+		/* Select the device to be served by its priority and weight. Scans of
+		 * threaded devices have been processed by the worker thread already
+		 * and will be returned, unless they are duplicates. If the scans shall
+		 * be ordered, they will be held back at the beginning of the loop. */
+		iter = codereader_lane_pick(handle, ret > 0);
+		if (iter == NULL)
+			continue;
+		if (iter->threaded) {
+			if (handle->order.enabled)
+				continue;
+			ret = codereader_deliver(handle, barcode,
+			                         codereader_lane_take(iter));
+			if (ret != 0)
+				return ret;
+			continue;
+		}
+
+		/* Read the selected device. Its scan will be returned, unless the scan
+		 * is dropped by a filter, invalid or a duplicate. If the device failed,
+		 * it will be reconnected in the background and the other devices will
+		 * be read meanwhile. */
+		CODEREADER_PROBE2(device__dispatch, iter->name, iter->fd);
+		ssize_t n = codereader_device_read(iter);
+		if (n < 0) {
+			if (!codereader_reconnect_start(iter))
+				return -1;
+			continue;
+		}
+		if (n > 0)
+			n = codereader_process(iter, iter->buffer, n, iter->buffer_size);
+		if (n == 0)
+			continue;
+
+		/* If the scans shall be ordered, the scan will be held back and
+		 * checked for duplicates, when it will be delivered. */
+		if (handle->order.enabled) {
+			struct codereader_scan *scan =
+			    codereader_scan_new(iter, iter->buffer, n);
+			if (scan != NULL)
+				codereader_order_push(handle, scan);
+			continue;
+		}
+		if (codereader_dedup_check(iter, iter->buffer, n))
+			continue;
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		codereader_latency_add(handle, &(iter->stamp));
+		codereader_fill(handle, barcode, iter, iter->buffer, n, &now);
+		return 1;
+	}
+}
+
+
+#ifdef HAVE_SYS_EPOLL_H
+/** \brief Arm the timer of \ref codereader_fileno for scans held back.
+ *
+ * \details The timer expires, when the oldest scan held back for ordering may
+ *  be delivered, so the descriptor becomes readable in time. If no scan is
+ *  held back, the timer will be disarmed. Setting the timer resets its
+ *  expirations, so the descriptor doesn't stay readable after delivery.
+ *
+ *
+ * \param handle The handle of the stream.
+ */
+static void
+codereader_timer_arm(struct codereader_handle *handle)
+{
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	if (codereader_order_timeout(handle, &(its.it_value))) {
+		/* A zero value would disarm the timer, although the scan may be
+		 * delivered already. */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(handle->timer, 0, &its, NULL) < 0)
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Failed to arm the order timer.\n");
+}
+#endif
+
+
+/** \brief Get the next scan of any device.
+ *
+ * \details This function waits for the next scan of any device opened by
+ *  \p handle. Only one scan will be returned, even if more than one device is
+ *  ready. The device with the highest priority will be served first, devices
+ *  with the same priority by their weights. The next scan will be fetched by
+ *  the next call to this function.
+ *
+ *
+ * \param handle The handle returned by \ref codereader_new.
+ * \param barcode Where to store the scan. The data is valid until the next
+ *  call of this function.
+ * \param timeout Maximum time to wait in milliseconds or -1 to wait forever.
+ *
+ * \return 1 A scan has been stored in \p barcode.
+ * \return 0 No scan has been read until the timeout expired or the wait has
+ *  been interrupted by a signal.
+ * \return -1 An error occured.
+ */
+int
+codereader_next(struct codereader_handle *handle,
+                struct codereader_barcode *barcode, int timeout)
+{
+	int ret = codereader_wait(handle, barcode, timeout);
+#ifdef HAVE_SYS_EPOLL_H
+	if (handle->timer >= 0)
+		codereader_timer_arm(handle);
+#endif
+	return ret;
+}
+
+
+/** \brief Get a pollable file descriptor for \p handle.
+ *
+ * \details The returned file descriptor will be readable, if a call of
+ *  \ref codereader_next might return a scan without waiting, so applications
+ *  may integrate the handle into their own event loop. It watches all devices
+ *  read by the calling thread and the wakeup pipe of the worker threads. If
+ *  scans are delivered in the order they happened, it also watches a timer
+ *  expiring, when the oldest scan held back may be delivered.
+ *
+ *  Devices, which are down when this function is called, will be added by
+ *  \ref codereader_next after they have been reconnected. Reconnected devices
+ *  wake up the returned descriptor, so they will be added in time.
+ *
+ * \note The file descriptor may be readable, although no scan is returned,
+ *  e.g. if a scan has been dropped by a filter. Scans should be read by
+ *  calling \ref codereader_next with a timeout of zero, until it returns zero,
+ *  before waiting for the file descriptor again.
+ *
+ *
+ * \param handle The handle returned by \ref codereader_new.
+ *
+ * \return On success the file descriptor will be returned, otherwise -1. The
+ *  file descriptor is owned by \p handle and must not be closed.
+ */
+int
+codereader_fileno(struct codereader_handle *handle)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (handle->epoll >= 0)
+		return handle->epoll;
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Failed to create epoll instance.\n");
+		return -1;
+	}
+
+	struct epoll_event ev = {.events = EPOLLIN};
+	bool ok = (epoll_ctl(epfd, EPOLL_CTL_ADD, handle->wakeup[0], &ev) == 0);
+	if (ok && handle->order.enabled) {
+		handle->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		ok = (handle->timer >= 0 &&
+		      epoll_ctl(epfd, EPOLL_CTL_ADD, handle->timer, &ev) == 0);
+	}
+	struct codereader_device *iter;
+	SLIST_FOREACH(iter, &(handle->devices), lmp)
+	{
+		if (ok && !iter->threaded &&
+		    __atomic_load_n(&(iter->state), __ATOMIC_SEQ_CST) ==
+		        CODEREADER_DEVICE_UP)
+			ok = (epoll_ctl(epfd, EPOLL_CTL_ADD, iter->fd, &ev) == 0);
+	}
+	if (!ok) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to add file descriptors to epoll instance.\n");
+		close(epfd);
+		if (handle->timer >= 0)
+			close(handle->timer);
+		handle->timer = -1;
+		return -1;
+	}
+
+	handle->epoll = epfd;
+	if (handle->timer >= 0)
+		codereader_timer_arm(handle);
+	return epfd;
+#else
+	fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+	        "A pollable file descriptor is not supported on this platform.\n");
+	return -1;
+#endif
+}
+
+
+/** \brief Get the latency histogram of \p handle.
+ *
+ * \details The histogram counts the time between a scan and its delivery by
+ *  \ref codereader_next, including the time a scan read by a worker thread
+ *  waited for the reader of the stream. The time of the scan will be reported
+ *  by the driver, e.g. the time the kernel received the input events. For
+ *  drivers not supporting timestamps, the time the scan has been read from the
+ *  device will be used. Bucket `i` counts scans delivered within less than
+ *  `2^i` microseconds.
+ *
+ *
+ * \param handle The handle returned by \ref codereader_new.
+ * \param buckets Where to store the histogram.
+ * \param num Number of entries in \p buckets.
+ *
+ * \return The number of buckets stored in \p buckets.
+ */
+size_t
+codereader_latency(const struct codereader_handle *handle,
+                   unsigned long *buckets, size_t num)
+{
+	if (num > CODEREADER_LATENCY_BUCKETS)
+		num = CODEREADER_LATENCY_BUCKETS;
+	memcpy(buckets, handle->latency, num * sizeof(unsigned long));
+	return num;
+}
+
+
+/** \brief Read data from codereader devices.
+ *
+ * \details This function behaves like a proxy to the system's `read` function
+ *  for the stream returned by \ref codereader_open. It returns the scans of
+ *  \ref codereader_next with their original line ending, i.e. `"\r\n"` or
+ *  `"\n"`. If a scan doesn't fit into \p buf, the remaining bytes will be
+ *  delivered by the following calls.
+ *
+ *
+ * \param cookie Pointer to the \ref codereader_handle of the stream.
  * \param buf Destination buffer.
  * \param size Size of \p buf.
  *
@@ -47,53 +603,40 @@ CODEREADER_INTERNAL
 CODEREADER_READ_RETURN_TYPE
 codereader_read(void *cookie, char *buf, CODEREADER_READ_SIZE_TYPE size)
 {
-	/* Restore the device list. Cookie is a pointer to the first element in the
-	 * list, so it will be set as first element of a temporary list. The list-
-	 * management-pointers in the cookie remain, so the list can be fully
-	 * restored with the cookie. */
-	struct codereader_device_list devices = SLIST_HEAD_INITIALIZER(devices);
-	SLIST_FIRST(&devices) = cookie;
-
-	/* Build a list of all file descriptors, so a select can be done on them
-	 * below. */
-	fd_set fds;
-	FD_ZERO(&fds);
-	int fd_max = 0;
-	struct codereader_device *iter;
-	SLIST_FOREACH(iter, &devices, lmp)
-	{
-		FD_SET(iter->fd, &fds);
-		if (iter->fd > fd_max)
-			fd_max = iter->fd;
-	}
-
-listen_devices:
-	/* Do a select on all device file descriptors, to wait for available data on
-	 * any of them. There will be no time-limit. Only one file descriptor will
-	 * be processed, even if more than one is ready for reading, as this
-	 * function should only return one barcode at a time. The next barcode will
-	 * be fetched by the next call to this function. */
-	if (select(fd_max + 1, &fds, NULL, NULL, NULL) < 0) {
-		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
-		        "Failed to select a device file descriptor.\n");
-		return -1;
-	}
+	struct codereader_handle *handle = cookie;
+	struct codereader_barcode *current = &(handle->current);
 
-	/* Check which device is ready for reading now. The first matching device
-	 * will be used and data be returned to the user. */
-	SLIST_FOREACH(iter, &devices, lmp)
-	{
-		if (FD_ISSET(iter->fd, &fds)) {
-			int ret = iter->driver.read(iter->fd, buf, size, iter->cookie);
-			if (ret == 0)
-				goto listen_devices;
+	/* If the current scan has been delivered completely, get the next one.
+	 * The data of the current scan has been freed already by the call, so it
+	 * must not be delivered again, if no new scan has been returned. This
+	 * happens, if the wait has been interrupted or the handle is destroyed,
+	 * which will be reported as end of file. */
+	if (handle->offset >= current->length + handle->ending) {
+		int ret = codereader_next(handle, current, -1);
+		if (ret <= 0) {
+			memset(current, 0, sizeof(struct codereader_barcode));
+			handle->ending = handle->offset = 0;
 			return ret;
 		}
+		handle->offset = 0;
 	}
 
-	/* If the function reached this point, a fatal error occured, as select
-	 * returned with no file descriptor set ready to read. */
-	fprintf(stderr, CODEREADER_MESSAGE_PREFIX
-	        "Select set no valid file descriptors.\n");
-	return -1;
+	/* Copy as much of the remaining scan as fits into buf. The line ending
+	 * has been stripped from the scan, so it needs to be appended. */
+	size_t n = 0;
+	if (handle->offset < current->length) {
+		n = current->length - handle->offset;
+		if (n > (size_t)size)
+			n = size;
+		memcpy(buf, current->data + handle->offset, n);
+		handle->offset += n;
+	}
+	const char *ending = "\r\n" + (2 - handle->ending);
+	while (n < (size_t)size &&
+	       handle->offset < current->length + handle->ending) {
+		buf[n++] = ending[handle->offset - current->length];
+		handle->offset++;
+	}
+
+	return n;
 }
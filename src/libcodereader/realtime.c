@@ -0,0 +1,279 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Real-time scheduling of the threads reading devices.
+ *
+ * \details The thread reading the codereader stream and the worker threads may
+ *  be run with a real-time scheduling policy and pinned to a set of CPUs, so
+ *  other processes on the same machine don't delay the delivery of scans.
+ */
+
+/* The following define is required for CPU_* macros and
+ * pthread_setaffinity_np. */
+#define _GNU_SOURCE
+
+
+#include <pthread.h> // pthread_*
+#include <sched.h>   // SCHED_*, sched_get_priority_*, CPU_* macros
+#include <stdio.h>   // fprintf
+#include <stdlib.h>  // calloc, free, malloc
+#include <string.h>  // strcmp, strerror
+
+#include "config.h"   // HAVE_PTHREAD_SETAFFINITY_NP
+#include "handle.h"   // codereader_realtime_*
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Scheduling of the thread reading the stream before the global
+ *  real-time settings have been applied.
+ */
+struct codereader_realtime_saved
+{
+	pthread_t thread;         ///< The thread reading the stream.
+	int policy;               ///< Previous scheduling policy.
+	struct sched_param param; ///< Previous scheduling parameters.
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	bool pinned;   ///< Whether the thread has been pinned.
+	cpu_set_t cpu; ///< Previous CPU affinity.
+#endif
+};
+
+
+/** \brief Read the CPUs of the real-time configuration \p config.
+ *
+ *
+ * \param rt The settings to store the CPUs in.
+ * \param config The `cpus` array of the configuration.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+static bool
+codereader_realtime_cpus(struct codereader_realtime *rt,
+                         const config_setting_t *config)
+{
+#ifndef HAVE_PTHREAD_SETAFFINITY_NP
+	fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+	        "CPU pinning is not supported on this platform.\n");
+	return false;
+#else
+	int n = config_setting_length(config);
+	if (!config_setting_is_array(config) || n == 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'realtime.cpus' must be a non-empty array.\n");
+		return false;
+	}
+
+	if ((rt->cpus = calloc(n, sizeof(int))) == NULL) {
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Not enough memory for CPU set.\n");
+		return false;
+	}
+	for (int i = 0; i < n; i++) {
+		int cpu = config_setting_get_int_elem(config, i);
+		if (cpu < 0 || cpu >= CPU_SETSIZE) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX "Invalid CPU %d.\n",
+			        cpu);
+			return false;
+		}
+		rt->cpus[rt->cpus_num++] = cpu;
+	}
+
+	return true;
+#endif
+}
+
+
+/** \brief Read the real-time configuration \p config into \p rt.
+ *
+ *
+ * \param rt The settings to configure.
+ * \param config The `realtime` group of the configuration.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_realtime_config(struct codereader_realtime *rt,
+                           const config_setting_t *config)
+{
+	rt->enabled = true;
+
+	/* By default the policy of the thread will not be changed, so a thread may
+	 * be pinned to some CPUs or lock its buffers only. */
+	const char *policy = "other";
+	config_setting_lookup_string(config, "policy", &policy);
+	if (strcmp(policy, "other") == 0)
+		rt->policy = SCHED_OTHER;
+	else if (strcmp(policy, "fifo") == 0)
+		rt->policy = SCHED_FIFO;
+	else if (strcmp(policy, "rr") == 0)
+		rt->policy = SCHED_RR;
+	else {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Unknown scheduling policy '%s'.\n", policy);
+		return false;
+	}
+
+	int min = sched_get_priority_min(rt->policy);
+	int max = sched_get_priority_max(rt->policy);
+	rt->priority = min;
+	config_setting_lookup_int(config, "priority", &(rt->priority));
+	if (rt->priority < min || rt->priority > max) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Priority for policy '%s' must be between %d and %d.\n",
+		        policy, min, max);
+		return false;
+	}
+
+	config_setting_t *cpus = config_setting_get_member(config, "cpus");
+	if (cpus != NULL && !codereader_realtime_cpus(rt, cpus))
+		return false;
+
+	int lock = false;
+	config_setting_lookup_bool(config, "mlock", &lock);
+	rt->mlock = lock;
+
+	return true;
+}
+
+
+/** \brief Apply the real-time settings \p rt to the calling thread.
+ *
+ *
+ * \param rt The settings to apply.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_realtime_apply(const struct codereader_realtime *rt)
+{
+	if (!rt->enabled)
+		return true;
+
+	struct sched_param param = {.sched_priority = rt->priority};
+	int err = pthread_setschedparam(pthread_self(), rt->policy, &param);
+	if (err != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to set scheduling policy: %s\n",
+		        strerror(err));
+		return false;
+	}
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (rt->cpus_num > 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (size_t i = 0; i < rt->cpus_num; i++)
+			CPU_SET(rt->cpus[i], &set);
+
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err != 0) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Failed to pin thread to CPUs: %s\n",
+			        strerror(err));
+			return false;
+		}
+	}
+#endif
+
+	return true;
+}
+
+
+/** \brief Apply the global real-time settings of \p handle to the calling
+ *  thread.
+ *
+ * \details The calling thread is owned by the application, so its scheduling
+ *  will be saved before and restored by \ref codereader_realtime_restore.
+ *
+ *
+ * \param handle The handle of the stream.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_realtime_enter(struct codereader_handle *handle)
+{
+	const struct codereader_realtime *rt = &(handle->realtime);
+	if (!rt->enabled)
+		return true;
+
+	struct codereader_realtime_saved *saved = malloc(sizeof(*saved));
+	if (saved == NULL) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Not enough memory for scheduling settings.\n");
+		return false;
+	}
+	saved->thread = pthread_self();
+	int err = pthread_getschedparam(saved->thread, &(saved->policy),
+	                                &(saved->param));
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	saved->pinned = (rt->cpus_num > 0);
+	if (err == 0 && saved->pinned)
+		err = pthread_getaffinity_np(saved->thread, sizeof(saved->cpu),
+		                             &(saved->cpu));
+#endif
+	if (err != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to get scheduling policy: %s\n",
+		        strerror(err));
+		free(saved);
+		return false;
+	}
+	handle->realtime_saved = saved;
+
+	return codereader_realtime_apply(rt);
+}
+
+
+/** \brief Restore the scheduling of the thread reading \p handle.
+ *
+ * \details The scheduling can be restored by the thread, which read the
+ *  stream, only. If the handle is destroyed by another thread, that thread may
+ *  have finished already, e.g. the multiplexer thread of
+ *  \ref codereader_dispatch, so its scheduling will not be changed.
+ *
+ *
+ * \param handle The handle of the stream.
+ */
+CODEREADER_INTERNAL
+void
+codereader_realtime_restore(struct codereader_handle *handle)
+{
+	struct codereader_realtime_saved *saved = handle->realtime_saved;
+	if (saved == NULL)
+		return;
+
+	if (pthread_equal(saved->thread, pthread_self())) {
+		pthread_setschedparam(saved->thread, saved->policy, &(saved->param));
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+		if (saved->pinned)
+			pthread_setaffinity_np(saved->thread, sizeof(saved->cpu),
+			                       &(saved->cpu));
+#endif
+	}
+
+	free(saved);
+	handle->realtime_saved = NULL;
+}
@@ -0,0 +1,255 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Reconnecting failed devices.
+ *
+ * \details If the read hook of a driver fails (e.g. if the device has been
+ *  unplugged), the device will be closed and reopened by the driver's open
+ *  hook with an exponential backoff. Meanwhile, all other devices of the
+ *  stream keep delivering scans. Devices read by a worker thread will be
+ *  reopened by their worker thread, all other devices by a thread started for
+ *  reconnecting the device only.
+ */
+
+#include <errno.h>      // errno, EINTR
+#include <pthread.h>    // pthread_*
+#include <stdio.h>      // fprintf
+#include <sys/select.h> // select and FD_* macros
+
+#include "handle.h"   // codereader_handle, codereader_reconnect_*
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+#include "probes.h"   // CODEREADER_PROBE*
+
+
+/** \brief Default delay in ms before the first attempt to reopen a device.
+ */
+#define CODEREADER_RECONNECT_MIN 100
+
+/** \brief Default maximum delay in ms between two attempts to reopen a device.
+ */
+#define CODEREADER_RECONNECT_MAX 30000
+
+
+/** \brief Read the reconnect configuration of \p device.
+ *
+ * \details The option may be either a boolean to enable or disable
+ *  reconnecting the device, or a group with the `min` and `max` delay between
+ *  two attempts in milliseconds.
+ *
+ *
+ * \param device The device to configure.
+ * \param config The `reconnect` option of the device or NULL for defaults.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_reconnect_config(struct codereader_device *device,
+                            const config_setting_t *config)
+{
+	device->reconnect = true;
+	device->reconnect_min = CODEREADER_RECONNECT_MIN;
+	device->reconnect_max = CODEREADER_RECONNECT_MAX;
+	if (config == NULL)
+		return true;
+
+	if (config_setting_type(config) == CONFIG_TYPE_BOOL) {
+		device->reconnect = config_setting_get_bool(config);
+		return true;
+	}
+	if (!config_setting_is_group(config)) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'reconnect' must be a boolean or a group.\n");
+		return false;
+	}
+
+	int min = device->reconnect_min, max = device->reconnect_max;
+	config_setting_lookup_int(config, "min", &min);
+	config_setting_lookup_int(config, "max", &max);
+	if (min <= 0 || max < min) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Reconnect delays must be positive and min <= max.\n");
+		return false;
+	}
+	device->reconnect_min = min;
+	device->reconnect_max = max;
+
+	return true;
+}
+
+
+/** \brief Close \p device after a failure.
+ *
+ * \details The driver's close hook will be called to free the driver's data
+ *  storage, so the device can be opened again.
+ *
+ *
+ * \param device The device to close.
+ */
+static void
+codereader_reconnect_close(struct codereader_device *device)
+{
+	CODEREADER_PROBE2(device__close, device->name, device->fd);
+	device->driver.close(device->fd, device->cookie);
+	device->fd = -1;
+	device->cookie = NULL;
+}
+
+
+/** \brief Wait \p ms milliseconds, unless the stream is being destroyed.
+ *
+ *
+ * \param stop The reading end of the stop pipe.
+ * \param ms Time to wait in milliseconds.
+ *
+ * \return If the time elapsed true will be returned, otherwise false.
+ */
+static bool
+codereader_reconnect_wait(int stop, unsigned int ms)
+{
+	struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+	while (true) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(stop, &fds);
+
+		/* On Linux select updates the timeout, so an interrupted wait will
+		 * not start again. Other platforms may wait longer in this case. */
+		int ret = select(stop + 1, &fds, NULL, NULL, &tv);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		return (ret == 0);
+	}
+}
+
+
+/** \brief Reopen the failed \p device.
+ *
+ * \details The driver's open hook will be called until it succeeds. The delay
+ *  between two attempts will be doubled after each failure, until the
+ *  configured maximum is reached.
+ *
+ *
+ * \param device The device to reopen.
+ *
+ * \return If the device has been reopened true will be returned. If the stream
+ *  is being destroyed before, false will be returned.
+ */
+static bool
+codereader_reconnect(struct codereader_device *device)
+{
+	unsigned int delay = device->reconnect_min;
+	while (codereader_reconnect_wait(device->handle->stop[0], delay)) {
+		device->fd = device->driver.open(device->config, &(device->cookie));
+		if (device->fd >= 0) {
+			CODEREADER_PROBE2(device__open, device->name, device->fd);
+			fprintf(stderr,
+			        CODEREADER_MESSAGE_PREFIX "Device %s reconnected.\n",
+			        device->name);
+
+			/* A partial scan read before the failure will be dropped. */
+			device->length = 0;
+			device->complete = false;
+			__atomic_store_n(&(device->state), CODEREADER_DEVICE_UP,
+			                 __ATOMIC_SEQ_CST);
+			return true;
+		}
+		codereader_reconnect_close(device);
+
+		delay = (delay > device->reconnect_max / 2) ? device->reconnect_max
+		                                            : delay * 2;
+	}
+
+	return false;
+}
+
+
+/** \brief Thread reconnecting a failed device not read by a worker thread.
+ *
+ * \details After the device has been reopened, its \ref reopened flag will be
+ *  set and the reader of the stream woken up, so it adds the device to its
+ *  set of file descriptors again.
+ *
+ *
+ * \param arg Pointer to the \ref codereader_device to reopen.
+ */
+static void *
+codereader_reconnect_thread(void *arg)
+{
+	struct codereader_device *device = arg;
+	if (codereader_reconnect(device)) {
+		__atomic_store_n(&(device->reopened), true, __ATOMIC_SEQ_CST);
+		codereader_worker_wakeup(device->handle);
+	}
+	return NULL;
+}
+
+
+/** \brief Handle a failure of \p device.
+ *
+ * \details This function must be called by the thread reading \p device after
+ *  the driver's read hook failed. The device will be closed and reopened in
+ *  the background. Devices read by a worker thread will be reopened by the
+ *  calling worker thread, i.e. this function returns after the device has been
+ *  reopened.
+ *
+ *
+ * \param device The failed device.
+ *
+ * \return If the device will be reconnected true will be returned. If the
+ *  device shall not be reconnected, the stream is being destroyed or an error
+ *  occured, false will be returned.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_reconnect_start(struct codereader_device *device)
+{
+	if (!device->reconnect)
+		return false;
+
+	fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+	        "Device %s failed, trying to reconnect.\n",
+	        device->name);
+	__atomic_store_n(&(device->state), CODEREADER_DEVICE_DOWN,
+	                 __ATOMIC_SEQ_CST);
+	codereader_reconnect_close(device);
+
+	if (device->threaded)
+		return codereader_reconnect(device);
+
+	/* The thread of the previous reconnect has finished already, as the device
+	 * has been up again, but needs to be joined before starting a new one. Its
+	 * notification is obsolete, as the device has been closed again. */
+	if (device->running) {
+		pthread_join(device->thread, NULL);
+		device->running = false;
+		__atomic_store_n(&(device->reopened), false, __ATOMIC_SEQ_CST);
+	}
+	if (pthread_create(&(device->thread), NULL, codereader_reconnect_thread,
+	                   device) != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to start reconnect thread.\n");
+		return false;
+	}
+	device->running = true;
+	return true;
+}
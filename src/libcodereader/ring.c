@@ -0,0 +1,151 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/* The queue is based on the bounded MPMC queue by Dmitry Vyukov, see
+ * http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ * for details. */
+
+#include "ring.h"
+
+#include <stdint.h> // intptr_t
+#include <stdlib.h> // calloc, free
+
+#include "internal.h" // CODEREADER_INTERNAL
+
+
+/** \brief Initialize an empty \p ring.
+ *
+ *
+ * \param ring The queue to initialize.
+ * \param capacity Minimum number of elements the queue can hold. It will be
+ *  rounded up to the next power of two.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_ring_init(struct codereader_ring *ring, size_t capacity)
+{
+	size_t size = 2;
+	while (size < capacity)
+		size *= 2;
+
+	if ((ring->cells = calloc(size, sizeof(struct codereader_ring_cell))) ==
+	    NULL)
+		return false;
+	for (size_t i = 0; i < size; i++)
+		ring->cells[i].sequence = i;
+	ring->mask = size - 1;
+	ring->enqueue = 0;
+	ring->dequeue = 0;
+
+	return true;
+}
+
+
+/** \brief Free the memory of \p ring.
+ *
+ * \note Elements still stored in the queue will not be freed.
+ *
+ *
+ * \param ring The queue.
+ */
+CODEREADER_INTERNAL
+void
+codereader_ring_free(struct codereader_ring *ring)
+{
+	free(ring->cells);
+	ring->cells = NULL;
+}
+
+
+/** \brief Push \p data into \p ring.
+ *
+ *
+ * \param ring The queue.
+ * \param data The element to push.
+ *
+ * \return If the element has been pushed true will be returned. If the queue
+ *  is full false will be returned.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_ring_push(struct codereader_ring *ring, void *data)
+{
+	/* Reserve the next position, if its cell has been freed by consumers. The
+	 * cell will be published by storing the next sequence number. */
+	size_t pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+	while (true) {
+		struct codereader_ring_cell *cell = &(ring->cells[pos & ring->mask]);
+		size_t seq = __atomic_load_n(&(cell->sequence), __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&(ring->enqueue), &pos, pos + 1,
+			                                true, __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				cell->data = data;
+				__atomic_store_n(&(cell->sequence), pos + 1,
+				                 __ATOMIC_RELEASE);
+				return true;
+			}
+		} else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+	}
+}
+
+
+/** \brief Pop the oldest element from \p ring.
+ *
+ *
+ * \param ring The queue.
+ *
+ * \return The oldest element of the queue or NULL, if the queue is empty.
+ */
+CODEREADER_INTERNAL
+void *
+codereader_ring_pop(struct codereader_ring *ring)
+{
+	/* Reserve the next position, if its cell has been published by a
+	 * producer. The cell will be freed for the next round of producers by
+	 * storing the sequence number of the next round. */
+	size_t pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_RELAXED);
+	while (true) {
+		struct codereader_ring_cell *cell = &(ring->cells[pos & ring->mask]);
+		size_t seq = __atomic_load_n(&(cell->sequence), __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&(ring->dequeue), &pos, pos + 1,
+			                                true, __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				void *data = cell->data;
+				__atomic_store_n(&(cell->sequence), pos + ring->mask + 1,
+				                 __ATOMIC_RELEASE);
+				return data;
+			}
+		} else if (diff < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_RELAXED);
+	}
+}
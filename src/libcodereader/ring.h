@@ -0,0 +1,63 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#ifndef CODEREADER_PRIVATE_RING_H
+#define CODEREADER_PRIVATE_RING_H
+
+
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+
+/** \brief Cell of a \ref codereader_ring.
+ */
+struct codereader_ring_cell
+{
+	size_t sequence; ///< Position, the cell is ready for.
+	void *data;      ///< The stored element.
+};
+
+
+/** \brief Bounded lock-free multi-producer multi-consumer queue.
+ *
+ * \details Any number of threads may push and pop elements concurrently. Each
+ *  operation needs a single compare-and-swap in the uncontended case. The
+ *  positions of producers and consumers are kept in separate cache lines, so
+ *  they don't slow down each other.
+ */
+struct codereader_ring
+{
+	struct codereader_ring_cell *cells; ///< Cells of the queue.
+	size_t mask;                        ///< Number of cells minus one.
+	char pad0[64];
+	size_t enqueue; ///< Next position to push to.
+	char pad1[64];
+	size_t dequeue; ///< Next position to pop from.
+	char pad2[64];
+};
+
+
+bool codereader_ring_init(struct codereader_ring *ring, size_t capacity);
+void codereader_ring_free(struct codereader_ring *ring);
+bool codereader_ring_push(struct codereader_ring *ring, void *data);
+void *codereader_ring_pop(struct codereader_ring *ring);
+
+
+#endif
@@ -0,0 +1,354 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Validation of symbology check digits.
+ *
+ * \details The kernels of this file check a single scan without the trailing
+ *  newline. The digit kernels use fixed-length loops without data-dependent
+ *  branches, so the compiler is able to vectorize them.
+ */
+
+#include <stdio.h>  // fprintf, snprintf
+#include <string.h> // memcpy, memmove, memset, strcmp, strlen
+
+#include "handle.h"   // codereader_validate_*
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Check, if all characters of \p s are digits.
+ *
+ *
+ * \param s The payload.
+ * \param n Length of \p s.
+ *
+ * \return If all characters are digits true will be returned, otherwise false.
+ */
+static bool
+codereader_validate_digits(const char *s, size_t n)
+{
+	unsigned int bad = 0;
+	for (size_t i = 0; i < n; i++)
+		bad |= ((unsigned char)s[i] - '0') > 9;
+	return bad == 0;
+}
+
+
+/** \brief Check the GS1 modulo 10 check digit of \p s.
+ *
+ * \details The last digit of \p s is the check digit. The digits left of it
+ *  will be weighted alternating with 3 and 1, starting with 3 next to the check
+ *  digit. This algorithm is shared by EAN, UPC, ITF and all GS1 keys.
+ *
+ *
+ * \param s The payload.
+ * \param n Length of \p s.
+ *
+ * \return If the check digit is valid true will be returned, otherwise false.
+ */
+static bool
+codereader_validate_mod10(const char *s, size_t n)
+{
+	if (n < 2 || !codereader_validate_digits(s, n))
+		return false;
+
+	unsigned int sum = 0;
+	for (size_t i = 0; i < n - 1; i++)
+		sum += ((unsigned char)s[i] - '0') * (1 + 2 * ((n - 1 - i) & 1));
+	unsigned int check = (unsigned char)s[n - 1] - '0';
+	return (10 - sum % 10) % 10 == check;
+}
+
+
+/** \brief Check an EAN-8 payload.
+ */
+static bool
+codereader_validate_ean8(const char *s, size_t n)
+{
+	return n == 8 && codereader_validate_mod10(s, n);
+}
+
+
+/** \brief Check an EAN-13 payload.
+ */
+static bool
+codereader_validate_ean13(const char *s, size_t n)
+{
+	return n == 13 && codereader_validate_mod10(s, n);
+}
+
+
+/** \brief Check a UPC-A payload.
+ */
+static bool
+codereader_validate_upca(const char *s, size_t n)
+{
+	return n == 12 && codereader_validate_mod10(s, n);
+}
+
+
+/** \brief Check a UPC-E payload.
+ *
+ * \details The payload consists of the number system (0 or 1), six digits and
+ *  the check digit. It will be expanded to UPC-A to check the check digit.
+ */
+static bool
+codereader_validate_upce(const char *s, size_t n)
+{
+	if (n != 8 || !codereader_validate_digits(s, n) ||
+	    (s[0] != '0' && s[0] != '1'))
+		return false;
+
+	/* Expand the six digits d into UPC-A. The last digit of d defines, where
+	 * the zeros suppressed in UPC-E have to be inserted. */
+	const char *d = s + 1;
+	char upca[12];
+	memset(upca, '0', sizeof(upca));
+	upca[0] = s[0];
+	switch (d[5]) {
+		case '0':
+		case '1':
+		case '2':
+			upca[1] = d[0];
+			upca[2] = d[1];
+			upca[3] = d[5];
+			memcpy(upca + 8, d + 2, 3);
+			break;
+
+		case '3':
+			memcpy(upca + 1, d, 3);
+			memcpy(upca + 9, d + 3, 2);
+			break;
+
+		case '4':
+			memcpy(upca + 1, d, 4);
+			upca[10] = d[4];
+			break;
+
+		default:
+			memcpy(upca + 1, d, 5);
+			upca[10] = d[5];
+			break;
+	}
+	upca[11] = s[7];
+
+	return codereader_validate_mod10(upca, sizeof(upca));
+}
+
+
+/** \brief Check an Interleaved 2 of 5 payload.
+ *
+ * \details ITF encodes digits in pairs, so the payload must have an even
+ *  length. The last digit is the modulo 10 check digit.
+ */
+static bool
+codereader_validate_itf(const char *s, size_t n)
+{
+	return (n % 2) == 0 && codereader_validate_mod10(s, n);
+}
+
+
+/** \brief Check a Code 39 payload with modulo 43 check character.
+ *
+ * \details The start and stop character '*' may be part of the payload and
+ *  will be ignored. The value of each character will be looked up in a table,
+ *  which stores the value plus one, so invalid characters map to zero.
+ */
+static bool
+codereader_validate_code39(const char *s, size_t n)
+{
+	static const unsigned char values[256] = {
+	    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6,
+	    ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10, ['A'] = 11, ['B'] = 12,
+	    ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16, ['G'] = 17, ['H'] = 18,
+	    ['I'] = 19, ['J'] = 20, ['K'] = 21, ['L'] = 22, ['M'] = 23, ['N'] = 24,
+	    ['O'] = 25, ['P'] = 26, ['Q'] = 27, ['R'] = 28, ['S'] = 29, ['T'] = 30,
+	    ['U'] = 31, ['V'] = 32, ['W'] = 33, ['X'] = 34, ['Y'] = 35, ['Z'] = 36,
+	    ['-'] = 37, ['.'] = 38, [' '] = 39, ['$'] = 40, ['/'] = 41, ['+'] = 42,
+	    ['%'] = 43};
+
+	if (n >= 2 && s[0] == '*' && s[n - 1] == '*') {
+		s++;
+		n -= 2;
+	}
+	if (n < 2)
+		return false;
+
+	unsigned int sum = 0, bad = 0;
+	for (size_t i = 0; i < n - 1; i++) {
+		unsigned int v = values[(unsigned char)s[i]];
+		bad |= (v == 0);
+		sum += v - 1;
+	}
+
+	unsigned int check = values[(unsigned char)s[n - 1]];
+	return bad == 0 && check != 0 && (sum % 43) == check - 1;
+}
+
+
+/** \brief Check a GS1 key, i.e. GTIN-8, -12, -13, -14, GSIN or SSCC.
+ */
+static bool
+codereader_validate_gs1(const char *s, size_t n)
+{
+	switch (n) {
+		case 8:
+		case 12:
+		case 13:
+		case 14:
+		case 17:
+		case 18: return codereader_validate_mod10(s, n);
+		default: return false;
+	}
+}
+
+
+/** \brief Table of all supported symbologies.
+ *
+ * \details The index of a symbology in this table is its bit in the
+ *  `validate` mask of \ref codereader_device.
+ */
+static const struct
+{
+	const char *name;
+	bool (*check)(const char *s, size_t n);
+} codereader_symbologies[] = {
+    {"ean8", codereader_validate_ean8}, {"ean13", codereader_validate_ean13},
+    {"upca", codereader_validate_upca}, {"upce", codereader_validate_upce},
+    {"itf", codereader_validate_itf},   {"code39", codereader_validate_code39},
+    {"gs1", codereader_validate_gs1},
+};
+
+#define CODEREADER_SYMBOLOGIES_NUM                                             \
+	(sizeof(codereader_symbologies) / sizeof(codereader_symbologies[0]))
+
+
+/** \brief Read the validate configuration \p config of \p device.
+ *
+ *
+ * \param device The device to configure.
+ * \param config The `validate` group of the device's configuration.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_validate_config(struct codereader_device *device,
+                           const config_setting_t *config)
+{
+	config_setting_t *list = config_setting_get_member(config, "symbologies");
+	if (list == NULL || !config_setting_is_array(list) ||
+	    config_setting_length(list) == 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Option 'validate.symbologies' must be a non-empty array.\n");
+		return false;
+	}
+
+	int n = config_setting_length(list);
+	for (int i = 0; i < n; i++) {
+		const char *name = config_setting_get_string_elem(list, i);
+		size_t j;
+		for (j = 0; j < CODEREADER_SYMBOLOGIES_NUM; j++)
+			if (name != NULL &&
+			    strcmp(name, codereader_symbologies[j].name) == 0)
+				break;
+		if (j == CODEREADER_SYMBOLOGIES_NUM) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Unknown symbology '%s'.\n", name ? name : "");
+			return false;
+		}
+		device->validate |= 1U << j;
+	}
+
+	/* By default, invalid scans will be dropped. If the user wants to handle
+	 * them, invalid scans may be tagged with a prefix instead. */
+	const char *on_failure = "drop";
+	config_setting_lookup_string(config, "on_failure", &on_failure);
+	if (strcmp(on_failure, "tag") == 0) {
+		const char *tag = "!";
+		config_setting_lookup_string(config, "tag", &tag);
+		if (*tag == '\0' ||
+		    snprintf(device->validate_tag, sizeof(device->validate_tag), "%s",
+		             tag) >= (int)sizeof(device->validate_tag)) {
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Option 'validate.tag' must have 1 to %zu characters.\n",
+			        sizeof(device->validate_tag) - 1);
+			return false;
+		}
+	} else if (strcmp(on_failure, "drop") != 0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Unknown value '%s' for option 'validate.on_failure'.\n",
+		        on_failure);
+		return false;
+	}
+
+	return true;
+}
+
+
+/** \brief Validate the check digit of a scan.
+ *
+ * \details The scan is valid, if any of the symbologies enabled for \p device
+ *  accepts it. Invalid scans will be dropped or tagged, depending on the
+ *  configuration of the device.
+ *
+ *
+ * \param device The device that read the scan.
+ * \param buffer The scan.
+ * \param length Length of \p buffer.
+ * \param size Size of \p buffer.
+ *
+ * \return The new length of the scan. If the scan has been dropped, zero will
+ *  be returned.
+ */
+CODEREADER_INTERNAL
+size_t
+codereader_validate(struct codereader_device *device, char *buffer,
+                    size_t length, size_t size)
+{
+	if (device->validate == 0)
+		return length;
+
+	/* Strip the line ending, as it's not part of the payload. */
+	size_t n = length;
+	while (n > 0 && (buffer[n - 1] == '\n' || buffer[n - 1] == '\r'))
+		n--;
+
+	for (size_t i = 0; i < CODEREADER_SYMBOLOGIES_NUM; i++)
+		if ((device->validate & (1U << i)) &&
+		    codereader_symbologies[i].check(buffer, n))
+			return length;
+
+	/* Tag the invalid scan by prepending the tag, if configured. If the tag
+	 * doesn't fit into the buffer, the scan will be dropped. */
+	size_t tag = strlen(device->validate_tag);
+	if (tag > 0) {
+		if (length + tag <= size) {
+			memmove(buffer + tag, buffer, length);
+			memcpy(buffer, device->validate_tag, tag);
+			return length + tag;
+		}
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "No space to tag invalid scan, dropping it.\n");
+	}
+
+	return 0;
+}
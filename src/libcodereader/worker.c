@@ -0,0 +1,342 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+#include <errno.h>   // errno, EINTR
+#include <poll.h>    // poll
+#include <pthread.h> // pthread_*
+#include <signal.h>  // sigaction, SIGURG
+#include <stdio.h>   // fprintf
+#include <stdlib.h>  // free, malloc
+#include <string.h>  // memcpy, memset
+#include <time.h>    // clock_gettime, nanosleep
+#include <unistd.h>  // close, write
+
+#include "handle.h"   // codereader_handle, codereader_scan
+#include "internal.h" // CODEREADER_INTERNAL, CODEREADER_MESSAGE_PREFIX
+
+
+/** \brief Signal interrupting a worker thread blocked in a driver's read hook.
+ *
+ * \details SIGURG will be ignored by default, so sending it to a thread can't
+ *  terminate the application, even if no handler has been installed.
+ */
+#define CODEREADER_WORKER_SIGNAL SIGURG
+
+/** \brief Time in ms to wait for a worker thread before warning about it.
+ */
+#define CODEREADER_WORKER_STOP_TIMEOUT 1000
+
+/** \brief Interval in ms to repeat \ref CODEREADER_WORKER_SIGNAL.
+ */
+#define CODEREADER_WORKER_STOP_INTERVAL 10
+
+
+/** \brief Pass a scan read by a worker thread to the reader of the stream.
+ *
+ *
+ * \param device The device that read the scan.
+ * \param buffer The scan.
+ * \param length Length of \p buffer or -1, if the device failed.
+ */
+static void
+codereader_worker_push(struct codereader_device *device, const char *buffer,
+                       ssize_t length)
+{
+	struct codereader_handle *handle = device->handle;
+
+	struct codereader_scan *scan = codereader_scan_new(device, buffer, length);
+	if (scan == NULL)
+		return;
+
+	/* Push the scan into the queue and wake up the reader of the stream. */
+	codereader_queue_push(&(device->queue), &(scan->node));
+	codereader_worker_wakeup(handle);
+}
+
+
+/** \brief Copy a scan of \p device into a new \ref codereader_scan.
+ *
+ *
+ * \param device The device that read the scan.
+ * \param buffer The scan.
+ * \param length Length of \p buffer or -1, if the device failed.
+ *
+ * \return The new scan or NULL, if an error occured.
+ */
+CODEREADER_INTERNAL
+struct codereader_scan *
+codereader_scan_new(struct codereader_device *device, const char *buffer,
+                    ssize_t length)
+{
+	struct codereader_scan *scan =
+	    malloc(sizeof(struct codereader_scan) + ((length > 0) ? length : 0));
+	if (scan == NULL) {
+		fprintf(stderr,
+		        CODEREADER_MESSAGE_PREFIX "Not enough memory for scan.\n");
+		return NULL;
+	}
+	scan->device = device;
+	clock_gettime(CLOCK_REALTIME, &(scan->time));
+	scan->stamp = device->stamp;
+	scan->length = length;
+	if (length > 0)
+		memcpy(scan->data, buffer, length);
+
+	return scan;
+}
+
+
+/** \brief Wake up the reader of the stream.
+ *
+ * \details If the reader has been woken up already but didn't process the
+ *  notification yet, no additional byte needs to be written, so the
+ *  notifications of all threads will be coalesced.
+ *
+ *
+ * \param handle The stream to wake up the reader for.
+ */
+CODEREADER_INTERNAL
+void
+codereader_worker_wakeup(struct codereader_handle *handle)
+{
+	if (!__atomic_exchange_n(&(handle->signalled), true, __ATOMIC_SEQ_CST)) {
+		char c = 0;
+		if (write(handle->wakeup[1], &c, 1) != 1)
+			fprintf(stderr,
+			        CODEREADER_MESSAGE_PREFIX "Failed to wake up reader.\n");
+	}
+}
+
+
+/** \brief Handler for \ref CODEREADER_WORKER_SIGNAL.
+ *
+ * \details The handler has nothing to do, as the signal is only used to
+ *  interrupt blocking system calls with `EINTR`.
+ */
+static void
+codereader_worker_interrupt(int signum)
+{
+}
+
+
+/** \brief Install the handler for \ref CODEREADER_WORKER_SIGNAL.
+ *
+ * \details The handler will be installed without `SA_RESTART`, so blocking
+ *  system calls of the drivers will be interrupted. A handler or disposition
+ *  set by the application will not be replaced.
+ */
+static void
+codereader_worker_signal_init(void)
+{
+	struct sigaction sa;
+	if (sigaction(CODEREADER_WORKER_SIGNAL, NULL, &sa) != 0 ||
+	    (sa.sa_flags & SA_SIGINFO) || sa.sa_handler != SIG_DFL)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = codereader_worker_interrupt;
+	sigemptyset(&(sa.sa_mask));
+	sigaction(CODEREADER_WORKER_SIGNAL, &sa, NULL);
+}
+
+
+/** \brief Check whether the stop pipe \p stop has been closed.
+ */
+static bool
+codereader_worker_stopped(int stop)
+{
+	struct pollfd fd = {.fd = stop, .events = POLLIN};
+	return (poll(&fd, 1, 0) > 0);
+}
+
+
+/** \brief Read a single device until it fails or the stream is destroyed.
+ *
+ * \details See \ref codereader_worker.
+ */
+static void
+codereader_worker_run(struct codereader_device *device)
+{
+	int stop = device->handle->stop[0];
+
+	/* The signal interrupting the driver's read hook must not be blocked, even
+	 * if the application blocked it in the thread opening the stream. */
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, CODEREADER_WORKER_SIGNAL);
+	pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+	if (!codereader_realtime_apply(codereader_realtime_get(device))) {
+		codereader_worker_push(device, NULL, -1);
+		return;
+	}
+
+	while (true) {
+		struct pollfd fds[2] = {
+			{.fd = device->fd, .events = POLLIN},
+			{.fd = stop, .events = POLLIN},
+		};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Failed to poll a device file descriptor.\n");
+			codereader_worker_push(device, NULL, -1);
+			return;
+		}
+
+		if (fds[1].revents != 0)
+			return;
+
+		ssize_t ret = codereader_device_read(device);
+		if (ret < 0) {
+			/* If the read hook has been interrupted to destroy the stream,
+			 * the device didn't fail and will be closed by the destroy. */
+			if (codereader_worker_stopped(stop))
+				return;
+
+			/* If the device has been reopened, the worker continues reading
+			 * it. Otherwise the failure will be passed to the reader of the
+			 * stream, unless the stream is being destroyed. */
+			if (codereader_reconnect_start(device))
+				continue;
+			if (!device->reconnect)
+				codereader_worker_push(device, NULL, -1);
+			return;
+		}
+		if (ret > 0)
+			ret = codereader_process(device, device->buffer, ret,
+			                         device->buffer_size);
+		if (ret == 0)
+			continue;
+		codereader_worker_push(device, device->buffer, ret);
+	}
+}
+
+
+/** \brief Worker thread reading a single device.
+ *
+ * \details The thread waits for data on the device's file descriptor and calls
+ *  the driver's read hook, so a blocking driver doesn't delay the other
+ *  devices of the stream. If the device fails, it will be reopened by the
+ *  thread. The thread stops, if the device fails without being reconnected or
+ *  the stop pipe of the stream gets closed.
+ *
+ *
+ * \param arg Pointer to the \ref codereader_device to read.
+ */
+static void *
+codereader_worker(void *arg)
+{
+	/* The flag tells codereader_worker_join, that the thread doesn't need to
+	 * be interrupted anymore and can be joined without blocking. */
+	struct codereader_device *device = arg;
+	codereader_worker_run(device);
+	__atomic_store_n(&(device->finished), true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+/** \brief Start a worker thread for \p device.
+ *
+ *
+ * \param device The device to be read by the new worker thread.
+ *
+ * \return On success true will be returned, otherwise false.
+ */
+CODEREADER_INTERNAL
+bool
+codereader_worker_start(struct codereader_device *device)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, codereader_worker_signal_init);
+
+	device->finished = false;
+	if (pthread_create(&(device->thread), NULL, codereader_worker, device) !=
+	    0) {
+		fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+		        "Failed to start worker thread.\n");
+		return false;
+	}
+
+	device->running = true;
+	return true;
+}
+
+
+/** \brief Join the worker thread of \p device.
+ *
+ * \details A worker thread blocked in the driver's read hook will be
+ *  interrupted by \ref CODEREADER_WORKER_SIGNAL. As the signal may arrive just
+ *  before the thread enters a blocking call, it will be repeated until the
+ *  thread finished. The thread will never be cancelled, as it may be inside
+ *  the driver's code, so a warning will be printed, if a driver retries
+ *  interrupted calls for longer than \ref CODEREADER_WORKER_STOP_TIMEOUT.
+ *
+ *
+ * \param device The device read by the worker thread.
+ */
+static void
+codereader_worker_join(struct codereader_device *device)
+{
+	const struct timespec interval = {
+	    .tv_nsec = CODEREADER_WORKER_STOP_INTERVAL * 1000000L};
+	long waited = 0;
+	while (!__atomic_load_n(&(device->finished), __ATOMIC_ACQUIRE)) {
+		pthread_kill(device->thread, CODEREADER_WORKER_SIGNAL);
+		nanosleep(&interval, NULL);
+
+		waited += CODEREADER_WORKER_STOP_INTERVAL;
+		if (waited == CODEREADER_WORKER_STOP_TIMEOUT)
+			fprintf(stderr, CODEREADER_MESSAGE_PREFIX
+			        "Worker of device %s doesn't stop, waiting for it.\n",
+			        device->name);
+	}
+	pthread_join(device->thread, NULL);
+}
+
+
+/** \brief Stop all worker threads of \p handle.
+ *
+ * \details The stop pipe will be closed, which wakes up all worker threads
+ *  waiting for new data. Worker threads in the middle of a driver's read hook
+ *  will be interrupted, so a blocking driver can't hang the destroy.
+ *
+ *
+ * \param handle The stream to stop the worker threads for.
+ */
+CODEREADER_INTERNAL
+void
+codereader_worker_stop(struct codereader_handle *handle)
+{
+	if (handle->stop[1] >= 0) {
+		close(handle->stop[1]);
+		handle->stop[1] = -1;
+	}
+
+	struct codereader_device *iter;
+	SLIST_FOREACH(iter, &(handle->devices), lmp)
+	{
+		if (iter->running) {
+			codereader_worker_join(iter);
+			iter->running = false;
+		}
+	}
+}
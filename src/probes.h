@@ -0,0 +1,61 @@
+/* This file is part of crutils.
+ *
+ * crutils is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * crutils is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with crutils. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Copyright (C)
+ *  2013-2017 Alexander Haase <ahaase@alexhaase.de>
+ */
+
+/** \file
+ *
+ * \brief Static tracepoints of crutils.
+ *
+ * \details libcodereader and its drivers define static probes (USDT) of the
+ *  provider `codereader` at the interesting points of the scan path. Tools like
+ *  `perf`, `bpftrace` or SystemTap may attach to them at runtime, e.g.
+ *  `bpftrace -e 'usdt:/usr/lib/libcodereader.so:codereader:scan__deliver {}'`.
+ *  A disabled probe is a single `nop` instruction.
+ *
+ *  If `sys/sdt.h` is not available, the probes will be removed at compile time
+ *  and their arguments won't be evaluated.
+ */
+
+#ifndef CODEREADER_PROBES_H
+#define CODEREADER_PROBES_H
+
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h> // DTRACE_PROBE* macros
+
+#define CODEREADER_PROBE(name) DTRACE_PROBE(codereader, name)
+#define CODEREADER_PROBE1(name, a) DTRACE_PROBE1(codereader, name, a)
+#define CODEREADER_PROBE2(name, a, b) DTRACE_PROBE2(codereader, name, a, b)
+#define CODEREADER_PROBE3(name, a, b, c)                                       \
+	DTRACE_PROBE3(codereader, name, a, b, c)
+
+#else
+
+#define CODEREADER_PROBE(name)                                                 \
+	do {                                                                       \
+	} while (0)
+#define CODEREADER_PROBE1(name, a) CODEREADER_PROBE(name)
+#define CODEREADER_PROBE2(name, a, b) CODEREADER_PROBE(name)
+#define CODEREADER_PROBE3(name, a, b, c) CODEREADER_PROBE(name)
+
+#endif
+
+
+#endif